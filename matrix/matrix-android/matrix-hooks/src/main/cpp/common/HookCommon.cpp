@@ -26,6 +26,7 @@
 #include "JNICommon.h"
 #include "PthreadExt.h"
 #include "Backtrace.h"
+#include "Symbolizer.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +35,7 @@ extern "C" {
 #define TAG "Matrix.HookCommon"
 
 std::vector<dlopen_callback_t> m_dlopen_callbacks;
+std::vector<dlclose_callback_t> m_dlclose_callbacks;
 std::vector<hook_init_callback_t> m_init_callbacks;
 
 static std::recursive_mutex dlopen_mutex;
@@ -49,6 +51,8 @@ DEFINE_HOOK_FUN(void *, __loader_android_dlopen_ext, const char *file_name,
 
     LOGD(TAG, "call into dlopen hook");
 
+    symbolizer_notify_maps_changed();
+
 //    NanoSeconds_Start(TAG, begin);
 
     bool map_refreshed = false;
@@ -64,6 +68,46 @@ DEFINE_HOOK_FUN(void *, __loader_android_dlopen_ext, const char *file_name,
     return ret;
 }
 
+DEFINE_HOOK_FUN(int, __loader_dlclose, void *handle) {
+    std::lock_guard<std::recursive_mutex> dlopen_lock(dlopen_mutex);
+
+    int ret = (*ORIGINAL_FUNC_NAME(__loader_dlclose))(handle);
+
+    // so 卸载后其地址区间可能被新加载的 so 复用, 按地址缓存的信息需要重建
+    symbolizer_notify_maps_changed();
+
+    for (auto &callback : m_dlclose_callbacks) {
+        callback();
+    }
+
+    return ret;
+}
+
+bool resolve_hook_functions(const char *__lib, const HookFunction *__functions, size_t __count) {
+    // 与原先 handler 中的懒加载一致: 库尚未加载时由这里加载, 句柄不释放
+    void *handle = dlopen(__lib, RTLD_NOW);
+    if (!handle) {
+        LOGE(TAG, "resolve_hook_functions: dlopen %s failed", __lib);
+    }
+
+    bool resolved = true;
+    for (size_t i = 0; i < __count; ++i) {
+        const HookFunction &f = __functions[i];
+        if (!f.original) {
+            continue;
+        }
+        void *sym = handle ? dlsym(handle, f.name) : nullptr;
+        if (!sym) {
+            // 已安装的 hook 可能正在使用之前解析到的指针, 不能清空
+            LOGE(TAG, "resolve_hook_functions: %s not found in %s", f.name, __lib);
+            resolved = false;
+            continue;
+        }
+        __atomic_store_n(f.original, sym, __ATOMIC_RELEASE);
+    }
+    return resolved;
+}
+
 static void hook_common_init() {
     for (auto &callback : m_init_callbacks) {
         callback();
@@ -74,6 +118,10 @@ void add_dlopen_hook_callback(dlopen_callback_t callback) {
     m_dlopen_callbacks.push_back(callback);
 }
 
+void add_dlclose_hook_callback(dlclose_callback_t callback) {
+    m_dlclose_callbacks.push_back(callback);
+}
+
 void add_hook_init_callback(hook_init_callback_t callback) {
     m_init_callbacks.push_back(callback);
 }
@@ -17,7 +17,8 @@
 //
 // Created by Yves on 2019-12-16.
 //
-// must define ORIGINAL_LIB to use CALL_ORIGIN_FUNC_RET and CALL_ORIGIN_FUNC_VOID
+// 原函数指针在安装 hook (xhook_register) 之前由 resolve_hook_functions 一次性解析,
+// handler 中的 CALL_ORIGIN_FUNC_RET / CALL_ORIGIN_FUNC_VOID 直接经指针调用, 不再判空和 dlopen
 //
 
 #ifndef LIBMATRIX_JNI_HOOKCOMMON_H
@@ -46,23 +47,17 @@
 
 
 #define CALL_ORIGIN_FUNC_RET(retType, ret, sym, params...) \
-    if (!ORIGINAL_FUNC_NAME(sym)) { \
-        void *handle = dlopen(ORIGINAL_LIB, RTLD_LAZY); \
-        if (handle) { \
-            ORIGINAL_FUNC_NAME(sym) = (FUNC_TYPE(sym))dlsym(handle, #sym); \
-        } \
-    } \
     retType ret = ORIGINAL_FUNC_NAME(sym)(params)
 
 #define CALL_ORIGIN_FUNC_VOID(sym, params...) \
-    if (!ORIGINAL_FUNC_NAME(sym)) { \
-        void *handle = dlopen(ORIGINAL_LIB, RTLD_LAZY); \
-        if (handle) { \
-            ORIGINAL_FUNC_NAME(sym) = (FUNC_TYPE(sym))dlsym(handle, #sym); \
-        } \
-    } \
     ORIGINAL_FUNC_NAME(sym)(params)
 
+/**
+ * handler 经原函数指针调用原函数的 hook, 注册前需先 resolve_hook_functions
+ */
+#define HOOK_FUNCTION(sym) \
+    {#sym, (void *) HANDLER_FUNC_NAME(sym), NULL, (void **) &ORIGINAL_FUNC_NAME(sym)}
+
 #include <vector>
 
 #ifdef __cplusplus
@@ -73,12 +68,34 @@ typedef struct {
     const char *name;
     void       *handler_ptr;
     void       **origin_ptr;
+    /**
+     * handler 中使用的原函数指针, 为 NULL 表示 handler 不经过原函数指针
+     */
+    void       **original;
 } HookFunction;
 
+/**
+ * 从 __lib 中解析各 hook 的原函数并发布到其原函数指针, 未找到的保持原值.
+ * 需在 xhook_register 之前调用
+ * @return 全部解析成功时返回 true
+ */
+bool resolve_hook_functions(const char *__lib, const HookFunction *__functions, size_t __count);
+
+/**
+ * 原函数未解析时不能注册该 hook, 否则 handler 会调用空指针
+ */
+static inline bool hook_function_ready(const HookFunction &__function) {
+    return !__function.original || __atomic_load_n(__function.original, __ATOMIC_ACQUIRE);
+}
+
 typedef void (*dlopen_callback_t)(const char *__file_name, bool *maps_refreshed);
 
 void add_dlopen_hook_callback(dlopen_callback_t callback);
 
+typedef void (*dlclose_callback_t)();
+
+void add_dlclose_hook_callback(dlclose_callback_t callback);
+
 typedef void (*hook_init_callback_t)();
 
 void add_hook_init_callback(hook_init_callback_t callback);
@@ -89,6 +106,8 @@ DECLARE_HOOK_ORIG(void *, __loader_android_dlopen_ext, const char *filename,
                   int                                             flag,
                   const void                                      *extinfo,
                   const void                                      *caller_addr) ;
+
+DECLARE_HOOK_ORIG(int, __loader_dlclose, void *handle);
 #ifdef __cplusplus
 }
 #endif
@@ -71,6 +71,9 @@ JNIEXPORT jint JNI_OnLoad(JavaVM *vm, void *reserved) {
     xhook_register(".*\\.so$", "__loader_android_dlopen_ext",
                    (void *) HANDLER_FUNC_NAME(__loader_android_dlopen_ext),
                    (void **) &ORIGINAL_FUNC_NAME(__loader_android_dlopen_ext));
+    xhook_register(".*\\.so$", "__loader_dlclose",
+                   (void *) HANDLER_FUNC_NAME(__loader_dlclose),
+                   (void **) &ORIGINAL_FUNC_NAME(__loader_dlclose));
 
 
     return JNI_VERSION_1_6;
@@ -0,0 +1,241 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 流式 JSON 输出: 只持有一块定长缓冲, 写满即 write 到 fd, 不在内存中构建整棵树.
+// 逗号由层级状态自动补齐; 字符串值可以分多次追加 (begin_string/append/end_string)
+//
+
+#ifndef LIBMATRIX_HOOK_JSONSTREAMWRITER_H
+#define LIBMATRIX_HOOK_JSONSTREAMWRITER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <cinttypes>
+#include <cstdio>
+#include <unistd.h>
+
+class json_stream_writer {
+
+    static const size_t BUFFER_SIZE = 4096;
+    static const int    MAX_DEPTH   = 32;
+
+public:
+
+    /**
+     * @param __fd 小于 0 时丢弃所有输出
+     */
+    explicit json_stream_writer(int __fd) : m_fd(__fd), m_used(0), m_depth(0),
+                                            m_after_key(false) {
+    }
+
+    ~json_stream_writer() {
+        flush();
+    }
+
+    json_stream_writer(const json_stream_writer &) = delete;
+
+    json_stream_writer &operator=(const json_stream_writer &) = delete;
+
+    json_stream_writer &begin_object() {
+        return open('{');
+    }
+
+    json_stream_writer &end_object() {
+        return close('}');
+    }
+
+    json_stream_writer &begin_array() {
+        return open('[');
+    }
+
+    json_stream_writer &end_array() {
+        return close(']');
+    }
+
+    json_stream_writer &key(const char *__key) {
+        separate();
+        put_quoted(__key);
+        put(':');
+        m_after_key = true;
+        return *this;
+    }
+
+    json_stream_writer &value(const char *__value) {
+        separate();
+        put_quoted(__value ? __value : "");
+        return *this;
+    }
+
+    /**
+     * 与原 cJSON 输出保持一致, 数值以字符串形式写出
+     */
+    json_stream_writer &value_as_string(size_t __value) {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%zu", __value);
+        return value(buf);
+    }
+
+    json_stream_writer &value_as_string(int64_t __value) {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%" PRId64, __value);
+        return value(buf);
+    }
+
+    json_stream_writer &begin_string() {
+        separate();
+        put('"');
+        return *this;
+    }
+
+    json_stream_writer &append(const char *__str) {
+        put_escaped(__str ? __str : "");
+        return *this;
+    }
+
+    json_stream_writer &append_hex(uintptr_t __value) {
+        char buf[20];
+        int  len = snprintf(buf, sizeof(buf), "%" PRIxPTR, __value);
+        put(buf, (size_t) len);
+        return *this;
+    }
+
+    json_stream_writer &end_string() {
+        put('"');
+        return *this;
+    }
+
+    void flush() {
+        size_t written = 0;
+        while (m_fd >= 0 && written < m_used) {
+            ssize_t ret = write(m_fd, m_buffer + written, m_used - written);
+            if (ret <= 0) {
+                break;
+            }
+            written += (size_t) ret;
+        }
+        m_used = 0;
+    }
+
+private:
+
+    json_stream_writer &open(char __c) {
+        separate();
+        put(__c);
+        if (m_depth < MAX_DEPTH) {
+            m_first[m_depth] = true;
+        }
+        m_depth++;
+        return *this;
+    }
+
+    json_stream_writer &close(char __c) {
+        m_depth--;
+        put(__c);
+        return *this;
+    }
+
+    /**
+     * 同一层的第二个及之后的元素前补逗号, key 之后的值不补
+     */
+    void separate() {
+        if (m_after_key) {
+            m_after_key = false;
+            return;
+        }
+        if (m_depth == 0 || m_depth > MAX_DEPTH) {
+            return;
+        }
+        if (m_first[m_depth - 1]) {
+            m_first[m_depth - 1] = false;
+        } else {
+            put(',');
+        }
+    }
+
+    inline void put(char __c) {
+        if (m_used == BUFFER_SIZE) {
+            flush();
+        }
+        m_buffer[m_used++] = __c;
+    }
+
+    void put(const char *__str, size_t __len) {
+        while (__len) {
+            if (m_used == BUFFER_SIZE) {
+                flush();
+            }
+            size_t n = BUFFER_SIZE - m_used < __len ? BUFFER_SIZE - m_used : __len;
+            memcpy(m_buffer + m_used, __str, n);
+            m_used += n;
+            __str += n;
+            __len -= n;
+        }
+    }
+
+    void put_quoted(const char *__str) {
+        put('"');
+        put_escaped(__str);
+        put('"');
+    }
+
+    void put_escaped(const char *__str) {
+        static const char hex[] = "0123456789abcdef";
+        for (auto p = reinterpret_cast<const unsigned char *>(__str); *p; ++p) {
+            unsigned char c = *p;
+            switch (c) {
+                case '"':
+                    put("\\\"", 2);
+                    break;
+                case '\\':
+                    put("\\\\", 2);
+                    break;
+                case '\b':
+                    put("\\b", 2);
+                    break;
+                case '\f':
+                    put("\\f", 2);
+                    break;
+                case '\n':
+                    put("\\n", 2);
+                    break;
+                case '\r':
+                    put("\\r", 2);
+                    break;
+                case '\t':
+                    put("\\t", 2);
+                    break;
+                default:
+                    if (c < 0x20) {
+                        char buf[6] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf]};
+                        put(buf, sizeof(buf));
+                    } else {
+                        put((char) c);
+                    }
+            }
+        }
+    }
+
+    int    m_fd;
+    char   m_buffer[BUFFER_SIZE];
+    size_t m_used;
+    bool   m_first[MAX_DEPTH];
+    int    m_depth;
+    bool   m_after_key;
+};
+
+#endif //LIBMATRIX_HOOK_JSONSTREAMWRITER_H
@@ -0,0 +1,656 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 以指针为 key 的开放寻址哈希表, 供 hook 回调在 malloc/free 路径上直接使用:
+//  - slot 的 key 以 CAS 加锁 (最低位为 busy 标记), 删除留下 tombstone
+//  - 表内存直接 mmap, 不经过被 hook 的堆
+//  - 负载过高时分配新表, 由后续的 insert/erase 每次顺带迁移一小段 (incremental resize)
+//  - 旧表在所有正在进行的操作退出后 (两阶段 epoch) 才 munmap
+//
+// 约束: key 非 0 且至少 2 字节对齐 (malloc/mmap 返回值, pthread_t 均满足);
+//      同一 key 不会被两个线程同时 insert (分配器保证同一时刻只有一个持有者).
+//
+
+#ifndef LIBMATRIX_HOOK_LOCKFREEPTRTABLE_H
+#define LIBMATRIX_HOOK_LOCKFREEPTRTABLE_H
+
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "MappingName.h"
+
+template<class _Value>
+class lock_free_ptr_table {
+
+    static_assert(std::is_trivially_copyable<_Value>::value,
+                  "value of lock_free_ptr_table is copied by migration, must be trivially copyable");
+
+    static const uintptr_t SLOT_EMPTY     = 0;
+    static const uintptr_t SLOT_TOMBSTONE = ~(uintptr_t) 0;
+    static const uintptr_t SLOT_BUSY_BIT  = 1;
+
+    static const size_t STRIPE_COUNT         = 64; // power of 2
+    static const size_t CACHE_LINE_SIZE      = 64;
+    static const size_t MIGRATE_BATCH        = 32;
+    static const size_t MIN_CAPACITY         = 1 << 10;
+    static const size_t DEFAULT_CAPACITY     = 1 << 16;
+
+    struct slot_t {
+        std::atomic<uintptr_t> key;
+        _Value                 value;
+    };
+
+    struct alignas(CACHE_LINE_SIZE) stripe_counter_t {
+        std::atomic<size_t> value;
+    };
+
+    struct alignas(CACHE_LINE_SIZE) table_t {
+        size_t              capacity;
+        size_t              mask;
+        size_t              mapped_size;
+        size_t              used_check_interval;
+        slot_t              *slots;
+
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> migrate_cursor;
+        alignas(CACHE_LINE_SIZE) std::atomic<size_t> migrated;
+
+        // 非 EMPTY 的 slot 数 (含 tombstone), 按线程分散计数, 仅用于判断是否需要扩容
+        stripe_counter_t    used[STRIPE_COUNT];
+    };
+
+    // 两阶段 epoch: 操作进入时登记到当前 epoch, 回收旧表前翻转 epoch 并等待旧 epoch 的登记清零
+    struct alignas(CACHE_LINE_SIZE) epoch_stripe_t {
+        std::atomic<size_t> active[2];
+    };
+
+    class op_guard {
+    public:
+        explicit op_guard(lock_free_ptr_table *__table) : table(__table) {
+            stripe = &table->m_epoch_stripes[current_stripe()];
+            for (;;) {
+                epoch = table->m_epoch.load();
+                stripe->active[epoch].fetch_add(1);
+                if (table->m_epoch.load() == epoch) {
+                    break;
+                }
+                stripe->active[epoch].fetch_sub(1);
+            }
+        }
+
+        ~op_guard() {
+            stripe->active[epoch].fetch_sub(1, std::memory_order_release);
+        }
+
+    private:
+        lock_free_ptr_table *table;
+        epoch_stripe_t      *stripe;
+        size_t              epoch;
+    };
+
+public:
+
+    lock_free_ptr_table() : lock_free_ptr_table(DEFAULT_CAPACITY) {
+    }
+
+    explicit lock_free_ptr_table(size_t __initial_capacity)
+            : m_current(nullptr), m_previous(nullptr), m_epoch(0), m_epoch_stripes() {
+        size_t capacity = MIN_CAPACITY;
+        while (capacity < __initial_capacity) {
+            capacity <<= 1;
+        }
+        m_current.store(create_table(capacity));
+    }
+
+    ~lock_free_ptr_table() {
+        destroy_table(m_previous.load());
+        destroy_table(m_current.load());
+    }
+
+    lock_free_ptr_table(const lock_free_ptr_table &) = delete;
+
+    lock_free_ptr_table &operator=(const lock_free_ptr_table &) = delete;
+
+    /**
+     * 插入或覆盖 __key, __callable(_Value &, bool exists) 在持有 slot 锁期间回调
+     * 新插入的 value 已清零
+     * @return false 表示表已满且无法扩容, 记录被丢弃
+     */
+    template<class _Callable>
+    bool insert(uintptr_t __key, _Callable __callable) {
+        for (;;) {
+            table_t *target = nullptr;
+            bool    need_resize = false;
+            {
+                op_guard guard(this);
+
+                // 先取当前表再取旧表, 与扩容时先发布旧表再发布新表的顺序相反
+                target = m_current.load();
+                table_t *prev = live_previous();
+
+                if (prev && prev != target) {
+                    migrate_some(prev, target);
+                    slot_t *slot = lock_slot(prev, __key);
+                    if (slot) {
+                        __callable(slot->value, true);
+                        unlock_slot(slot, __key);
+                        return true;
+                    }
+                }
+
+                // 迁移期间新表需给旧表剩余的 key 留出位置, 否则按表满处理: 等迁移完成并再次扩容
+                bool   exists = false;
+                slot_t *slot  = nullptr;
+                if (!prev || prev == target || has_room_for_migration(prev, target)) {
+                    slot = acquire_slot(target, __key, current_stripe(), &exists, &need_resize);
+                }
+                if (slot) {
+                    if (!exists) {
+                        slot->value = _Value();
+                    }
+                    __callable(slot->value, exists);
+                    publish_slot(target, slot, __key);
+                    if (!need_resize) {
+                        return true;
+                    }
+                }
+            }
+
+            // 退出 guard 后再扩容, 扩容需要等待所有进行中的操作退出旧 epoch
+            if (need_resize) {
+                resize(target, false);
+                return true;
+            }
+
+            if (!resize(target, true)) {
+                return false;
+            }
+        }
+    }
+
+    /**
+     * 查找 __key, 找到时在持有 slot 锁期间回调 __callable(_Value &)
+     */
+    template<class _Callable>
+    bool get(uintptr_t __key, _Callable __callable) {
+        op_guard guard(this);
+
+        slot_t *slot = lock_any(__key);
+        if (!slot) {
+            return false;
+        }
+        __callable(slot->value);
+        unlock_slot(slot, __key);
+        return true;
+    }
+
+    /**
+     * 删除 __key, 删除前在持有 slot 锁期间回调 __callable(_Value &)
+     */
+    template<class _Callable>
+    bool erase(uintptr_t __key, _Callable __callable) {
+        op_guard guard(this);
+
+        table_t *current = m_current.load();
+        table_t *prev    = live_previous();
+        if (prev && prev != current) {
+            migrate_some(prev, current);
+        }
+
+        slot_t *slot = lock_any(__key);
+        if (!slot) {
+            return false;
+        }
+        __callable(slot->value);
+        slot->key.store(SLOT_TOMBSTONE, std::memory_order_release);
+        return true;
+    }
+
+    bool contains(uintptr_t __key) {
+        return get(__key, [](_Value &) {});
+    }
+
+    /**
+     * 遍历所有存活的 key, __callable(uintptr_t key, _Value &) 在持有 slot 锁期间回调
+     * 遍历期间不会扩容, 并发的 insert/erase 可能被看到也可能看不到
+     */
+    template<class _Callable>
+    void for_each(_Callable __callable) {
+        std::lock_guard<std::mutex> resize_lock(m_resize_mutex);
+
+        finish_migration();
+
+        table_t *table = m_current.load();
+        for (size_t i = 0; i < table->capacity; ++i) {
+            slot_t    *slot = &table->slots[i];
+            uintptr_t key   = lock_live_slot(slot);
+            if (key == SLOT_EMPTY) {
+                continue;
+            }
+            __callable(key, slot->value);
+            unlock_slot(slot, key);
+        }
+    }
+
+    /**
+     * 不加锁遍历当前表及迁移中的旧表, __callable(uintptr_t key, const _Value &).
+     * 只能在其他线程都已暂停时使用 (泄漏扫描): 迁移中的 key 可能出现两次,
+     * 正在被修改的 slot 其 value 可能不完整. 不分配内存
+     */
+    template<class _Callable>
+    void for_each_unsafe(_Callable __callable) {
+        table_t *current = m_current.load();
+        table_t *prev    = m_previous.load();
+        for (table_t *table : {current, prev == current ? nullptr : prev}) {
+            if (!table) {
+                continue;
+            }
+            for (size_t i = 0; i < table->capacity; ++i) {
+                uintptr_t k = table->slots[i].key.load(std::memory_order_acquire);
+                if (k == SLOT_EMPTY || k == SLOT_TOMBSTONE) {
+                    continue;
+                }
+                __callable(k & ~SLOT_BUSY_BIT, (const _Value &) table->slots[i].value);
+            }
+        }
+    }
+
+    /**
+     * 当前表与旧表的 slot 总数, 即 for_each_unsafe 回调次数的上限
+     */
+    size_t slot_capacity() {
+        op_guard guard(this);
+        table_t *prev = m_previous.load();
+        return m_current.load()->capacity + (prev ? prev->capacity : 0);
+    }
+
+    /**
+     * 表自身占用的内存 (字节)
+     */
+    size_t mapped_size() {
+        op_guard guard(this);
+        table_t *prev = m_previous.load();
+        return m_current.load()->mapped_size + (prev ? prev->mapped_size : 0);
+    }
+
+private:
+
+    static inline size_t hash(uintptr_t __key) {
+        uint64_t h = (uint64_t) __key * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(h ^ (h >> 32));
+    }
+
+    static inline size_t current_stripe() {
+        uint64_t h = (uint64_t) pthread_self() * 0x9E3779B97F4A7C15ULL;
+        return static_cast<size_t>(h >> 32) & (STRIPE_COUNT - 1);
+    }
+
+    static inline void spin_pause(size_t &__spins) {
+        if (++__spins > 64) {
+            sched_yield();
+        }
+    }
+
+    static table_t *create_table(size_t __capacity) {
+        size_t page_size   = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t header_size = (sizeof(table_t) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+        size_t size        = header_size + __capacity * sizeof(slot_t);
+        size = (size + page_size - 1) & ~(page_size - 1);
+
+        void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                         -1, 0);
+        if (mem == MAP_FAILED) {
+            return nullptr;
+        }
+        name_hook_mapping(mem, size);
+
+        // 匿名映射已清零: 所有 slot 为 SLOT_EMPTY, 计数器为 0
+        auto table = new(mem) table_t;
+        table->capacity    = __capacity;
+        table->mask        = __capacity - 1;
+        table->mapped_size = size;
+        // 各 stripe 未汇总的计数之和不超过容量的 1/8
+        table->used_check_interval = __capacity / (STRIPE_COUNT * 8) ?: 1;
+        table->slots       = reinterpret_cast<slot_t *>(static_cast<char *>(mem) + header_size);
+        return table;
+    }
+
+    static void destroy_table(table_t *__table) {
+        if (__table) {
+            munmap(__table, __table->mapped_size);
+        }
+    }
+
+    /**
+     * 迁移未完成的旧表, 迁移完成后旧表全是 tombstone, 不需要再查
+     */
+    inline table_t *live_previous() {
+        table_t *prev = m_previous.load();
+        if (prev && prev->migrated.load(std::memory_order_acquire) < prev->capacity) {
+            return prev;
+        }
+        return nullptr;
+    }
+
+    static inline void unlock_slot(slot_t *__slot, uintptr_t __key) {
+        __slot->key.store(__key, std::memory_order_release);
+    }
+
+    /**
+     * 在 __table 中查找 __key 并加锁
+     */
+    static slot_t *lock_slot(table_t *__table, uintptr_t __key) {
+        size_t idx = hash(__key) & __table->mask;
+        for (size_t n = 0; n < __table->capacity; ++n, idx = (idx + 1) & __table->mask) {
+            slot_t *slot  = &__table->slots[idx];
+            size_t spins  = 0;
+            for (;;) {
+                uintptr_t k = slot->key.load(std::memory_order_acquire);
+                if (k == SLOT_EMPTY) {
+                    return nullptr;
+                }
+                if (k == SLOT_TOMBSTONE || (k & ~SLOT_BUSY_BIT) != __key) {
+                    break; // next slot
+                }
+                if (k & SLOT_BUSY_BIT) {
+                    spin_pause(spins);
+                    continue;
+                }
+                if (slot->key.compare_exchange_weak(k, __key | SLOT_BUSY_BIT,
+                                                    std::memory_order_acquire)) {
+                    return slot;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    /**
+     * 对任意存活的 slot 加锁, 返回其 key; slot 为空或 tombstone 时返回 SLOT_EMPTY
+     */
+    static uintptr_t lock_live_slot(slot_t *__slot) {
+        size_t spins = 0;
+        for (;;) {
+            uintptr_t k = __slot->key.load(std::memory_order_acquire);
+            if (k == SLOT_EMPTY || k == SLOT_TOMBSTONE) {
+                return SLOT_EMPTY;
+            }
+            if (k & SLOT_BUSY_BIT) {
+                spin_pause(spins);
+                continue;
+            }
+            if (__slot->key.compare_exchange_weak(k, k | SLOT_BUSY_BIT,
+                                                  std::memory_order_acquire)) {
+                return k;
+            }
+        }
+    }
+
+    /**
+     * 先查迁移中的旧表, 再查当前表. 迁移时先写新表再在旧表留 tombstone, 因此这个顺序不会漏掉 key
+     */
+    inline slot_t *lock_any(uintptr_t __key) {
+        for (;;) {
+            table_t *current = m_current.load();
+            table_t *prev    = live_previous();
+            if (prev && prev != current) {
+                slot_t *slot = lock_slot(prev, __key);
+                if (slot) {
+                    return slot;
+                }
+            }
+            slot_t *slot = lock_slot(current, __key);
+            if (slot) {
+                return slot;
+            }
+            // 查找期间发生了扩容, key 可能已被迁到新表
+            if (m_current.load() == current) {
+                return nullptr;
+            }
+        }
+    }
+
+    /**
+     * 在 __table 中找到 __key 并加锁, 不存在时占用探测链上第一个 tombstone 或空 slot
+     */
+    slot_t *acquire_slot(table_t *__table, uintptr_t __key, size_t __stripe,
+                         bool *__exists, bool *__need_resize) {
+        retry:
+        slot_t *reusable = nullptr;
+        size_t idx       = hash(__key) & __table->mask;
+        for (size_t n = 0; n < __table->capacity; ++n, idx = (idx + 1) & __table->mask) {
+            slot_t    *slot = &__table->slots[idx];
+            uintptr_t k     = slot->key.load(std::memory_order_acquire);
+
+            if (k == SLOT_EMPTY) {
+                slot_t    *claim   = reusable ? reusable : slot;
+                uintptr_t expected = reusable ? SLOT_TOMBSTONE : SLOT_EMPTY;
+                if (!claim->key.compare_exchange_strong(expected, __key | SLOT_BUSY_BIT,
+                                                        std::memory_order_acquire)) {
+                    goto retry;
+                }
+                if (!reusable) {
+                    size_t used = __table->used[__stripe].value.fetch_add(
+                            1, std::memory_order_relaxed) + 1;
+                    if (used % __table->used_check_interval == 0) {
+                        *__need_resize = exceeds_load_factor(__table);
+                    }
+                }
+                *__exists = false;
+                return claim;
+            }
+
+            if (k == SLOT_TOMBSTONE) {
+                if (!reusable) {
+                    reusable = slot;
+                }
+                continue;
+            }
+
+            if ((k & ~SLOT_BUSY_BIT) == __key) {
+                slot_t *locked = lock_slot(__table, __key);
+                if (!locked) {
+                    goto retry; // 刚被删除
+                }
+                *__exists = true;
+                return locked;
+            }
+        }
+
+        if (reusable) {
+            uintptr_t expected = SLOT_TOMBSTONE;
+            if (!reusable->key.compare_exchange_strong(expected, __key | SLOT_BUSY_BIT,
+                                                       std::memory_order_acquire)) {
+                goto retry;
+            }
+            *__exists = false;
+            return reusable;
+        }
+
+        return nullptr; // full
+    }
+
+    static size_t used_slots(table_t *__table) {
+        size_t used = 0;
+        for (auto &counter : __table->used) {
+            used += counter.value.load(std::memory_order_relaxed);
+        }
+        return used;
+    }
+
+    static bool exceeds_load_factor(table_t *__table) {
+        return used_slots(__table) > __table->capacity / 4 * 3;
+    }
+
+    /**
+     * 迁移期间新表至少要能容纳旧表中尚未迁移的 slot, 否则迁移时会因新表已满丢失记录
+     */
+    bool has_room_for_migration(table_t *__prev, table_t *__current) {
+        for (int pass = 0; pass < 2; ++pass) {
+            size_t pending = __prev->capacity - __prev->migrated.load(std::memory_order_relaxed);
+            if (used_slots(__current) + pending < __current->capacity / 8 * 7) {
+                return true;
+            }
+            // 新表偏满, 由当前线程把旧表剩余部分迁完再判断
+            while (__prev->migrate_cursor.load(std::memory_order_relaxed) < __prev->capacity) {
+                migrate_some(__prev, __current);
+            }
+        }
+        return false;
+    }
+
+    /**
+     * 解锁新写入的 slot. 若写入期间 __table 已被换成旧表, 迁移游标可能已经越过此 slot, 需自行搬到新表
+     */
+    void publish_slot(table_t *__table, slot_t *__slot, uintptr_t __key) {
+        table_t *current = m_current.load();
+        if (current == __table) {
+            unlock_slot(__slot, __key);
+            return;
+        }
+        move_slot(__slot, __key, current, true);
+    }
+
+    /**
+     * __slot 已由调用方加锁
+     * @param __overwrite 目标表已有同 key 时是否覆盖; 迁移时目标表中的记录更新, 不覆盖
+     */
+    void move_slot(slot_t *__slot, uintptr_t __key, table_t *__dest, bool __overwrite) {
+        bool   exists      = false;
+        bool   need_resize = false;
+        slot_t *dest_slot  = acquire_slot(__dest, __key, current_stripe(), &exists,
+                                          &need_resize);
+        if (dest_slot) {
+            if (!exists || __overwrite) {
+                dest_slot->value = __slot->value;
+            }
+            unlock_slot(dest_slot, __key);
+        }
+        __slot->key.store(SLOT_TOMBSTONE, std::memory_order_release);
+    }
+
+    void migrate_some(table_t *__prev, table_t *__current) {
+        size_t begin = __prev->migrate_cursor.fetch_add(MIGRATE_BATCH, std::memory_order_relaxed);
+        if (begin >= __prev->capacity) {
+            return;
+        }
+        size_t end = begin + MIGRATE_BATCH < __prev->capacity ? begin + MIGRATE_BATCH
+                                                              : __prev->capacity;
+        for (size_t i = begin; i < end; ++i) {
+            slot_t    *slot = &__prev->slots[i];
+            uintptr_t key   = lock_live_slot(slot);
+            if (key != SLOT_EMPTY) {
+                move_slot(slot, key, __current, false);
+            }
+        }
+        __prev->migrated.fetch_add(end - begin, std::memory_order_release);
+    }
+
+    /**
+     * 需持有 m_resize_mutex
+     */
+    void finish_migration() {
+        table_t *prev = m_previous.load();
+        if (!prev) {
+            return;
+        }
+        table_t *current = m_current.load();
+        size_t  spins    = 0;
+        while (prev->migrated.load(std::memory_order_acquire) < prev->capacity) {
+            if (prev->migrate_cursor.load(std::memory_order_relaxed) < prev->capacity) {
+                migrate_some(prev, current);
+            } else {
+                spin_pause(spins); // 其他线程还在迁移最后几段
+            }
+        }
+    }
+
+    /**
+     * 翻转 epoch 并等待旧 epoch 中的操作全部退出
+     */
+    void synchronize_epoch() {
+        size_t old_epoch = m_epoch.load();
+        m_epoch.store(old_epoch ^ 1);
+        for (auto &stripe : m_epoch_stripes) {
+            size_t spins = 0;
+            while (stripe.active[old_epoch].load(std::memory_order_acquire)) {
+                spin_pause(spins);
+            }
+        }
+    }
+
+    /**
+     * @param __table 调用方观察到的当前表, 已被别人扩容时直接返回
+     * @param __wait  表已满时必须等到扩容完成
+     */
+    bool resize(table_t *__table, bool __wait) {
+        std::unique_lock<std::mutex> resize_lock(m_resize_mutex, std::defer_lock);
+        if (__wait) {
+            resize_lock.lock();
+        } else if (!resize_lock.try_lock()) {
+            return true;
+        }
+
+        if (m_current.load() != __table) {
+            return true;
+        }
+
+        finish_migration();
+
+        table_t *retired = m_previous.load();
+        if (retired) {
+            m_previous.store(nullptr);
+            synchronize_epoch();
+            destroy_table(retired);
+        }
+
+        // tombstone 过多时只重建, 存活 key 较多时才翻倍
+        size_t live = 0;
+        for (size_t i = 0; i < __table->capacity; ++i) {
+            uintptr_t k = __table->slots[i].key.load(std::memory_order_relaxed);
+            if (k != SLOT_EMPTY && k != SLOT_TOMBSTONE) {
+                live++;
+            }
+        }
+        size_t capacity = __table->capacity;
+        while (live * 2 >= capacity) {
+            capacity <<= 1;
+        }
+
+        table_t *table = create_table(capacity);
+        if (!table) {
+            return false;
+        }
+
+        m_previous.store(__table);
+        m_current.store(table);
+        return true;
+    }
+
+    std::atomic<table_t *> m_current;
+    std::atomic<table_t *> m_previous;
+    std::atomic<size_t>    m_epoch;
+    epoch_stripe_t         m_epoch_stripes[STRIPE_COUNT];
+    std::mutex             m_resize_mutex;
+};
+
+#endif //LIBMATRIX_HOOK_LOCKFREEPTRTABLE_H
@@ -0,0 +1,40 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include "MappingName.h"
+#include "Log.h"
+
+#define TAG "Matrix.MappingName"
+
+static std::atomic<bool> m_unnamed(false);
+
+bool name_hook_mapping(void *__addr, size_t __size) {
+    if (0 == prctl(PR_SET_VMA, PR_SET_VMA_ANON_NAME, __addr, __size, HOOK_MAPPING_NAME)) {
+        return true;
+    }
+    if (!m_unnamed.exchange(true, std::memory_order_relaxed)) {
+        LOGE(TAG, "name_hook_mapping: prctl failed, errno = %d", errno);
+    }
+    return false;
+}
+
+bool hook_mappings_named() {
+    return !m_unnamed.load(std::memory_order_relaxed);
+}
+
+#undef TAG
@@ -0,0 +1,51 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 给 hook 自身 mmap 的匿名内存命名, /proc/self/maps 中显示为 [anon:matrix-hooks].
+// 泄漏扫描据此跳过这些区域 (其中保存了大量堆指针, 不能作为根).
+// 命名失败会被记下, 此后泄漏扫描无法区分这些区域, 直接放弃扫描而不是报出大量误报
+//
+
+#ifndef LIBMATRIX_HOOK_MAPPINGNAME_H
+#define LIBMATRIX_HOOK_MAPPINGNAME_H
+
+#include <cstddef>
+#include <sys/prctl.h>
+
+#ifndef PR_SET_VMA
+#define PR_SET_VMA 0x53564d41
+#endif
+
+#ifndef PR_SET_VMA_ANON_NAME
+#define PR_SET_VMA_ANON_NAME 0
+#endif
+
+#define HOOK_MAPPING_NAME "matrix-hooks"
+#define HOOK_MAPPING_MAPS_NAME "[anon:" HOOK_MAPPING_NAME "]"
+
+/**
+ * 部分内核只保存名字的指针, 因此只能传字符串常量
+ * @return prctl 失败时返回 false
+ */
+bool name_hook_mapping(void *__addr, size_t __size);
+
+/**
+ * 至今所有 hook 自身的映射都已命名
+ */
+bool hook_mappings_named();
+
+#endif //LIBMATRIX_HOOK_MAPPINGNAME_H
@@ -0,0 +1,169 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "PoolAllocator.h"
+#include "MappingName.h"
+#include "Log.h"
+
+#define TAG "Matrix.PoolAllocator"
+
+#define POOL_SLAB_SIZE (64 * 1024)
+
+// size class: 256 以内按 16 递增, 1024 以内按 64 递增, 4096 以内按 256 递增
+#define POOL_SMALL_MAX 256
+#define POOL_MEDIUM_MAX 1024
+#define POOL_LARGE_MAX 4096
+#define POOL_CLASS_COUNT (POOL_SMALL_MAX / 16 + (POOL_MEDIUM_MAX - POOL_SMALL_MAX) / 64 \
+                          + (POOL_LARGE_MAX - POOL_MEDIUM_MAX) / 256)
+
+struct pool_free_block_t {
+    pool_free_block_t *next;
+};
+
+struct alignas(64) pool_class_t {
+    std::mutex        mutex;
+    pool_free_block_t *free_list;
+    char              *bump;
+    char              *bump_end;
+};
+
+static pool_class_t        m_pool_classes[POOL_CLASS_COUNT];
+static std::atomic<size_t> m_pool_mapped_size(0);
+static std::atomic<size_t> m_pool_used_size(0);
+
+static inline size_t class_index(size_t __size) {
+    if (__size <= POOL_SMALL_MAX) {
+        return (__size - 1) / 16;
+    }
+    if (__size <= POOL_MEDIUM_MAX) {
+        return POOL_SMALL_MAX / 16 + (__size - POOL_SMALL_MAX - 1) / 64;
+    }
+    return POOL_SMALL_MAX / 16 + (POOL_MEDIUM_MAX - POOL_SMALL_MAX) / 64
+           + (__size - POOL_MEDIUM_MAX - 1) / 256;
+}
+
+static inline size_t class_size(size_t __size) {
+    if (__size <= POOL_SMALL_MAX) {
+        return (__size + 15) & ~(size_t) 15;
+    }
+    if (__size <= POOL_MEDIUM_MAX) {
+        return (__size + 63) & ~(size_t) 63;
+    }
+    return (__size + 255) & ~(size_t) 255;
+}
+
+static inline size_t page_round(size_t __size) {
+    static const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+    return (__size + page_size - 1) & ~(page_size - 1);
+}
+
+static void *slab_map(size_t __size) {
+    void *mem = mmap(nullptr, __size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "slab_map: mmap %zu failed", __size);
+        return nullptr;
+    }
+    name_hook_mapping(mem, __size);
+    m_pool_mapped_size.fetch_add(__size, std::memory_order_relaxed);
+    return mem;
+}
+
+void *pool_alloc(size_t __size) {
+    if (!__size) {
+        __size = 1;
+    }
+
+    if (__size > POOL_LARGE_MAX) {
+        size_t mapped = page_round(__size);
+        void   *mem   = slab_map(mapped);
+        if (mem) {
+            m_pool_used_size.fetch_add(mapped, std::memory_order_relaxed);
+        }
+        return mem;
+    }
+
+    size_t       block = class_size(__size);
+    pool_class_t &pc   = m_pool_classes[class_index(__size)];
+    void         *mem  = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(pc.mutex);
+        if (pc.free_list) {
+            mem = pc.free_list;
+            pc.free_list = pc.free_list->next;
+        } else {
+            if (!pc.bump || pc.bump + block > pc.bump_end) {
+                auto slab = static_cast<char *>(slab_map(POOL_SLAB_SIZE));
+                if (!slab) {
+                    return nullptr;
+                }
+                // 旧 slab 的尾部不足一块, 直接弃用
+                pc.bump     = slab;
+                pc.bump_end = slab + POOL_SLAB_SIZE;
+            }
+            mem = pc.bump;
+            pc.bump += block;
+        }
+    }
+    m_pool_used_size.fetch_add(block, std::memory_order_relaxed);
+    return mem;
+}
+
+void pool_free(void *__ptr, size_t __size) {
+    if (!__ptr) {
+        return;
+    }
+    if (!__size) {
+        __size = 1;
+    }
+
+    if (__size > POOL_LARGE_MAX) {
+        size_t mapped = page_round(__size);
+        munmap(__ptr, mapped);
+        m_pool_used_size.fetch_sub(mapped, std::memory_order_relaxed);
+        m_pool_mapped_size.fetch_sub(mapped, std::memory_order_relaxed);
+        return;
+    }
+
+    pool_class_t &pc = m_pool_classes[class_index(__size)];
+    auto block = static_cast<pool_free_block_t *>(__ptr);
+    {
+        std::lock_guard<std::mutex> lock(pc.mutex);
+        block->next = pc.free_list;
+        pc.free_list = block;
+    }
+    m_pool_used_size.fetch_sub(class_size(__size), std::memory_order_relaxed);
+}
+
+void *pool_alloc_or_abort(size_t __size) {
+    void *mem = pool_alloc(__size);
+    if (!mem) {
+        LOGE(TAG, "pool_alloc: out of memory, size = %zu", __size);
+        abort();
+    }
+    return mem;
+}
+
+pool_stat_t pool_stat() {
+    return {m_pool_mapped_size.load(std::memory_order_relaxed),
+            m_pool_used_size.load(std::memory_order_relaxed)};
+}
+
+#undef TAG
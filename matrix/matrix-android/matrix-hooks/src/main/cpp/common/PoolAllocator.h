@@ -0,0 +1,126 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// hook 内部容器使用的池分配器, 内存直接 mmap, 不经过被 hook 的堆:
+//  - 按 size class 分池, 每个池从 64KB 的 slab 中切块, 释放的块挂回池的空闲链表, slab 不归还系统
+//  - 释放时由调用方给出大小 (同 std::allocator::deallocate), 块不带头部
+//  - 超过最大 size class 的请求单独 mmap, 释放时 munmap
+// 可用于 hook 回调内部, 不会重入 malloc, 开销与被 hook 的分配器无关
+//
+
+#ifndef LIBMATRIX_HOOK_POOLALLOCATOR_H
+#define LIBMATRIX_HOOK_POOLALLOCATOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <new>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define POOL_ALIGNMENT 16
+
+struct pool_stat_t {
+    /**
+     * 池自身 mmap 的字节数 (含单独 mmap 的大块)
+     */
+    size_t mapped_size;
+    /**
+     * 已分出去的字节数, 按 size class 向上取整
+     */
+    size_t used_size;
+};
+
+/**
+ * @return 失败时返回 nullptr, __size 为 0 时按 1 处理
+ */
+void *pool_alloc(size_t __size);
+
+/**
+ * __size 必须与 pool_alloc 时相同
+ */
+void pool_free(void *__ptr, size_t __size);
+
+pool_stat_t pool_stat();
+
+/**
+ * 分配失败时直接 abort, 与 -fno-exceptions 下的 std::allocator 一致
+ */
+void *pool_alloc_or_abort(size_t __size);
+
+template<class _Tp>
+struct pool_allocator {
+
+    static_assert(alignof(_Tp) <= POOL_ALIGNMENT, "over-aligned type is not supported by pool_allocator");
+
+    typedef _Tp value_type;
+
+    pool_allocator() noexcept = default;
+
+    template<class _Up>
+    pool_allocator(const pool_allocator<_Up> &) noexcept {}
+
+    _Tp *allocate(size_t __n) {
+        return static_cast<_Tp *>(pool_alloc_or_abort(__n * sizeof(_Tp)));
+    }
+
+    void deallocate(_Tp *__p, size_t __n) noexcept {
+        pool_free(__p, __n * sizeof(_Tp));
+    }
+};
+
+template<class _Tp, class _Up>
+inline bool operator==(const pool_allocator<_Tp> &, const pool_allocator<_Up> &) noexcept {
+    return true;
+}
+
+template<class _Tp, class _Up>
+inline bool operator!=(const pool_allocator<_Tp> &, const pool_allocator<_Up> &) noexcept {
+    return false;
+}
+
+template<class _Key, class _Value, class _Compare = std::less<_Key>>
+using pool_map = std::map<_Key, _Value, _Compare, pool_allocator<std::pair<const _Key, _Value>>>;
+
+template<class _Key, class _Compare = std::less<_Key>>
+using pool_set = std::set<_Key, _Compare, pool_allocator<_Key>>;
+
+template<class _Key, class _Value, class _Hash = std::hash<_Key>>
+using pool_unordered_map = std::unordered_map<_Key, _Value, _Hash, std::equal_to<_Key>,
+        pool_allocator<std::pair<const _Key, _Value>>>;
+
+template<class _Tp>
+using pool_vector = std::vector<_Tp, pool_allocator<_Tp>>;
+
+template<class _Tp, class... _Args>
+inline _Tp *pool_new(_Args &&... __args) {
+    void *p = pool_alloc(sizeof(_Tp));
+    return p ? new(p) _Tp(std::forward<_Args>(__args)...) : nullptr;
+}
+
+template<class _Tp>
+inline void pool_delete(_Tp *__p) {
+    if (__p) {
+        __p->~_Tp();
+        pool_free(__p, sizeof(_Tp));
+    }
+}
+
+#endif //LIBMATRIX_HOOK_POOLALLOCATOR_H
@@ -18,13 +18,64 @@
 // Created by Yves on 2020/7/9.
 //
 
+//
+// 各类 hook 共用的重入标记, 存放在 initial-exec 的 TLS 中:
+// 快路径只有一次 TLS 读和比较, 不分配内存, 线程退出时也不需要释放
+//
+
 #ifndef LIBMATRIX_HOOK_REENTRANTPREVENTION_H
 #define LIBMATRIX_HOOK_REENTRANTPREVENTION_H
 
-void rp_init();
+#include <cstdint>
+
+extern __thread uint32_t t_rp_depth __attribute__((tls_model("initial-exec")));
+
+void rp_unbalanced_release();
+
+/**
+ * @return 本线程已在 hook 中时返回 false, 此时不能调用 rp_release
+ */
+static inline bool rp_acquire() {
+    if (__builtin_expect(t_rp_depth != 0, 0)) {
+        return false;
+    }
+    t_rp_depth = 1;
+    return true;
+}
+
+static inline void rp_release() {
+    if (__builtin_expect(t_rp_depth == 0, 0)) {
+        rp_unbalanced_release();
+    }
+    t_rp_depth = 0;
+}
+
+/**
+ * 作用域内持有重入标记, acquired() 为 false 时说明已在 hook 中
+ */
+class rp_scope {
+
+public:
+
+    rp_scope() : m_acquired(rp_acquire()) {}
+
+    ~rp_scope() {
+        if (m_acquired) {
+            rp_release();
+        }
+    }
+
+    rp_scope(const rp_scope &) = delete;
+
+    rp_scope &operator=(const rp_scope &) = delete;
+
+    bool acquired() const {
+        return m_acquired;
+    }
 
-bool rp_acquire() ;
+private:
 
-void rp_release();
+    bool m_acquired;
+};
 
 #endif //LIBMATRIX_HOOK_REENTRANTPREVENTION_H
@@ -0,0 +1,251 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// so 列表由 dl_iterate_phdr 一次建好后二分查找, 代替逐个 pc 调 dladdr;
+// 函数名由 get_stacktrace_elements 解析 (内部按 map 缓存 ElfWrapper, 能查到 .symtab 中的非导出符号)
+//
+
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <link.h>
+#include "Log.h"
+#include "Backtrace.h"
+#include "Symbolizer.h"
+
+#define TAG "Matrix.Symbolizer"
+
+#define SYMBOL_CACHE_CAPACITY 16384
+#define RESOLVE_BATCH_SIZE 128
+
+using wechat_backtrace::uptr;
+
+struct module_t {
+    uptr       start;
+    uptr       end;
+    uptr       base;
+    const char *name;
+};
+
+struct symbol_entry_t {
+    uptr        pc;
+    uptr        rel_pc;
+    const char  *so_name;
+    std::string function_name;
+};
+
+typedef std::list<symbol_entry_t> symbol_lru_t;
+
+static std::mutex                                        m_symbolizer_mutex;
+static std::atomic<bool>                                 m_modules_stale(true);
+static std::vector<module_t>                             m_modules;
+static std::unordered_set<std::string>                   m_so_names; // 只增不删, 保证名字指针长期有效
+static symbol_lru_t                                      m_symbol_lru;
+static std::unordered_map<uptr, symbol_lru_t::iterator> m_symbols;
+
+static int on_phdr(struct dl_phdr_info *info, size_t, void *) {
+    const char *name = m_so_names.insert(info->dlpi_name ? info->dlpi_name : "").first->c_str();
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD) {
+            continue;
+        }
+        uptr start = (uptr) info->dlpi_addr + phdr.p_vaddr;
+        m_modules.push_back({start, start + phdr.p_memsz, (uptr) info->dlpi_addr, name});
+    }
+    return 0;
+}
+
+static void refresh_modules_locked() {
+    if (!m_modules_stale.exchange(false)) {
+        return;
+    }
+    m_modules.clear();
+    dl_iterate_phdr(on_phdr, nullptr);
+    std::sort(m_modules.begin(), m_modules.end(), [](const module_t &l, const module_t &r) {
+        return l.start < r.start;
+    });
+    LOGD(TAG, "refresh_modules: %zu segments", m_modules.size());
+}
+
+static const module_t *find_module_locked(uptr pc) {
+    auto it = std::upper_bound(m_modules.begin(), m_modules.end(), pc,
+                               [](uptr pc, const module_t &module) {
+                                   return pc < module.start;
+                               });
+    if (it == m_modules.begin()) {
+        return nullptr;
+    }
+    --it;
+    return pc < it->end ? &*it : nullptr;
+}
+
+static inline uptr adjust_pc(const wechat_backtrace::Frame *frames, size_t i) {
+#ifdef __aarch64__
+    // 与 restore_frame_detail 一致: 除第 0 帧外都是 LR, -4 恢复到调用指令
+    return frames[i].pc - (i > 0 ? 4 : 0);
+#else
+    return frames[i].pc;
+#endif
+}
+
+static void insert_locked(uptr pc, uptr rel_pc, const char *so_name, std::string &&function_name) {
+    if (m_symbols.count(pc)) {
+        return;
+    }
+    m_symbol_lru.push_front({pc, rel_pc, so_name, std::move(function_name)});
+    m_symbols[pc] = m_symbol_lru.begin();
+    if (m_symbol_lru.size() > SYMBOL_CACHE_CAPACITY) {
+        m_symbols.erase(m_symbol_lru.back().pc);
+        m_symbol_lru.pop_back();
+    }
+}
+
+static std::string fallback_function_name(uptr pc) {
+    Dl_info info{};
+    if (!dladdr((void *) pc, &info) || !info.dli_sname) {
+        return std::string();
+    }
+    int  status     = 0;
+    char *demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+    std::string name(demangled ? demangled : info.dli_sname);
+    free(demangled);
+    return name;
+}
+
+/**
+ * __pcs 需已排序去重
+ */
+static void resolve_locked(const std::vector<uptr> &pcs) {
+    refresh_modules_locked();
+
+    std::vector<wechat_backtrace::Frame>        batch;
+    std::vector<const char *>                   batch_so_names;
+    std::vector<wechat_backtrace::FrameElement> elements(RESOLVE_BATCH_SIZE);
+
+    auto flush_batch = [&] {
+        if (batch.empty()) {
+            return;
+        }
+        size_t elements_size = 0;
+        wechat_backtrace::get_stacktrace_elements(batch.data(), batch.size(), false,
+                                                  elements.data(), elements.size(),
+                                                  elements_size);
+        for (size_t i = 0; i < batch.size(); ++i) {
+            std::string function_name;
+            if (i < elements_size) {
+                function_name = std::move(elements[i].function_name);
+                elements[i]   = wechat_backtrace::FrameElement();
+            }
+            if (function_name.empty()) {
+                function_name = fallback_function_name(batch[i].pc);
+            }
+            insert_locked(batch[i].pc, batch[i].rel_pc, batch_so_names[i],
+                          std::move(function_name));
+        }
+        batch.clear();
+        batch_so_names.clear();
+    };
+
+    for (auto pc : pcs) {
+        auto it = m_symbols.find(pc);
+        if (it != m_symbols.end()) {
+            m_symbol_lru.splice(m_symbol_lru.begin(), m_symbol_lru, it->second);
+            continue;
+        }
+
+        const module_t *module = find_module_locked(pc);
+        if (!module) {
+            insert_locked(pc, pc, "null", std::string());
+            continue;
+        }
+
+        wechat_backtrace::Frame frame;
+        frame.pc     = pc;
+        frame.rel_pc = pc - module->base;
+        batch.push_back(frame);
+        batch_so_names.push_back(module->name);
+        if (batch.size() == RESOLVE_BATCH_SIZE) {
+            flush_batch();
+        }
+    }
+    flush_batch();
+}
+
+void symbolizer_collect(const wechat_backtrace::Frame *__frames, size_t __frame_size,
+                        std::vector<uptr> &__pcs) {
+    for (size_t i = 0; __frames && i < __frame_size; ++i) {
+        __pcs.push_back(adjust_pc(__frames, i));
+    }
+}
+
+void symbolizer_resolve(std::vector<uptr> &__pcs) {
+    std::sort(__pcs.begin(), __pcs.end());
+    __pcs.erase(std::unique(__pcs.begin(), __pcs.end()), __pcs.end());
+
+    std::lock_guard<std::mutex> symbolizer_lock(m_symbolizer_mutex);
+    resolve_locked(__pcs);
+}
+
+void symbolizer_restore(const wechat_backtrace::Frame *__frames, size_t __frame_size,
+                        const std::function<void(wechat_backtrace::FrameDetail)> &__callback) {
+    if (!__frames || !__frame_size || !__callback) {
+        return;
+    }
+
+    std::vector<uptr> pcs;
+    symbolizer_collect(__frames, __frame_size, pcs);
+    std::sort(pcs.begin(), pcs.end());
+    pcs.erase(std::unique(pcs.begin(), pcs.end()), pcs.end());
+
+    std::lock_guard<std::mutex> symbolizer_lock(m_symbolizer_mutex);
+    resolve_locked(pcs);
+
+    for (size_t i = 0; i < __frame_size; ++i) {
+        auto it = m_symbols.find(adjust_pc(__frames, i));
+        if (it == m_symbols.end()) { // 不会发生: 本次解析的 pc 都在 LRU 头部
+            continue;
+        }
+        const symbol_entry_t &entry = *it->second;
+        wechat_backtrace::FrameDetail detail = {
+                .rel_pc = entry.rel_pc,
+                .map_name = entry.so_name,
+                .function_name = entry.function_name.empty() ? "(null)"
+                                                             : entry.function_name.c_str()
+        };
+        __callback(detail);
+    }
+}
+
+const char *symbolizer_so_name(const void *__addr) {
+    std::lock_guard<std::mutex> symbolizer_lock(m_symbolizer_mutex);
+    refresh_modules_locked();
+    const module_t *module = find_module_locked((uptr) __addr);
+    return module ? module->name : nullptr;
+}
+
+void symbolizer_notify_maps_changed() {
+    m_modules_stale.store(true);
+}
+
+#undef TAG
@@ -0,0 +1,58 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// memory / pthread dump 共用的符号化服务: pc -> (so 名, 已 demangle 的函数名) 的 LRU 缓存.
+// 批量解析时 pc 去重排序, 同一 so 的 pc 相邻, 由 get_stacktrace_elements 按 map 复用 ElfWrapper 查符号
+//
+
+#ifndef LIBMATRIX_HOOK_SYMBOLIZER_H
+#define LIBMATRIX_HOOK_SYMBOLIZER_H
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+#include "BacktraceDefine.h"
+
+/**
+ * 把堆栈中待符号化的 pc 追加到 __pcs, pc 的修正方式与 restore_frame_detail 一致
+ */
+void symbolizer_collect(const wechat_backtrace::Frame *__frames, size_t __frame_size,
+                        std::vector<wechat_backtrace::uptr> &__pcs);
+
+/**
+ * 批量解析 __pcs 中未缓存的 pc, 会对 __pcs 排序去重
+ */
+void symbolizer_resolve(std::vector<wechat_backtrace::uptr> &__pcs);
+
+/**
+ * 与 restore_frame_detail 用法相同, 但优先查缓存, 且 function_name 已 demangle, 未知时为 "(null)".
+ * 回调期间持有缓存锁, FrameDetail 中的字符串只在回调内有效
+ */
+void symbolizer_restore(const wechat_backtrace::Frame *__frames, size_t __frame_size,
+                        const std::function<void(wechat_backtrace::FrameDetail)> &__callback);
+
+/**
+ * 地址所在 so 的路径, 找不到时返回 nullptr. 返回值在进程生命周期内有效, 同一 so 返回同一指针
+ */
+const char *symbolizer_so_name(const void *__addr);
+
+/**
+ * dlopen 后调用, 下次查询时重建 so 列表
+ */
+void symbolizer_notify_maps_changed();
+
+#endif //LIBMATRIX_HOOK_SYMBOLIZER_H
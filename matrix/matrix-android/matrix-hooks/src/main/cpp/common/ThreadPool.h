@@ -18,21 +18,36 @@
 // Created by Yves on 2020/6/15.
 //
 
+//
+// 每个 worker 持有一个有界的无锁 MPSC 环 (Vyukov 有界队列), 任务闭包直接构造在定长 slot 中:
+//  - enqueue 只有一次 CAS 和一次 fetch_add, 不加锁, 不分配内存; 环满时返回 false, 由调用方决定如何处理
+//  - 只在待处理数由 0 变 1 时写 eventfd 唤醒, worker 醒来后批量执行直到环为空才再次阻塞
+//
+
 #ifndef LIBMATRIX_HOOK_THREADPOOL_H
 #define LIBMATRIX_HOOK_THREADPOOL_H
 
 
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cmath>
 #include <cstddef>
-#include <vector>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <string>
 #include <thread>
-#include <condition_variable>
-#include <semaphore.h>
-#include <queue>
+#include <type_traits>
+#include <utility>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <sys/eventfd.h>
-#include <sys/epoll.h>
-#include <linux/eventpoll.h>
+#include <sys/mman.h>
 #include "Log.h"
+#include "MappingName.h"
 #include "BacktraceDefine.h"
 
 #define TAG "ThreadPool"
@@ -41,107 +56,169 @@ typedef std::function<void()> runnable;
 
 class worker {
 
-#define EPOLL_MAX_EVENTS 16
-#define DEFAULT_WAIT_TIMEOUT_MILLIS 1
+#define WORKER_DEFAULT_CAPACITY 1024 // power of 2
+#define WORKER_TASK_INLINE_SIZE 48
+#define WORKER_DRAIN_BATCH 64
+
+    struct alignas(64) task_slot_t {
+        std::atomic<size_t> seq;
+        /**
+         * 执行并析构 storage 中的闭包
+         */
+        void (*run)(void *);
+        alignas(16) unsigned char storage[WORKER_TASK_INLINE_SIZE];
+    };
 
 public:
     worker() : worker("mh-worker-def") {
     }
 
-    worker(const char *__name) : worker(__name, -1) {
+    worker(const char *__name) : worker(__name, WORKER_DEFAULT_CAPACITY) {
     }
 
-    worker(const char *__name, const int __epfd) : thread_name(__name),
-                                                   epoll_fd(__epfd),
-                                                   quit(false),
-                                                   wait_timeout_millis(
-                                                           DEFAULT_WAIT_TIMEOUT_MILLIS) {
-//        epoll_prepare();
+    worker(const char *__name, size_t __capacity) : thread_name(__name),
+                                                   slots(nullptr),
+                                                   capacity(__capacity),
+                                                   head(0),
+                                                   tail(0),
+                                                   pending(0),
+                                                   quit(false) {
+        assert(capacity && !(capacity & (capacity - 1)));
+        mapped_size = capacity * sizeof(task_slot_t);
+        void *mem = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            LOGE(TAG, "worker: mmap %zu failed", mapped_size);
+            capacity = 0;
+        } else {
+            name_hook_mapping(mem, mapped_size);
+            slots = static_cast<task_slot_t *>(mem);
+            for (size_t i = 0; i < capacity; ++i) {
+                slots[i].seq.store(i, std::memory_order_relaxed);
+            }
+        }
+        wake_fd = eventfd(0, EFD_CLOEXEC);
         this->work_thread = std::thread(worker::work, this);
     }
 
     ~worker() {
-        {
-            std::lock_guard<std::mutex> lock(task_mutex);
-            quit = true;
-        }
-//        task_condition.notify_one();
+        quit.store(true, std::memory_order_release);
+        signal();
         work_thread.join();
-        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, wake_fd, nullptr);
-        close(epoll_fd);
+        close(wake_fd);
+        if (slots) {
+            munmap(slots, mapped_size);
+        }
     }
 
-    void enqueue(runnable __task) {
-//        LOGD(TAG, "worker execute");
-//        NanoSeconds_Start(enq_begin);
-        bool need_wake;
-        {
-            std::lock_guard<std::mutex> queue_lock(task_mutex);
-            task_queue.emplace(__task);
-            need_wake = blocked;
+    /**
+     * 闭包需能放入 slot, 在 worker 线程中执行一次后析构
+     * @return 环已满或 worker 不可用时返回 false, 此时闭包未被拷贝
+     */
+    template<class _Callable>
+    bool enqueue(_Callable &&__task) {
+        typedef typename std::decay<_Callable>::type task_t;
+        static_assert(sizeof(task_t) <= WORKER_TASK_INLINE_SIZE, "task is too large for a worker slot");
+        static_assert(alignof(task_t) <= 16, "task is over-aligned for a worker slot");
+
+        if (!capacity) {
+            return false;
         }
 
-//        NanoSeconds_End(enq_cost, enq_begin);
-//
-//        NanoSeconds_Start(notify_begin);
-        if (need_wake) {
-            task_condition.notify_one();
-//            epoll_notify();
+        task_slot_t *slot;
+        size_t      pos = tail.load(std::memory_order_relaxed);
+        for (;;) {
+            slot = &slots[pos & (capacity - 1)];
+            size_t   seq  = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                return false; // 满
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+
+        new(slot->storage) task_t(std::forward<_Callable>(__task));
+        slot->run = [](void *__storage) {
+            auto task = static_cast<task_t *>(__storage);
+            (*task)();
+            task->~task_t();
+        };
+        slot->seq.store(pos + 1, std::memory_order_release);
+
+        if (pending.fetch_add(1, std::memory_order_acq_rel) == 0) {
+            signal();
         }
-//        NanoSeconds_End(notify_cost, notify_begin);
-////        if (!need_wake)
-//        LOGD(TAG, "acquire lock enq cost %lld, notify cost %s, %lld",
-//             enq_cost, need_wake ? "true" : "false", notify_cost);
+        return true;
     }
 
 private:
 
+    void signal() {
+        uint64_t one = 1;
+        while (write(wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+
+    /**
+     * 只在 worker 线程调用
+     * @return 执行的任务数
+     */
+    size_t drain_batch() {
+        size_t n = 0;
+        for (; n < WORKER_DRAIN_BATCH; ++n) {
+            task_slot_t *slot = &slots[head & (capacity - 1)];
+            if (slot->seq.load(std::memory_order_acquire) != head + 1) {
+                break;
+            }
+            slot->run(slot->storage);
+            slot->seq.store(head + capacity, std::memory_order_release);
+            head++;
+        }
+        return n;
+    }
+
     static void work(worker *w) {
-        pthread_setname_np(w->work_thread.native_handle(), w->thread_name.c_str());
+        // work_thread 可能尚未赋值, 不能用其 native_handle
+        pthread_setname_np(pthread_self(), w->thread_name.c_str());
 
-//        int time_out_millis = 0;
         for (;;) {
+            uint64_t count;
+            if (read(w->wake_fd, &count, sizeof(count)) < 0 && errno != EINTR) {
+                LOGE(TAG, "worker %s: read eventfd failed, errno = %d", w->thread_name.c_str(),
+                     errno);
+                return;
+            }
 
-            runnable task;
-            size_t   retained_size;
-            {
-                std::unique_lock<std::mutex> queue_lock(w->task_mutex);
-
-                w->task_condition.wait(queue_lock, [w] {
-                    w->blocked = w->task_queue.empty();
-                    if (w->blocked) {
-                        LOGD(TAG, "task queue is empty, blocked");
-                    }
-                    return w->quit || !w->blocked;
-                });
-
-                if (w->quit) {
-                    return;
+            // 生产者先发布 slot 再计数, 可能先被取走而使 pending 暂为负数, 此时等待计数追上
+            int64_t left;
+            do {
+                size_t n = w->capacity ? w->drain_batch() : 0;
+                left = w->pending.fetch_sub((int64_t) n, std::memory_order_acq_rel) - (int64_t) n;
+                if (!n && left) {
+                    sched_yield();
                 }
+            } while (left);
 
-                w->wait_timeout_millis = DEFAULT_WAIT_TIMEOUT_MILLIS;
-                w->blocked             = false;
-                task = w->task_queue.front();
-                w->task_queue.pop();
-                retained_size = w->task_queue.size();
+            if (w->quit.load(std::memory_order_acquire)) {
+                return;
             }
-//            LOGD(TAG, "proceed within #%s retained %zu", w->thread_name.c_str(), retained_size);
-            task();
-//            usleep(0);
         }
     }
 
-    std::thread                        work_thread;
-    std::queue<std::function<void()> > task_queue;
-    std::condition_variable            task_condition;
-    std::mutex                         task_mutex;
-    std::string                        thread_name;
-    int                                wake_fd;
-    int                                epoll_fd;
-    int                                wait_timeout_millis;
-    bool                               quit;
-    bool                               blocked;
-//    bool                               hungry;
+    std::thread           work_thread;
+    std::string           thread_name;
+    task_slot_t           *slots;
+    size_t                capacity;
+    size_t                mapped_size;
+    size_t                head; // 只由 worker 线程访问
+    alignas(64) std::atomic<size_t> tail;
+    alignas(64) std::atomic<int64_t> pending;
+    std::atomic<bool>     quit;
+    int                   wake_fd;
 
 };
 
@@ -191,21 +268,23 @@ public:
         return ret;
     }
 
-    void execute(runnable __task) const {
-        execute(__task, -1);
+    template<class _Callable>
+    bool execute(_Callable &&__task) const {
+        return execute(std::forward<_Callable>(__task), pool_size);
     }
 
-    // fixme 减少拷贝
-    void execute(runnable __func, size_t __idx) const {
-        if (__idx < 0 || __idx >= pool_size) {
+    /**
+     * @param __idx 超出范围时按当前线程选择 worker
+     * @return worker 的环已满时返回 false
+     */
+    template<class _Callable>
+    bool execute(_Callable &&__task, size_t __idx) const {
+        if (__idx >= pool_size) {
             __idx = pthread_self() & (pool_size - 1);
         }
 
         assert(__idx < pool_size);
-//        NanoSeconds_Start(begin);
-        workers[__idx]->enqueue(__func);
-//        NanoSeconds_End(end, begin);
-//        LOGD(TAG, "enqueue cost %lld", end);
+        return workers[__idx]->enqueue(std::forward<_Callable>(__task));
     }
 
 private:
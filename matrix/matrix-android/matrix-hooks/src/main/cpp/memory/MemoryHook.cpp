@@ -20,10 +20,15 @@
 
 #include <malloc.h>
 #include <unistd.h>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
 #include <unordered_map>
 #include <set>
 #include <unordered_set>
 #include <list>
+#include <vector>
 #include <map>
 #include <memory>
 #include <random>
@@ -34,14 +39,25 @@
 #include <mutex>
 #include <condition_variable>
 #include <shared_mutex>
-#include <cJSON.h>
 #include <Log.h>
 #include "MemoryHookFunctions.h"
 #include "Utils.h"
 #include "unwindstack/Unwinder.h"
 #include "ThreadPool.h"
 #include "BacktraceDefine.h"
+#include "PoolAllocator.h"
+#include "ReentrantPrevention.h"
 #include "MemoryHookMetas.h"
+#include "MemoryHookEventBuffer.h"
+#include "MemoryHookStackArena.h"
+#include "JsonStreamWriter.h"
+#include "Symbolizer.h"
+#include "MemoryHookSizeClass.h"
+#include "MemoryHookLifetime.h"
+#include "MemoryHookMmapIndex.h"
+#include "MemoryHookThreadGroup.h"
+#include "MemoryHookStatsPage.h"
+#include "MemoryHookLeakScan.h"
 #include "MemoryHook.h"
 
 #define MEMHOOK_BACKTRACE_MAX_FRAMES MAX_FRAME_SHORT
@@ -50,10 +66,14 @@ static memory_meta_container m_memory_meta_container;
 
 static bool is_stacktrace_enabled = false;
 static bool is_caller_sampling_enabled = false;
+static bool is_event_buffer_enabled = false;
+static bool is_lifetime_enabled = false;
+static bool is_realloc_reattribute_enabled = false;
 
 static size_t m_sample_size_min = 0;
 static size_t m_sample_size_max = 0;
 static double m_sampling = 1;
+static size_t m_sampling_interval_bytes = 0;
 
 static size_t m_stacktrace_log_threshold;
 
@@ -74,10 +94,36 @@ void set_sampling(double sampling) {
     m_sampling = sampling;
 }
 
+void set_sampling_interval_bytes(size_t interval) {
+    m_sampling_interval_bytes = interval;
+}
+
 void enable_caller_sampling(bool enable) {
     is_caller_sampling_enabled = enable;
 }
 
+static void on_memory_event(const memory_event_t &event);
+
+void enable_event_buffer(bool enable) {
+    if (enable) {
+        event_buffer_init(on_memory_event);
+    } else {
+        event_buffer_flush();
+    }
+    is_event_buffer_enabled = enable;
+}
+
+void enable_lifetime_profile(bool enable) {
+    if (enable) {
+        lifetime_start();
+    }
+    is_lifetime_enabled = enable;
+}
+
+void enable_realloc_reattribute(bool enable) {
+    is_realloc_reattribute_enabled = enable;
+}
+
 static inline void
 decrease_stack_size(std::map<uint64_t, stack_meta_t> &stack_metas,
                     const ptr_meta_t &meta) {
@@ -89,17 +135,314 @@ void memory_hook_init() {
     LOGI(TAG, "memory_hook_init");
 }
 
-static inline bool should_do_unwind(size_t byte_count, void *caller) {
+static __thread uint64_t t_xorshift_state __attribute__((tls_model("initial-exec")));
+
+/**
+ * 线程私有的 xorshift64, 避免 bionic 中 rand() 的全局锁
+ */
+static inline uint64_t xorshift_next() {
+    uint64_t x = t_xorshift_state;
+    if (!x) {
+        x = ((uint64_t) pthread_self() ^ (uint64_t) time(nullptr)) * 0x9E3779B97F4A7C15ULL | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    t_xorshift_state = x;
+    return x;
+}
+
+static inline bool sample_by_rate(double rate) {
+    return rate >= 1 || (double) (xorshift_next() >> 11) * 0x1.0p-53 < rate;
+}
+
+#define CALLER_SAMPLING_SLOTS 4096 // power of 2
+#define CALLER_SAMPLING_PROBES 8
+#define CALLER_COLD_THRESHOLD 32
+
+struct caller_sampling_slot_t {
+    std::atomic<uintptr_t> caller;
+    std::atomic<uint32_t>  count;
+};
+
+static caller_sampling_slot_t m_caller_sampling_slots[CALLER_SAMPLING_SLOTS];
+
+/**
+ * 探测范围内都被其他 caller 占住时, 把它们的计数减半; 减到 1 以下的 slot 让给新 caller.
+ * 热 caller 很快会重新累计, 不再出现的 caller 则逐渐被挤出, 表不会被早期的 caller 永久占满
+ * @return caller 累计的分配次数 (含本次), 未能占到 slot 时返回 1, 即按冷 caller 处理
+ */
+static inline uint32_t caller_hit_count(void *caller) {
+    auto   key   = (uintptr_t) caller;
+    size_t start = (size_t) ((key * 0x9E3779B97F4A7C15ULL) >> 32);
+    size_t idx   = start;
+    for (int n = 0; n < CALLER_SAMPLING_PROBES; ++n, ++idx) {
+        auto      &slot   = m_caller_sampling_slots[idx & (CALLER_SAMPLING_SLOTS - 1)];
+        uintptr_t current = slot.caller.load(std::memory_order_relaxed);
+        if (!current && slot.caller.compare_exchange_strong(current, key,
+                                                            std::memory_order_relaxed)) {
+            current = key;
+        }
+        if (current == key) {
+            return slot.count.fetch_add(1, std::memory_order_relaxed) + 1;
+        }
+    }
+
+    idx = start;
+    for (int n = 0; n < CALLER_SAMPLING_PROBES; ++n, ++idx) {
+        auto     &slot = m_caller_sampling_slots[idx & (CALLER_SAMPLING_SLOTS - 1)];
+        uint32_t count = slot.count.load(std::memory_order_relaxed);
+        if (count > 1) {
+            slot.count.compare_exchange_strong(count, count >> 1, std::memory_order_relaxed);
+            continue;
+        }
+        uintptr_t current = slot.caller.load(std::memory_order_relaxed);
+        if (current != key && slot.caller.compare_exchange_strong(current, key,
+                                                                  std::memory_order_relaxed)) {
+            slot.count.store(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+    return 1;
+}
+
+/**
+ * 冷 caller 每次都回溯, 避免漏掉低频的泄漏点;
+ * 热 caller 的采样率按 CALLER_COLD_THRESHOLD / count 衰减, 回溯次数只随分配次数对数增长
+ */
+static inline bool should_unwind_caller(void *caller) {
+    if (!caller) {
+        return sample_by_rate(m_sampling);
+    }
+    uint32_t count = caller_hit_count(caller);
+    if (count <= CALLER_COLD_THRESHOLD) {
+        return true;
+    }
+    return xorshift_next() % count < CALLER_COLD_THRESHOLD;
+}
+
+static __thread int64_t t_bytes_until_sample __attribute__((tls_model("initial-exec")));
+
+/**
+ * 到下一次采样的字节数服从均值为 interval 的指数分布, 即每个字节以 1/interval 的概率被采中
+ */
+static inline int64_t next_sample_distance(size_t interval) {
+    double u = (double) ((xorshift_next() >> 11) + 1) * 0x1.0p-53; // (0, 1]
+    return (int64_t) (-std::log(u) * (double) interval) + 1;
+}
+
+/**
+ * 按字节采样 (tcmalloc 方式): 分配越大越容易被采中, 大块不会被漏掉
+ * @param weight 被采中时写入该分配代表的期望字节数, 用于 dump 时还原总量
+ */
+static inline bool should_sample_bytes(size_t byte_count, size_t *weight) {
+    size_t  interval = m_sampling_interval_bytes;
+    int64_t left     = t_bytes_until_sample;
+    if (!left) { // 新线程先取一段距离, 否则每个线程的第一次分配都会被采中. 用过之后不会再为 0
+        left = next_sample_distance(interval);
+    }
+    left -= (int64_t) byte_count;
+    if (left > 0) {
+        t_bytes_until_sample = left;
+        return false;
+    }
+    t_bytes_until_sample = next_sample_distance(interval);
+
+    // 被采中的概率为 1 - e^(-size/interval), 取其倒数作为权重即为无偏估计
+    double probability = -std::expm1(-(double) byte_count / (double) interval);
+    *weight = probability > 0 ? (size_t) ((double) byte_count / probability) : byte_count;
+    return true;
+}
+
+static inline bool should_do_unwind(size_t byte_count, void *caller, size_t *weight) {
+    if (m_sampling_interval_bytes) {
+        return should_sample_bytes(byte_count, weight);
+    }
+
+    if ((m_sample_size_min != 0 && byte_count < m_sample_size_min)
+        || (m_sample_size_max != 0 && byte_count > m_sample_size_max)) {
+        return false;
+    }
+
     if (!is_caller_sampling_enabled) {
+        return sample_by_rate(m_sampling);
+    }
+
+    return should_unwind_caller(caller);
+}
+
+/**
+ * 回溯到调用方栈上的帧数组并 intern 进堆栈池, 不经过任何堆分配
+ * @return 堆栈池中的 id, 回溯失败或堆栈池内存不足时为 STACK_ID_INVALID
+ */
+static inline uint32_t unwind_and_intern(uint64_t *stack_hash) {
+    wechat_backtrace::Frame frames[MEMHOOK_BACKTRACE_MAX_FRAMES];
+    wechat_backtrace::Backtrace backtrace;
+    backtrace.max_frames = MEMHOOK_BACKTRACE_MAX_FRAMES;
+    // 别名构造, 不分配控制块
+    backtrace.frames = std::shared_ptr<wechat_backtrace::Frame>(
+            std::shared_ptr<wechat_backtrace::Frame>(), frames);
+    wechat_backtrace::unwind_adapter(frames, backtrace.max_frames, backtrace.frame_size);
+
+    *stack_hash = hash_backtrace_frames(&backtrace);
+    assert(*stack_hash != 0);
+    return stack_arena_intern(*stack_hash, frames, backtrace.frame_size);
+}
+
+static std::mutex       m_mmap_mutex;
+static mmap_range_index m_mmap_index;
+
+static inline uintptr_t page_align_up(uintptr_t addr) {
+    static const uintptr_t page_size = (uintptr_t) getpagesize();
+    return (addr + page_size - 1) & ~(page_size - 1);
+}
+
+static void unmap_range_locked(uintptr_t start, uintptr_t end, uint32_t tick);
+
+/**
+ * 按 so / 线程组的增量统计及统计页, 需在 meta 填好后调用
+ */
+static inline void account_acquire(const ptr_meta_t &meta) {
+    uint32_t so_index = meta.so_index;
+    size_class_on_acquire(so_index, meta.size, meta.is_mmap);
+    thread_group_on_acquire(meta.thread_group, so_index, meta.size, meta.is_mmap);
+    stats_page_on_acquire(so_index, meta.size, meta.is_mmap);
+}
+
+static inline void account_release(const ptr_meta_t &meta) {
+    uint32_t so_index = meta.so_index;
+    size_class_on_release(so_index, meta.size, meta.is_mmap);
+    thread_group_on_release(meta.thread_group, so_index, meta.size, meta.is_mmap);
+    stats_page_on_release(so_index, meta.size, meta.is_mmap);
+}
+
+static inline void record_acquire(void *caller,
+                                  void *ptr,
+                                  size_t byte_count,
+                                  bool is_mmap,
+                                  uint64_t stack_hash,
+                                  size_t weight,
+                                  uint32_t tick,
+                                  uint8_t thread_group,
+                                  uint32_t stack_id) {
+    std::unique_lock<std::mutex> mmap_lock(m_mmap_mutex, std::defer_lock);
+    if (is_mmap) {
+        mmap_lock.lock();
+        // MAP_FIXED 会替换掉区间内原有的映射, 先按 munmap 处理重叠部分
+        uintptr_t start = (uintptr_t) ptr;
+        uintptr_t end   = page_align_up(start + byte_count);
+        unmap_range_locked(start, end, tick);
+        m_mmap_index.insert(start, end);
+    }
+
+    auto so_index = (uint8_t) size_class_so_index(caller);
+    m_memory_meta_container.insert(ptr,
+                                   stack_hash,
+                                   account_release,
+                                   [&](ptr_meta_t *ptr_meta, stack_meta_t *stack_meta) {
+                                       ptr_meta->ptr          = ptr;
+                                       ptr_meta->size         = byte_count;
+                                       ptr_meta->caller       = caller;
+                                       ptr_meta->is_mmap      = is_mmap;
+                                       ptr_meta->weight       = weight;
+                                       ptr_meta->birth_tick   = tick;
+                                       ptr_meta->thread_group = thread_group;
+                                       ptr_meta->so_index     = so_index;
+                                       account_acquire(*ptr_meta);
+
+                                       if (!stack_meta) {
+                                           return;
+                                       }
+
+                                       if (!stack_meta->stack_id) { // 相同的堆栈只记录一个
+                                           stack_meta->stack_id = stack_id;
+                                           stack_meta->caller   = caller;
+                                       }
+                                   });
+}
+
+static inline void record_release(void *ptr, uint32_t tick) {
+    m_memory_meta_container.erase(ptr, [tick](const ptr_meta_t &meta) {
+        account_release(meta);
+        // 只统计有堆栈的分配, 报告需要按堆栈输出
+        if (tick && meta.birth_tick && meta.stack_hash) {
+            lifetime_on_release(meta.stack_hash, meta.birth_tick, tick);
+        }
+    });
+}
+
+/**
+ * @return 旧地址不在表中时返回 false, 由调用方按新分配记录
+ */
+static inline bool record_realloc(void *old_ptr, void *new_ptr, size_t byte_count) {
+    return m_memory_meta_container.realloc(
+            old_ptr, new_ptr, byte_count, account_release,
+            [](const ptr_meta_t &old_meta, const ptr_meta_t &new_meta) {
+                account_release(old_meta);
+                account_acquire(new_meta);
+            });
+}
+
+/**
+ * 需持有 m_mmap_mutex. 已记录的 mmap 中与 [start, end) 重叠的部分视为释放,
+ * 只被覆盖一部分的记录裁剪或一分为二, 剩余部分保留原堆栈
+ */
+static void unmap_range_locked(uintptr_t start, uintptr_t end, uint32_t tick) {
+    m_mmap_index.carve(start, end, [tick](const mmap_range_t &range, const mmap_range_t &cut) {
+        auto ptr  = (void *) range.start;
+        bool head = range.start < cut.start;
+        bool tail = cut.end < range.end;
+        if (!head && !tail) {
+            record_release(ptr, tick);
+        } else if (!tail) {
+            record_realloc(ptr, ptr, cut.start - range.start);
+        } else if (!head) {
+            record_realloc(ptr, (void *) cut.end, range.end - cut.end);
+        } else {
+            m_memory_meta_container.split(
+                    ptr, cut.start - range.start, (void *) cut.end, range.end - cut.end,
+                    [](const ptr_meta_t &old_meta, const ptr_meta_t &head_meta,
+                       const ptr_meta_t &tail_meta) {
+                        account_release(old_meta);
+                        account_acquire(head_meta);
+                        account_acquire(tail_meta);
+                    });
+        }
+    });
+}
 
-        return ((m_sample_size_min == 0 || byte_count >= m_sample_size_min)
-                && (m_sample_size_max == 0 || byte_count <= m_sample_size_max)
-                && rand() <= m_sampling * RAND_MAX);
+static inline void record_munmap(void *ptr, size_t byte_count, uint32_t tick) {
+    std::lock_guard<std::mutex> mmap_lock(m_mmap_mutex);
+    uintptr_t start = (uintptr_t) ptr;
+    unmap_range_locked(start, page_align_up(start + byte_count), tick);
+}
 
+/**
+ * 聚合线程按序回放各线程缓冲的事件
+ */
+static void on_memory_event(const memory_event_t &event) {
+    if (event.op == EVENT_RELEASE) {
+        record_release(event.ptr, event.tick);
+        return;
+    }
+
+    if (event.op == EVENT_MUNMAP) {
+        record_munmap(event.ptr, event.size, event.tick);
+        return;
     }
 
-    // TODO caller sampling
-    return false;
+    if (event.op == EVENT_REALLOC) {
+        // 旧地址未被记录 (如 hook 之前的分配) 时按无堆栈的新分配记录, 聚合线程中无法再回溯
+        if (!record_realloc(event.old_ptr, event.ptr, event.size)) {
+            record_acquire(event.caller, event.ptr, event.size, false, 0, 0, event.tick,
+                           event.thread_group, STACK_ID_INVALID);
+        }
+        return;
+    }
+
+    record_acquire(event.caller, event.ptr, event.size, event.op == EVENT_MMAP,
+                   event.stack_hash, event.weight, event.tick, event.thread_group,
+                   event.stack_id);
 }
 
 static inline void on_acquire_memory(void *caller,
@@ -115,34 +458,29 @@ static inline void on_acquire_memory(void *caller,
         return;
     }
 
-    wechat_backtrace::Backtrace backtrace;
+    uint64_t timer = stats_page_timer_begin();
+
     uint64_t stack_hash = 0;
-    if (is_stacktrace_enabled && should_do_unwind(byte_count, caller)) {
-        backtrace = BACKTRACE_INITIALIZER(MEMHOOK_BACKTRACE_MAX_FRAMES);
-        wechat_backtrace::unwind_adapter(backtrace.frames.get(), backtrace.max_frames,
-                                         backtrace.frame_size);
-        stack_hash = hash_backtrace_frames(&backtrace);
-        assert(stack_hash != 0);
+    uint32_t stack_id   = STACK_ID_INVALID;
+    size_t   weight     = 0;
+    if (is_stacktrace_enabled && should_do_unwind(byte_count, caller, &weight)) {
+        stack_id = unwind_and_intern(&stack_hash);
     }
 
-    m_memory_meta_container.insert(ptr,
-                                   stack_hash,
-                                   [&](ptr_meta_t *ptr_meta, stack_meta_t *stack_meta) {
-                                       ptr_meta->ptr     = ptr;
-                                       ptr_meta->size    = byte_count;
-                                       ptr_meta->caller  = caller;
-                                       ptr_meta->is_mmap = is_mmap;
+    // 在 hook 线程取 tick, 事件缓冲的延迟不计入生命周期
+    uint32_t tick = is_lifetime_enabled ? lifetime_tick() : 0;
+    uint8_t thread_group = thread_group_current();
 
-                                       if (!stack_meta) {
-                                           return;
-                                       }
+    if (is_event_buffer_enabled) {
+        event_buffer_push(is_mmap ? EVENT_MMAP : EVENT_ALLOC, ptr, byte_count, caller, stack_hash,
+                          weight, tick, thread_group, stack_id);
+        stats_page_on_alloc(byte_count, stack_hash != 0, timer);
+        return;
+    }
 
-                                       stack_meta->size += byte_count;
-                                       if (!stack_meta->backtrace.frames) { // 相同的堆栈只记录一个
-                                           stack_meta->backtrace = backtrace;
-                                           stack_meta->caller = caller;
-                                       }
-                                   });
+    record_acquire(caller, ptr, byte_count, is_mmap, stack_hash, weight, tick, thread_group,
+                   stack_id);
+    stats_page_on_alloc(byte_count, stack_hash != 0, timer);
 
 //    NanoSeconds_End(alloc_cost, alloc_begin);
 //    LOGD(TAG, "alloc cost %lld", alloc_cost);
@@ -155,27 +493,278 @@ static inline void on_release_memory(void *ptr, bool is_mmap) {
     }
 //    NanoSeconds_Start(release_begin);
 
-    m_memory_meta_container.erase(ptr);
+    uint64_t timer = stats_page_timer_begin();
+    uint32_t tick  = is_lifetime_enabled ? lifetime_tick() : 0;
+
+    if (is_event_buffer_enabled) {
+        event_buffer_push(EVENT_RELEASE, ptr, 0, nullptr, 0, 0, tick, 0, STACK_ID_INVALID);
+        stats_page_on_free(timer);
+        return;
+    }
+
+    record_release(ptr, tick);
+    stats_page_on_free(timer);
 //    NanoSeconds_End(release_cost, release_begin);
 //    LOGD(TAG, "release cost %lld", release_cost);
 }
 
+// 以下入口在 hook 自身的处理过程中 (如回溯时) 再次进入时不能再回溯, 新分配直接忽略;
+// 释放不需要回溯, 仍然记录, 否则已记录的 meta 会残留
+
 void on_alloc_memory(void *caller, void *ptr, size_t byte_count) {
+    rp_scope rp;
+    if (!rp.acquired()) {
+        return;
+    }
     on_acquire_memory(caller, ptr, byte_count, false);
 }
 
 void on_free_memory(void *ptr) {
+    rp_scope rp;
     on_release_memory(ptr, true);
 }
 
+void on_realloc_memory(void *caller, void *old_ptr, void *new_ptr, size_t byte_count) {
+    rp_scope rp;
+
+    if (!old_ptr || !new_ptr) {
+        LOGE(TAG, "on_realloc_memory: invalid pointer");
+        return;
+    }
+
+    // 重入时不回溯, 沿用原分配的堆栈
+    if (is_realloc_reattribute_enabled && rp.acquired()) {
+        // 原地扩缩时 key 不变, 也须先释放旧记录, 否则同一块内存被计两次
+        on_release_memory(old_ptr, false);
+        on_acquire_memory(caller, new_ptr, byte_count, false);
+        return;
+    }
+
+    // 原地更新的 realloc 在统计页中按一次分配计
+    uint64_t timer = stats_page_timer_begin();
+
+    if (is_event_buffer_enabled) {
+        uint32_t tick = is_lifetime_enabled ? lifetime_tick() : 0;
+        event_buffer_push(EVENT_REALLOC, new_ptr, byte_count, caller, 0, 0, tick,
+                          thread_group_current(), STACK_ID_INVALID, old_ptr);
+        stats_page_on_alloc(byte_count, false, timer);
+        return;
+    }
+
+    if (!record_realloc(old_ptr, new_ptr, byte_count)) {
+        if (rp.acquired()) {
+            on_acquire_memory(caller, new_ptr, byte_count, false);
+        }
+        return;
+    }
+    stats_page_on_alloc(byte_count, false, timer);
+}
+
 void on_mmap_memory(void *caller, void *ptr, size_t byte_count) {
+    rp_scope rp;
+    if (!rp.acquired()) {
+        return;
+    }
     on_acquire_memory(caller, ptr, byte_count, true);
 }
 
-void on_munmap_memory(void *ptr) {
-    on_release_memory(ptr, true);
+void on_munmap_memory(void *ptr, size_t byte_count) {
+    rp_scope rp;
+
+    if (!ptr) {
+        LOGE(TAG, "on_munmap_memory: invalid pointer");
+        return;
+    }
+
+    uint64_t timer = stats_page_timer_begin();
+    uint32_t tick  = is_lifetime_enabled ? lifetime_tick() : 0;
+
+    if (is_event_buffer_enabled) {
+        event_buffer_push(EVENT_MUNMAP, ptr, byte_count, nullptr, 0, 0, tick, 0,
+                          STACK_ID_INVALID);
+        stats_page_on_free(timer);
+        return;
+    }
+
+    record_munmap(ptr, byte_count, tick);
+    stats_page_on_free(timer);
 }
 
+struct stack_dump_meta_t {
+    uint64_t hash;
+    size_t   size;
+    void     *caller;
+    uint32_t stack_id;
+    uint32_t so_index;
+};
+
+/**
+ * dump 时按堆栈聚合, 按当前堆栈数一次性 mmap, 不随 ptr 数增长
+ */
+class stack_dump_table {
+
+public:
+
+    explicit stack_dump_table(size_t __expected) : entries(nullptr), size(0), capacity(16) {
+        while (capacity < __expected * 2) {
+            capacity <<= 1;
+        }
+        mapped_size = capacity * sizeof(stack_dump_meta_t);
+        void *mem = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            LOGE(TAG, "stack_dump_table: mmap %zu failed", mapped_size);
+            capacity = 0;
+            return;
+        }
+        entries = static_cast<stack_dump_meta_t *>(mem);
+    }
+
+    ~stack_dump_table() {
+        if (entries) {
+            munmap(entries, mapped_size);
+        }
+    }
+
+    /**
+     * dump 期间新出现的堆栈可能使表超出预估容量, 此时返回 nullptr
+     */
+    stack_dump_meta_t *find_or_insert(uint64_t __hash) {
+        if (!capacity) {
+            return nullptr;
+        }
+        size_t idx = (size_t) ((__hash * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+        for (;; idx = (idx + 1) & (capacity - 1)) {
+            stack_dump_meta_t *entry = &entries[idx];
+            if (entry->hash == __hash) {
+                return entry;
+            }
+            if (!entry->hash) {
+                if ((size + 1) * 4 > capacity * 3) {
+                    return nullptr;
+                }
+                size++;
+                entry->hash = __hash;
+                return entry;
+            }
+        }
+    }
+
+    /**
+     * 把有效项移到数组前部, 之后不能再 find_or_insert
+     * @return 有效项个数
+     */
+    size_t compact() {
+        size_t n = 0;
+        for (size_t i = 0; i < capacity; ++i) {
+            if (entries[i].hash) {
+                entries[n++] = entries[i];
+            }
+        }
+        return n;
+    }
+
+    stack_dump_meta_t *entries;
+    size_t            size;
+
+private:
+    size_t capacity;
+    size_t mapped_size;
+};
+
+struct caller_dump_meta_t {
+    void   *caller;
+    size_t total_size;
+    size_t count;
+};
+
+/**
+ * dump 时按 caller 聚合, 只保存总量和个数, 不保存指针. caller 数无法预估, 装载超过 3/4 时翻倍
+ */
+class caller_dump_table {
+
+public:
+
+    caller_dump_table() : size(0), entries(nullptr), capacity(0), mapped_size(0) {
+        rehash(1024);
+    }
+
+    ~caller_dump_table() {
+        if (entries) {
+            munmap(entries, mapped_size);
+        }
+    }
+
+    /**
+     * 扩容失败时返回 nullptr
+     */
+    caller_dump_meta_t *find_or_insert(void *__caller) {
+        if ((size + 1) * 4 > capacity * 3 && !rehash(capacity ? capacity << 1 : 1024)) {
+            return nullptr;
+        }
+        size_t idx = probe(entries, capacity, __caller);
+        caller_dump_meta_t *entry = &entries[idx];
+        if (!entry->caller) {
+            size++;
+            entry->caller = __caller;
+        }
+        return entry;
+    }
+
+    template<class _Callable>
+    void for_each(_Callable __callable) const {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (entries[i].caller) {
+                __callable(entries[i]);
+            }
+        }
+    }
+
+    bool empty() const {
+        return !size;
+    }
+
+    size_t size;
+
+private:
+
+    static size_t probe(caller_dump_meta_t *__entries, size_t __capacity, void *__caller) {
+        size_t idx = (size_t) (((uint64_t) (uintptr_t) __caller * 0x9E3779B97F4A7C15ULL) >> 32)
+                     & (__capacity - 1);
+        while (__entries[idx].caller && __entries[idx].caller != __caller) {
+            idx = (idx + 1) & (__capacity - 1);
+        }
+        return idx;
+    }
+
+    bool rehash(size_t __capacity) {
+        size_t new_mapped_size = __capacity * sizeof(caller_dump_meta_t);
+        void   *mem            = mmap(nullptr, new_mapped_size, PROT_READ | PROT_WRITE,
+                                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            LOGE(TAG, "caller_dump_table: mmap %zu failed", new_mapped_size);
+            return false;
+        }
+        auto new_entries = static_cast<caller_dump_meta_t *>(mem);
+        for (size_t i = 0; i < capacity; ++i) {
+            if (entries[i].caller) {
+                new_entries[probe(new_entries, __capacity, entries[i].caller)] = entries[i];
+            }
+        }
+        if (entries) {
+            munmap(entries, mapped_size);
+        }
+        entries     = new_entries;
+        capacity    = __capacity;
+        mapped_size = new_mapped_size;
+        return true;
+    }
+
+    caller_dump_meta_t *entries;
+    size_t             capacity;
+    size_t             mapped_size;
+};
+
 /**
  * 区分 native heap 和 mmap 的 caller 和 stack
  * @param heap_caller_metas
@@ -183,33 +772,43 @@ void on_munmap_memory(void *ptr) {
  * @param heap_stack_metas
  * @param mmap_stack_metas
  */
-static inline size_t collect_metas(std::map<void *, caller_meta_t> &heap_caller_metas,
-                                   std::map<void *, caller_meta_t> &mmap_caller_metas,
-                                   std::map<uint64_t, stack_meta_t> &heap_stack_metas,
-                                   std::map<uint64_t, stack_meta_t> &mmap_stack_metas) {
+static inline size_t collect_metas(caller_dump_table &heap_caller_metas,
+                                   caller_dump_table &mmap_caller_metas,
+                                   stack_dump_table &heap_stack_metas,
+                                   stack_dump_table &mmap_stack_metas,
+                                   uint32_t since_epoch) {
     LOGD(TAG, "collect_metas");
 
     size_t ptr_meta_size = 0;
 
     m_memory_meta_container.for_each(
-            [&](const void *ptr, ptr_meta_t *meta, stack_meta_t *stack_meta) {
+            [&](const void *, ptr_meta_t *meta, stack_meta_t *stack_meta) {
+
+                if (meta->epoch < since_epoch) {
+                    return;
+                }
 
                 auto &dest_caller_metes =
                              meta->is_mmap ? mmap_caller_metas : heap_caller_metas;
                 auto &dest_stack_metas  = meta->is_mmap ? mmap_stack_metas : heap_stack_metas;
 
                 if (meta->caller) {
-                    caller_meta_t &caller_meta = dest_caller_metes[meta->caller];
-                    caller_meta.pointers.insert(ptr);
-                    caller_meta.total_size += meta->size;
+                    auto caller_meta = dest_caller_metes.find_or_insert(meta->caller);
+                    if (caller_meta) {
+                        caller_meta->total_size += meta->size;
+                        caller_meta->count++;
+                    }
                 }
 
                 if (stack_meta) {
-                    auto &dest_stack_meta = dest_stack_metas[meta->stack_hash];
-                    dest_stack_meta.backtrace = stack_meta->backtrace;
-                    // 没错, 这里的确使用 ptr_meta 的 size, 因为是在遍历 ptr_meta, 因此原来 stack_meta 的 size 仅起引用计数作用
-                    dest_stack_meta.size += meta->size;
-                    dest_stack_meta.caller     = stack_meta->caller;
+                    auto dest_stack_meta = dest_stack_metas.find_or_insert(meta->stack_hash);
+                    if (dest_stack_meta) {
+                        dest_stack_meta->stack_id = stack_meta->stack_id;
+                        // 这里使用 ptr_meta 的 size 而不是 stack_meta 的存活量, 因为可能按 epoch 过滤了部分指针
+                        // 按字节采样时用权重还原为估计总量
+                        dest_stack_meta->size += meta->weight ? meta->weight : meta->size;
+                        dest_stack_meta->caller = stack_meta->caller;
+                    }
                 }
 
                 ptr_meta_size++;
@@ -220,90 +819,58 @@ static inline size_t collect_metas(std::map<void *, caller_meta_t> &heap_caller_
 }
 
 static inline void dump_callers(FILE *log_file,
-                                cJSON *json_size_arr,
-//                                const std::multimap<void *, ptr_meta_t> &ptr_metas,
-                                std::map<void *, caller_meta_t> &caller_metas) {
+                                json_stream_writer &json,
+                                const caller_dump_table &caller_metas) {
 
     if (caller_metas.empty()) {
         LOGI(TAG, "dump_callers: nothing dump");
         return;
     }
 
-    LOGD(TAG, "dump_callers: count = %zu", caller_metas.size());
-    flogger(log_file, "dump_callers: count = %zu\n", caller_metas.size());
+    LOGD(TAG, "dump_callers: count = %zu", caller_metas.size);
+    flogger(log_file, "dump_callers: count = %zu\n", caller_metas.size);
 
-    std::unordered_map<std::string, size_t> caller_alloc_size_of_so;
-    std::unordered_map<std::string, std::map<size_t, size_t>> same_size_count_of_so;
+    std::unordered_map<std::string, std::pair<size_t, size_t>> caller_alloc_of_so;
 
     LOGD(TAG, "caller so begin");
     // 按 so 聚类
-    for (auto &i : caller_metas) {
-        auto caller = i.first;
-        auto caller_meta = i.second;
-
-        Dl_info dl_info;
-        dladdr(caller, &dl_info);
+    caller_metas.for_each([&](const caller_dump_meta_t &caller_meta) {
+        const char *so_name = symbolizer_so_name(caller_meta.caller);
 
-        if (!dl_info.dli_fname) {
-            continue;
+        if (!so_name) {
+            return;
         }
-        caller_alloc_size_of_so[dl_info.dli_fname] += caller_meta.total_size;
-
-        // 按 size 聚类
-        for (auto pointer : caller_meta.pointers) {
-            m_memory_meta_container.get(pointer,
-                                        [&same_size_count_of_so, &dl_info](ptr_meta_t &meta) {
-                                            same_size_count_of_so[dl_info.dli_fname][meta.size]++;
-                                        });
-        }
-    }
+        auto &so_alloc = caller_alloc_of_so[so_name];
+        so_alloc.first += caller_meta.total_size;
+        so_alloc.second += caller_meta.count;
+    });
 
     // 排序 so
-    std::multimap<size_t, std::string> result_sort_by_size;
-
-    std::transform(caller_alloc_size_of_so.begin(),
-                   caller_alloc_size_of_so.end(),
-                   std::inserter(result_sort_by_size, result_sort_by_size.begin()),
-                   [](const std::pair<std::string, size_t> &src) {
-                       return std::pair<size_t, std::string>(src.second, src.first);
-                   });
+    std::vector<std::pair<std::string, std::pair<size_t, size_t>>> result_sort_by_size(
+            caller_alloc_of_so.begin(), caller_alloc_of_so.end());
+    std::sort(result_sort_by_size.begin(), result_sort_by_size.end(),
+              [](const std::pair<std::string, std::pair<size_t, size_t>> &a,
+                 const std::pair<std::string, std::pair<size_t, size_t>> &b) {
+                  return a.second.first > b.second.first;
+              });
 
     size_t caller_total_size = 0;
 
-    for (auto i = result_sort_by_size.rbegin(); i != result_sort_by_size.rend(); ++i) {
-        auto &so_name = i->second;
-        auto &so_size = i->first;
-        LOGD(TAG, "so = %s, caller alloc size = %zu", i->second.c_str(), i->first);
-        cJSON *so_size_obj = cJSON_CreateObject();
-        cJSON_AddStringToObject(so_size_obj, "so", so_name.c_str());
-        cJSON_AddStringToObject(so_size_obj, "size", std::to_string(so_size).c_str());
-        cJSON_AddItemToArray(json_size_arr, so_size_obj);
-        flogger(log_file, "caller alloc size = %10zu b, so = %s\n", so_size, so_name.c_str());
+    for (auto &i : result_sort_by_size) {
+        auto &so_name = i.first;
+        auto so_size  = i.second.first;
+        auto so_count = i.second.second;
+        LOGD(TAG, "so = %s, caller alloc size = %zu, count = %zu", so_name.c_str(), so_size,
+             so_count);
+        // JSON 格式保持不变, 个数只输出到日志
+        json.begin_object()
+                .key("so").value(so_name.c_str())
+                .key("size").value_as_string(so_size)
+                .end_object();
+        flogger(log_file, "caller alloc size = %10zu b, count = %8zu, so = %s\n", so_size,
+                so_count, so_name.c_str());
 
         caller_total_size += so_size;
-
-        auto count_of_size = same_size_count_of_so[so_name];
-        std::multimap<size_t, std::pair<size_t, size_t>> result_sort_by_mul;
-        std::transform(count_of_size.begin(),
-                       count_of_size.end(),
-                       std::inserter(result_sort_by_mul, result_sort_by_mul.begin()),
-                       [](std::pair<size_t, size_t> src) {
-                           return std::pair<size_t, std::pair<size_t, size_t >>(
-                                   src.first * src.second,
-                                   std::pair<size_t, size_t>(src.first, src.second));
-                       });
-
-        int lines = 20; // fixme hard coding
-        LOGD(TAG, "top %d (size * count):", lines);
-        flogger(log_file, "top %d (size * count):\n", lines); // fixme using json
-
-        for (auto sc = result_sort_by_mul.rbegin();
-             sc != result_sort_by_mul.rend() && lines; ++sc, --lines) {
-            auto size = sc->second.first;
-            auto count = sc->second.second;
-            LOGD(TAG, "   size = %10zu b, count = %zu", size, count);
-            flogger(log_file, "   size = %10zu b, count = %zu\n", size, count);
-        }
     }
 
     LOGD(TAG, "\n---------------------------------------------------");
@@ -351,156 +918,172 @@ static inline void dump_callers(FILE *log_file,
 //    m_debug_lost_ptr_stack.clear();
 //}
 
-struct stack_dump_meta_t {
-    size_t size;
-    std::string full_stacktrace;
-    std::string brief_stacktrace;
+struct so_dump_meta_t {
+    const char *name;
+    size_t     size;
 };
 
-static inline void dump_stacks(FILE *log_file,
-                               cJSON *json_mem_arr,
-                               std::map<uint64_t, stack_meta_t> &stack_metas) {
-    if (stack_metas.empty()) {
-        LOGI(TAG, "stacktrace: nothing dump");
-        return;
+/**
+ * 优先取 caller 所在 so, 取不到时取堆栈中第一个不属于 hook 自身的 so
+ */
+static inline const char *stack_so_name(const stack_dump_meta_t &stack_meta) {
+    const char *caller_so_name = symbolizer_so_name(stack_meta.caller);
+    if (caller_so_name != nullptr) {
+        return caller_so_name;
     }
 
-    LOGD(TAG, "dump_stacks: hash count = %zu", stack_metas.size());
-    flogger(log_file, "dump_stacks: hash count = %zu\n", stack_metas.size());
-
-    std::unordered_map<std::string, size_t> stack_alloc_size_of_so;
-    std::unordered_map<std::string, std::vector<stack_dump_meta_t>> stacktrace_of_so;
-
-    for (auto &stack_meta_it : stack_metas) {
-        auto hash       = stack_meta_it.first;
-        auto size       = stack_meta_it.second.size;
-        auto backtrace = stack_meta_it.second.backtrace;
-        auto caller     = stack_meta_it.second.caller;
-
-        std::string caller_so_name;
-        std::stringstream full_stack_builder;
-        std::stringstream brief_stack_builder;
-
-
-        Dl_info caller_info{};
-        dladdr(caller, &caller_info);
-
-        if (caller_info.dli_fname != nullptr) {
-            caller_so_name = caller_info.dli_fname;
+    LOGD(TAG, "fallback getting so name -> caller = %p", stack_meta.caller);
+    wechat_backtrace::Frame frames[MEMHOOK_BACKTRACE_MAX_FRAMES];
+    size_t frame_size = stack_arena_restore(stack_meta.stack_id, frames,
+                                            MEMHOOK_BACKTRACE_MAX_FRAMES);
+    for (size_t i = 0; i < frame_size; ++i) {
+        const char *so_name = symbolizer_so_name((void *) frames[i].pc);
+        // fixme hard coding
+        if (!so_name
+            || strstr(so_name, "libwechatbacktrace.so") != nullptr
+            || strstr(so_name, "libmatrix-hooks.so") != nullptr) {
+            continue;
         }
+        return so_name;
+    }
+    return "";
+}
 
-        std::string last_so_name; // 上一帧所属 so 名字
+/**
+ * 先把要输出的堆栈的 pc 一次性交给符号化缓存, 之后逐帧输出时都能命中
+ */
+static inline void prepare_symbols(const uint32_t *stack_ids, size_t count) {
+    std::vector<wechat_backtrace::uptr> pcs;
+    wechat_backtrace::Frame             frames[MEMHOOK_BACKTRACE_MAX_FRAMES];
+    for (size_t i = 0; i < count; ++i) {
+        size_t frame_size = stack_arena_restore(stack_ids[i], frames,
+                                                MEMHOOK_BACKTRACE_MAX_FRAMES);
+        symbolizer_collect(frames, frame_size, pcs);
+    }
+    symbolizer_resolve(pcs);
+}
 
-        auto _callback = [&](wechat_backtrace::FrameDetail it) {
-            std::string so_name = it.map_name;
+/**
+ * 输出堆栈的每一帧, json 非空时以 "so;pc;pc;so;..." 的简写追加到已打开的字符串中
+ */
+static inline void dump_stack_frames(FILE *log_file,
+                                     json_stream_writer *json,
+                                     uint32_t stack_id) {
+    wechat_backtrace::Frame frames[MEMHOOK_BACKTRACE_MAX_FRAMES];
+    size_t frame_size = stack_arena_restore(stack_id, frames, MEMHOOK_BACKTRACE_MAX_FRAMES);
+
+    const char *last_so_name = ""; // 上一帧所属 so 名字
+    symbolizer_restore(frames, frame_size, [&](wechat_backtrace::FrameDetail it) {
+        flogger(log_file, "      | #pc %" PRIxPTR " %s (%s)\n", (uintptr_t) it.rel_pc,
+                it.function_name, it.map_name);
+
+        if (!json) {
+            return;
+        }
+        if (strcmp(last_so_name, it.map_name) != 0) {
+            last_so_name = it.map_name;
+            json->append(it.map_name).append(";");
+        }
+        json->append_hex(it.rel_pc).append(";");
+    });
+}
 
-            char *demangled_name = nullptr;
-            int status = 0;
-            demangled_name = abi::__cxa_demangle(it.function_name, nullptr, 0, &status);
+static inline void dump_stack(FILE *log_file,
+                              json_stream_writer *json,
+                              const stack_dump_meta_t &stack_meta) {
+    LOGD(TAG, "malloc size of the same stack = %zu", stack_meta.size);
+    flogger(log_file, "malloc size of the same stack = %zu\n stacktrace : \n", stack_meta.size);
 
-            full_stack_builder << "      | "
-                               << "#pc " << std::hex << it.rel_pc << " "
-                               << (demangled_name ? demangled_name : "(null)")
-                               << " ("
-                               << it.map_name
-                               << ")"
-                               << std::endl;
+    if (json) {
+        json->begin_object()
+                .key("size").value_as_string(stack_meta.size)
+                .key("stack").begin_string();
+    }
 
-            if (last_so_name != it.map_name) {
-                last_so_name = it.map_name;
-                brief_stack_builder << it.map_name << ";";
-            }
+    dump_stack_frames(log_file, json, stack_meta.stack_id);
 
-            brief_stack_builder << std::hex << it.rel_pc << ";";
+    if (json) {
+        json->end_string().end_object();
+    }
+    flogger(log_file, "\n");
+}
 
-            if (demangled_name) {
-                free(demangled_name);
-            }
+static inline void dump_stacks(FILE *log_file,
+                               json_stream_writer &json,
+                               stack_dump_table &stack_metas) {
+    size_t stack_count = stack_metas.compact();
+    if (!stack_count) {
+        LOGI(TAG, "stacktrace: nothing dump");
+        return;
+    }
 
-            if (caller_so_name.empty()) { // fallback
-                LOGD(TAG, "fallback getting so name -> caller = %p", stack_meta_it.second.caller);
-                // fixme hard coding
-                if (/*so_name.find("com.tencent.mm") == std::string::npos ||*/
-                        so_name.find("libwechatbacktrace.so") != std::string::npos ||
-                        so_name.find("libmatrix-hooks.so") != std::string::npos) {
-                    return;
-                }
-                caller_so_name = so_name;
-            }
-        };
+    LOGD(TAG, "dump_stacks: hash count = %zu", stack_count);
+    flogger(log_file, "dump_stacks: hash count = %zu\n", stack_count);
 
-        wechat_backtrace::restore_frame_detail(backtrace.frames.get(), backtrace.frame_size,
-                                               _callback);
+    stack_dump_meta_t *stacks = stack_metas.entries;
 
-//        for (auto   &it : stacktrace) {
-//
-//            std::string so_name = it.map_name;
-//
-//            char *demangled_name = nullptr;
-//            int  status          = 0;
-//            demangled_name = abi::__cxa_demangle(it.function_name.c_str(), nullptr, 0, &status);
-//
-//            full_stack_builder << "      | "
-//                               << "#pc " << std::hex << it.rel_pc << " "
-//                               << (demangled_name ? demangled_name : "(null)")
-//                               << " ("
-//                               << it.map_name
-//                               << ")"
-//                               << std::endl;
-//
-//            if (last_so_name != it.map_name) {
-//                last_so_name = it.map_name;
-//                brief_stack_builder << it.map_name << ";";
-//            }
-//
-//            brief_stack_builder << std::hex << it.rel_pc << ";";
-//
-//            if (demangled_name) {
-//                free(demangled_name);
-//            }
-//
-//            if (caller_so_name.empty()) { // fallback
-//                LOGD(TAG, "fallback getting so name -> caller = %p", stack_meta_it.second.caller);
-//                // fixme hard coding
-//                if (/*so_name.find("com.tencent.mm") == std::string::npos ||*/
-//                        so_name.find("libwxperf.so") != std::string::npos ||
-//                        so_name.find("libwxperf-jni.so") != std::string::npos) {
-//                    continue;
-//                }
-//                caller_so_name = so_name;
-//            }
-//        }
-        stack_alloc_size_of_so[caller_so_name] += size;
+    // 按 so 聚类. 同一 so 的名字指针相同, 直接以指针作 key
+    std::vector<so_dump_meta_t>                  sos;
+    std::unordered_map<const char *, uint32_t>   so_index_of_name;
+    for (size_t i = 0; i < stack_count; ++i) {
+        const char *so_name = stack_so_name(stacks[i]);
 
-        stack_dump_meta_t stack_dump_meta{size,
-                                          full_stack_builder.str(),
-                                          brief_stack_builder.str()};
-        stacktrace_of_so[caller_so_name].emplace_back(stack_dump_meta);
+        auto it = so_index_of_name.find(so_name);
+        if (it == so_index_of_name.end()) {
+            it = so_index_of_name.emplace(so_name, (uint32_t) sos.size()).first;
+            sos.push_back({so_name, 0});
+        }
+        stacks[i].so_index = it->second;
+        sos[it->second].size += stacks[i].size;
     }
 
-    // 从大到小排序
-    std::vector<std::pair<std::string, size_t>> so_sorted_by_size;
-    so_sorted_by_size.reserve(stack_alloc_size_of_so.size());
-    for (auto &p : stack_alloc_size_of_so) {
-        so_sorted_by_size.emplace_back(p);
+    // 从大到小排序 so, 同一 so 内的堆栈也从大到小排序
+    std::vector<uint32_t> so_sorted_by_size(sos.size());
+    for (uint32_t i = 0; i < sos.size(); ++i) {
+        so_sorted_by_size[i] = i;
     }
     std::sort(so_sorted_by_size.begin(), so_sorted_by_size.end(),
-              [](const std::pair<std::string, size_t> &v1,
-                 const std::pair<std::string, size_t> &v2) {
-                  return v1.second > v2.second;
+              [&sos](uint32_t l, uint32_t r) {
+                  return sos[l].size > sos[r].size;
+              });
+    std::vector<uint32_t> so_rank(sos.size());
+    for (uint32_t rank = 0; rank < so_sorted_by_size.size(); ++rank) {
+        so_rank[so_sorted_by_size[rank]] = rank;
+    }
+    std::sort(stacks, stacks + stack_count,
+              [&so_rank](const stack_dump_meta_t &l, const stack_dump_meta_t &r) {
+                  if (so_rank[l.so_index] != so_rank[r.so_index]) {
+                      return so_rank[l.so_index] < so_rank[r.so_index];
+                  }
+                  return l.size > r.size;
               });
 
+    {
+        std::vector<uint32_t> stack_ids;
+        for (size_t i = 0; i < stack_count; ++i) {
+            if (sos[stacks[i].so_index].size >= m_stacktrace_log_threshold) {
+                stack_ids.push_back(stacks[i].stack_id);
+            }
+        }
+        prepare_symbols(stack_ids.data(), stack_ids.size());
+    }
+
     /*************************** prepared done ********************************/
 
     size_t json_so_count = 3;
+    size_t cursor        = 0;
+
+    for (auto so_index : so_sorted_by_size) {
+        auto so_name       = sos[so_index].name;
+        auto so_alloc_size = sos[so_index].size;
 
-    for (auto &p : so_sorted_by_size) {
-        auto so_name = p.first;
-        auto so_alloc_size = p.second;
+        size_t begin = cursor;
+        while (cursor < stack_count && stacks[cursor].so_index == so_index) {
+            cursor++;
+        }
 
-        LOGD(TAG, "\nmalloc size of so (%s) : remaining size = %zu", so_name.c_str(),
-             so_alloc_size);
-        flogger(log_file, "\nmalloc size of so (%s) : remaining size = %zu\n", so_name.c_str(),
+        LOGD(TAG, "\nmalloc size of so (%s) : remaining size = %zu", so_name, so_alloc_size);
+        flogger(log_file, "\nmalloc size of so (%s) : remaining size = %zu\n", so_name,
                 so_alloc_size);
 
         if (so_alloc_size < m_stacktrace_log_threshold) {
@@ -509,121 +1092,221 @@ static inline void dump_stacks(FILE *log_file,
             continue;
         }
 
-        // 从大到小排序
-        auto &stacktrace_sorted_by_size = stacktrace_of_so[so_name];
-        std::sort(stacktrace_sorted_by_size.begin(), stacktrace_sorted_by_size.end(),
-                  [](const stack_dump_meta_t &v1,
-                     const stack_dump_meta_t &v2) {
-                      return v1.size > v2.size;
-                  });
-
-        cJSON *so_obj = nullptr; // nullable
-        cJSON *so_stack_arr = nullptr; // nullable
+        bool json_so_opened = false;
         if (json_so_count) {
             LOGE(TAG
                          ".json", "json_so_count = %zu", json_so_count);
             json_so_count--;
-            so_obj = cJSON_CreateObject();
-            cJSON_AddStringToObject(so_obj, "so", so_name.c_str());
-            cJSON_AddStringToObject(so_obj, "size", std::to_string(so_alloc_size).c_str());
-            so_stack_arr = cJSON_AddArrayToObject(so_obj, "top_stacks");
+            json.begin_object()
+                    .key("so").value(so_name)
+                    .key("size").value_as_string(so_alloc_size)
+                    .key("top_stacks").begin_array();
+            json_so_opened = true;
         }
 
         size_t json_stacktrace_count = 3;
 
-        for (auto &stack_dump_meta : stacktrace_sorted_by_size) {
-
-            LOGD(TAG, "malloc size of the same stack = %zu\n stacktrace : \n%s",
-                 stack_dump_meta.size,
-                 stack_dump_meta.full_stacktrace.c_str());
-
-            flogger(log_file, "malloc size of the same stack = %zu\n stacktrace : \n%s\n",
-                    stack_dump_meta.size,
-                    stack_dump_meta.full_stacktrace.c_str());
-
-            if (json_so_count && json_stacktrace_count) {
+        for (size_t i = begin; i < cursor; ++i) {
+            bool to_json = json_so_count && json_stacktrace_count;
+            if (to_json) {
                 json_stacktrace_count--;
                 LOGE(TAG
                              ".json", "json_stacktrace_count = %zu", json_stacktrace_count);
-                cJSON *stack_obj = cJSON_CreateObject();
-                cJSON_AddStringToObject(stack_obj, "size",
-                                        std::to_string(stack_dump_meta.size).c_str());
-                cJSON_AddStringToObject(stack_obj, "stack",
-                                        stack_dump_meta.brief_stacktrace.c_str());
-                cJSON_AddItemToArray(so_stack_arr, stack_obj);
             }
+            dump_stack(log_file, to_json ? &json : nullptr, stacks[i]);
+        }
+
+        if (json_so_opened) {
+            json.end_array().end_object();
+        }
+    }
+}
+
+#define LIFETIME_REPORT_TOP 20
+
+/**
+ * 按 "每秒短命分配次数" 从高到低输出堆栈, 这些是值得池化的临时分配
+ */
+static inline void dump_lifetime(FILE *log_file, json_stream_writer &json) {
+    std::vector<lifetime_record_t> records;
+    lifetime_collect(records);
+
+    size_t top = std::min(records.size(), (size_t) LIFETIME_REPORT_TOP);
+    std::partial_sort(records.begin(), records.begin() + top, records.end(),
+                      [](const lifetime_record_t &l, const lifetime_record_t &r) {
+                          return l.short_lived > r.short_lived;
+                      });
+    while (top && !records[top - 1].short_lived) {
+        top--;
+    }
+
+    double elapsed = lifetime_elapsed_seconds();
+
+    std::vector<uint32_t> stack_ids(top);
+    for (size_t i = 0; i < top; ++i) {
+        stack_ids[i] = stack_arena_find(records[i].stack_hash);
+    }
+    prepare_symbols(stack_ids.data(), stack_ids.size());
+
+    flogger(log_file,
+            "\n######################## short-lived allocations ########################\n"
+            "elapsed = %.1f s, tick = %d ns, stacks = %zu\n", elapsed,
+            1 << LIFETIME_TICK_SHIFT, records.size());
+
+    json.key("ShortLived").begin_array();
+    for (size_t i = 0; i < top; ++i) {
+        auto   &record = records[i];
+        double rate    = elapsed > 0 ? (double) record.short_lived / elapsed : 0;
+
+        char rate_str[32];
+        snprintf(rate_str, sizeof(rate_str), "%.2f", rate);
+
+        flogger(log_file, "\nallocs/sec with lifetime < 1ms = %s, short-lived = %zu, frees = %zu\n"
+                          " lifetime histogram (log2 tick) :", rate_str, record.short_lived,
+                record.frees);
+        json.begin_object()
+                .key("rate").value(rate_str)
+                .key("short_lived").value_as_string(record.short_lived)
+                .key("frees").value_as_string(record.frees)
+                .key("histogram").begin_array();
+        for (size_t b = 0; b < LIFETIME_BUCKETS; ++b) {
+            flogger(log_file, " %zu", record.buckets[b]);
+            json.value_as_string(record.buckets[b]);
         }
-        cJSON_AddItemToArray(json_mem_arr, so_obj);
+        flogger(log_file, "\n stacktrace : \n");
+        json.end_array().key("stack").begin_string();
+        dump_stack_frames(log_file, &json, stack_ids[i]);
+        json.end_string().end_object();
     }
+    json.end_array();
 }
 
-static inline void dump_impl(FILE *log_file, FILE *json_file, bool mmap) {
+static inline void dump_impl(FILE *log_file, FILE *json_file, bool mmap, uint32_t since_epoch) {
+
+    if (is_event_buffer_enabled) {
+        // 先回放各线程尚未处理的事件, 保证 dump 结果准确
+        event_buffer_flush();
+    }
+
+    // hook 自身的内存, 在 dump 的临时容器分配之前取
+    pool_stat_t pool        = pool_stat();
+    size_t      ptr_table   = m_memory_meta_container.ptr_meta_mapped_size();
+    size_t      stack_arena = stack_arena_mapped_size();
+    size_t      self_mapped = pool.mapped_size + ptr_table + stack_arena;
 
-    std::map<void *, caller_meta_t> heap_caller_metas;
-    std::map<void *, caller_meta_t> mmap_caller_metas;
-    std::map<uint64_t, stack_meta_t> heap_stack_metas;
-    std::map<uint64_t, stack_meta_t> mmap_stack_metas;
+    caller_dump_table heap_caller_metas;
+    caller_dump_table mmap_caller_metas;
+    size_t stack_count = m_memory_meta_container.stack_count();
+    stack_dump_table heap_stack_metas(stack_count);
+    stack_dump_table mmap_stack_metas(mmap ? stack_count : 0);
 
     size_t ptr_meta_size = collect_metas(heap_caller_metas,
                                          mmap_caller_metas,
                                          heap_stack_metas,
-                                         mmap_stack_metas);
+                                         mmap_stack_metas,
+                                         since_epoch);
 
-    cJSON *json_obj           = cJSON_CreateObject();
-    cJSON *so_native_size_arr = cJSON_AddArrayToObject(json_obj, "SoNativeSize");
+    if (since_epoch) {
+        flogger(log_file, "only allocations since snapshot %u\n", since_epoch);
+    }
 
-    // native heap allocation
-    dump_callers(log_file, so_native_size_arr, heap_caller_metas);
-    cJSON *native_heap_arr = cJSON_AddArrayToObject(json_obj, "NativeHeap");
+    if (m_sampling_interval_bytes) {
+        flogger(log_file, "sampling interval = %zu bytes, size of stacks are estimated\n",
+                m_sampling_interval_bytes);
+    }
 
-    dump_stacks(log_file, native_heap_arr, heap_stack_metas);
+    {
+        json_stream_writer json(json_file ? fileno(json_file) : -1);
+        json.begin_object();
 
-    if (mmap) {
-        // mmap allocation
-        LOGD(TAG, "############################# mmap #############################\n\n");
-        flogger(log_file,
-                "############################# mmap #############################\n\n");
+        // native heap allocation
+        json.key("SoNativeSize").begin_array();
+        dump_callers(log_file, json, heap_caller_metas);
+        json.end_array();
 
-        cJSON *so_mmap_size_arr = cJSON_AddArrayToObject(json_obj, "SoMmapSize");
-        dump_callers(log_file, so_mmap_size_arr, mmap_caller_metas);
-        cJSON *mmap_arr = cJSON_AddArrayToObject(json_obj, "mmap");
-        dump_stacks(log_file, mmap_arr, mmap_stack_metas);
-    }
+        json.key("NativeHeap").begin_array();
+        dump_stacks(log_file, json, heap_stack_metas);
+        json.end_array();
+
+        // 各 so 按 size class 的分布及各线程组的存活量, 由分配释放时增量统计
+        size_class_dump(log_file, json, mmap);
+        thread_group_dump(log_file, json, mmap);
+
+        if (is_lifetime_enabled) {
+            dump_lifetime(log_file, json);
+        }
 
-    char *printed = cJSON_PrintUnformatted(json_obj);
-    flogger(json_file, "%s", printed);
-    LOGD(TAG, "===> %s", printed);
-    cJSON_free(printed);
-    cJSON_Delete(json_obj);
+        if (mmap) {
+            // mmap allocation
+            LOGD(TAG, "############################# mmap #############################\n\n");
+            flogger(log_file,
+                    "############################# mmap #############################\n\n");
+
+            json.key("SoMmapSize").begin_array();
+            dump_callers(log_file, json, mmap_caller_metas);
+            json.end_array();
+
+            json.key("mmap").begin_array();
+            dump_stacks(log_file, json, mmap_stack_metas);
+            json.end_array();
+        }
+
+        // hook 自身占用的内存, 不经过被 hook 的堆, 不计入上面的统计
+        json.key("HookSelf").begin_object()
+                .key("mapped").value_as_string(self_mapped)
+                .key("ptr_table").value_as_string(ptr_table)
+                .key("stack_arena").value_as_string(stack_arena)
+                .key("pool_mapped").value_as_string(pool.mapped_size)
+                .key("pool_used").value_as_string(pool.used_size)
+                .end_object();
+
+        json.end_object();
+    }
 
     flogger(log_file,
             "\n\n---------------------------------------------------\n"
             "<void *, ptr_meta_t> ptr_meta [%zu * %zu = (%zu)]\n"
             "<uint64_t, stack_meta_t> stack_meta [%zu * %zu = (%zu)]\n"
+            "ptr_meta table mapped = %zu\n"
+            "stack arena mapped = %zu\n"
+            "pool mapped = %zu, used = %zu\n"
+            "hook self mapped = %zu\n"
             "---------------------------------------------------\n",
 
             sizeof(ptr_meta_t) + sizeof(void *), ptr_meta_size,
             (sizeof(ptr_meta_t) + sizeof(void *)) * ptr_meta_size,
 
             sizeof(stack_meta_t) + sizeof(uint64_t),
-            (heap_stack_metas.size() + mmap_stack_metas.size()),
+            (heap_stack_metas.size + mmap_stack_metas.size),
             (sizeof(stack_meta_t) + sizeof(uint64_t)) *
-            ((heap_stack_metas.size() + mmap_stack_metas.size())));
+            ((heap_stack_metas.size + mmap_stack_metas.size)),
+            ptr_table,
+            stack_arena,
+            pool.mapped_size, pool.used_size,
+            self_mapped);
 
     LOGD(TAG,
          "<void *, ptr_meta_t> ptr_meta [%zu * %zu = (%zu)]\n"
-         "<uint64_t, stack_meta_t> stack_meta [%zu * %zu = (%zu)]\n",
+         "<uint64_t, stack_meta_t> stack_meta [%zu * %zu = (%zu)]\n"
+         "ptr_meta table mapped = %zu\n"
+         "stack arena mapped = %zu\n"
+         "pool mapped = %zu, used = %zu\n"
+         "hook self mapped = %zu\n",
 
          sizeof(ptr_meta_t) + sizeof(void *), ptr_meta_size,
          (sizeof(ptr_meta_t) + sizeof(void *)) * ptr_meta_size,
 
          sizeof(stack_meta_t) + sizeof(uint64_t),
-         (heap_stack_metas.size() + mmap_stack_metas.size()),
+         (heap_stack_metas.size + mmap_stack_metas.size),
          (sizeof(stack_meta_t) + sizeof(uint64_t)) *
-         ((heap_stack_metas.size() + mmap_stack_metas.size())));
+         ((heap_stack_metas.size + mmap_stack_metas.size)),
+         ptr_table,
+         stack_arena,
+         pool.mapped_size, pool.used_size,
+         self_mapped);
 }
 
-void dump(bool enable_mmap, const char *log_path, const char *json_path) {
+void dump(bool enable_mmap, const char *log_path, const char *json_path, uint32_t since_epoch) {
     LOGD(TAG,
          ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> memory dump begin <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<");
 
@@ -632,7 +1315,7 @@ void dump(bool enable_mmap, const char *log_path, const char *json_path) {
     FILE *json_file = json_path ? fopen(json_path, "w+") : nullptr;
     LOGD(TAG, "dump path = %s", log_path);
 
-    dump_impl(log_file, json_file, enable_mmap);
+    dump_impl(log_file, json_file, enable_mmap, since_epoch);
 
     if (log_file) {
         fflush(log_file);
@@ -647,15 +1330,246 @@ void dump(bool enable_mmap, const char *log_path, const char *json_path) {
          ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> memory dump end <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<");
 }
 
+struct stack_diff_meta_t {
+    uint64_t hash;
+    size_t   size;
+    size_t   count;
+    int64_t  delta_size;
+    int64_t  delta_count;
+    uint32_t stack_id;
+};
+
+static inline void dump_diff_impl(FILE *log_file, FILE *json_file) {
+    if (is_event_buffer_enabled) {
+        event_buffer_flush();
+    }
+
+    std::vector<stack_diff_meta_t> diffs;
+    m_memory_meta_container.for_each_changed([&](uint64_t hash, const stack_meta_t &stack_meta) {
+        diffs.push_back({hash, stack_meta.size, stack_meta.count,
+                         (int64_t) stack_meta.size - (int64_t) stack_meta.generation.size,
+                         (int64_t) stack_meta.count - (int64_t) stack_meta.generation.count,
+                         stack_meta.stack_id});
+    });
+
+    // 同一堆栈在一代内被删除后重建会出现多次
+    std::sort(diffs.begin(), diffs.end(),
+              [](const stack_diff_meta_t &l, const stack_diff_meta_t &r) {
+                  return l.hash < r.hash;
+              });
+    diffs.erase(std::unique(diffs.begin(), diffs.end(),
+                            [](const stack_diff_meta_t &l, const stack_diff_meta_t &r) {
+                                return l.hash == r.hash;
+                            }), diffs.end());
+    diffs.erase(std::remove_if(diffs.begin(), diffs.end(),
+                               [](const stack_diff_meta_t &diff) {
+                                   return !diff.delta_size && !diff.delta_count;
+                               }), diffs.end());
+    std::sort(diffs.begin(), diffs.end(),
+              [](const stack_diff_meta_t &l, const stack_diff_meta_t &r) {
+                  return std::llabs(l.delta_size) > std::llabs(r.delta_size);
+              });
+
+    {
+        std::vector<uint32_t> stack_ids;
+        for (auto &diff : diffs) {
+            stack_ids.push_back(diff.stack_id);
+        }
+        prepare_symbols(stack_ids.data(), stack_ids.size());
+    }
+
+    uint32_t epoch = m_memory_meta_container.current_epoch();
+    LOGD(TAG, "dump_diff: snapshot = %u, changed stacks = %zu", epoch, diffs.size());
+    flogger(log_file, "dump_diff: snapshot = %u, changed stacks = %zu\n", epoch, diffs.size());
+
+    json_stream_writer json(json_file ? fileno(json_file) : -1);
+    json.begin_object()
+            .key("snapshot").value_as_string((size_t) epoch)
+            .key("changed").begin_array();
+
+    for (auto &diff : diffs) {
+        flogger(log_file,
+                "\ndelta size = %" PRId64 ", delta count = %" PRId64
+                ", remaining size = %zu, remaining count = %zu\n stacktrace : \n",
+                diff.delta_size, diff.delta_count, diff.size, diff.count);
+
+        json.begin_object()
+                .key("delta_size").value_as_string(diff.delta_size)
+                .key("delta_count").value_as_string(diff.delta_count)
+                .key("size").value_as_string(diff.size)
+                .key("count").value_as_string(diff.count)
+                .key("stack").begin_string();
+        dump_stack_frames(log_file, &json, diff.stack_id);
+        json.end_string().end_object();
+    }
+
+    json.end_array().end_object();
+}
+
+uint32_t memory_hook_snapshot() {
+    if (is_event_buffer_enabled) {
+        event_buffer_flush();
+    }
+    uint32_t epoch = m_memory_meta_container.snapshot();
+    LOGD(TAG, "memory_hook_snapshot: epoch = %u", epoch);
+    return epoch;
+}
+
+void dump_diff(const char *log_path, const char *json_path) {
+    FILE *log_file  = log_path ? fopen(log_path, "w+") : nullptr;
+    FILE *json_file = json_path ? fopen(json_path, "w+") : nullptr;
+
+    dump_diff_impl(log_file, json_file);
+
+    if (log_file) {
+        fflush(log_file);
+        fclose(log_file);
+    }
+    if (json_file) {
+        fflush(json_file);
+        fclose(json_file);
+    }
+}
+
+struct unreachable_meta_t {
+    uint64_t key;   // 堆栈 hash, 没有堆栈时为 caller
+    bool     has_stack;
+    void     *caller;
+    size_t   size;
+    size_t   count;
+    uint32_t stack_id;
+};
+
+static inline void dump_unreachable_impl(FILE *log_file, FILE *json_file) {
+    if (is_event_buffer_enabled) {
+        event_buffer_flush();
+    }
+
+    leak_scanner scanner(m_memory_meta_container.ptr_capacity());
+    bool         scanned = scanner.scan(0, [](leak_scanner &s) {
+        m_memory_meta_container.for_each_unsafe([&](const void *ptr, const ptr_meta_t &meta) {
+            if (!meta.is_mmap) {
+                s.add_block(ptr, meta.size, meta.stack_hash, meta.caller);
+            }
+        });
+    });
+    if (!scanned) {
+        LOGE(TAG, "dump_unreachable: scan failed");
+        return;
+    }
+
+    // 扫描期间恢复的线程可能已经释放了部分块, 只报告仍然存活的
+    std::vector<unreachable_meta_t> leaks;
+    scanner.for_each_unreachable([&](const leak_block_t &block) {
+        if (!m_memory_meta_container.contains(reinterpret_cast<const void *>(block.start))) {
+            return;
+        }
+        leaks.push_back({block.stack_hash ? block.stack_hash : (uint64_t) block.caller,
+                         block.stack_hash != 0, block.caller, block.size, 1, 0});
+    });
+
+    std::sort(leaks.begin(), leaks.end(),
+              [](const unreachable_meta_t &l, const unreachable_meta_t &r) {
+                  return l.has_stack != r.has_stack ? l.has_stack : l.key < r.key;
+              });
+    size_t merged = 0;
+    for (size_t i = 0; i < leaks.size(); ++i) {
+        if (merged && leaks[merged - 1].has_stack == leaks[i].has_stack
+            && leaks[merged - 1].key == leaks[i].key) {
+            leaks[merged - 1].size += leaks[i].size;
+            leaks[merged - 1].count++;
+        } else {
+            leaks[merged++] = leaks[i];
+        }
+    }
+    leaks.resize(merged);
+
+    std::vector<uint32_t> stack_ids;
+    for (auto &leak : leaks) {
+        if (leak.has_stack) {
+            m_memory_meta_container.get_stack(leak.key, [&](const stack_meta_t &stack_meta) {
+                leak.stack_id = stack_meta.stack_id;
+            });
+        }
+        if (leak.stack_id) {
+            stack_ids.push_back(leak.stack_id);
+        }
+    }
+    prepare_symbols(stack_ids.data(), stack_ids.size());
+
+    std::sort(leaks.begin(), leaks.end(),
+              [](const unreachable_meta_t &l, const unreachable_meta_t &r) {
+                  return l.size > r.size;
+              });
+
+    const leak_scan_result_t &result = scanner.result();
+    LOGD(TAG, "dump_unreachable: blocks = %zu, unreachable = %zu (%zu b), unstopped threads = %zu",
+         result.block_count, result.unreachable_count, result.unreachable_size,
+         result.unstopped_count);
+    flogger(log_file,
+            "dump_unreachable: blocks = %zu, unreachable = %zu (%zu b), threads = %zu, "
+            "unstopped threads = %zu, truncated = %d\n",
+            result.block_count, result.unreachable_count, result.unreachable_size,
+            result.thread_count, result.unstopped_count, result.truncated);
+
+    json_stream_writer json(json_file ? fileno(json_file) : -1);
+    json.begin_object()
+            .key("blocks").value_as_string(result.block_count)
+            .key("unreachable_count").value_as_string(result.unreachable_count)
+            .key("unreachable_size").value_as_string(result.unreachable_size)
+            .key("threads").value_as_string(result.thread_count)
+            .key("unstopped").value_as_string(result.unstopped_count)
+            .key("truncated").value_as_string((size_t) result.truncated)
+            .key("leaks").begin_array();
+
+    for (auto &leak : leaks) {
+        const char *so_name = leak.caller ? symbolizer_so_name(leak.caller) : nullptr;
+        so_name = so_name ? so_name : "unknown";
+        flogger(log_file, "\nunreachable size = %zu, count = %zu, caller = %s\n stacktrace : \n",
+                leak.size, leak.count, so_name);
+
+        json.begin_object()
+                .key("size").value_as_string(leak.size)
+                .key("count").value_as_string(leak.count)
+                .key("so").value(so_name)
+                .key("stack").begin_string();
+        if (leak.stack_id) {
+            dump_stack_frames(log_file, &json, leak.stack_id);
+        }
+        json.end_string().end_object();
+    }
+
+    json.end_array().end_object();
+}
+
+void dump_unreachable(const char *log_path, const char *json_path) {
+    FILE *log_file  = log_path ? fopen(log_path, "w+") : nullptr;
+    FILE *json_file = json_path ? fopen(json_path, "w+") : nullptr;
+
+    dump_unreachable_impl(log_file, json_file);
+
+    if (log_file) {
+        fflush(log_file);
+        fclose(log_file);
+    }
+    if (json_file) {
+        fflush(json_file);
+        fclose(json_file);
+    }
+}
+
 void memory_hook_on_dlopen(const char *file_name, bool *maps_refreshed) {
     LOGD(TAG, "memory_hook_on_dlopen: file %s, h_malloc %p, h_realloc %p, h_free %p", file_name,
          h_malloc, h_realloc, h_free);
+    size_class_refresh_modules();
     if (is_stacktrace_enabled) {
         if (!*maps_refreshed) {
             wechat_backtrace::notify_maps_changed();
             *maps_refreshed = true;
         }
     }
-    srand((unsigned int) time(NULL));
 }
 
+void memory_hook_on_dlclose() {
+    size_class_refresh_modules();
+}
@@ -21,21 +21,55 @@
 #ifndef LIBMATRIX_HOOK_MEMORYHOOK_H
 #define LIBMATRIX_HOOK_MEMORYHOOK_H
 
+#include <cstddef>
+#include <cstdint>
+
 #define TAG "Matrix.MemoryHook"
 
 void on_alloc_memory(void *caller, void *ptr, size_t byte_count);
 
 void on_free_memory(void *ptr);
 
+/**
+ * 默认保留原分配的堆栈, 只更新 size 与地址
+ */
+void on_realloc_memory(void *caller, void *old_ptr, void *new_ptr, size_t byte_count);
+
 void on_mmap_memory(void *caller, void *ptr, size_t byte_count);
 
-void on_munmap_memory(void *ptr);
+/**
+ * 按区间处理, 可以只释放已记录映射的一部分
+ */
+void on_munmap_memory(void *ptr, size_t byte_count);
 
 void memory_hook_on_dlopen(const char *file_name, bool *maps_refreshed);
 
+void memory_hook_on_dlclose();
+
+/**
+ * @param since_epoch 非 0 时只统计该次快照之后的分配
+ */
 void dump(bool enable_mmap = false,
           const char *log_path = nullptr,
-          const char *json_path = nullptr);
+          const char *json_path = nullptr,
+          uint32_t since_epoch = 0);
+
+/**
+ * 记录各堆栈当前的存活量并开启新的一代
+ * @return 新一代的 epoch
+ */
+uint32_t memory_hook_snapshot();
+
+/**
+ * 只输出自上次快照以来存活量有变化的堆栈, 按变化量从大到小排序
+ */
+void dump_diff(const char *log_path, const char *json_path);
+
+/**
+ * 暂停其他线程做一次保守式可达性扫描, 按堆栈输出不可达的堆块. 未记录的分配不参与扫描,
+ * 其中保存的指针同样不作为根, 因此采样开启时结果可能偏多
+ */
+void dump_unreachable(const char *log_path, const char *json_path);
 
 void enable_stacktrace(bool);
 
@@ -45,8 +79,16 @@ void set_sample_size_range(size_t min, size_t max);
 
 void set_sampling(double);
 
+void set_sampling_interval_bytes(size_t interval);
+
 void enable_caller_sampling(bool enable);
 
+void enable_event_buffer(bool enable);
+
+void enable_lifetime_profile(bool enable);
+
+void enable_realloc_reattribute(bool enable);
+
 void memory_hook_init();
 
 #endif //LIBMATRIX_HOOK_MEMORYHOOK_H
@@ -0,0 +1,292 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 每个线程一个单生产者 ring, 事件带单调时钟的时间戳, 不共享任何计数器.
+// 同一指针的释放一定发生在其分配事件写入之后, 所以按时间戳合并各 ring 即可还原因果顺序.
+// ring 满时 hook 线程先替聚合线程处理完已写入的事件, 再同步处理本事件, 不等待也不丢弃
+//
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "Log.h"
+#include "MappingName.h"
+#include "PoolAllocator.h"
+#include "MemoryHookEventBuffer.h"
+
+#define TAG "Matrix.MemoryHook.EventBuffer"
+
+#define EVENT_RING_CAPACITY 1024 // power of 2
+#define AGGREGATE_INTERVAL_MILLIS 10
+
+enum ring_state_t {
+    RING_ACTIVE = 0,
+    RING_RETIRED,
+    RING_SHARED,
+};
+
+struct event_ring_t {
+    alignas(64) std::atomic<size_t> head; // 由聚合方推进
+    alignas(64) std::atomic<size_t> tail; // 由所属线程推进
+    std::atomic<int>                state;
+    event_ring_t                    *next;
+    memory_event_t                  events[EVENT_RING_CAPACITY];
+};
+
+struct ring_cursor_t {
+    event_ring_t *ring;
+    size_t       pos;
+    size_t       end;
+
+    uint64_t timestamp() const {
+        return ring->events[pos & (EVENT_RING_CAPACITY - 1)].timestamp;
+    }
+};
+
+struct ring_cursor_greater {
+    bool operator()(const ring_cursor_t &__l, const ring_cursor_t &__r) const {
+        return __l.timestamp() > __r.timestamp();
+    }
+};
+
+static memory_event_consumer_t     m_consumer = nullptr;
+static std::atomic<event_ring_t *> m_rings(nullptr);
+static std::atomic<bool>           m_wake_pending(false);
+static std::mutex                  m_wake_mutex;
+static std::condition_variable     m_wake_cond;
+static std::mutex                  m_drain_mutex;
+/**
+ * 合并用的最小堆, 需持有 m_drain_mutex. 不在被 hook 的堆上分配, 聚合过程不会重入 hook
+ */
+static pool_vector<ring_cursor_t>  m_cursors;
+static pthread_key_t               m_ring_key;
+static std::once_flag              m_init_flag;
+
+/**
+ * 没有私有 ring 的线程 (正在退出或 mmap 失败) 共用, 写入时持有 m_shared_ring_mutex
+ */
+static event_ring_t                *m_shared_ring = nullptr;
+static std::mutex                  m_shared_ring_mutex;
+
+static __thread event_ring_t *t_ring          __attribute__((tls_model("initial-exec")));
+static __thread bool         t_ring_released __attribute__((tls_model("initial-exec")));
+/**
+ * 本线程持有 m_drain_mutex
+ */
+static __thread bool         t_draining      __attribute__((tls_model("initial-exec")));
+
+static inline uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void on_thread_exit(void *__ring) {
+    auto ring = static_cast<event_ring_t *>(__ring);
+    // 剩余事件仍由聚合线程处理, 处理完后 ring 可被新线程复用
+    ring->state.store(RING_RETIRED, std::memory_order_release);
+    t_ring          = nullptr;
+    t_ring_released = true;
+}
+
+/**
+ * ring 不从被 hook 的堆上分配
+ */
+static event_ring_t *create_ring(int state) {
+    void *mem = mmap(nullptr, sizeof(event_ring_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "create_ring: mmap failed");
+        return nullptr;
+    }
+    name_hook_mapping(mem, sizeof(event_ring_t));
+    auto ring = new(mem) event_ring_t;
+    ring->state.store(state, std::memory_order_relaxed);
+    ring->next = m_rings.load(std::memory_order_relaxed);
+    while (!m_rings.compare_exchange_weak(ring->next, ring, std::memory_order_release)) {
+    }
+    return ring;
+}
+
+static event_ring_t *acquire_ring() {
+    event_ring_t *ring = nullptr;
+    for (auto it = m_rings.load(std::memory_order_acquire); it; it = it->next) {
+        int expected = RING_RETIRED;
+        if (it->state.load(std::memory_order_relaxed) == RING_RETIRED
+            && it->head.load(std::memory_order_acquire) == it->tail.load(std::memory_order_relaxed)
+            && it->state.compare_exchange_strong(expected, RING_ACTIVE)) {
+            ring = it;
+            break;
+        }
+    }
+
+    if (!ring) {
+        ring = create_ring(RING_ACTIVE);
+        if (!ring) {
+            return nullptr;
+        }
+    }
+
+    t_ring = ring;
+    pthread_setspecific(m_ring_key, ring);
+    return ring;
+}
+
+/**
+ * 需持有 m_drain_mutex. 只处理时间戳小于 limit 的事件:
+ * 若某事件因果上依赖另一线程的事件, 后者在前者取时间戳之前已写入, 读 limit 之后再读 tail 一定可见
+ */
+static void drain_locked(uint64_t limit) {
+    m_cursors.clear();
+    for (auto ring = m_rings.load(std::memory_order_acquire); ring; ring = ring->next) {
+        size_t end = ring->tail.load(std::memory_order_acquire);
+        size_t pos = ring->head.load(std::memory_order_relaxed);
+        if (pos != end) {
+            m_cursors.push_back({ring, pos, end});
+        }
+    }
+    std::make_heap(m_cursors.begin(), m_cursors.end(), ring_cursor_greater());
+
+    while (!m_cursors.empty()) {
+        std::pop_heap(m_cursors.begin(), m_cursors.end(), ring_cursor_greater());
+        ring_cursor_t &cursor = m_cursors.back();
+        if (cursor.timestamp() >= limit) {
+            break; // 留到下一轮
+        }
+
+        m_consumer(cursor.ring->events[cursor.pos & (EVENT_RING_CAPACITY - 1)]);
+        cursor.ring->head.store(++cursor.pos, std::memory_order_release);
+
+        if (cursor.pos != cursor.end) {
+            std::push_heap(m_cursors.begin(), m_cursors.end(), ring_cursor_greater());
+        } else {
+            m_cursors.pop_back();
+        }
+    }
+}
+
+static void drain(uint64_t limit) {
+    std::lock_guard<std::mutex> drain_lock(m_drain_mutex);
+    t_draining = true;
+    drain_locked(limit);
+    t_draining = false;
+}
+
+/**
+ * 先处理完所有 ring 中早于本事件的事件, 再直接交给 consumer
+ */
+static void record_sync(memory_event_t &event) {
+    event.timestamp = now_ns();
+    if (t_draining) { // 聚合过程中重入, 已持有 m_drain_mutex
+        m_consumer(event);
+        return;
+    }
+    std::lock_guard<std::mutex> drain_lock(m_drain_mutex);
+    t_draining = true;
+    drain_locked(now_ns() + 1);
+    m_consumer(event);
+    t_draining = false;
+}
+
+/**
+ * ring 只有一个写入方 (所属线程, 或持有 m_shared_ring_mutex 的线程), 时间戳在 ring 内单调.
+ * 过半时提前唤醒聚合线程, 满时同步处理
+ */
+static void ring_push(event_ring_t *ring, memory_event_t &event) {
+    size_t tail = ring->tail.load(std::memory_order_relaxed);
+    size_t used = tail - ring->head.load(std::memory_order_acquire);
+    if (used >= EVENT_RING_CAPACITY) {
+        record_sync(event);
+        return;
+    }
+    if (used == EVENT_RING_CAPACITY / 2
+        && !m_wake_pending.exchange(true, std::memory_order_relaxed)) {
+        m_wake_cond.notify_one();
+    }
+
+    memory_event_t &slot = ring->events[tail & (EVENT_RING_CAPACITY - 1)];
+    slot           = event;
+    slot.timestamp = now_ns();
+    ring->tail.store(tail + 1, std::memory_order_release);
+}
+
+static void aggregate_routine() {
+    pthread_setname_np(pthread_self(), "mh-aggregator");
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> wake_lock(m_wake_mutex);
+            m_wake_cond.wait_for(wake_lock, std::chrono::milliseconds(AGGREGATE_INTERVAL_MILLIS),
+                                 [] { return m_wake_pending.load(std::memory_order_relaxed); });
+        }
+        m_wake_pending.store(false, std::memory_order_relaxed);
+        drain(now_ns());
+    }
+}
+
+void event_buffer_init(memory_event_consumer_t consumer) {
+    std::call_once(m_init_flag, [consumer] {
+        m_consumer = consumer;
+        pthread_key_create(&m_ring_key, on_thread_exit);
+        m_shared_ring = create_ring(RING_SHARED);
+        std::thread(aggregate_routine).detach();
+        LOGD(TAG, "event_buffer_init");
+    });
+}
+
+void event_buffer_push(memory_event_op_t op,
+                       void *ptr,
+                       size_t size,
+                       void *caller,
+                       uint64_t stack_hash,
+                       size_t weight,
+                       uint32_t tick,
+                       uint8_t thread_group,
+                       uint32_t stack_id,
+                       void *old_ptr) {
+    memory_event_t event = {0, ptr, size, caller, stack_hash, weight, tick, stack_id, op,
+                            thread_group, old_ptr};
+
+    event_ring_t *ring = t_ring;
+    if (!ring && !t_ring_released) {
+        ring = acquire_ring();
+    }
+    if (ring) {
+        ring_push(ring, event);
+        return;
+    }
+
+    if (!m_shared_ring) {
+        record_sync(event);
+        return;
+    }
+    std::lock_guard<std::mutex> shared_lock(m_shared_ring_mutex);
+    ring_push(m_shared_ring, event);
+}
+
+void event_buffer_flush() {
+    if (!m_consumer) {
+        return;
+    }
+    drain(now_ns());
+}
+
+#undef TAG
@@ -0,0 +1,89 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 分配/释放事件的线程私有缓冲 (参考 iOS 的 memory_logging_event_buffer_list):
+// hook 线程只把事件写进自己的 ring, 由后台线程按时间戳合并后交给 consumer 更新 meta container.
+// 堆栈在 hook 线程中 intern 进堆栈池, 事件只带 stack id
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKEVENTBUFFER_H
+#define LIBMATRIX_HOOK_MEMORYHOOKEVENTBUFFER_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum memory_event_op_t : uint8_t {
+    EVENT_ALLOC = 0,
+    EVENT_MMAP,
+    EVENT_RELEASE,
+    EVENT_REALLOC,
+    EVENT_MUNMAP,
+};
+
+struct memory_event_t {
+    /**
+     * 写入 ring 时的 CLOCK_MONOTONIC 纳秒数
+     */
+    uint64_t                    timestamp;
+    void                        *ptr;
+    size_t                      size;
+    void                        *caller;
+    uint64_t                    stack_hash;
+    size_t                      weight;
+    /**
+     * 事件发生时的 lifetime tick, 未开启生命周期统计时为 0
+     */
+    uint32_t                    tick;
+    /**
+     * 堆栈池中的 id, 仅在做了回溯的分配事件上非 0
+     */
+    uint32_t                    stack_id;
+    memory_event_op_t           op;
+    /**
+     * 分配线程所属的线程组, 需在 hook 线程中取得
+     */
+    uint8_t                     thread_group;
+    /**
+     * 仅 EVENT_REALLOC 使用, ptr 为新地址
+     */
+    void                        *old_ptr;
+};
+
+typedef void (*memory_event_consumer_t)(const memory_event_t &event);
+
+/**
+ * 启动后台聚合线程, 重复调用无效
+ */
+void event_buffer_init(memory_event_consumer_t consumer);
+
+void event_buffer_push(memory_event_op_t op,
+                       void *ptr,
+                       size_t size,
+                       void *caller,
+                       uint64_t stack_hash,
+                       size_t weight,
+                       uint32_t tick,
+                       uint8_t thread_group,
+                       uint32_t stack_id,
+                       void *old_ptr = nullptr);
+
+/**
+ * 把所有线程已写入的事件交给 consumer, 返回后 meta container 与调用时刻一致
+ */
+void event_buffer_flush();
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKEVENTBUFFER_H
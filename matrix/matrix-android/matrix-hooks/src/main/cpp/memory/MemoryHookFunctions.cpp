@@ -18,23 +18,174 @@
 // Created by Yves on 2020-04-28.
 //
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <link.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "BacktraceDefine.h"
 #include "MemoryHookFunctions.h"
 #include "MemoryHook.h"
+#include "MemoryHookGuardedPool.h"
 
-#define ORIGINAL_LIB "libc.so"
+#define CXX_RUNTIME_LIB "libc++_shared.so"
+#define CXX_CALLER_MAX_DEPTH 8
+#define CXX_FRAME_MAX_SPAN (256 * 1024)
+
+/**
+ * 正在执行原始 operator new/delete 的层数. 运行时内部再调用的 malloc/free 以及
+ * nothrow new -> new, sized delete -> delete 等转发已由外层记录, 不再重复查表和回溯.
+ * 计数期间只调用不抛异常的原函数, 见 CALL_CXX_ORIGIN_NEW
+ */
+static __thread uint32_t t_cxx_runtime_depth __attribute__((tls_model("initial-exec")));
 
 #define DO_HOOK_ACQUIRE(p, size) \
-    GET_CALLER_ADDR(caller); \
-    on_alloc_memory(caller, p, size);
+    if (!t_cxx_runtime_depth) { \
+        GET_CALLER_ADDR(caller); \
+        on_alloc_memory(caller, p, size); \
+    }
 
 #define DO_HOOK_RELEASE(p) \
-    on_free_memory(p)
+    if (!t_cxx_runtime_depth) { \
+        on_free_memory(p); \
+    }
+
+static uintptr_t m_cxx_runtime_start = 0;
+static uintptr_t m_cxx_runtime_end   = 0;
+
+static int find_cxx_runtime(struct dl_phdr_info *info, size_t, void *) {
+    size_t name_len = info->dlpi_name ? strlen(info->dlpi_name) : 0;
+    size_t lib_len  = sizeof(CXX_RUNTIME_LIB) - 1;
+    if (name_len < lib_len || strcmp(info->dlpi_name + name_len - lib_len, CXX_RUNTIME_LIB) != 0) {
+        return 0;
+    }
+    uintptr_t start = UINTPTR_MAX;
+    uintptr_t end   = 0;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD) {
+            continue;
+        }
+        start = std::min(start, (uintptr_t) (info->dlpi_addr + phdr.p_vaddr));
+        end   = std::max(end, (uintptr_t) (info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz));
+    }
+    if (start < end) {
+        m_cxx_runtime_start = start;
+        m_cxx_runtime_end   = end;
+    }
+    return 1;
+}
+
+void resolve_cxx_runtime() {
+    dl_iterate_phdr(find_cxx_runtime, nullptr);
+    LOGD(TAG, "resolve_cxx_runtime: [%p, %p)", (void *) m_cxx_runtime_start,
+         (void *) m_cxx_runtime_end);
+}
+
+/**
+ * 范围在注册 hook 之前由 resolve_cxx_runtime 取得, 未找到时为空
+ */
+static inline bool in_cxx_runtime(void *addr) {
+    return (uintptr_t) addr >= m_cxx_runtime_start && (uintptr_t) addr < m_cxx_runtime_end;
+}
+
+/**
+ * 调用方在运行时内部 (如 std::string 扩容) 时, 沿帧记录向上找到第一个运行时之外的返回地址,
+ * 否则所有 C++ 分配都会归到 libc++_shared 中的少数几个地址上.
+ * 只在 arm64 上做 (AAPCS64 保证帧记录), 其他架构及帧记录不可信时仍记为运行时内的地址
+ */
+static inline void *cxx_caller(void *caller, void *frame) {
+#ifdef __aarch64__
+    if (!in_cxx_runtime(caller)) {
+        return caller;
+    }
+    auto fp = (uintptr_t *) frame;
+    for (int i = 0; i < CXX_CALLER_MAX_DEPTH; ++i) {
+        auto next = (uintptr_t *) fp[0];
+        // 上一帧只会在更高的地址, 且不会离得太远
+        if (next <= fp || (uintptr_t) next - (uintptr_t) fp > CXX_FRAME_MAX_SPAN
+            || ((uintptr_t) next & (sizeof(uintptr_t) - 1))) {
+            break;
+        }
+        fp = next;
+        auto ret = (void *) fp[1];
+        if (!in_cxx_runtime(ret)) {
+            return ret;
+        }
+    }
+#else
+    (void) frame;
+#endif
+    return caller;
+}
+
+#define DO_HOOK_CXX_ACQUIRE(p, size) \
+    if (!t_cxx_runtime_depth) { \
+        on_alloc_memory(cxx_caller(__builtin_return_address(0), __builtin_frame_address(0)), p, size); \
+    }
+
+/**
+ * sized delete 的 size 不需要: 指针的 meta 本身就要查表删除, size 随之取得
+ */
+#define DO_HOOK_CXX_RELEASE(p) DO_HOOK_RELEASE(p)
+
+#define CALL_CXX_ORIGIN_FUNC_RET(retType, ret, sym, params...) \
+    t_cxx_runtime_depth++; \
+    CALL_ORIGIN_FUNC_RET(retType, ret, sym, params); \
+    t_cxx_runtime_depth--
+
+#define CALL_CXX_ORIGIN_FUNC_VOID(sym, params...) \
+    t_cxx_runtime_depth++; \
+    CALL_ORIGIN_FUNC_VOID(sym, params); \
+    t_cxx_runtime_depth--
+
+/**
+ * 先调 nothrow 版本, 失败时再调用会抛异常的原函数, 由它执行 new_handler 或抛出 bad_alloc.
+ * 后者内部的 malloc 同样由外层记录, 调用期间也要保持计数, 否则同一块内存记两次.
+ * 本文件以 -fno-exceptions 编译, 不做异常复位: 只有内存耗尽抛出 bad_alloc 时计数不再复位
+ */
+#define CALL_CXX_ORIGIN_NEW(ret, sym, nothrow_sym, params...) \
+    void *ret = nullptr; \
+    t_cxx_runtime_depth++; \
+    if (ORIGINAL_FUNC_NAME(nothrow_sym)) { \
+        ret = ORIGINAL_FUNC_NAME(nothrow_sym)(params, std::nothrow); \
+    } \
+    if (!ret) { \
+        ret = ORIGINAL_FUNC_NAME(sym)(params); \
+    } \
+    t_cxx_runtime_depth--
+
+/**
+ * 池中的块不能交给 libc realloc: 换成普通堆内存后释放 slot
+ */
+static void *guarded_realloc(void *__ptr, size_t __byte_count) {
+    void *p = nullptr;
+    if (__byte_count) {
+        CALL_ORIGIN_FUNC_RET(void *, q, malloc, __byte_count);
+        if (!q) {
+            return nullptr; // 失败时原内存保持不变
+        }
+        memcpy(q, __ptr, std::min(guarded_pool_usable_size(__ptr), __byte_count));
+        p = q;
+    }
+
+    DO_HOOK_RELEASE(__ptr);
+    guarded_pool_free(__ptr);
+    if (p) {
+        DO_HOOK_ACQUIRE(p, __byte_count);
+    }
+    return p;
+}
 
 DEFINE_HOOK_FUN(void *, malloc, size_t __byte_count) {
+    void *guarded = guarded_pool_malloc(__byte_count);
+    if (guarded) {
+        DO_HOOK_ACQUIRE(guarded, __byte_count);
+        return guarded;
+    }
     CALL_ORIGIN_FUNC_RET(void*, p, malloc, __byte_count);
     LOGI(TAG, "+ malloc %p", p);
     DO_HOOK_ACQUIRE(p, __byte_count);
@@ -42,17 +193,24 @@ DEFINE_HOOK_FUN(void *, malloc, size_t __byte_count) {
 }
 
 DEFINE_HOOK_FUN(void *, calloc, size_t __item_count, size_t __item_size) {
+    size_t byte_count;
+    if (!__builtin_mul_overflow(__item_count, __item_size, &byte_count)) {
+        void *guarded = guarded_pool_malloc(byte_count); // slot 释放时已丢弃内容, 总是零页
+        if (guarded) {
+            DO_HOOK_ACQUIRE(guarded, byte_count);
+            return guarded;
+        }
+    }
     CALL_ORIGIN_FUNC_RET(void *, p, calloc, __item_count, __item_size);
     LOGI(TAG, "+ calloc %p", p);
     DO_HOOK_ACQUIRE(p, __item_count * __item_size);
     return p;
 }
 
-DEFINE_HOOK_FUN(void *, realloc, void *__ptr, size_t __byte_count) {
-    CALL_ORIGIN_FUNC_RET(void *, p, realloc, __ptr, __byte_count);
-
-    GET_CALLER_ADDR(caller);
-
+/**
+ * realloc 语义的调用 (realloc / reallocarray / getline 等) 完成后记录, p 为原函数的返回值
+ */
+static inline void on_realloc_done(void *caller, void *__ptr, void *p, size_t __byte_count) {
     // If ptr is NULL, then the call is equivalent to malloc(size), for all values of size;
     // if size is equal to zero, and ptr is not NULL, then the call is equivalent to free(ptr).
     // Unless ptr is NULL, it must have been returned by an earlier call to malloc(), calloc() or realloc().
@@ -60,20 +218,31 @@ DEFINE_HOOK_FUN(void *, realloc, void *__ptr, size_t __byte_count) {
     if (!__ptr) { // malloc
         LOGI(TAG, "+ realloc1 %p", p);
         on_alloc_memory(caller, p, __byte_count);
-        return p;
+        return;
     } else if (!__byte_count) { // free
         on_free_memory(__ptr);
-        return p;
+        return;
     }
 
-    // whatever has been moved or not, record anyway, because using realloc to shrink an allocation is allowed.
-    // wtf whatever. if p == __ptr , just override meta
-    if (p != __ptr) {
-        on_free_memory(__ptr);
+    // 失败时原内存保持不变
+    if (!p) {
+        return;
     }
+
+    // 原地扩缩只更新 size, 移动时把 meta 搬到新地址, 都保留原分配的堆栈
     LOGI(TAG, "+ realloc2 %p", p);
-    on_alloc_memory(caller, p, __byte_count);
+    on_realloc_memory(caller, __ptr, p, __byte_count);
+}
+
+DEFINE_HOOK_FUN(void *, realloc, void *__ptr, size_t __byte_count) {
+    if (guarded_pool_owns(__ptr)) {
+        return guarded_realloc(__ptr, __byte_count);
+    }
 
+    CALL_ORIGIN_FUNC_RET(void *, p, realloc, __ptr, __byte_count);
+
+    GET_CALLER_ADDR(caller);
+    on_realloc_done(caller, __ptr, p, __byte_count);
     return p;
 }
 
@@ -96,9 +265,90 @@ DEFINE_HOOK_FUN(int, posix_memalign, void** __memptr, size_t __alignment, size_t
 DEFINE_HOOK_FUN(void, free, void *__ptr) {
     LOGI(TAG, "- free %p", __ptr);
     DO_HOOK_RELEASE(__ptr);
+    if (guarded_pool_owns(__ptr)) {
+        guarded_pool_free(__ptr);
+        return;
+    }
     CALL_ORIGIN_FUNC_VOID(free, __ptr);
 }
 
+DEFINE_HOOK_FUN(void *, reallocarray, void *__ptr, size_t __item_count, size_t __item_size) {
+    size_t byte_count;
+    if (__builtin_mul_overflow(__item_count, __item_size, &byte_count)) {
+        CALL_ORIGIN_FUNC_RET(void *, p, reallocarray, __ptr, __item_count, __item_size);
+        return p; // 溢出时原函数失败, 原内存保持不变
+    }
+    if (guarded_pool_owns(__ptr)) {
+        return guarded_realloc(__ptr, byte_count);
+    }
+    CALL_ORIGIN_FUNC_RET(void *, p, reallocarray, __ptr, __item_count, __item_size);
+
+    GET_CALLER_ADDR(caller);
+    on_realloc_done(caller, __ptr, p, byte_count);
+    return p;
+}
+
+DEFINE_HOOK_FUN(size_t, malloc_usable_size, const void *__ptr) {
+    if (guarded_pool_owns(__ptr)) {
+        return guarded_pool_usable_size(__ptr);
+    }
+    CALL_ORIGIN_FUNC_RET(size_t, size, malloc_usable_size, __ptr);
+    return size;
+}
+
+/**
+ * getline / getdelim 在 libc 内部 realloc 调用方给的缓冲, 不经过 hook, 池中的缓冲需先换成普通堆内存,
+ * 返回后按缓冲地址和大小的变化补记一次 realloc
+ */
+static bool unguard_line_buffer(char **__lineptr, size_t *__n) {
+    if (!__lineptr || !guarded_pool_owns(*__lineptr)) {
+        return true;
+    }
+    size_t size = guarded_pool_usable_size(*__lineptr);
+    void   *p   = guarded_realloc(*__lineptr, size);
+    if (!p) {
+        return false;
+    }
+    *__lineptr = (char *) p;
+    if (__n) {
+        *__n = size;
+    }
+    return true;
+}
+
+static inline void on_line_buffer_done(void *caller, char **__lineptr, size_t *__n,
+                                       void *__old_line, size_t __old_n) {
+    if (__lineptr && __n && (*__lineptr != __old_line || *__n != __old_n)) {
+        on_realloc_done(caller, __old_line, *__lineptr, *__n);
+    }
+}
+
+DEFINE_HOOK_FUN(ssize_t, getline, char **__lineptr, size_t *__n, FILE *__stream) {
+    if (!unguard_line_buffer(__lineptr, __n)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    void   *old_line = __lineptr ? *__lineptr : nullptr;
+    size_t old_n     = __n ? *__n : 0;
+    CALL_ORIGIN_FUNC_RET(ssize_t, ret, getline, __lineptr, __n, __stream);
+    GET_CALLER_ADDR(caller);
+    on_line_buffer_done(caller, __lineptr, __n, old_line, old_n);
+    return ret;
+}
+
+DEFINE_HOOK_FUN(ssize_t, getdelim, char **__lineptr, size_t *__n, int __delimiter, FILE *__stream) {
+    if (!unguard_line_buffer(__lineptr, __n)) {
+        errno = ENOMEM;
+        return -1;
+    }
+    void   *old_line = __lineptr ? *__lineptr : nullptr;
+    size_t old_n     = __n ? *__n : 0;
+    CALL_ORIGIN_FUNC_RET(ssize_t, ret, getdelim, __lineptr, __n, __delimiter, __stream);
+    GET_CALLER_ADDR(caller);
+    on_line_buffer_done(caller, __lineptr, __n, old_line, old_n);
+    return ret;
+}
+
 #if defined(__USE_FILE_OFFSET64)
 void*h_mmap(void* __addr, size_t __size, int __prot, int __flags, int __fd, off_t __offset) __RENAME(mmap64) {
     void * p = mmap(__addr, __size, __prot, __flags, __fd, __offset);
@@ -155,7 +405,10 @@ DEFINE_HOOK_FUN(void *, mremap, void *__old_addr, size_t __old_size, size_t __ne
 
     GET_CALLER_ADDR(caller);
 
-    on_munmap_memory(__old_addr);
+    // 只搬走 [old, old + old_size), 原映射超出的部分仍保留; old_size 为 0 时是复制共享映射, 原映射不变
+    if (__old_size) {
+        on_munmap_memory(__old_addr, __old_size);
+    }
     LOGI(TAG, "+ mremap %p = mremap(addr=%p, __new_size=%zu", p, __old_addr, __new_size);
     on_mmap_memory(caller, p, __new_size);
 
@@ -164,7 +417,7 @@ DEFINE_HOOK_FUN(void *, mremap, void *__old_addr, size_t __old_size, size_t __ne
 
 DEFINE_HOOK_FUN(int, munmap, void *__addr, size_t __size) {
     LOGI(TAG, "- munmap %p", __addr);
-    on_munmap_memory(__addr);
+    on_munmap_memory(__addr, __size);
     return munmap(__addr, __size);
 }
 
@@ -182,247 +435,242 @@ DEFINE_HOOK_FUN(char*, strndup, const char *str, size_t n) {
     return p;
 }
 
-#undef ORIGINAL_LIB
-#define ORIGINAL_LIB "libc++_shared.so"
-
 #ifndef __LP64__
 
 DEFINE_HOOK_FUN(void*, _Znwj, size_t size) {
 //    void * p = ORIGINAL_FUNC_NAME(_Znwj)(size);
-    CALL_ORIGIN_FUNC_RET(void*, p, _Znwj, size);
+    CALL_CXX_ORIGIN_NEW(p, _Znwj, _ZnwjRKSt9nothrow_t, size);
     LOGI(TAG, "+ _Znwj %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnwjSt11align_val_t, size_t size, std::align_val_t align_val) {
 //    void * p = ORIGINAL_FUNC_NAME(_ZnwjSt11align_val_t)(size, align_val);
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnwjSt11align_val_t, size, align_val);
+    CALL_CXX_ORIGIN_NEW(p, _ZnwjSt11align_val_t, _ZnwjSt11align_val_tRKSt9nothrow_t, size, align_val);
     LOGI(TAG, "- _ZnwjSt11align_val_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnwjSt11align_val_tRKSt9nothrow_t, size_t size,
                 std::align_val_t align_val, std::nothrow_t const& nothrow) {
 //    void * p = ORIGINAL_FUNC_NAME(_ZnwjSt11align_val_tRKSt9nothrow_t)(size, align_val, nothrow);
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnwjSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnwjSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
     LOGI(TAG, "+ _ZnwjSt11align_val_tRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnwjRKSt9nothrow_t, size_t size, std::nothrow_t const& nothrow) {
 //    void * p = ORIGINAL_FUNC_NAME(_ZnwjRKSt9nothrow_t)(size, nothrow);
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnwjRKSt9nothrow_t, size, nothrow);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnwjRKSt9nothrow_t, size, nothrow);
     LOGI(TAG, "+ _ZnwjRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _Znaj, size_t size) {
 //    void * p = ORIGINAL_FUNC_NAME(_Znaj)(size);
-    CALL_ORIGIN_FUNC_RET(void*, p, _Znaj, size);
+    CALL_CXX_ORIGIN_NEW(p, _Znaj, _ZnajRKSt9nothrow_t, size);
     LOGI(TAG, "+ _Znaj %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnajSt11align_val_t, size_t size, std::align_val_t align_val) {
 //    void * p = ORIGINAL_FUNC_NAME(_ZnajSt11align_val_t)(size, align_val);
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnajSt11align_val_t, size, align_val);
+    CALL_CXX_ORIGIN_NEW(p, _ZnajSt11align_val_t, _ZnajSt11align_val_tRKSt9nothrow_t, size, align_val);
     LOGI(TAG, "+ _ZnajSt11align_val_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnajSt11align_val_tRKSt9nothrow_t, size_t size,
                 std::align_val_t align_val, std::nothrow_t const& nothrow) {
 //    void * p = ORIGINAL_FUNC_NAME(_ZnajSt11align_val_tRKSt9nothrow_t)(size, align_val, nothrow);
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnajSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnajSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
     LOGI(TAG, "+ _ZnajSt11align_val_tRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnajRKSt9nothrow_t, size_t size, std::nothrow_t const& nothrow) {
 //    void * p = ORIGINAL_FUNC_NAME(_ZnajRKSt9nothrow_t)(size, nothrow);
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnajRKSt9nothrow_t, size, nothrow);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnajRKSt9nothrow_t, size, nothrow);
     LOGI(TAG, "+ _ZnajRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPvj, void* ptr, size_t size) {
     LOGI(TAG, "- _ZdaPvj %p", ptr);
-    DO_HOOK_RELEASE(ptr);
+    DO_HOOK_CXX_RELEASE(ptr);
 //    ORIGINAL_FUNC_NAME(_ZdaPvj)(ptr, size);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPvj, ptr, size);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPvj, ptr, size);
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPvjSt11align_val_t, void* ptr, size_t size,
                 std::align_val_t align_val) {
     LOGI(TAG, "- _ZdaPvjSt11align_val_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
+    DO_HOOK_CXX_RELEASE(ptr);
 //    ORIGINAL_FUNC_NAME(_ZdaPvjSt11align_val_t)(ptr, size, align_val);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPvjSt11align_val_t, ptr, size, align_val);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPvjSt11align_val_t, ptr, size, align_val);
 }
 
 DEFINE_HOOK_FUN(void, _ZdlPvj, void* ptr, size_t size) {
     LOGI(TAG, "- _ZdlPvj %p", ptr);
-    DO_HOOK_RELEASE(ptr);
+    DO_HOOK_CXX_RELEASE(ptr);
 //    ORIGINAL_FUNC_NAME(_ZdlPvj)(ptr, size);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPvj, ptr, size);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPvj, ptr, size);
 }
 
 DEFINE_HOOK_FUN(void, _ZdlPvjSt11align_val_t, void* ptr, size_t size,
                 std::align_val_t align_val) {
     LOGI(TAG, "- _ZdlPvjSt11align_val_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
+    DO_HOOK_CXX_RELEASE(ptr);
 //    ORIGINAL_FUNC_NAME(_ZdlPvjSt11align_val_t)(ptr, size, align_val);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPvjSt11align_val_t, ptr, size, align_val);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPvjSt11align_val_t, ptr, size, align_val);
 }
 
 #else
 
 DEFINE_HOOK_FUN(void*, _Znwm, size_t size) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _Znwm, size);
+    CALL_CXX_ORIGIN_NEW(p, _Znwm, _ZnwmRKSt9nothrow_t, size);
     LOGI(TAG, "+ _Znwm %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnwmSt11align_val_t, size_t size, std::align_val_t align_val) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnwmSt11align_val_t, size, align_val);
+    CALL_CXX_ORIGIN_NEW(p, _ZnwmSt11align_val_t, _ZnwmSt11align_val_tRKSt9nothrow_t, size, align_val);
     LOGI(TAG, "+ _ZnwmSt11align_val_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnwmSt11align_val_tRKSt9nothrow_t, size_t size,
                 std::align_val_t                                  align_val,
                 std::nothrow_t const                              &nothrow) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnwmSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnwmSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
     LOGI(TAG, "+ _ZnwmSt11align_val_tRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnwmRKSt9nothrow_t, size_t size, std::nothrow_t const &nothrow) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _Znwm, size);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnwmRKSt9nothrow_t, size, nothrow);
     LOGI(TAG, "+ _ZnwmRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _Znam, size_t size) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _Znam, size);
+    CALL_CXX_ORIGIN_NEW(p, _Znam, _ZnamRKSt9nothrow_t, size);
     LOGI(TAG, "+ _Znam %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnamSt11align_val_t, size_t size, std::align_val_t align_val) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnamSt11align_val_t, size, align_val);
+    CALL_CXX_ORIGIN_NEW(p, _ZnamSt11align_val_t, _ZnamSt11align_val_tRKSt9nothrow_t, size, align_val);
     LOGI(TAG, "+ _ZnamSt11align_val_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnamSt11align_val_tRKSt9nothrow_t, size_t size,
                 std::align_val_t                                  align_val,
                 std::nothrow_t const                              &nothrow) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnamSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnamSt11align_val_tRKSt9nothrow_t, size, align_val, nothrow);
     LOGI(TAG, "+ _ZnamSt11align_val_tRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void*, _ZnamRKSt9nothrow_t, size_t size, std::nothrow_t const &nothrow) {
-    CALL_ORIGIN_FUNC_RET(void*, p, _ZnamRKSt9nothrow_t, size, nothrow);
+    CALL_CXX_ORIGIN_FUNC_RET(void*, p, _ZnamRKSt9nothrow_t, size, nothrow);
     LOGI(TAG, "+ _ZnamRKSt9nothrow_t %p", p);
-    DO_HOOK_ACQUIRE(p, size);
+    DO_HOOK_CXX_ACQUIRE(p, size);
     return p;
 }
 
 DEFINE_HOOK_FUN(void, _ZdlPvm, void *ptr, size_t size) {
     LOGI(TAG, "- _ZdlPvm %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPvm, ptr, size);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPvm, ptr, size);
 }
 
 DEFINE_HOOK_FUN(void, _ZdlPvmSt11align_val_t, void *ptr, size_t size,
                 std::align_val_t                   align_val) {
     LOGI(TAG, "- _ZdlPvmSt11align_val_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPvmSt11align_val_t, ptr, size, align_val);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPvmSt11align_val_t, ptr, size, align_val);
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPvm, void *ptr, size_t size) {
     LOGI(TAG, "- _ZdaPvm %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPvm, ptr, size);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPvm, ptr, size);
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPvmSt11align_val_t, void *ptr, size_t size,
                 std::align_val_t                   align_val) {
     LOGI(TAG, "- _ZdaPvmSt11align_val_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPvmSt11align_val_t, ptr, size, align_val);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPvmSt11align_val_t, ptr, size, align_val);
 }
 
 #endif
 
 DEFINE_HOOK_FUN(void, _ZdlPv, void *p) {
     LOGI(TAG, "- _ZdlPv %p", p);
-    DO_HOOK_RELEASE(p);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPv, p);
+    DO_HOOK_CXX_RELEASE(p);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPv, p);
 }
 
 DEFINE_HOOK_FUN(void, _ZdlPvSt11align_val_t, void *ptr, std::align_val_t align_val) {
     LOGI(TAG, "- _ZdlPvSt11align_val_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPvSt11align_val_t, ptr, align_val);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPvSt11align_val_t, ptr, align_val);
 }
 
 DEFINE_HOOK_FUN(void, _ZdlPvSt11align_val_tRKSt9nothrow_t, void *ptr,
                 std::align_val_t                                align_val,
                 std::nothrow_t const                            &nothrow) {
     LOGI(TAG, "- _ZdlPvSt11align_val_tRKSt9nothrow_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPvSt11align_val_tRKSt9nothrow_t, ptr, align_val, nothrow);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPvSt11align_val_tRKSt9nothrow_t, ptr, align_val, nothrow);
 }
 
 DEFINE_HOOK_FUN(void, _ZdlPvRKSt9nothrow_t, void *ptr, std::nothrow_t const &nothrow) {
     LOGI(TAG, "- _ZdlPvRKSt9nothrow_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdlPvRKSt9nothrow_t, ptr, nothrow);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdlPvRKSt9nothrow_t, ptr, nothrow);
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPv, void *ptr) {
     LOGI(TAG, "- _ZdaPv %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPv, ptr);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPv, ptr);
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPvSt11align_val_t, void *ptr, std::align_val_t align_val) {
     LOGI(TAG, "- _ZdaPvSt11align_val_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPvSt11align_val_t, ptr, align_val);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPvSt11align_val_t, ptr, align_val);
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPvSt11align_val_tRKSt9nothrow_t, void *ptr,
                 std::align_val_t                                align_val,
                 std::nothrow_t const                            &nothrow) {
     LOGI(TAG, "- _ZdaPvSt11align_val_tRKSt9nothrow_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPvSt11align_val_tRKSt9nothrow_t, ptr, align_val, nothrow);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPvSt11align_val_tRKSt9nothrow_t, ptr, align_val, nothrow);
 }
 
 DEFINE_HOOK_FUN(void, _ZdaPvRKSt9nothrow_t, void *ptr, std::nothrow_t const &nothrow) {
     LOGI(TAG, "- _ZdaPvRKSt9nothrow_t %p", ptr);
-    DO_HOOK_RELEASE(ptr);
-    CALL_ORIGIN_FUNC_VOID(_ZdaPvRKSt9nothrow_t, ptr, nothrow);
+    DO_HOOK_CXX_RELEASE(ptr);
+    CALL_CXX_ORIGIN_FUNC_VOID(_ZdaPvRKSt9nothrow_t, ptr, nothrow);
 }
-
-#undef ORIGINAL_LIB
\ No newline at end of file
@@ -22,6 +22,8 @@
 #define MEMINFO_MEMORYHOOK_H
 
 #include <cstddef>
+#include <cstdio>
+#include <sys/types.h>
 #include <string>
 #include <dlfcn.h>
 #include "Log.h"
@@ -30,6 +32,11 @@
 #include "MemoryHookCXXFunctions.h"
 #include "HookCommon.h"
 
+/**
+ * 取得 libc++_shared 的地址范围, 供 operator new 归属调用方. 需在注册 hook 之前调用
+ */
+void resolve_cxx_runtime();
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -46,6 +53,14 @@ DECLARE_HOOK_ORIG(void *, memalign, size_t __alignment, size_t __byte_count);
 
 DECLARE_HOOK_ORIG(int, posix_memalign, void** __memptr, size_t __alignment, size_t __size);
 
+DECLARE_HOOK_ORIG(void *, reallocarray, void *__ptr, size_t __item_count, size_t __item_size);
+
+DECLARE_HOOK_ORIG(size_t, malloc_usable_size, const void *__ptr);
+
+DECLARE_HOOK_ORIG(ssize_t, getline, char **__lineptr, size_t *__n, FILE *__stream);
+
+DECLARE_HOOK_ORIG(ssize_t, getdelim, char **__lineptr, size_t *__n, int __delimiter, FILE *__stream);
+
 #if defined(__USE_FILE_OFFSET64)
 // DECLARE_HOOK_ORIG not supports attrbute
 void *h_mmap(void* __addr, size_t __size, int __prot, int __flags, int __fd, off_t __offset) __RENAME(mmap64);
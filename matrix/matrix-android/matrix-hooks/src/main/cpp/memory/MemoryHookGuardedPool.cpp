@@ -0,0 +1,440 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 池布局: [guard][slot 0][guard][slot 1] ... [slot n-1][guard], 每段一页.
+// slot 元数据与空闲列表都在池外单独 mmap, 信号处理函数中只读不写
+//
+
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <android/log.h>
+#include "Log.h"
+#include "Backtrace.h"
+#include "MemoryHookGuardedPool.h"
+
+#define TAG "Matrix.MemoryHook.GuardedPool"
+
+#define GUARDED_POOL_MAX_FRAMES 16
+#define GUARDED_POOL_ALIGNMENT 16
+
+enum {
+    SLOT_UNUSED = 0,
+    SLOT_ALLOCATED,
+    SLOT_FREED,
+};
+
+struct guarded_stack_t {
+    pid_t     tid;
+    size_t    frame_size;
+    uintptr_t pcs[GUARDED_POOL_MAX_FRAMES];
+};
+
+struct guarded_slot_t {
+    uintptr_t        ptr;
+    size_t           size;
+    /**
+     * 释放时 CAS 切换, 并发释放同一指针只有一个能成功
+     */
+    std::atomic<int> state;
+    guarded_stack_t  alloc_stack;
+    guarded_stack_t  free_stack;
+};
+
+static std::atomic<bool> m_enabled(false);
+static size_t            m_page_size   = 0;
+static size_t            m_slot_count  = 0;
+static size_t            m_sample_rate = 0;
+static uintptr_t         m_pool_start  = 0;
+static uintptr_t         m_pool_end    = 0;
+
+static std::mutex     m_pool_mutex;
+static guarded_slot_t *m_slots       = nullptr;
+static uint32_t       *m_free_slots  = nullptr;
+static size_t         m_free_count   = 0;
+static size_t         m_next_unused  = 0; // 先用没用过的 slot, 之后从空闲列表中随机取
+
+static struct sigaction  m_old_sigsegv;
+static std::atomic<bool> m_reported(false);
+
+static __thread int64_t  t_until_sample __attribute__((tls_model("initial-exec")));
+static __thread uint64_t t_random_state __attribute__((tls_model("initial-exec")));
+static __thread bool     t_in_pool __attribute__((tls_model("initial-exec")));
+
+static inline uint64_t next_random() {
+    uint64_t x = t_random_state;
+    if (!x) {
+        x = ((uint64_t) pthread_self() ^ (uint64_t) time(nullptr)) * 0x9E3779B97F4A7C15ULL | 1;
+    }
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    t_random_state = x;
+    return x;
+}
+
+/**
+ * 间隔在 [1, 2 * rate] 内均匀分布, 新线程第一次只初始化不采样
+ */
+static inline bool should_sample() {
+    int64_t left = t_until_sample;
+    if (left > 1) {
+        t_until_sample = left - 1;
+        return false;
+    }
+    t_until_sample = (int64_t) (next_random() % (2 * m_sample_rate)) + 1;
+    return left == 1;
+}
+
+static inline uintptr_t slot_page(size_t index) {
+    return m_pool_start + m_page_size * (2 * index + 1);
+}
+
+/**
+ * @return 落在保护页上时返回 false, __index 为其后的 slot
+ */
+static inline bool slot_index_of(uintptr_t addr, size_t *index) {
+    size_t page = (addr - m_pool_start) / m_page_size;
+    *index = page / 2;
+    return page & 1;
+}
+
+static void capture_stack(guarded_stack_t *stack) {
+    wechat_backtrace::Frame frames[GUARDED_POOL_MAX_FRAMES];
+    size_t                  frame_size = 0;
+    wechat_backtrace::unwind_adapter(frames, GUARDED_POOL_MAX_FRAMES, frame_size);
+    stack->tid        = gettid();
+    stack->frame_size = frame_size;
+    for (size_t i = 0; i < frame_size; ++i) {
+        stack->pcs[i] = frames[i].pc;
+    }
+}
+
+/**
+ * 信号处理函数中也会用到, 不能调用 __android_log_print: 自行格式化后 write 到 stderr,
+ * 不在信号处理函数中时再输出一份到 logcat
+ */
+class report_line {
+
+public:
+
+    report_line &str(const char *__s) {
+        while (*__s && len < sizeof(buf) - 1) {
+            buf[len++] = *__s++;
+        }
+        return *this;
+    }
+
+    report_line &hex(uintptr_t __v) {
+        char   digits[2 * sizeof(uintptr_t)];
+        size_t n = 0;
+        do {
+            digits[n++] = "0123456789abcdef"[__v & 0xf];
+            __v >>= 4;
+        } while (__v);
+        return reverse_append(digits, n);
+    }
+
+    report_line &dec(ssize_t __v) {
+        if (__v < 0) {
+            str("-");
+        }
+        size_t u = __v < 0 ? (size_t) 0 - (size_t) __v : (size_t) __v;
+        char   digits[20];
+        size_t n = 0;
+        do {
+            digits[n++] = (char) ('0' + u % 10);
+            u /= 10;
+        } while (u);
+        return reverse_append(digits, n);
+    }
+
+    void flush(bool __in_signal) {
+        if (!__in_signal) {
+            buf[len] = '\0';
+            __android_log_print(ANDROID_LOG_FATAL, TAG, "%s", buf);
+        }
+        buf[len++] = '\n';
+        write(STDERR_FILENO, TAG ": ", sizeof(TAG ": ") - 1);
+        write(STDERR_FILENO, buf, len);
+        len = 0;
+    }
+
+private:
+
+    report_line &reverse_append(const char *__digits, size_t __n) {
+        while (__n && len < sizeof(buf) - 1) {
+            buf[len++] = __digits[--__n];
+        }
+        return *this;
+    }
+
+    char   buf[256];
+    size_t len = 0;
+};
+
+/**
+ * 只输出地址, 符号化交给离线工具
+ */
+static void report_stack(const char *title, const guarded_stack_t &stack, bool in_signal) {
+    report_line line;
+    line.str(title).str(" by thread ").dec(stack.tid).str(":").flush(in_signal);
+    for (size_t i = 0; i < stack.frame_size; ++i) {
+        line.str("  #").dec((ssize_t) i).str(" pc ").hex(stack.pcs[i]).flush(in_signal);
+    }
+}
+
+static void report(const char *error, uintptr_t addr, const guarded_slot_t *slot,
+                   bool in_signal) {
+    report_line line;
+    line.str(error).str(" at ").hex(addr);
+    if (!slot) {
+        line.flush(in_signal);
+        return;
+    }
+    line.str(", ").dec((ssize_t) (addr - slot->ptr)).str(" bytes from allocation ")
+        .hex(slot->ptr).str(" (size ").dec((ssize_t) slot->size).str(")").flush(in_signal);
+    report_stack("allocated", slot->alloc_stack, in_signal);
+    if (slot->state == SLOT_FREED) {
+        report_stack("freed", slot->free_stack, in_signal);
+    }
+}
+
+/**
+ * 保护页上的访问归到距离更近的那个已分配 slot
+ */
+static const guarded_slot_t *nearest_slot(uintptr_t addr, size_t next_index) {
+    const guarded_slot_t *left  = next_index > 0 ? &m_slots[next_index - 1] : nullptr;
+    const guarded_slot_t *right = next_index < m_slot_count ? &m_slots[next_index] : nullptr;
+    if (left && left->state == SLOT_UNUSED) {
+        left = nullptr;
+    }
+    if (right && right->state == SLOT_UNUSED) {
+        right = nullptr;
+    }
+    if (!left || !right) {
+        return left ? left : right;
+    }
+    return addr - (left->ptr + left->size) <= right->ptr - addr ? left : right;
+}
+
+/**
+ * 在信号处理函数中调用
+ */
+static void diagnose(uintptr_t addr) {
+    size_t index;
+    if (!slot_index_of(addr, &index)) {
+        const guarded_slot_t *slot = nearest_slot(addr, index);
+        report(slot && addr < slot->ptr ? "buffer-underflow" : "buffer-overflow", addr, slot,
+               true);
+        return;
+    }
+
+    const guarded_slot_t *slot = &m_slots[index];
+    if (slot->state == SLOT_FREED) {
+        report("use-after-free", addr, slot, true);
+    } else if (slot->state == SLOT_ALLOCATED) {
+        // 对齐留下的空隙以外, slot 内已分配的页不会触发 SIGSEGV, 走到这里通常是权限被其他代码改动
+        report(addr < slot->ptr ? "buffer-underflow" : "buffer-overflow", addr, slot, true);
+    } else {
+        report("wild-access", addr, nullptr, true);
+    }
+}
+
+/**
+ * 交给安装前的处理函数. 原处理函数为默认行为时恢复默认处理后返回,
+ * 重新执行出错指令产生 crash, 只有这种情况才改动信号处理函数
+ */
+static void chain_sigsegv(int sig, siginfo_t *info, void *ucontext) {
+    if (m_old_sigsegv.sa_flags & SA_SIGINFO) {
+        if (m_old_sigsegv.sa_sigaction) {
+            m_old_sigsegv.sa_sigaction(sig, info, ucontext);
+            return;
+        }
+    } else if (m_old_sigsegv.sa_handler != SIG_DFL && m_old_sigsegv.sa_handler != SIG_IGN) {
+        m_old_sigsegv.sa_handler(sig);
+        return;
+    }
+    signal(sig, SIG_DFL);
+}
+
+static void on_sigsegv(int sig, siginfo_t *info, void *ucontext) {
+    auto addr = (uintptr_t) info->si_addr;
+    if (addr >= m_pool_start && addr < m_pool_end && !m_reported.exchange(true)) {
+        diagnose(addr);
+    }
+    chain_sigsegv(sig, info, ucontext);
+}
+
+static void *map_zeroed(size_t size, int prot) {
+    void *mem = mmap(nullptr, size, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? nullptr : mem;
+}
+
+bool guarded_pool_init(size_t __slot_count, size_t __sample_rate) {
+    if (m_enabled.load() || !__slot_count || !__sample_rate) {
+        return false;
+    }
+
+    m_page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    size_t pool_size = m_page_size * (2 * __slot_count + 1);
+    void   *pool     = map_zeroed(pool_size, PROT_NONE);
+    auto   slots     = static_cast<guarded_slot_t *>(
+            map_zeroed(sizeof(guarded_slot_t) * __slot_count, PROT_READ | PROT_WRITE));
+    auto   free_list = static_cast<uint32_t *>(
+            map_zeroed(sizeof(uint32_t) * __slot_count, PROT_READ | PROT_WRITE));
+    if (!pool || !slots || !free_list) {
+        LOGE(TAG, "guarded_pool_init: mmap failed, slots = %zu", __slot_count);
+        if (pool) munmap(pool, pool_size);
+        if (slots) munmap(slots, sizeof(guarded_slot_t) * __slot_count);
+        if (free_list) munmap(free_list, sizeof(uint32_t) * __slot_count);
+        return false;
+    }
+
+    m_slot_count  = __slot_count;
+    m_sample_rate = __sample_rate;
+    m_pool_start  = (uintptr_t) pool;
+    m_pool_end    = m_pool_start + pool_size;
+    m_slots       = slots;
+    m_free_slots  = free_list;
+
+    struct sigaction action{};
+    action.sa_sigaction = on_sigsegv;
+    action.sa_flags     = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &m_old_sigsegv);
+
+    m_enabled.store(true);
+    LOGD(TAG, "guarded_pool_init: pool = %p, slots = %zu, sample rate = %zu", pool,
+         __slot_count, __sample_rate);
+    return true;
+}
+
+bool guarded_pool_enabled() {
+    return m_enabled.load(std::memory_order_relaxed);
+}
+
+static bool acquire_slot(size_t *index) {
+    std::lock_guard<std::mutex> pool_lock(m_pool_mutex);
+    if (m_next_unused < m_slot_count) {
+        *index = m_next_unused++;
+        return true;
+    }
+    if (!m_free_count) {
+        return false;
+    }
+    // 随机复用, 让刚释放的 slot 尽量保持不可访问, 便于发现释放后使用
+    size_t pick = next_random() % m_free_count;
+    *index = m_free_slots[pick];
+    m_free_slots[pick] = m_free_slots[--m_free_count];
+    return true;
+}
+
+static void release_slot(size_t index) {
+    std::lock_guard<std::mutex> pool_lock(m_pool_mutex);
+    m_free_slots[m_free_count++] = (uint32_t) index;
+}
+
+void *guarded_pool_malloc(size_t __size) {
+    if (!m_enabled.load(std::memory_order_relaxed) || !__size || __size > m_page_size
+        || t_in_pool || !should_sample()) {
+        return nullptr;
+    }
+
+    // 回溯内部可能再分配内存
+    t_in_pool = true;
+
+    size_t index;
+    if (!acquire_slot(&index)) {
+        t_in_pool = false;
+        return nullptr;
+    }
+
+    uintptr_t page = slot_page(index);
+    if (mprotect((void *) page, m_page_size, PROT_READ | PROT_WRITE) != 0) {
+        release_slot(index);
+        t_in_pool = false;
+        return nullptr;
+    }
+
+    // 随机靠左或靠右放置, 分别用于发现下溢和上溢
+    uintptr_t ptr = page;
+    if (next_random() & 1) {
+        ptr = (page + m_page_size - __size) & ~(uintptr_t) (GUARDED_POOL_ALIGNMENT - 1);
+    }
+
+    guarded_slot_t &slot = m_slots[index];
+    capture_stack(&slot.alloc_stack);
+    slot.free_stack.frame_size = 0;
+    slot.ptr  = ptr;
+    slot.size = __size;
+    slot.state.store(SLOT_ALLOCATED, std::memory_order_release);
+
+    t_in_pool = false;
+    return (void *) ptr;
+}
+
+bool guarded_pool_owns(const void *__ptr) {
+    return (uintptr_t) __ptr >= m_pool_start && (uintptr_t) __ptr < m_pool_end;
+}
+
+size_t guarded_pool_usable_size(const void *__ptr) {
+    size_t index;
+    if (!slot_index_of((uintptr_t) __ptr, &index)) {
+        return 0;
+    }
+    return m_slots[index].size;
+}
+
+void guarded_pool_free(void *__ptr) {
+    auto   addr = (uintptr_t) __ptr;
+    size_t index;
+    if (!slot_index_of(addr, &index)) {
+        report("invalid-free", addr, nearest_slot(addr, index), false);
+        abort();
+    }
+
+    bool reentrant = t_in_pool;
+    t_in_pool = true;
+    guarded_stack_t free_stack;
+    capture_stack(&free_stack);
+    t_in_pool = reentrant;
+
+    guarded_slot_t &slot = m_slots[index];
+    int            state = SLOT_ALLOCATED;
+    if (slot.ptr != addr || !slot.state.compare_exchange_strong(state, SLOT_FREED)) {
+        state = slot.state.load();
+        report(state == SLOT_FREED ? "double-free" : "invalid-free", addr, &slot, false);
+        abort();
+    }
+    slot.free_stack = free_stack;
+
+    // 丢弃内容, 复用时读到的是零页, calloc 也能直接使用
+    void *page = (void *) slot_page(index);
+    mprotect(page, m_page_size, PROT_NONE);
+    madvise(page, m_page_size, MADV_DONTNEED);
+
+    release_slot(index);
+}
+
+#undef TAG
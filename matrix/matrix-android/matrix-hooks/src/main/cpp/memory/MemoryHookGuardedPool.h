@@ -0,0 +1,54 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 采样的保护页分配器 (GWP-ASan 方式): 每 N 次 malloc 抽一次, 从预留的池中分配一个单页 slot,
+// slot 两侧都是 PROT_NONE 的保护页, 释放后 slot 本身也变为 PROT_NONE.
+// 越界和释放后使用会直接触发 SIGSEGV, 由信号处理函数输出分配/释放堆栈后交给原处理函数.
+//
+// 池中的指针必须由 hook 后的 free/realloc 释放, 不能交给 libc. malloc_usable_size 也需经过 hook,
+// libc 内部会 realloc 调用方缓冲的 getline / getdelim 在调用原函数前把池中的缓冲换出
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKGUARDEDPOOL_H
+#define LIBMATRIX_HOOK_MEMORYHOOKGUARDEDPOOL_H
+
+#include <cstddef>
+
+/**
+ * 只能调用一次, 池一旦建立不再释放
+ * @param __slot_count 同时存活的采样分配上限
+ * @param __sample_rate 平均每 __sample_rate 次 malloc 采一次
+ */
+bool guarded_pool_init(size_t __slot_count, size_t __sample_rate);
+
+bool guarded_pool_enabled();
+
+/**
+ * @return 未采中, 超过一页或池满时返回 nullptr, 由调用方走原始分配
+ */
+void *guarded_pool_malloc(size_t __size);
+
+bool guarded_pool_owns(const void *__ptr);
+
+size_t guarded_pool_usable_size(const void *__ptr);
+
+/**
+ * 重复释放或释放非起始地址时输出报告并 abort
+ */
+void guarded_pool_free(void *__ptr);
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKGUARDEDPOOL_H
@@ -17,10 +17,15 @@
 //
 // Created by Yves on 2019-08-08.
 //
+#include <cstring>
 #include <jni.h>
 #include "xhook.h"
 #include "MemoryHookFunctions.h"
 #include "MemoryHook.h"
+#include "MemoryHookGuardedPool.h"
+#include "MemoryHookThreadGroup.h"
+#include "MemoryHookSizeClass.h"
+#include "MemoryHookStatsPage.h"
 #include "xh_errno.h"
 #include "HookCommon.h"
 
@@ -29,91 +34,154 @@ extern "C" {
 #endif
 // @formatter:off
 const HookFunction HOOK_MALL_FUNCTIONS[] = {
-        {"malloc", (void *) h_malloc, NULL},
-        {"calloc", (void *) h_calloc, NULL},
-        {"realloc", (void *) h_realloc, NULL},
-        {"free", (void *) h_free, NULL},
-        {"memalign", (void *) HANDLER_FUNC_NAME(memalign), NULL},
-        {"posix_memalign", (void *) HANDLER_FUNC_NAME(posix_memalign), NULL},
-        // CXX functions
+        HOOK_FUNCTION(malloc),
+        HOOK_FUNCTION(calloc),
+        HOOK_FUNCTION(realloc),
+        HOOK_FUNCTION(reallocarray),
+        HOOK_FUNCTION(free),
+        HOOK_FUNCTION(memalign),
+        HOOK_FUNCTION(posix_memalign),
+        HOOK_FUNCTION(strdup),
+        HOOK_FUNCTION(strndup),
+        HOOK_FUNCTION(getline),
+        HOOK_FUNCTION(getdelim),
+};
+
+// 原函数从 libc++_shared.so 中解析, 找不到的不注册
+static const HookFunction HOOK_CXX_FUNCTIONS[] = {
 #ifndef __LP64__
-        {"_Znwj",                               (void*) HANDLER_FUNC_NAME(_Znwj), NULL},
-        {"_ZnwjSt11align_val_t",                (void*) HANDLER_FUNC_NAME(_ZnwjSt11align_val_t), NULL},
-        {"_ZnwjSt11align_val_tRKSt9nothrow_t",  (void*) HANDLER_FUNC_NAME(_ZnwjSt11align_val_tRKSt9nothrow_t), NULL},
-        {"_ZnwjRKSt9nothrow_t",                 (void*) HANDLER_FUNC_NAME(_ZnwjRKSt9nothrow_t), NULL},
-
-        {"_Znaj",                               (void*) HANDLER_FUNC_NAME(_Znaj), NULL},
-        {"_ZnajSt11align_val_t",                (void*) HANDLER_FUNC_NAME(_ZnajSt11align_val_t), NULL},
-        {"_ZnajSt11align_val_tRKSt9nothrow_t",  (void*) HANDLER_FUNC_NAME(_ZnajSt11align_val_tRKSt9nothrow_t), NULL},
-        {"_ZnajRKSt9nothrow_t",                 (void*) HANDLER_FUNC_NAME(_ZnajRKSt9nothrow_t), NULL},
-
-        {"_ZdlPvj",                             (void*) HANDLER_FUNC_NAME(_ZdlPvj), NULL},
-        {"_ZdlPvjSt11align_val_t",              (void*) HANDLER_FUNC_NAME(_ZdlPvjSt11align_val_t), NULL},
-        {"_ZdaPvj",                             (void*) HANDLER_FUNC_NAME(_ZdaPvj), NULL},
-        {"_ZdaPvjSt11align_val_t",              (void*) HANDLER_FUNC_NAME(_ZdaPvjSt11align_val_t), NULL},
+        HOOK_FUNCTION(_Znwj),
+        HOOK_FUNCTION(_ZnwjSt11align_val_t),
+        HOOK_FUNCTION(_ZnwjSt11align_val_tRKSt9nothrow_t),
+        HOOK_FUNCTION(_ZnwjRKSt9nothrow_t),
+
+        HOOK_FUNCTION(_Znaj),
+        HOOK_FUNCTION(_ZnajSt11align_val_t),
+        HOOK_FUNCTION(_ZnajSt11align_val_tRKSt9nothrow_t),
+        HOOK_FUNCTION(_ZnajRKSt9nothrow_t),
+
+        HOOK_FUNCTION(_ZdlPvj),
+        HOOK_FUNCTION(_ZdlPvjSt11align_val_t),
+        HOOK_FUNCTION(_ZdaPvj),
+        HOOK_FUNCTION(_ZdaPvjSt11align_val_t),
 #else
-        {"_Znwm",                               (void*) HANDLER_FUNC_NAME(_Znwm), NULL},
-        {"_ZnwmSt11align_val_t",                (void*) HANDLER_FUNC_NAME(_ZnwmSt11align_val_t), NULL},
-        {"_ZnwmSt11align_val_tRKSt9nothrow_t",  (void*) HANDLER_FUNC_NAME(_ZnwmSt11align_val_tRKSt9nothrow_t), NULL},
-        {"_ZnwmRKSt9nothrow_t",                 (void*) HANDLER_FUNC_NAME(_ZnwmRKSt9nothrow_t), NULL},
-
-        {"_Znam",                               (void*) HANDLER_FUNC_NAME(_Znam), NULL},
-        {"_ZnamSt11align_val_t",                (void*) HANDLER_FUNC_NAME(_ZnamSt11align_val_t), NULL},
-        {"_ZnamSt11align_val_tRKSt9nothrow_t",  (void*) HANDLER_FUNC_NAME(_ZnamSt11align_val_tRKSt9nothrow_t), NULL},
-        {"_ZnamRKSt9nothrow_t",                 (void*) HANDLER_FUNC_NAME(_ZnamRKSt9nothrow_t), NULL},
-
-        {"_ZdlPvm",                             (void*) HANDLER_FUNC_NAME(_ZdlPvm), NULL},
-        {"_ZdlPvmSt11align_val_t",              (void*) HANDLER_FUNC_NAME(_ZdlPvmSt11align_val_t), NULL},
-        {"_ZdaPvm",                             (void*) HANDLER_FUNC_NAME(_ZdaPvm), NULL},
-        {"_ZdaPvmSt11align_val_t",              (void*) HANDLER_FUNC_NAME(_ZdaPvmSt11align_val_t), NULL},
+        HOOK_FUNCTION(_Znwm),
+        HOOK_FUNCTION(_ZnwmSt11align_val_t),
+        HOOK_FUNCTION(_ZnwmSt11align_val_tRKSt9nothrow_t),
+        HOOK_FUNCTION(_ZnwmRKSt9nothrow_t),
+
+        HOOK_FUNCTION(_Znam),
+        HOOK_FUNCTION(_ZnamSt11align_val_t),
+        HOOK_FUNCTION(_ZnamSt11align_val_tRKSt9nothrow_t),
+        HOOK_FUNCTION(_ZnamRKSt9nothrow_t),
+
+        HOOK_FUNCTION(_ZdlPvm),
+        HOOK_FUNCTION(_ZdlPvmSt11align_val_t),
+        HOOK_FUNCTION(_ZdaPvm),
+        HOOK_FUNCTION(_ZdaPvmSt11align_val_t),
 #endif
-        {"_ZdlPv",                              (void*) HANDLER_FUNC_NAME(_ZdlPv), NULL},
-        {"_ZdlPvSt11align_val_t",               (void*) HANDLER_FUNC_NAME(_ZdlPvSt11align_val_t), NULL},
-        {"_ZdlPvSt11align_val_tRKSt9nothrow_t", (void*) HANDLER_FUNC_NAME(_ZdlPvSt11align_val_tRKSt9nothrow_t), NULL},
-        {"_ZdlPvRKSt9nothrow_t",                (void*) HANDLER_FUNC_NAME(_ZdlPvRKSt9nothrow_t), NULL},
-
-        {"_ZdaPv",                              (void*) HANDLER_FUNC_NAME(_ZdaPv), NULL},
-        {"_ZdaPvSt11align_val_t",               (void*) HANDLER_FUNC_NAME(_ZdaPvSt11align_val_t), NULL},
-        {"_ZdaPvSt11align_val_tRKSt9nothrow_t", (void*) HANDLER_FUNC_NAME(_ZdaPvSt11align_val_tRKSt9nothrow_t), NULL},
-        {"_ZdaPvRKSt9nothrow_t",                (void*) HANDLER_FUNC_NAME(_ZdaPvRKSt9nothrow_t), NULL},
-
-        {"strdup", (void*) HANDLER_FUNC_NAME(strdup), (void **) ORIGINAL_FUNC_NAME(strdup)},
-        {"strndup", (void*) HANDLER_FUNC_NAME(strndup), (void **) ORIGINAL_FUNC_NAME(strndup)},
+        HOOK_FUNCTION(_ZdlPv),
+        HOOK_FUNCTION(_ZdlPvSt11align_val_t),
+        HOOK_FUNCTION(_ZdlPvSt11align_val_tRKSt9nothrow_t),
+        HOOK_FUNCTION(_ZdlPvRKSt9nothrow_t),
+
+        HOOK_FUNCTION(_ZdaPv),
+        HOOK_FUNCTION(_ZdaPvSt11align_val_t),
+        HOOK_FUNCTION(_ZdaPvSt11align_val_tRKSt9nothrow_t),
+        HOOK_FUNCTION(_ZdaPvRKSt9nothrow_t),
 };
 
+// 除 mmap 外的 handler 直接调用 libc, 不经过原函数指针
 static const HookFunction HOOK_MMAP_FUNCTIONS[] = {
+#if defined(__USE_FILE_OFFSET64)
         {"mmap", (void *) h_mmap, NULL},
+#else
+        HOOK_FUNCTION(mmap),
+#endif
         {"munmap", (void *) h_munmap, NULL},
         {"mremap", (void *) h_mremap, NULL},
 #if __ANDROID_API__ >= __ANDROID_API_L__
         {"mmap64", (void *) h_mmap64, NULL},
 #endif
 };
+// 池中的指针可能被其他 so 释放或查询大小, 开启保护页采样后所有 so 的这些调用都要经过 hook, 不受 ignore 影响.
+// libc 内部的 realloc/free 不经过 PLT: 会改写调用方缓冲的 getline / getdelim 先把池中的缓冲换出;
+// 其余 libc 接口只释放自己分配的内存, 不会拿到池中的指针
+static const HookFunction HOOK_GUARDED_RELEASE_FUNCTIONS[] = {
+        HOOK_FUNCTION(free),
+        HOOK_FUNCTION(realloc),
+        HOOK_FUNCTION(reallocarray),
+        HOOK_FUNCTION(malloc_usable_size),
+        HOOK_FUNCTION(getline),
+        HOOK_FUNCTION(getdelim),
+};
 // @formatter:on
 
 bool enable_mmap_hook = false;
 
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+
+/**
+ * 在注册任何 hook 之前解析所有原函数, 之后 handler 中不再需要判空
+ */
+static void resolve_origins() {
+    resolve_hook_functions("libc.so", HOOK_MALL_FUNCTIONS, ARRAY_SIZE(HOOK_MALL_FUNCTIONS));
+    resolve_hook_functions("libc++_shared.so", HOOK_CXX_FUNCTIONS, ARRAY_SIZE(HOOK_CXX_FUNCTIONS));
+    resolve_cxx_runtime();
+    resolve_hook_functions("libc.so", HOOK_MMAP_FUNCTIONS, ARRAY_SIZE(HOOK_MMAP_FUNCTIONS));
+    if (guarded_pool_enabled()) {
+        resolve_hook_functions("libc.so", HOOK_GUARDED_RELEASE_FUNCTIONS,
+                               ARRAY_SIZE(HOOK_GUARDED_RELEASE_FUNCTIONS));
+    }
+}
+
 static void hook(const char *regex) {
 
     for (auto f : HOOK_MALL_FUNCTIONS) {
-        xhook_register(regex, f.name, f.handler_ptr, f.origin_ptr);
+        if (hook_function_ready(f)) {
+            xhook_register(regex, f.name, f.handler_ptr, f.origin_ptr);
+        }
+    }
+    for (auto f : HOOK_CXX_FUNCTIONS) {
+        if (hook_function_ready(f)) {
+            xhook_register(regex, f.name, f.handler_ptr, f.origin_ptr);
+        }
     }
     LOGD(TAG, "mmap enabled ? %d", enable_mmap_hook);
     if (enable_mmap_hook) {
         for (auto f: HOOK_MMAP_FUNCTIONS) {
-            xhook_register(regex, f.name, f.handler_ptr, f.origin_ptr);
+            if (hook_function_ready(f)) {
+                xhook_register(regex, f.name, f.handler_ptr, f.origin_ptr);
+            }
+        }
+    }
+}
+
+static bool is_guarded_release(const HookFunction &f) {
+    for (auto g : HOOK_GUARDED_RELEASE_FUNCTIONS) {
+        if (strcmp(f.name, g.name) == 0) {
+            return true;
         }
     }
+    return false;
 }
 
 static void ignore(const char *regex) {
 
     for (auto f : HOOK_MALL_FUNCTIONS) {
+        // 被忽略的 so 也可能释放池中的指针
+        if (guarded_pool_enabled() && is_guarded_release(f)) {
+            continue;
+        }
+        xhook_ignore(regex, f.name);
+    }
+
+    for (auto f : HOOK_CXX_FUNCTIONS) {
         xhook_ignore(regex, f.name);
     }
 
     if (enable_mmap_hook) {
-        for (auto f : HOOK_MALL_FUNCTIONS) {
+        for (auto f : HOOK_MMAP_FUNCTIONS) {
             xhook_ignore(regex, f.name);
         }
     }
@@ -131,6 +199,9 @@ JNIEXPORT void JNICALL
 Java_com_tencent_matrix_hook_memory_MemoryHook_addHookSoNative(JNIEnv *env, jobject instance,
                                                               jobjectArray hookSoList) {
 
+    resolve_origins();
+    size_class_init();
+
     jsize size = env->GetArrayLength(hookSoList);
 
     for (int i = 0; i < size; ++i) {
@@ -139,8 +210,16 @@ Java_com_tencent_matrix_hook_memory_MemoryHook_addHookSoNative(JNIEnv *env, jobj
         hook(regex);
         env->ReleaseStringUTFChars(jregex, regex);
     }
+    if (guarded_pool_enabled()) {
+        for (auto f : HOOK_GUARDED_RELEASE_FUNCTIONS) {
+            if (hook_function_ready(f)) {
+                xhook_register(".*\\.so$", f.name, f.handler_ptr, f.origin_ptr);
+            }
+        }
+    }
     add_hook_init_callback(memory_hook_init);
     add_dlopen_hook_callback(memory_hook_on_dlopen);
+    add_dlclose_hook_callback(memory_hook_on_dlclose);
 }
 
 JNIEXPORT void JNICALL
@@ -171,6 +250,15 @@ Java_com_tencent_matrix_hook_memory_MemoryHook_setSamplingNative(JNIEnv *env,
 
 }
 
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_setSamplingIntervalBytesNative(JNIEnv *env,
+                                                                             jobject instance,
+                                                                             jint interval) {
+
+    set_sampling_interval_bytes((size_t) interval);
+
+}
+
 JNIEXPORT void JNICALL
 Java_com_tencent_matrix_hook_memory_MemoryHook_setSampleSizeRangeNative(JNIEnv *env,
                                                                        jobject instance,
@@ -183,12 +271,54 @@ Java_com_tencent_matrix_hook_memory_MemoryHook_setSampleSizeRangeNative(JNIEnv *
 
 JNIEXPORT void JNICALL
 Java_com_tencent_matrix_hook_memory_MemoryHook_dumpNative(JNIEnv *env, jobject instance,
-                                                         jstring j_log_path, jstring j_json_path) {
+                                                         jstring j_log_path, jstring j_json_path,
+                                                         jint since_snapshot) {
+
+    const char *log_path  = j_log_path ? env->GetStringUTFChars(j_log_path, nullptr) : nullptr;
+    const char *json_path = j_json_path ? env->GetStringUTFChars(j_json_path, nullptr) : nullptr;
+
+    dump(enable_mmap_hook, log_path, json_path, (uint32_t) since_snapshot);
+
+    if (j_log_path) {
+        env->ReleaseStringUTFChars(j_log_path, log_path);
+    }
+    if (j_json_path) {
+        env->ReleaseStringUTFChars(j_json_path, json_path);
+    }
+}
+
+JNIEXPORT jint JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_takeSnapshotNative(JNIEnv *env, jobject instance) {
+    return (jint) memory_hook_snapshot();
+}
+
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_dumpDiffNative(JNIEnv *env, jobject instance,
+                                                             jstring j_log_path,
+                                                             jstring j_json_path) {
+
+    const char *log_path  = j_log_path ? env->GetStringUTFChars(j_log_path, nullptr) : nullptr;
+    const char *json_path = j_json_path ? env->GetStringUTFChars(j_json_path, nullptr) : nullptr;
+
+    dump_diff(log_path, json_path);
+
+    if (j_log_path) {
+        env->ReleaseStringUTFChars(j_log_path, log_path);
+    }
+    if (j_json_path) {
+        env->ReleaseStringUTFChars(j_json_path, json_path);
+    }
+}
+
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_dumpUnreachableNative(JNIEnv *env, jobject instance,
+                                                                    jstring j_log_path,
+                                                                    jstring j_json_path) {
 
     const char *log_path  = j_log_path ? env->GetStringUTFChars(j_log_path, nullptr) : nullptr;
     const char *json_path = j_json_path ? env->GetStringUTFChars(j_json_path, nullptr) : nullptr;
 
-    dump(enable_mmap_hook, log_path, json_path);
+    dump_unreachable(log_path, json_path);
 
     if (j_log_path) {
         env->ReleaseStringUTFChars(j_log_path, log_path);
@@ -208,6 +338,70 @@ Java_com_tencent_matrix_hook_memory_MemoryHook_enableMmapHookNative(JNIEnv *env,
 
 }
 
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_enableCallerSamplingNative(JNIEnv *env,
+                                                                         jobject instance,
+                                                                         jboolean enable) {
+    enable_caller_sampling(enable);
+}
+
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_enableEventBufferNative(JNIEnv *env,
+                                                                     jobject instance,
+                                                                     jboolean enable) {
+    enable_event_buffer(enable);
+}
+
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_enableLifetimeProfileNative(JNIEnv *env,
+                                                                          jobject instance,
+                                                                          jboolean enable) {
+    enable_lifetime_profile(enable);
+}
+
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_enableReallocReattributeNative(JNIEnv *env,
+                                                                             jobject instance,
+                                                                             jboolean enable) {
+    enable_realloc_reattribute(enable);
+}
+
+JNIEXPORT jboolean JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_enableGuardedAllocNative(JNIEnv *env,
+                                                                       jobject instance,
+                                                                       jint slot_count,
+                                                                       jint sample_rate) {
+    return guarded_pool_init((size_t) slot_count, (size_t) sample_rate);
+}
+
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_addThreadGroupNative(JNIEnv *env,
+                                                                   jobject instance,
+                                                                   jobjectArray threadGroups) {
+    if (!threadGroups) {
+        return;
+    }
+
+    jsize size = env->GetArrayLength(threadGroups);
+
+    for (int i = 0; i < size; ++i) {
+        auto       jregex = (jstring) env->GetObjectArrayElement(threadGroups, i);
+        const char *regex = env->GetStringUTFChars(jregex, NULL);
+        thread_group_add(regex);
+        env->ReleaseStringUTFChars(jregex, regex);
+    }
+}
+
+JNIEXPORT jobject JNICALL
+Java_com_tencent_matrix_hook_memory_MemoryHook_enableStatsPageNative(JNIEnv *env,
+                                                                    jobject instance) {
+    memory_stats_page_t *page = stats_page_init();
+    if (!page) {
+        return NULL;
+    }
+    return env->NewDirectByteBuffer(page, (jlong) stats_page_size());
+}
+
 JNIEXPORT void JNICALL
 Java_com_tencent_matrix_hook_memory_MemoryHook_setStacktraceLogThresholdNative(JNIEnv *env,
                                                                               jobject thiz,
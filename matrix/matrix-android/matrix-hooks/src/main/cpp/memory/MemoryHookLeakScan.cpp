@@ -0,0 +1,801 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 块地址按起始地址排序后每 16 个一组, 查找时先在各组首地址中二分, 再在组内做无分支的计数比较,
+// 组内比较可以被编译器向量化. 标记位用原子交换, 每个块只会被一个线程压栈, 因此每个线程的标记栈
+// 容量取块数即可.
+//
+// 暂停线程: 向每个线程发 LEAK_SCAN_SIGNAL, 信号处理函数保存寄存器和栈顶后在 futex 上等待恢复.
+// 信号处理函数装上后不再卸载, 迟到的信号在扫描结束后直接返回
+//
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include "Log.h"
+#include "MappingName.h"
+#include "MemoryHookLeakScan.h"
+
+#define TAG "Matrix.MemoryHook.LeakScan"
+
+#define LEAK_SCAN_SIGNAL SIGPWR
+#define LEAK_SCAN_MAX_THREADS 4096
+#define LEAK_SCAN_REGS_SIZE 512
+#define LEAK_SCAN_STOP_ROUNDS 8
+#define LEAK_SCAN_STOP_TIMEOUT_MS 2000
+#define LEAK_SCAN_GROUP 16
+#define LEAK_SCAN_CHUNK (256 * 1024)
+#define LEAK_SCAN_READ_BUFFER (64 * 1024)
+
+enum {
+    THREAD_SIGNALED = 1,
+    THREAD_STOPPED,
+    THREAD_RESUMED,
+    THREAD_GONE,
+};
+
+enum {
+    MAPPING_SKIP = 0,
+    MAPPING_ROOT,
+    MAPPING_STACK,
+};
+
+struct leak_thread_t {
+    pid_t            tid;
+    std::atomic<int> state;
+    uintptr_t        sp;
+    uintptr_t        regs[LEAK_SCAN_REGS_SIZE / sizeof(uintptr_t)];
+};
+
+struct linux_dirent64_t {
+    uint64_t       d_ino;
+    int64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+static std::mutex          m_scan_mutex;
+static bool                m_signal_installed = false;
+static struct sigaction    m_old_action;
+static leak_thread_t       *m_threads = nullptr; // 迟到的信号仍会访问, 不释放
+static std::atomic<size_t> m_thread_count(0);
+static std::atomic<int>    m_resume(0);
+static std::atomic<bool>   m_scan_active(false);
+static pid_t               m_pid = 0;
+
+static inline void futex_wait(std::atomic<int> *__addr, int __expected) {
+    syscall(__NR_futex, __addr, FUTEX_WAIT_PRIVATE, __expected, nullptr, nullptr, 0);
+}
+
+static inline void futex_wake(std::atomic<int> *__addr) {
+    syscall(__NR_futex, __addr, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+static inline pid_t current_tid() {
+    return (pid_t) syscall(__NR_gettid);
+}
+
+static inline void sleep_ms(long ms) {
+    timespec ts = {0, ms * 1000000L};
+    nanosleep(&ts, nullptr);
+}
+
+static inline uintptr_t untag(uintptr_t __addr) {
+#if defined(__aarch64__)
+    return __addr & ((1ULL << 56) - 1); // TBI: 堆指针高字节可能带 tag
+#else
+    return __addr;
+#endif
+}
+
+/**
+ * 地址不可读时返回 0 或已读到的字节数
+ */
+static inline size_t safe_read(uintptr_t __addr, void *__buffer, size_t __size) {
+    iovec local  = {__buffer, __size};
+    iovec remote = {(void *) untag(__addr), __size};
+    auto  n      = (ssize_t) syscall(__NR_process_vm_readv, m_pid, &local, 1, &remote, 1, 0);
+    return n > 0 ? (size_t) n : 0;
+}
+
+static inline uintptr_t context_sp(const ucontext_t *__context) {
+#if defined(__aarch64__)
+    return (uintptr_t) __context->uc_mcontext.sp;
+#elif defined(__arm__)
+    return (uintptr_t) __context->uc_mcontext.arm_sp;
+#elif defined(__x86_64__)
+    return (uintptr_t) __context->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+    return (uintptr_t) __context->uc_mcontext.gregs[REG_ESP];
+#else
+    return 0;
+#endif
+}
+
+static void on_scan_signal(int __signal, siginfo_t *__info, void *__context) {
+    if (!m_scan_active.load(std::memory_order_acquire)) {
+        // 扫描已结束, 交给原处理函数
+        if ((m_old_action.sa_flags & SA_SIGINFO) && m_old_action.sa_sigaction) {
+            m_old_action.sa_sigaction(__signal, __info, __context);
+        } else if (!(m_old_action.sa_flags & SA_SIGINFO)
+                   && m_old_action.sa_handler != SIG_DFL && m_old_action.sa_handler != SIG_IGN) {
+            m_old_action.sa_handler(__signal);
+        }
+        return;
+    }
+
+    int    saved_errno = errno;
+    pid_t  tid         = current_tid();
+    size_t count       = m_thread_count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; ++i) {
+        leak_thread_t &thread = m_threads[i];
+        if (thread.tid != tid || thread.state.load(std::memory_order_relaxed) != THREAD_SIGNALED) {
+            continue;
+        }
+        auto context = (const ucontext_t *) __context;
+        __builtin_memcpy(thread.regs, &context->uc_mcontext,
+                         std::min(sizeof(context->uc_mcontext), sizeof(thread.regs)));
+        thread.sp = context_sp(context);
+        thread.state.store(THREAD_STOPPED, std::memory_order_release);
+
+        while (!m_resume.load(std::memory_order_acquire)) {
+            futex_wait(&m_resume, 0);
+        }
+        thread.state.store(THREAD_RESUMED, std::memory_order_release);
+        break;
+    }
+    errno = saved_errno;
+}
+
+static bool install_signal_handler() {
+    if (m_signal_installed) {
+        return true;
+    }
+
+    void *mem = mmap(nullptr, sizeof(leak_thread_t) * LEAK_SCAN_MAX_THREADS,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "install_signal_handler: mmap failed");
+        return false;
+    }
+    name_hook_mapping(mem, sizeof(leak_thread_t) * LEAK_SCAN_MAX_THREADS);
+    m_threads = static_cast<leak_thread_t *>(mem);
+
+    struct sigaction action = {};
+    action.sa_sigaction = on_scan_signal;
+    action.sa_flags     = SA_SIGINFO | SA_RESTART | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    if (0 != sigaction(LEAK_SCAN_SIGNAL, &action, &m_old_action)) {
+        LOGE(TAG, "install_signal_handler: sigaction failed, errno = %d", errno);
+        return false;
+    }
+    m_signal_installed = true;
+    return true;
+}
+
+static inline bool is_known_thread(pid_t __tid) {
+    size_t count = m_thread_count.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        if (m_threads[i].tid == __tid) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * 等待已发信号的线程进入处理函数. 超时的线程保持 THREAD_SIGNALED, 计为未暂停
+ */
+static void wait_stopped() {
+    for (int ms = 0; ms < LEAK_SCAN_STOP_TIMEOUT_MS; ++ms) {
+        bool   pending = false;
+        size_t count   = m_thread_count.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i) {
+            leak_thread_t &thread = m_threads[i];
+            if (thread.state.load(std::memory_order_acquire) != THREAD_SIGNALED) {
+                continue;
+            }
+            if (0 != syscall(__NR_tgkill, m_pid, thread.tid, 0)) {
+                thread.state.store(THREAD_GONE, std::memory_order_relaxed); // 已退出
+            } else {
+                pending = true;
+            }
+        }
+        if (!pending) {
+            return;
+        }
+        sleep_ms(1);
+    }
+}
+
+/**
+ * 不分配内存: 用 getdents64 直接读 /proc/self/task. 暂停期间可能有新线程, 反复枚举直到没有新线程
+ */
+static void stop_threads(pid_t __self, const pid_t *__excluded, size_t __excluded_count) {
+    int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    char buffer[4096];
+    for (int round = 0; round < LEAK_SCAN_STOP_ROUNDS; ++round) {
+        size_t added = 0;
+        lseek(fd, 0, SEEK_SET);
+        for (;;) {
+            long n = syscall(__NR_getdents64, fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                break;
+            }
+            for (long offset = 0; offset < n;) {
+                auto entry = (const linux_dirent64_t *) (buffer + offset);
+                offset += entry->d_reclen;
+
+                pid_t tid = 0;
+                for (const char *c = entry->d_name; *c >= '0' && *c <= '9'; ++c) {
+                    tid = tid * 10 + (*c - '0');
+                }
+                if (tid <= 0 || tid == __self
+                    || std::find(__excluded, __excluded + __excluded_count, tid)
+                       != __excluded + __excluded_count
+                    || is_known_thread(tid)) {
+                    continue;
+                }
+
+                size_t count = m_thread_count.load(std::memory_order_relaxed);
+                if (count == LEAK_SCAN_MAX_THREADS) {
+                    continue;
+                }
+                leak_thread_t &thread = m_threads[count];
+                thread.tid = tid;
+                thread.sp  = 0;
+                thread.state.store(THREAD_SIGNALED, std::memory_order_relaxed);
+                m_thread_count.store(count + 1, std::memory_order_release);
+                if (0 != syscall(__NR_tgkill, m_pid, tid, LEAK_SCAN_SIGNAL)) {
+                    thread.state.store(THREAD_GONE, std::memory_order_relaxed);
+                }
+                added++;
+            }
+        }
+        if (!added) {
+            break;
+        }
+        wait_stopped();
+    }
+    close(fd);
+}
+
+static void resume_threads() {
+    m_resume.store(1, std::memory_order_release);
+    futex_wake(&m_resume);
+
+    // 等各线程离开处理函数, 下次扫描才能复用 slot
+    for (int ms = 0; ms < LEAK_SCAN_STOP_TIMEOUT_MS; ++ms) {
+        bool   pending = false;
+        size_t count   = m_thread_count.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < count; ++i) {
+            if (m_threads[i].state.load(std::memory_order_acquire) == THREAD_STOPPED) {
+                pending = true;
+                break;
+            }
+        }
+        if (!pending) {
+            break;
+        }
+        sleep_ms(1);
+    }
+    m_scan_active.store(false, std::memory_order_release);
+}
+
+static inline bool starts_with(const char *__str, size_t __len, const char *__prefix) {
+    size_t prefix_len = strlen(__prefix);
+    return __len >= prefix_len && 0 == memcmp(__str, __prefix, prefix_len);
+}
+
+static int classify_mapping(const char *__path, size_t __len, bool __readable, bool __writable) {
+    if (!__readable || !__writable) {
+        return MAPPING_SKIP;
+    }
+    // hook 自身的表中都是堆地址. 堆映射仍作为根 (同 libmemunreachable): 已记录的块在 add_root 中
+    // 跳过, 只在被标记后扫描; 未记录的分配 (hook 之前或未 hook 的 so) 可能持有已记录块的指针
+    if (starts_with(__path, __len, HOOK_MAPPING_MAPS_NAME)
+        || starts_with(__path, __len, "[anon:thread signal stack")
+        || starts_with(__path, __len, "[vvar]")
+        || starts_with(__path, __len, "[vsyscall]")) {
+        return MAPPING_SKIP;
+    }
+    // 线程栈只扫描栈顶以上的部分, 栈顶以下是已经失效的栈帧
+    if (starts_with(__path, __len, "[stack")
+        || starts_with(__path, __len, "[anon:stack_and_tls:")) {
+        return MAPPING_STACK;
+    }
+    // 设备内存读取可能有副作用, ashmem 上是 dalvik 堆等普通内存
+    if (starts_with(__path, __len, "/dev/") && !starts_with(__path, __len, "/dev/ashmem")) {
+        return MAPPING_SKIP;
+    }
+    return MAPPING_ROOT;
+}
+
+static inline uintptr_t parse_hex(const char *&__p) {
+    uintptr_t value = 0;
+    for (;; ++__p) {
+        char c = *__p;
+        if (c >= '0' && c <= '9') {
+            value = (value << 4) | (uintptr_t) (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value = (value << 4) | (uintptr_t) (c - 'a' + 10);
+        } else {
+            return value;
+        }
+    }
+}
+
+/**
+ * 暂停前估算 /proc/self/maps 的大小, 用于预先分配缓冲
+ */
+static bool measure_maps(size_t *__bytes, size_t *__lines) {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    char    buffer[4096];
+    ssize_t n;
+    *__bytes = 0;
+    *__lines = 0;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        *__bytes += n;
+        *__lines += std::count(buffer, buffer + n, '\n');
+    }
+    close(fd);
+    return *__bytes > 0;
+}
+
+static __attribute__((noinline)) uintptr_t current_frame() {
+    return (uintptr_t) __builtin_frame_address(0);
+}
+
+leak_scanner::leak_scanner(size_t __capacity)
+        : m_own(), m_own_count(0), m_capacity(__capacity), m_blocks(nullptr), m_block_count(0),
+          m_starts(nullptr), m_ends(nullptr), m_pivots(nullptr), m_pivot_count(0),
+          m_marks(nullptr), m_min_start(UINTPTR_MAX), m_max_end(0),
+          m_maps_buffer(nullptr), m_maps_buffer_size(0),
+          m_mappings(nullptr), m_mapping_capacity(0), m_mapping_count(0),
+          m_regions(nullptr), m_region_capacity(0), m_region_count(0), m_chunk_total(0),
+          m_next_chunk(0), m_worker_count(0), m_mark_stacks(nullptr), m_read_buffers(nullptr),
+          m_workers_ready(0), m_workers_go(0), m_workers_done(0), m_worker_tids(),
+          m_result() {
+    if (!m_capacity || m_capacity > UINT32_MAX) {
+        return;
+    }
+    size_t group_capacity = (m_capacity + LEAK_SCAN_GROUP - 1) / LEAK_SCAN_GROUP;
+    m_blocks = static_cast<leak_block_t *>(map_buffer(m_capacity * sizeof(leak_block_t)));
+    m_starts = static_cast<uintptr_t *>(map_buffer(
+            group_capacity * LEAK_SCAN_GROUP * sizeof(uintptr_t)));
+    m_ends   = static_cast<uintptr_t *>(map_buffer(m_capacity * sizeof(uintptr_t)));
+    m_pivots = static_cast<uintptr_t *>(map_buffer(group_capacity * sizeof(uintptr_t)));
+    m_marks  = static_cast<std::atomic<uint8_t> *>(map_buffer(m_capacity));
+}
+
+leak_scanner::~leak_scanner() {
+    for (size_t i = 0; i < m_own_count; ++i) {
+        if (m_own[i].addr != m_threads) {
+            munmap(m_own[i].addr, m_own[i].size);
+        }
+    }
+}
+
+void *leak_scanner::map_buffer(size_t __size) {
+    if (m_own_count == MAX_OWN_REGIONS) {
+        return nullptr;
+    }
+    size_t page_size = (size_t) getpagesize();
+    size_t size      = (__size + page_size - 1) & ~(page_size - 1);
+    void   *mem      = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "map_buffer: mmap %zu failed", size);
+        return nullptr;
+    }
+    name_hook_mapping(mem, size);
+    m_own[m_own_count++] = {mem, size};
+    return mem;
+}
+
+void leak_scanner::add_block(const void *__ptr, size_t __size, uint64_t __stack_hash,
+                             void *__caller) {
+    if (m_block_count == m_capacity) {
+        m_result.truncated = true;
+        return;
+    }
+    m_blocks[m_block_count++] = {(uintptr_t) __ptr, __size, __stack_hash, __caller};
+}
+
+void leak_scanner::prepare_index() {
+    std::sort(m_blocks, m_blocks + m_block_count, [](const leak_block_t &l, const leak_block_t &r) {
+        return l.start < r.start;
+    });
+    // 迁移中的 key 可能出现两次
+    m_block_count = std::unique(m_blocks, m_blocks + m_block_count,
+                                [](const leak_block_t &l, const leak_block_t &r) {
+                                    return l.start == r.start;
+                                }) - m_blocks;
+
+    for (size_t i = 0; i < m_block_count; ++i) {
+        m_starts[i] = m_blocks[i].start;
+        m_ends[i]   = m_blocks[i].start + std::max(m_blocks[i].size, (size_t) 1);
+        m_max_end   = std::max(m_max_end, m_ends[i]);
+    }
+    m_pivot_count = (m_block_count + LEAK_SCAN_GROUP - 1) / LEAK_SCAN_GROUP;
+    for (size_t i = m_block_count; i < m_pivot_count * LEAK_SCAN_GROUP; ++i) {
+        m_starts[i] = UINTPTR_MAX;
+    }
+    for (size_t g = 0; g < m_pivot_count; ++g) {
+        m_pivots[g] = m_starts[g * LEAK_SCAN_GROUP];
+    }
+    m_min_start = m_block_count ? m_starts[0] : UINTPTR_MAX;
+}
+
+inline ssize_t leak_scanner::find_block(uintptr_t __value) const {
+    if (__value < m_min_start || __value >= m_max_end) {
+        return -1;
+    }
+
+    // 最后一个首地址 <= __value 的组, m_pivots[0] == m_min_start 一定满足
+    size_t lo = 0;
+    size_t hi = m_pivot_count;
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (m_pivots[mid] <= __value) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    const uintptr_t *group = m_starts + lo * LEAK_SCAN_GROUP;
+    size_t          count  = 0;
+    for (size_t k = 0; k < LEAK_SCAN_GROUP; ++k) {
+        count += group[k] <= __value;
+    }
+    size_t index = lo * LEAK_SCAN_GROUP + count - 1;
+    return __value < m_ends[index] ? (ssize_t) index : -1;
+}
+
+bool leak_scanner::read_mappings() {
+    int fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    size_t  used = 0;
+    ssize_t n;
+    while (used < m_maps_buffer_size
+           && (n = read(fd, m_maps_buffer + used, m_maps_buffer_size - used)) > 0) {
+        used += n;
+    }
+    close(fd);
+
+    m_mapping_count = 0;
+    const char *p   = m_maps_buffer;
+    const char *end = m_maps_buffer + used;
+    while (p < end && m_mapping_count < m_mapping_capacity) {
+        const char *line_end = (const char *) memchr(p, '\n', end - p);
+        if (!line_end) {
+            break; // 缓冲不够时丢弃不完整的最后一行
+        }
+
+        mapping_t &mapping = m_mappings[m_mapping_count];
+        mapping.start = parse_hex(p);
+        ++p; // '-'
+        mapping.end = parse_hex(p);
+        ++p; // ' '
+        bool readable = p[0] == 'r';
+        bool writable = p[1] == 'w';
+
+        // 跳过 perms, offset, dev, inode 四列
+        for (int column = 0; column < 4 && p < line_end; ++column) {
+            while (p < line_end && *p != ' ') ++p;
+            while (p < line_end && *p == ' ') ++p;
+        }
+        mapping.kind = classify_mapping(p, line_end - p, readable, writable);
+        m_mapping_count++;
+        p = line_end + 1;
+    }
+    return m_mapping_count > 0;
+}
+
+void leak_scanner::add_region(uintptr_t __start, uintptr_t __end, bool __exclude_blocks) {
+    if (__start >= __end || m_region_count == m_region_capacity) {
+        return;
+    }
+    m_regions[m_region_count++] = {__start, __end, 0, __exclude_blocks};
+    m_result.root_size += __end - __start;
+}
+
+void leak_scanner::add_root(uintptr_t __start, uintptr_t __end) {
+    // 扫描器自身的缓冲中都是块地址, 不能作为根
+    for (size_t i = 0; i < m_own_count && __start < __end; ++i) {
+        auto own_start = (uintptr_t) m_own[i].addr;
+        auto own_end   = own_start + m_own[i].size;
+        if (own_end <= __start || own_start >= __end) {
+            continue;
+        }
+        if (own_start > __start) {
+            add_root(__start, own_start);
+        }
+        __start = own_end;
+    }
+    add_region(__start, __end, true);
+}
+
+void leak_scanner::add_thread_roots(uintptr_t __self_sp) {
+    auto add_stack = [this](uintptr_t sp) {
+        const mapping_t *mapping = std::upper_bound(
+                m_mappings, m_mappings + m_mapping_count, sp,
+                [](uintptr_t addr, const mapping_t &m) { return addr < m.start; });
+        if (mapping == m_mappings) {
+            return;
+        }
+        --mapping;
+        // 未命名的栈已整体作为根
+        if (sp < mapping->end && mapping->kind == MAPPING_STACK) {
+            add_region(sp, mapping->end, true);
+        }
+    };
+
+    size_t count = m_thread_count.load(std::memory_order_acquire);
+    for (size_t i = 0; i < count; ++i) {
+        leak_thread_t &thread = m_threads[i];
+        int           state   = thread.state.load(std::memory_order_acquire);
+        if (state == THREAD_STOPPED) {
+            add_region((uintptr_t) thread.regs, (uintptr_t) thread.regs + sizeof(thread.regs),
+                       false);
+            add_stack(thread.sp);
+            m_result.thread_count++;
+        } else if (state == THREAD_SIGNALED) {
+            m_result.unstopped_count++;
+        }
+    }
+    add_stack(__self_sp);
+}
+
+void leak_scanner::scan_range(uintptr_t __start, uintptr_t __end, size_t __worker, size_t &__top) {
+    static const uintptr_t page_size = (uintptr_t) getpagesize();
+
+    auto     buffer = m_read_buffers + __worker * LEAK_SCAN_READ_BUFFER;
+    uint32_t *stack = m_mark_stacks + __worker * m_capacity;
+
+    uintptr_t pos = (__start + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+    while (pos + sizeof(uintptr_t) <= __end) {
+        size_t want  = std::min((size_t) (__end - pos), (size_t) LEAK_SCAN_READ_BUFFER);
+        size_t got   = safe_read(pos, buffer, want & ~(sizeof(uintptr_t) - 1));
+        size_t words = got / sizeof(uintptr_t);
+        if (!words) {
+            pos = (pos + page_size) & ~(page_size - 1); // 跳过不可读的页
+            continue;
+        }
+
+        auto values = reinterpret_cast<const uintptr_t *>(buffer);
+        for (size_t i = 0; i < words; ++i) {
+            ssize_t index = find_block(values[i]);
+            if (index < 0
+                || m_marks[index].load(std::memory_order_relaxed)
+                || m_marks[index].exchange(1, std::memory_order_relaxed)) {
+                continue;
+            }
+            stack[__top++] = (uint32_t) index;
+        }
+        pos += words * sizeof(uintptr_t);
+    }
+}
+
+void leak_scanner::scan_root(const region_t &__region, uintptr_t __start, uintptr_t __end,
+                             size_t __worker, size_t &__top) {
+    if (!__region.exclude_blocks) {
+        scan_range(__start, __end, __worker, __top);
+        return;
+    }
+
+    // 根区域中落在已记录块内的部分跳过 (如分配器直接 mmap 的大块), 块的内容只在被标记后扫描
+    size_t    index = std::upper_bound(m_ends, m_ends + m_block_count, __start) - m_ends;
+    uintptr_t pos   = __start;
+    while (pos < __end) {
+        if (index >= m_block_count || m_blocks[index].start >= __end) {
+            scan_range(pos, __end, __worker, __top);
+            break;
+        }
+        if (m_blocks[index].start > pos) {
+            scan_range(pos, m_blocks[index].start, __worker, __top);
+        }
+        pos = std::max(pos, m_ends[index]);
+        ++index;
+    }
+}
+
+void leak_scanner::drain(size_t __worker, size_t &__top) {
+    uint32_t *stack = m_mark_stacks + __worker * m_capacity;
+    while (__top) {
+        const leak_block_t &block = m_blocks[stack[--__top]];
+        scan_range(block.start, block.start + block.size, __worker, __top);
+    }
+}
+
+void leak_scanner::worker_main(size_t __worker) {
+    m_worker_tids[__worker] = current_tid();
+    m_workers_ready.fetch_add(1, std::memory_order_release);
+
+    int go;
+    while (!(go = m_workers_go.load(std::memory_order_acquire))) {
+        futex_wait(&m_workers_go, 0);
+    }
+
+    if (go == 1) {
+        size_t top = 0;
+        for (;;) {
+            size_t chunk = m_next_chunk.fetch_add(1, std::memory_order_relaxed);
+            if (chunk >= m_chunk_total) {
+                break;
+            }
+            const region_t *region = std::upper_bound(
+                    m_regions, m_regions + m_region_count, chunk,
+                    [](size_t c, const region_t &r) { return c < r.chunk_begin; }) - 1;
+            uintptr_t start = region->start + (chunk - region->chunk_begin) * LEAK_SCAN_CHUNK;
+            uintptr_t end   = std::min(start + LEAK_SCAN_CHUNK, region->end);
+            scan_root(*region, start, end, __worker, top);
+            drain(__worker, top);
+        }
+    }
+
+    m_workers_done.fetch_add(1, std::memory_order_release);
+    futex_wake(&m_workers_done);
+}
+
+bool leak_scanner::scan(size_t __worker_count,
+                        const std::function<void(leak_scanner &)> &__collect) {
+    std::lock_guard<std::mutex> scan_lock(m_scan_mutex);
+
+    m_result = {};
+    if (!m_blocks || !m_starts || !m_ends || !m_pivots || !m_marks) {
+        LOGE(TAG, "scan: buffers not allocated, capacity = %zu", m_capacity);
+        return false;
+    }
+    if (!install_signal_handler()) {
+        return false;
+    }
+
+    m_pid = getpid();
+    uintptr_t probe = 1;
+    uintptr_t copy  = 0;
+    if (safe_read((uintptr_t) &probe, &copy, sizeof(copy)) != sizeof(copy) || copy != probe) {
+        LOGE(TAG, "scan: process_vm_readv unavailable, errno = %d", errno);
+        return false;
+    }
+
+    // 暂停前分配所有缓冲
+    size_t maps_bytes = 0;
+    size_t maps_lines = 0;
+    if (!measure_maps(&maps_bytes, &maps_lines)) {
+        LOGE(TAG, "scan: read maps failed");
+        return false;
+    }
+    m_worker_count = __worker_count ? __worker_count : std::thread::hardware_concurrency();
+    m_worker_count = std::max((size_t) 1, std::min(m_worker_count, MAX_WORKERS));
+
+    m_maps_buffer_size = maps_bytes * 2 + 64 * 1024;
+    m_mapping_capacity = maps_lines * 2 + 1024;
+    m_region_capacity  = m_mapping_capacity + MAX_OWN_REGIONS + 2 * LEAK_SCAN_MAX_THREADS + 1;
+    m_maps_buffer  = static_cast<char *>(map_buffer(m_maps_buffer_size));
+    m_mappings     = static_cast<mapping_t *>(map_buffer(m_mapping_capacity * sizeof(mapping_t)));
+    m_regions      = static_cast<region_t *>(map_buffer(m_region_capacity * sizeof(region_t)));
+    m_mark_stacks  = static_cast<uint32_t *>(map_buffer(
+            m_worker_count * m_capacity * sizeof(uint32_t)));
+    m_read_buffers = static_cast<uint8_t *>(map_buffer(m_worker_count * LEAK_SCAN_READ_BUFFER));
+    if (!m_maps_buffer || !m_mappings || !m_regions || !m_mark_stacks || !m_read_buffers
+        || m_own_count == MAX_OWN_REGIONS) {
+        LOGE(TAG, "scan: allocate buffers failed");
+        return false;
+    }
+    m_own[m_own_count++] = {m_threads, sizeof(leak_thread_t) * LEAK_SCAN_MAX_THREADS};
+    // 未命名的 hook 映射会被当作根, 其中的块地址会让所有块都可达
+    if (!hook_mappings_named()) {
+        LOGE(TAG, "scan: hook mappings are not named, results would be unreliable");
+        return false;
+    }
+
+    m_thread_count.store(0, std::memory_order_relaxed);
+    m_resume.store(0, std::memory_order_relaxed);
+    m_scan_active.store(true, std::memory_order_release);
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < m_worker_count; ++i) {
+        workers.emplace_back(&leak_scanner::worker_main, this, i);
+    }
+    while ((size_t) m_workers_ready.load(std::memory_order_acquire) < m_worker_count) {
+        sched_yield();
+    }
+
+    // 调用方的寄存器压到栈上, 从更深一层的栈帧开始扫描本线程的栈
+    __builtin_unwind_init();
+    uintptr_t self_sp = current_frame();
+
+    stop_threads(current_tid(), m_worker_tids, m_worker_count);
+
+    // ---- 暂停期间: 不分配内存, 不加锁, 不输出日志 ----
+    __collect(*this);
+    prepare_index();
+
+    bool mapped = read_mappings();
+    if (mapped) {
+        for (size_t i = 0; i < m_mapping_count; ++i) {
+            if (m_mappings[i].kind == MAPPING_ROOT) {
+                add_root(m_mappings[i].start, m_mappings[i].end);
+            }
+        }
+        add_thread_roots(self_sp);
+    }
+
+    m_chunk_total = 0;
+    for (size_t i = 0; i < m_region_count; ++i) {
+        m_regions[i].chunk_begin = m_chunk_total;
+        m_chunk_total += (m_regions[i].end - m_regions[i].start + LEAK_SCAN_CHUNK - 1)
+                         / LEAK_SCAN_CHUNK;
+    }
+    m_next_chunk.store(0, std::memory_order_relaxed);
+    m_workers_go.store(mapped ? 1 : 2, std::memory_order_release);
+    futex_wake(&m_workers_go);
+
+    int done;
+    while ((size_t) (done = m_workers_done.load(std::memory_order_acquire)) < m_worker_count) {
+        futex_wait(&m_workers_done, done);
+    }
+
+    resume_threads();
+    // ---- 恢复 ----
+
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    if (!mapped) {
+        LOGE(TAG, "scan: parse maps failed");
+        return false;
+    }
+
+    m_result.block_count = m_block_count;
+    for_each_unreachable([this](const leak_block_t &block) {
+        m_result.unreachable_count++;
+        m_result.unreachable_size += block.size;
+    });
+    LOGD(TAG, "scan: blocks = %zu, unreachable = %zu (%zu b), roots = %zu b, threads = %zu, "
+              "unstopped = %zu", m_result.block_count, m_result.unreachable_count,
+         m_result.unreachable_size, m_result.root_size, m_result.thread_count,
+         m_result.unstopped_count);
+    return true;
+}
+
+#undef TAG
@@ -0,0 +1,185 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 保守式泄漏扫描 (参考 libmemunreachable): 用信号暂停其他线程, 在暂停期间取出已记录的堆块,
+// 以线程栈, 寄存器和可写的非堆映射为根, 把其中形如指针的值在块地址表中查找, 并行地传递标记.
+// 扫描结束后仍未被标记的块即为不可达.
+//
+// 暂停期间被暂停的线程可能持有 malloc 或 meta 的锁, 因此暂停期间不分配内存也不加锁:
+// 所有缓冲在暂停前 mmap, 读取目标内存用 process_vm_readv, 地址已失效时返回错误而不会崩溃
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKLEAKSCAN_H
+#define LIBMATRIX_HOOK_MEMORYHOOKLEAKSCAN_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
+
+struct leak_block_t {
+    uintptr_t start;
+    size_t    size;
+    uint64_t  stack_hash;
+    void      *caller;
+};
+
+struct leak_scan_result_t {
+    size_t block_count;
+    size_t unreachable_count;
+    size_t unreachable_size;
+    size_t root_size;
+    size_t thread_count;
+    /**
+     * 未能暂停的线程, 其栈和寄存器没有被扫描, 非 0 时可能有误报
+     */
+    size_t unstopped_count;
+    /**
+     * 块数超过容量, 多出的块没有参与扫描
+     */
+    bool   truncated;
+};
+
+class leak_scanner {
+
+public:
+
+    /**
+     * @param __capacity 块数上限, 应取 meta 表的 slot 数
+     */
+    explicit leak_scanner(size_t __capacity);
+
+    ~leak_scanner();
+
+    leak_scanner(const leak_scanner &) = delete;
+
+    leak_scanner &operator=(const leak_scanner &) = delete;
+
+    /**
+     * 只能在 scan 的 __collect 回调中调用. 同一地址可以重复添加
+     */
+    void add_block(const void *__ptr, size_t __size, uint64_t __stack_hash, void *__caller);
+
+    /**
+     * 暂停其他线程后调用 __collect(*this) 取块并标记, 返回前恢复所有线程.
+     * 同一时刻只能有一个扫描
+     * @param __worker_count 并行标记的线程数, 0 表示按 CPU 数
+     * @return 内存不足或无法安全读取内存时返回 false
+     */
+    bool scan(size_t __worker_count, const std::function<void(leak_scanner &)> &__collect);
+
+    const leak_scan_result_t &result() const {
+        return m_result;
+    }
+
+    /**
+     * 按地址顺序回调 __callable(const leak_block_t &)
+     */
+    template<class _Callable>
+    void for_each_unreachable(_Callable __callable) const {
+        for (size_t i = 0; i < m_block_count; ++i) {
+            if (!m_marks[i].load(std::memory_order_relaxed)) {
+                __callable(m_blocks[i]);
+            }
+        }
+    }
+
+private:
+
+    struct region_t {
+        uintptr_t start;
+        uintptr_t end;
+        size_t    chunk_begin; // 之前所有区域的分块数之和
+        bool      exclude_blocks; // 扫描时跳过落在其中的堆块
+    };
+
+    struct mapping_t {
+        uintptr_t start;
+        uintptr_t end;
+        int       kind;
+    };
+
+    void *map_buffer(size_t __size);
+
+    void prepare_index();
+
+    bool read_mappings();
+
+    void add_root(uintptr_t __start, uintptr_t __end);
+
+    void add_region(uintptr_t __start, uintptr_t __end, bool __exclude_blocks);
+
+    void add_thread_roots(uintptr_t __self_sp);
+
+    inline ssize_t find_block(uintptr_t __value) const;
+
+    void scan_range(uintptr_t __start, uintptr_t __end, size_t __worker, size_t &__top);
+
+    void scan_root(const region_t &__region, uintptr_t __start, uintptr_t __end, size_t __worker,
+                   size_t &__top);
+
+    void drain(size_t __worker, size_t &__top);
+
+    void worker_main(size_t __worker);
+
+    struct own_region_t {
+        void   *addr;
+        size_t size;
+    };
+
+    static const size_t MAX_OWN_REGIONS = 16;
+    static const size_t MAX_WORKERS     = 8;
+
+    own_region_t        m_own[MAX_OWN_REGIONS];
+    size_t              m_own_count;
+
+    size_t              m_capacity;
+    leak_block_t        *m_blocks;
+    size_t              m_block_count;
+    uintptr_t           *m_starts; // 按 16 对齐补齐, 供向量化的组内比较
+    uintptr_t           *m_ends;
+    uintptr_t           *m_pivots; // 每组第一个 start
+    size_t              m_pivot_count;
+    std::atomic<uint8_t> *m_marks;
+    uintptr_t           m_min_start;
+    uintptr_t           m_max_end;
+
+    char                *m_maps_buffer;
+    size_t              m_maps_buffer_size;
+    mapping_t           *m_mappings;
+    size_t              m_mapping_capacity;
+    size_t              m_mapping_count;
+
+    region_t            *m_regions;
+    size_t              m_region_capacity;
+    size_t              m_region_count;
+    size_t              m_chunk_total;
+    std::atomic<size_t> m_next_chunk;
+
+    size_t              m_worker_count;
+    uint32_t            *m_mark_stacks;   // 每个线程 m_capacity 个
+    uint8_t             *m_read_buffers;  // 每个线程一块
+    std::atomic<int>    m_workers_ready;
+    std::atomic<int>    m_workers_go;     // futex, 1: 开始, 2: 放弃
+    std::atomic<int>    m_workers_done;   // futex
+    pid_t               m_worker_tids[MAX_WORKERS];
+
+    leak_scan_result_t  m_result;
+};
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKLEAKSCAN_H
@@ -0,0 +1,83 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 按堆栈 hash 分片加锁, 与 memory_meta_container 的 stack 分片方式相同
+//
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <time.h>
+#include "PoolAllocator.h"
+#include "MemoryHookLifetime.h"
+
+#define LIFETIME_SHARDS 64 // power of 2
+
+struct lifetime_shard_t {
+    std::mutex                                      mutex;
+    pool_unordered_map<uint64_t, lifetime_record_t> records;
+};
+
+static lifetime_shard_t     m_lifetime_shards[LIFETIME_SHARDS];
+static std::atomic<int64_t> m_start_ns(0);
+
+static inline int64_t monotonic_ns() {
+    struct timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+uint32_t lifetime_tick() {
+    return (uint32_t) ((uint64_t) monotonic_ns() >> LIFETIME_TICK_SHIFT);
+}
+
+void lifetime_start() {
+    int64_t expected = 0;
+    m_start_ns.compare_exchange_strong(expected, monotonic_ns());
+}
+
+double lifetime_elapsed_seconds() {
+    int64_t start = m_start_ns.load();
+    return start ? (double) (monotonic_ns() - start) / 1e9 : 0;
+}
+
+static inline size_t lifetime_bucket(uint32_t ticks) {
+    return ticks ? (size_t) (32 - __builtin_clz(ticks)) : 0;
+}
+
+void lifetime_on_release(uint64_t stack_hash, uint32_t birth_tick, uint32_t death_tick) {
+    size_t bucket = lifetime_bucket(death_tick - birth_tick); // 无符号相减, 可跨越一次回绕
+
+    auto &shard = m_lifetime_shards[(stack_hash ^ (stack_hash >> 16)) & (LIFETIME_SHARDS - 1)];
+    std::lock_guard<std::mutex> shard_lock(shard.mutex);
+    lifetime_record_t &record = shard.records[stack_hash];
+    record.stack_hash = stack_hash;
+    record.frees++;
+    record.buckets[bucket]++;
+    if (bucket < LIFETIME_SHORT_BUCKETS) {
+        record.short_lived++;
+    }
+}
+
+void lifetime_collect(std::vector<lifetime_record_t> &records) {
+    for (auto &shard : m_lifetime_shards) {
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        for (auto &it : shard.records) {
+            records.push_back(it.second);
+        }
+    }
+}
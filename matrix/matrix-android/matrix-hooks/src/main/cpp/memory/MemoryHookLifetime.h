@@ -0,0 +1,59 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 分配生命周期统计: 分配时记下粗粒度 tick, 释放时把存活时长按 log2 分桶累加到所属堆栈.
+// 已释放的内存不会出现在常规 dump 中, 这里用来找出高频的短命分配
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKLIFETIME_H
+#define LIBMATRIX_HOOK_MEMORYHOOKLIFETIME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#define LIFETIME_TICK_SHIFT 14 // 1 tick = 2^14 ns ≈ 16.4us, uint32 约 19.5 小时回绕
+#define LIFETIME_BUCKETS 33    // 桶 0: 0 tick, 桶 b: [2^(b-1), 2^b) tick
+#define LIFETIME_SHORT_BUCKETS 7 // 桶 0~6 即存活不足 64 tick (约 1ms)
+
+struct lifetime_record_t {
+    uint64_t stack_hash;
+    size_t   frees;
+    size_t   short_lived;
+    size_t   buckets[LIFETIME_BUCKETS];
+};
+
+uint32_t lifetime_tick();
+
+/**
+ * 从调用时刻开始统计, 用于计算频率
+ */
+void lifetime_start();
+
+/**
+ * @return 自 lifetime_start 以来的秒数
+ */
+double lifetime_elapsed_seconds();
+
+void lifetime_on_release(uint64_t stack_hash, uint32_t birth_tick, uint32_t death_tick);
+
+/**
+ * 拷出所有堆栈的统计
+ */
+void lifetime_collect(std::vector<lifetime_record_t> &records);
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKLIFETIME_H
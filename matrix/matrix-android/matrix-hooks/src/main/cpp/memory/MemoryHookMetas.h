@@ -21,12 +21,15 @@
 #ifndef LIBMATRIX_HOOK_MEMORYHOOKMETAS_H
 #define LIBMATRIX_HOOK_MEMORYHOOKMETAS_H
 
+#include <atomic>
 #include <map>
+#include <mutex>
 #include <vector>
 #include <set>
 #include "unwindstack/Unwinder.h"
 #include "Utils.h"
-// TODO #include "pool_allocator.h"
+#include "LockFreePtrTable.h"
+#include "PoolAllocator.h"
 
 #define TAG "Matrix.MemoryHook.Container"
 
@@ -35,162 +38,413 @@ struct ptr_meta_t {
     size_t   size;
     void     *caller;
     uint64_t stack_hash;
+    /**
+     * 按字节采样时该分配代表的期望字节数, 0 表示未按字节采样
+     */
+    size_t   weight;
+    /**
+     * 分配时所处的快照代数, 用于查询某次快照之后的分配
+     */
+    uint32_t epoch;
+    /**
+     * 分配时的 lifetime tick, 未开启生命周期统计时为 0
+     */
+    uint32_t birth_tick;
     bool     is_mmap;
+    /**
+     * 分配线程所属的线程组
+     */
+    uint8_t  thread_group;
+    /**
+     * caller 所在 so 的序号, 分配时确定, 释放时沿用
+     */
+    uint8_t  so_index;
 };
 
-struct caller_meta_t {
-    size_t                 total_size;
-    std::set<const void *> pointers;
+/**
+ * 堆栈在某次快照时的存活量
+ */
+struct stack_generation_t {
+    uint32_t epoch;
+    size_t   count;
+    size_t   size;
 };
 
 struct stack_meta_t {
     /**
-     * size 在分配释放阶段仅起引用计数作用, 因为在 dump 时会重新以 ptr_meta 的 size 进行统计
+     * 存活指针的总字节数 (按字节采样时为权重之和) 及个数, 在分配释放时增量维护
      */
     size_t                              size;
+    size_t                              count;
     void                                *caller;
-    wechat_backtrace::Backtrace         backtrace;
+    /**
+     * 堆栈池中的 id, 见 MemoryHookStackArena.h
+     */
+    uint32_t                            stack_id;
+    /**
+     * 本代第一次变化前的存活量, 与当前值相减即为自上次快照以来的增量
+     */
+    stack_generation_t                  generation;
 };
 
 class memory_meta_container {
 
     typedef struct {
-
-        std::map<const void *, ptr_meta_t> container;
-        std::mutex                         mutex;
-
-    } ptr_meta_container_wrapper_t;
-
-    typedef struct {
-        std::map<uint64_t, stack_meta_t> container;
+        pool_map<uint64_t, stack_meta_t> container;
+        /**
+         * 本代发生过变化的堆栈, 可能有重复
+         */
+        pool_vector<uint64_t>            changed;
         std::mutex                       mutex;
     } stack_container_wrapper_t;
 
-#define TARGET_PTR_CONTAINER_LOCKED(target, key) \
-    ptr_meta_container_wrapper_t * target = ptr_meta_containers.data()[ptr_meta_hash((uintptr_t) key)]; \
-    std::lock_guard<std::mutex> target_lock(target->mutex)
-
 #define TARGET_STACK_CONTAINER_LOCKED(target, key) \
     stack_container_wrapper_t *target = stack_meta_containers.data()[stack_meta_hash(key)]; \
     std::lock_guard<std::mutex> stack_lock(target->mutex)
 
 public:
 
-    memory_meta_container() {
-        size_t cap = ptr_meta_capacity();
-        ptr_meta_containers.reserve(cap);
-        for (int i = 0; i < cap; ++i) {
-            ptr_meta_containers.emplace_back(new ptr_meta_container_wrapper_t);
-        }
-
-        cap = stack_meta_capacity();
+    memory_meta_container() : m_epoch(1) {
+        size_t cap = stack_meta_capacity();
         stack_meta_containers.reserve(cap);
         for (int i = 0; i < cap; ++i) {
             stack_meta_containers.emplace_back(new stack_container_wrapper_t);
         }
     }
 
-    inline ptr_meta_t &operator[](const void *__k) {
-        TARGET_PTR_CONTAINER_LOCKED(target, __k);
-        return target->container[__k];
+    /**
+     * 回调模板化, 避免 std::function 装下捕获较多的 lambda 时从被 hook 的堆上分配
+     * @param __callback 持有锁期间回调 __callback(ptr_meta_t *, stack_meta_t *), 无堆栈时后者为 nullptr
+     */
+    template<class _Callable>
+    inline void insert(const void *__ptr,
+                       uint64_t __stack_hash,
+                       _Callable __callback) {
+        insert(__ptr, __stack_hash, [](const ptr_meta_t &) {}, __callback);
     }
 
+    /**
+     * @param __on_replace key 已在表中 (漏记了释放, 或扩容迁移中) 时, 覆盖前在持有锁期间回调
+     *                     __on_replace(const ptr_meta_t &old_meta), 旧记录的堆栈计数随后扣除
+     */
+    template<class _Replace, class _Callable>
     inline void insert(const void *__ptr,
                        uint64_t __stack_hash,
-                       std::function<void(ptr_meta_t *, stack_meta_t *)> __callback) {
-        TARGET_PTR_CONTAINER_LOCKED(ptr_meta_container, __ptr);
-        auto ptr_meta = &ptr_meta_container->container[__ptr];
-        ptr_meta->stack_hash = __stack_hash;
-        if (__stack_hash) {
-            TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, __stack_hash);
-            auto stack_meta = &stack_meta_container->container[__stack_hash];
-            __callback(ptr_meta, stack_meta);
-        } else {
-            __callback(ptr_meta, nullptr);
-        }
+                       _Replace __on_replace,
+                       _Callable __callback) {
+        ptr_metas.insert((uintptr_t) __ptr, [&](ptr_meta_t &ptr_meta, bool exists) {
+            if (exists) {
+                __on_replace(ptr_meta);
+                release_stack(ptr_meta);
+                ptr_meta = ptr_meta_t();
+            }
+            ptr_meta.stack_hash = __stack_hash;
+            if (__stack_hash) {
+                TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, __stack_hash);
+                ptr_meta.epoch = m_epoch.load(std::memory_order_relaxed);
+                auto stack_meta = &stack_meta_container->container[__stack_hash];
+                __callback(&ptr_meta, stack_meta);
+                mark_changed(stack_meta_container, __stack_hash, *stack_meta, ptr_meta.epoch);
+                stack_meta->size += live_size(ptr_meta);
+                stack_meta->count++;
+            } else {
+                ptr_meta.epoch = m_epoch.load(std::memory_order_relaxed);
+                __callback(&ptr_meta, nullptr);
+            }
+        });
     }
 
-//    inline ptr_meta_t &at(const void *__k) {
-//        TARGET_PTR_CONTAINER_LOCKED(target, __k);
-//        auto &ret = target->container.at(__k);
-//        return target->container.at(__k);
-//    }
-
     template<class _Callable>
     inline void get(const void *__k, _Callable __callable) {
-        TARGET_PTR_CONTAINER_LOCKED(target, __k);
-        if (0 != target->container.count(__k)) {
-            auto &meta = target->container.at(__k);
-            __callable(meta);
-        }
+        ptr_metas.get((uintptr_t) __k, __callable);
     }
 
-//    template<class _Callback>
     inline bool erase(const void *__k) {
-        TARGET_PTR_CONTAINER_LOCKED(ptr_meta_container, __k);
+        return erase(__k, [](const ptr_meta_t &) {});
+    }
 
-        auto it = ptr_meta_container->container.find(__k);
-        if (it == ptr_meta_container->container.end()) { // not contains
+    /**
+     * @param __on_erase 删除前在持有锁期间回调 __on_erase(const ptr_meta_t &)
+     */
+    template<class _Callable>
+    inline bool erase(const void *__k, _Callable __on_erase) {
+        return ptr_metas.erase((uintptr_t) __k, [&](ptr_meta_t &ptr_meta) {
+            __on_erase(ptr_meta);
+            release_stack(ptr_meta);
+        });
+    }
+
+    /**
+     * realloc 后更新 meta 并保留原分配的堆栈: 地址不变时原地修改 size, 地址变化时把 meta 移到新地址.
+     * 堆栈的 count 不变, size 按差值调整
+     * @param __on_replace 新地址上残留旧记录时, 覆盖前回调 __on_replace(const ptr_meta_t &), 同 insert
+     * @param __on_update 持有锁期间回调 __on_update(const ptr_meta_t &old_meta, const ptr_meta_t &new_meta)
+     * @return 旧地址不在表中时返回 false, 不做任何修改
+     */
+    template<class _Replace, class _Callable>
+    inline bool realloc(const void *__old_ptr,
+                        const void *__new_ptr,
+                        size_t __size,
+                        _Replace __on_replace,
+                        _Callable __on_update) {
+        if (__old_ptr == __new_ptr) {
+            return ptr_metas.get((uintptr_t) __old_ptr, [&](ptr_meta_t &ptr_meta) {
+                ptr_meta_t old_meta = ptr_meta;
+                resize(ptr_meta, __size);
+                __on_update(old_meta, ptr_meta);
+            });
+        }
+
+        // 旧地址已还给分配器, 新地址只有本线程持有, 两步之间不会有其他线程操作这两个 key
+        ptr_meta_t old_meta;
+        if (!ptr_metas.erase((uintptr_t) __old_ptr, [&](ptr_meta_t &ptr_meta) {
+            old_meta = ptr_meta;
+        })) {
+            return false;
+        }
+        ptr_metas.insert((uintptr_t) __new_ptr, [&](ptr_meta_t &ptr_meta, bool exists) {
+            if (exists) {
+                __on_replace(ptr_meta);
+                release_stack(ptr_meta);
+            }
+            ptr_meta     = old_meta;
+            ptr_meta.ptr = const_cast<void *>(__new_ptr);
+            resize(ptr_meta, __size);
+            __on_update(old_meta, ptr_meta);
+        });
+        return true;
+    }
+
+    /**
+     * 把一个分配拆成两段 (munmap 掉中间一段时), 两段都沿用原分配的堆栈, 堆栈 count 加 1
+     * @param __on_split 回调 __on_split(const ptr_meta_t &old_meta, const ptr_meta_t &head, const ptr_meta_t &tail)
+     * @return __ptr 不在表中时返回 false
+     */
+    template<class _Callable>
+    inline bool split(const void *__ptr,
+                      size_t __head_size,
+                      const void *__tail,
+                      size_t __tail_size,
+                      _Callable __on_split) {
+        ptr_meta_t old_meta;
+        ptr_meta_t head_meta;
+        if (!ptr_metas.get((uintptr_t) __ptr, [&](ptr_meta_t &ptr_meta) {
+            old_meta = ptr_meta;
+            resize(ptr_meta, __head_size);
+            head_meta = ptr_meta;
+        })) {
             return false;
         }
 
-        auto &ptr_meta = it->second;
+        insert(__tail, old_meta.stack_hash, [&](ptr_meta_t *ptr_meta, stack_meta_t *) {
+            ptr_meta->ptr          = const_cast<void *>(__tail);
+            ptr_meta->size         = __tail_size;
+            ptr_meta->caller       = old_meta.caller;
+            ptr_meta->is_mmap      = old_meta.is_mmap;
+            ptr_meta->birth_tick   = old_meta.birth_tick;
+            ptr_meta->so_index     = old_meta.so_index;
+            ptr_meta->thread_group = old_meta.thread_group;
+            ptr_meta->weight       = old_meta.weight && old_meta.size
+                                     ? (size_t) ((double) old_meta.weight * __tail_size / old_meta.size)
+                                     : 0;
+            __on_split(old_meta, head_meta, *ptr_meta);
+        });
+        return true;
+    }
+
+    bool contains(const void *__k) {
+        return ptr_metas.contains((uintptr_t) __k);
+    }
 
-        if (ptr_meta.stack_hash) {
-            TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, ptr_meta.stack_hash);
-            if (stack_meta_container->container.count(ptr_meta.stack_hash)) {
-                auto &stack_meta = stack_meta_container->container.at(ptr_meta.stack_hash);
-                if (stack_meta.size > ptr_meta.size) { // 减去同堆栈的 size
-                    stack_meta.size -= ptr_meta.size;
-                } else { // 删除 size 为 0 的堆栈
-                    stack_meta_container->container.erase(ptr_meta.stack_hash);
+    /**
+     * @param __callback 回调 __callback(const void *ptr, ptr_meta_t *, stack_meta_t *)
+     */
+    template<class _Callable>
+    void for_each(_Callable __callback) {
+        ptr_metas.for_each([&](uintptr_t __ptr, ptr_meta_t &ptr_meta) {
+            auto ptr = reinterpret_cast<const void *>(__ptr);
+            if (ptr_meta.stack_hash) {
+                TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, ptr_meta.stack_hash);
+                stack_meta_t *stack_meta = nullptr;
+                auto it = stack_meta_container->container.find(ptr_meta.stack_hash);
+                if (it != stack_meta_container->container.end()) {
+                    stack_meta = &it->second;
                 }
+                __callback(ptr, &ptr_meta, stack_meta); // within lock scope
+            } else {
+                __callback(ptr, &ptr_meta, nullptr);
             }
-        }
+        });
+    }
 
-        ptr_meta_container->container.erase(it);
+    /**
+     * 不加锁遍历所有指针, 只能在其他线程都已暂停时使用, 同一指针可能出现两次
+     * @param __callable 回调 __callable(const void *ptr, const ptr_meta_t &)
+     */
+    template<class _Callable>
+    void for_each_unsafe(_Callable __callable) {
+        ptr_metas.for_each_unsafe([&](uintptr_t __ptr, const ptr_meta_t &ptr_meta) {
+            __callable(reinterpret_cast<const void *>(__ptr), ptr_meta);
+        });
+    }
 
+    /**
+     * for_each_unsafe 回调次数的上限
+     */
+    size_t ptr_capacity() {
+        return ptr_metas.slot_capacity();
+    }
+
+    /**
+     * 找到时在锁内回调 __callable(const stack_meta_t &)
+     */
+    template<class _Callable>
+    bool get_stack(uint64_t __stack_hash, _Callable __callable) {
+        TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, __stack_hash);
+        auto it = stack_meta_container->container.find(__stack_hash);
+        if (it == stack_meta_container->container.end()) {
+            return false;
+        }
+        __callable(it->second);
         return true;
     }
 
-    bool contains(const void *__k) {
-        TARGET_PTR_CONTAINER_LOCKED(ptr_meta_container, __k);
-        return 0 != ptr_meta_container->container.count(__k);
-    }
-
-//    template<class _Callback>
-    void for_each(std::function<void(const void *, ptr_meta_t *, stack_meta_t *)> __callback) {
-        for (const auto cw : ptr_meta_containers) {
-            std::lock_guard<std::mutex> container_lock(cw->mutex);
-
-            for (auto it : cw->container) {
-                auto &ptr      = it.first;
-                auto ptr_meta = &it.second;
-
-                if (ptr_meta->stack_hash) {
-                    TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, ptr_meta->stack_hash);
-                    stack_meta_t *stack_meta = nullptr;
-                    if (stack_meta_container->container.count(ptr_meta->stack_hash)) {
-                        stack_meta = &stack_meta_container->container.at(ptr_meta->stack_hash);
-                    }
-                    __callback(ptr, ptr_meta, stack_meta); // within lock scope
-                } else {
-                    __callback(ptr, ptr_meta, nullptr);
-                }
+    uint32_t current_epoch() {
+        return m_epoch.load(std::memory_order_relaxed);
+    }
 
+    /**
+     * 开启新的一代. 只处理上一代变化过的堆栈, 与存活指针数无关
+     * @return 新一代的 epoch, 此后的分配都带有该 epoch
+     */
+    uint32_t snapshot() {
+        uint32_t epoch = m_epoch.fetch_add(1, std::memory_order_relaxed) + 1;
+        for (auto cw : stack_meta_containers) {
+            std::lock_guard<std::mutex> stack_lock(cw->mutex);
+            // 加锁之前可能已有变化按新一代记入, 这些堆栈不会再被记入, 需要保留
+            size_t kept = 0;
+            for (auto hash : cw->changed) {
+                auto it = cw->container.find(hash);
+                if (it == cw->container.end()) {
+                    continue;
+                }
+                if (it->second.generation.epoch == epoch) {
+                    cw->changed[kept++] = hash;
+                } else if (!it->second.count) {
+                    cw->container.erase(it);
+                }
+            }
+            cw->changed.resize(kept);
+        }
+        return epoch;
+    }
 
+    /**
+     * 遍历自上次快照以来变化过的堆栈 (同一堆栈可能出现多次), 在锁内回调
+     */
+    template<class _Callable>
+    void for_each_changed(_Callable __callable) {
+        for (auto cw : stack_meta_containers) {
+            std::lock_guard<std::mutex> stack_lock(cw->mutex);
+            for (auto hash : cw->changed) {
+                auto it = cw->container.find(hash);
+                if (it != cw->container.end()) {
+                    __callable(hash, it->second);
+                }
             }
         }
     }
 
+    size_t stack_count() {
+        size_t count = 0;
+        for (auto cw : stack_meta_containers) {
+            std::lock_guard<std::mutex> stack_lock(cw->mutex);
+            count += cw->container.size();
+        }
+        return count;
+    }
+
+    /**
+     * 指针索引自身 mmap 的内存
+     */
+    size_t ptr_meta_mapped_size() {
+        return ptr_metas.mapped_size();
+    }
+
 private:
 
-    static inline size_t ptr_meta_capacity() {
-        return MAX_PTR_META_SLOT;
+    static inline size_t live_size(const ptr_meta_t &__ptr_meta) {
+        return __ptr_meta.weight ? __ptr_meta.weight : __ptr_meta.size;
     }
 
-    static inline size_t ptr_meta_hash(uintptr_t __key) {
-        return static_cast<size_t>((__key ^ (__key >> 16)) & PTR_META_MASK);
+    /**
+     * 需持有 ptr meta 的 slot 锁. 按字节采样的权重按 size 等比缩放
+     */
+    inline void resize(ptr_meta_t &__ptr_meta, size_t __size) {
+        size_t old_live = live_size(__ptr_meta);
+        if (__ptr_meta.weight) {
+            __ptr_meta.weight = __ptr_meta.size
+                                ? (size_t) ((double) __ptr_meta.weight * __size / __ptr_meta.size)
+                                : __size;
+        }
+        __ptr_meta.size = __size;
+
+        if (!__ptr_meta.stack_hash) {
+            return;
+        }
+        TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, __ptr_meta.stack_hash);
+        auto it = stack_meta_container->container.find(__ptr_meta.stack_hash);
+        if (it == stack_meta_container->container.end()) {
+            return;
+        }
+        auto &stack_meta = it->second;
+        mark_changed(stack_meta_container, __ptr_meta.stack_hash, stack_meta,
+                     m_epoch.load(std::memory_order_relaxed));
+        stack_meta.size -= stack_meta.size > old_live ? old_live : stack_meta.size;
+        stack_meta.size += live_size(__ptr_meta);
+    }
+
+    /**
+     * 需持有 ptr meta 的 slot 锁. 从所属堆栈扣除该指针, 堆栈不再存活时删除
+     */
+    inline void release_stack(const ptr_meta_t &__ptr_meta) {
+        if (!__ptr_meta.stack_hash) {
+            return;
+        }
+        TARGET_STACK_CONTAINER_LOCKED(stack_meta_container, __ptr_meta.stack_hash);
+        auto it = stack_meta_container->container.find(__ptr_meta.stack_hash);
+        if (it == stack_meta_container->container.end()) {
+            return;
+        }
+        auto     &stack_meta = it->second;
+        uint32_t epoch       = m_epoch.load(std::memory_order_relaxed);
+        mark_changed(stack_meta_container, __ptr_meta.stack_hash, stack_meta, epoch);
+        size_t size = live_size(__ptr_meta);
+        stack_meta.size -= stack_meta.size > size ? size : stack_meta.size;
+        if (stack_meta.count > 1) {
+            stack_meta.count--;
+            return;
+        }
+        stack_meta.count = 0;
+        stack_meta.size  = 0;
+        // 快照时仍存活的堆栈保留到下次快照, 以便报告其减少量
+        if (!stack_meta.generation.count) {
+            stack_meta_container->container.erase(it);
+        }
+    }
+
+    /**
+     * 需持有堆栈分片的锁. 每代第一次变化时记下变化前的存活量
+     */
+    static inline void mark_changed(stack_container_wrapper_t *__cw,
+                                    uint64_t __stack_hash,
+                                    stack_meta_t &__stack_meta,
+                                    uint32_t __epoch) {
+        if (__stack_meta.generation.epoch == __epoch) {
+            return;
+        }
+        __stack_meta.generation = {__epoch, __stack_meta.count, __stack_meta.size};
+        __cw->changed.push_back(__stack_hash);
     }
 
     static inline size_t stack_meta_capacity() {
@@ -201,11 +455,11 @@ private:
         return ((__key ^ (__key >> 16)) & STACK_META_MASK);
     }
 
-    std::vector<ptr_meta_container_wrapper_t *> ptr_meta_containers;
-    std::vector<stack_container_wrapper_t *>    stack_meta_containers;
+    // 指针索引: 开放寻址 + slot 级 CAS, 不在被 hook 的堆上分配
+    lock_free_ptr_table<ptr_meta_t>          ptr_metas;
+    std::vector<stack_container_wrapper_t *> stack_meta_containers;
+    std::atomic<uint32_t>                    m_epoch;
 
-    static const unsigned int MAX_PTR_META_SLOT   = 1 << 10;
-    static const unsigned int PTR_META_MASK       = MAX_PTR_META_SLOT - 1;
     static const unsigned int MAX_STACK_META_SLOT = 1 << 9;
     static const unsigned int STACK_META_MASK     = MAX_STACK_META_SLOT - 1;
 };
@@ -0,0 +1,99 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 已记录的 mmap 区间索引, 按起始地址有序, 区间互不重叠.
+// munmap/mremap/MAP_FIXED 只覆盖部分区间时, 由 carve 把区间裁剪或一分为二, 调用方据此更新 meta.
+// 不加锁, 由调用方保证串行
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKMMAPINDEX_H
+#define LIBMATRIX_HOOK_MEMORYHOOKMMAPINDEX_H
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <vector>
+#include "PoolAllocator.h"
+
+struct mmap_range_t {
+    uintptr_t start;
+    uintptr_t end;
+};
+
+class mmap_range_index {
+
+public:
+
+    /**
+     * 需先 carve 掉与 [__start, __end) 重叠的部分
+     */
+    inline void insert(uintptr_t __start, uintptr_t __end) {
+        if (__start < __end) {
+            m_ranges[__start] = __end;
+        }
+    }
+
+    /**
+     * 从索引中去掉 [__start, __end), 对每个与之相交的已有区间按地址顺序回调
+     * __callable(const mmap_range_t &range, const mmap_range_t &cut), cut 为相交部分.
+     * 回调时索引已更新: range 在 cut 之外的头尾部分 (如果有) 仍以各自的起始地址留在索引中
+     */
+    template<class _Callable>
+    void carve(uintptr_t __start, uintptr_t __end, _Callable __callable) {
+        if (__start >= __end || m_ranges.empty()) {
+            return;
+        }
+
+        // 第一个可能相交的区间: 起始地址 <= __start 的最后一个, 或其后第一个
+        auto it = m_ranges.upper_bound(__start);
+        if (it != m_ranges.begin()) {
+            auto prev = std::prev(it);
+            if (prev->second > __start) {
+                it = prev;
+            }
+        }
+
+        m_carved.clear();
+        while (it != m_ranges.end() && it->first < __end) {
+            m_carved.push_back({it->first, it->second});
+            it = m_ranges.erase(it);
+        }
+
+        for (auto &range : m_carved) {
+            mmap_range_t cut = {std::max(range.start, __start), std::min(range.end, __end)};
+            if (range.start < cut.start) {
+                m_ranges[range.start] = cut.start;
+            }
+            if (cut.end < range.end) {
+                m_ranges[cut.end] = range.end;
+            }
+            __callable(range, cut);
+        }
+    }
+
+    size_t size() const {
+        return m_ranges.size();
+    }
+
+private:
+
+    pool_map<uintptr_t, uintptr_t> m_ranges;
+    pool_vector<mmap_range_t>      m_carved; // carve 的临时缓冲, 复用以免每次分配
+};
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKMMAPINDEX_H
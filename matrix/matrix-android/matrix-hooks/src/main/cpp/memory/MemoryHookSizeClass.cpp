@@ -0,0 +1,461 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// so 快照是按地址排序的 [start, end) -> so 序号, 共两份: 重建时写入非活动的一份再切换.
+// 每份带序号 (seqlock), hook 中查找前后序号不变才采用结果, 否则重试, 不加锁也不会读到已释放的内存.
+// 快照只在 dlopen / dlclose 之后及初始化时重建, dl_iterate_phdr 期间不持有本模块的锁.
+// 每个 so 的名字和直方图登记后不再释放
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <link.h>
+#include <sys/mman.h>
+#include "Log.h"
+#include "MappingName.h"
+#include "MemoryHookSizeClass.h"
+
+#define TAG "Matrix.MemoryHook.SizeClass"
+
+#define JEMALLOC_MAX_LG 30 // 最大档 2GB, 更大的分配归入最后一档
+#define JEMALLOC_CLASS_COUNT (5 + (JEMALLOC_MAX_LG - 5) * 4 + 1)
+#define SIZE_CLASS_COUNT JEMALLOC_CLASS_COUNT // 直方图按档数较多的 jemalloc 分配
+#define SCUDO_SIZE_DELTA 16 // 块头, 与 AndroidSizeClassConfig::SizeDelta 一致
+#define SO_MODULE_MAX 4096
+#define SO_LOOKUP_RETRIES 4
+
+enum heap_allocator_t {
+    ALLOCATOR_JEMALLOC = 0,
+    ALLOCATOR_SCUDO,
+};
+
+// 取自 scudo 的 AndroidSizeClassConfig, 含块头
+#ifdef __LP64__
+static const uint32_t SCUDO_CLASSES[] = {
+        0x00020, 0x00030, 0x00040, 0x00050, 0x00060, 0x00070, 0x00090, 0x000b0,
+        0x000c0, 0x000e0, 0x00120, 0x00160, 0x001c0, 0x00250, 0x00320, 0x00450,
+        0x00670, 0x00830, 0x00a10, 0x00c30, 0x01010, 0x01210, 0x01bd0, 0x02210,
+        0x02d90, 0x03790, 0x04010, 0x04810, 0x05a10, 0x07310, 0x08210, 0x10010,
+};
+#else
+static const uint32_t SCUDO_CLASSES[] = {
+        0x00020, 0x00030, 0x00040, 0x00050, 0x00060, 0x00070, 0x00080, 0x00090,
+        0x000a0, 0x000b0, 0x000c0, 0x000e0, 0x000f0, 0x00110, 0x00120, 0x00130,
+        0x00150, 0x00160, 0x00170, 0x00190, 0x001d0, 0x00210, 0x00240, 0x002a0,
+        0x00330, 0x00370, 0x003a0, 0x00400, 0x00430, 0x004a0, 0x00530, 0x00610,
+        0x00730, 0x00840, 0x00910, 0x009c0, 0x00a60, 0x00b10, 0x00ca0, 0x00e00,
+        0x00fb0, 0x01030, 0x01130, 0x011f0, 0x01490, 0x01650, 0x01930, 0x02010,
+        0x02190, 0x02490, 0x02850, 0x02d50, 0x03010, 0x03210, 0x03c90, 0x04090,
+        0x04510, 0x04810, 0x05c10, 0x06f10, 0x07310, 0x08010, 0x0c010, 0x10010,
+};
+#endif
+
+// 最后一档为 secondary
+#define SCUDO_CLASS_COUNT (sizeof(SCUDO_CLASSES) / sizeof(SCUDO_CLASSES[0]) + 1)
+
+static_assert(SCUDO_CLASS_COUNT <= SIZE_CLASS_COUNT, "histogram is too small for scudo");
+
+enum {
+    KIND_HEAP = 0,
+    KIND_MMAP,
+    KIND_COUNT,
+};
+
+struct size_class_bin_t {
+    std::atomic<size_t> count;
+    std::atomic<size_t> size;
+};
+
+struct size_class_histogram_t {
+    size_class_bin_t bins[KIND_COUNT][SIZE_CLASS_COUNT];
+};
+
+struct so_module_t {
+    uintptr_t start;
+    uintptr_t end;
+    uint32_t  so_index;
+};
+
+struct module_snapshot_t {
+    std::atomic<uint32_t> seq; // 奇数表示正在写入
+    size_t                count;
+    so_module_t           modules[SO_MODULE_MAX];
+};
+
+struct module_range_t {
+    uintptr_t   start;
+    uintptr_t   end;
+    std::string name;
+};
+
+static std::once_flag                        m_init_flag;
+static heap_allocator_t                           m_allocator   = ALLOCATOR_JEMALLOC;
+static size_t                                m_class_count = JEMALLOC_CLASS_COUNT;
+
+static std::mutex                            m_so_mutex;
+static const char                            *m_so_names[SIZE_CLASS_MAX_SO];
+static std::atomic<size_class_histogram_t *> m_histograms[SIZE_CLASS_MAX_SO];
+static std::atomic<size_t>                   m_so_count(0);
+
+static std::atomic<module_snapshot_t *>      m_snapshots(nullptr); // 两份
+static std::atomic<uint32_t>                 m_active_snapshot(0);
+static std::atomic<uint64_t>                 m_refresh_ticket(0);
+static uint64_t                              m_published_ticket = 0; // 需持有 m_so_mutex
+
+static inline size_t jemalloc_class_index(size_t size) {
+    if (size <= 8) {
+        return 0;
+    }
+    if (size <= 64) {
+        return (size + 15) / 16;  // 16, 32, 48, 64 -> 1..4
+    }
+    size_t lg = (sizeof(size_t) * 8 - 1) - __builtin_clzl(size - 1); // size in (2^lg, 2^(lg+1)]
+    if (lg > JEMALLOC_MAX_LG) {
+        return JEMALLOC_CLASS_COUNT - 1;
+    }
+    return 5 + (lg - 6) * 4 + (((size - 1) >> (lg - 2)) - 4);
+}
+
+static inline size_t jemalloc_class_size(size_t index) {
+    if (index == 0) {
+        return 8;
+    }
+    if (index <= 4) {
+        return index * 16;
+    }
+    size_t lg = 6 + (index - 5) / 4;
+    return (size_t) (5 + (index - 5) % 4) << (lg - 2);
+}
+
+static inline size_t scudo_class_index(size_t size) {
+    size_t         needed = size + SCUDO_SIZE_DELTA;
+    const uint32_t *end   = SCUDO_CLASSES + SCUDO_CLASS_COUNT - 1;
+    return std::lower_bound(SCUDO_CLASSES, end, needed) - SCUDO_CLASSES;
+}
+
+static inline size_t size_class_index(size_t size) {
+    return m_allocator == ALLOCATOR_SCUDO ? scudo_class_index(size) : jemalloc_class_index(size);
+}
+
+/**
+ * 最后一档不是真实的 size class, 调用方需先排除
+ */
+static inline size_t size_class_size(size_t index) {
+    return m_allocator == ALLOCATOR_SCUDO ? SCUDO_CLASSES[index] : jemalloc_class_size(index);
+}
+
+size_t size_class_of(size_t size) {
+    size_t index = size_class_index(size);
+    return index == m_class_count - 1 ? size : size_class_size(index);
+}
+
+/**
+ * bionic 给 scudo 的映射都命名为 [anon:scudo:*], 没有时按 jemalloc 处理
+ */
+static heap_allocator_t detect_allocator() {
+    FILE *maps = fopen("/proc/self/maps", "re");
+    if (!maps) {
+        return ALLOCATOR_JEMALLOC;
+    }
+    heap_allocator_t allocator = ALLOCATOR_JEMALLOC;
+    char        line[512];
+    while (fgets(line, sizeof(line), maps)) {
+        if (strstr(line, "[anon:scudo:")) {
+            allocator = ALLOCATOR_SCUDO;
+            break;
+        }
+    }
+    fclose(maps);
+    return allocator;
+}
+
+static size_class_histogram_t *create_histogram() {
+    void *mem = mmap(nullptr, sizeof(size_class_histogram_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "create_histogram: mmap failed");
+        return nullptr;
+    }
+    return new(mem) size_class_histogram_t;
+}
+
+/**
+ * 需持有 m_so_mutex. so 过多时归入 unknown
+ */
+static uint32_t register_so_locked(const char *so_name) {
+    size_t count = m_so_count.load(std::memory_order_relaxed);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (strcmp(m_so_names[i], so_name) == 0) {
+            return i;
+        }
+    }
+    if (count == SIZE_CLASS_MAX_SO) {
+        return SO_INDEX_UNKNOWN;
+    }
+
+    m_so_names[count] = strdup(so_name);
+    m_histograms[count].store(create_histogram(), std::memory_order_release);
+    m_so_count.store(count + 1, std::memory_order_release);
+    return (uint32_t) count;
+}
+
+static int on_phdr(struct dl_phdr_info *info, size_t, void *data) {
+    if (!info->dlpi_name || !info->dlpi_name[0]) {
+        return 0;
+    }
+    uintptr_t start = UINTPTR_MAX;
+    uintptr_t end   = 0;
+    for (int i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+        if (phdr.p_type != PT_LOAD) {
+            continue;
+        }
+        start = std::min(start, (uintptr_t) (info->dlpi_addr + phdr.p_vaddr));
+        end   = std::max(end, (uintptr_t) (info->dlpi_addr + phdr.p_vaddr + phdr.p_memsz));
+    }
+    if (start < end) {
+        // 名字属于 linker, dlclose 后失效, 先拷出来
+        static_cast<std::vector<module_range_t> *>(data)->push_back({start, end, info->dlpi_name});
+    }
+    return 0;
+}
+
+void size_class_init() {
+    std::call_once(m_init_flag, [] {
+        m_allocator   = detect_allocator();
+        m_class_count = m_allocator == ALLOCATOR_SCUDO ? SCUDO_CLASS_COUNT : JEMALLOC_CLASS_COUNT;
+        LOGD(TAG, "size_class_init: allocator = %s",
+             m_allocator == ALLOCATOR_SCUDO ? "scudo" : "jemalloc");
+
+        {
+            std::lock_guard<std::mutex> so_lock(m_so_mutex);
+            m_so_names[SO_INDEX_UNKNOWN] = "unknown";
+            m_histograms[SO_INDEX_UNKNOWN].store(create_histogram(), std::memory_order_release);
+            m_so_count.store(1, std::memory_order_release);
+        }
+
+        size_t mapped_size = sizeof(module_snapshot_t) * 2;
+        void   *mem        = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            LOGE(TAG, "size_class_init: mmap snapshots failed");
+            return;
+        }
+        name_hook_mapping(mem, mapped_size);
+        auto snapshots = static_cast<module_snapshot_t *>(mem);
+        new(&snapshots[0]) module_snapshot_t;
+        new(&snapshots[1]) module_snapshot_t;
+        m_snapshots.store(snapshots, std::memory_order_release);
+    });
+    size_class_refresh_modules();
+}
+
+void size_class_refresh_modules() {
+    module_snapshot_t *snapshots = m_snapshots.load(std::memory_order_acquire);
+    if (!snapshots) {
+        return;
+    }
+
+    uint64_t                    ticket = m_refresh_ticket.fetch_add(1, std::memory_order_relaxed) + 1;
+    std::vector<module_range_t> ranges;
+    dl_iterate_phdr(on_phdr, &ranges);
+    std::sort(ranges.begin(), ranges.end(), [](const module_range_t &l, const module_range_t &r) {
+        return l.start < r.start;
+    });
+
+    std::lock_guard<std::mutex> so_lock(m_so_mutex);
+    if (ticket < m_published_ticket) { // 更晚收集的结果已经发布
+        return;
+    }
+    m_published_ticket = ticket;
+
+    uint32_t          active = m_active_snapshot.load(std::memory_order_relaxed);
+    module_snapshot_t &next  = snapshots[active ^ 1];
+
+    next.seq.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    size_t count = 0;
+    for (auto &range : ranges) {
+        if (count == SO_MODULE_MAX) {
+            LOGE(TAG, "size_class_refresh_modules: too many modules (%zu)", ranges.size());
+            break;
+        }
+        next.modules[count++] = {range.start, range.end, register_so_locked(range.name.c_str())};
+    }
+    next.count = count;
+    next.seq.fetch_add(1, std::memory_order_release);
+
+    m_active_snapshot.store(active ^ 1, std::memory_order_release);
+}
+
+static inline uint32_t lookup_module(const module_snapshot_t &snapshot, uintptr_t addr) {
+    // 读到的 count 可能是写了一半的值, 先截断, 结果由调用方按序号校验
+    size_t            count = std::min(snapshot.count, (size_t) SO_MODULE_MAX);
+    const so_module_t *end  = snapshot.modules + count;
+    const so_module_t *it   = std::upper_bound(snapshot.modules, end, addr,
+                                               [](uintptr_t addr, const so_module_t &module) {
+                                                   return addr < module.start;
+                                               });
+    if (it == snapshot.modules) {
+        return SO_INDEX_UNKNOWN;
+    }
+    --it;
+    return addr < it->end ? it->so_index : SO_INDEX_UNKNOWN;
+}
+
+uint32_t size_class_so_index(const void *caller) {
+    module_snapshot_t *snapshots = m_snapshots.load(std::memory_order_acquire);
+    if (!snapshots || !caller) {
+        return SO_INDEX_UNKNOWN;
+    }
+    for (int retry = 0; retry < SO_LOOKUP_RETRIES; ++retry) {
+        const module_snapshot_t &snapshot = snapshots[m_active_snapshot.load(
+                std::memory_order_acquire) & 1];
+        uint32_t seq = snapshot.seq.load(std::memory_order_acquire);
+        if (seq & 1) {
+            continue;
+        }
+        uint32_t so_index = lookup_module(snapshot, (uintptr_t) caller);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (snapshot.seq.load(std::memory_order_relaxed) == seq) {
+            return so_index;
+        }
+    }
+    return SO_INDEX_UNKNOWN;
+}
+
+const char *size_class_so_name(uint32_t so_index) {
+    return so_index < m_so_count.load(std::memory_order_acquire) ? m_so_names[so_index] : "unknown";
+}
+
+static inline void update(uint32_t so_index, size_t size, bool is_mmap, bool acquire) {
+    size_class_histogram_t *histogram = m_histograms[so_index].load(
+            std::memory_order_acquire);
+    if (!histogram) {
+        return;
+    }
+    size_class_bin_t &bin = histogram->bins[is_mmap ? KIND_MMAP : KIND_HEAP][size_class_index(size)];
+    if (acquire) {
+        bin.count.fetch_add(1, std::memory_order_relaxed);
+        bin.size.fetch_add(size, std::memory_order_relaxed);
+    } else {
+        bin.count.fetch_sub(1, std::memory_order_relaxed);
+        bin.size.fetch_sub(size, std::memory_order_relaxed);
+    }
+}
+
+void size_class_on_acquire(uint32_t so_index, size_t size, bool is_mmap) {
+    update(so_index, size, is_mmap, true);
+}
+
+void size_class_on_release(uint32_t so_index, size_t size, bool is_mmap) {
+    update(so_index, size, is_mmap, false);
+}
+
+struct so_histogram_snapshot_t {
+    const char *name;
+    size_t     total_size;
+    size_t     count[SIZE_CLASS_COUNT];
+    size_t     size[SIZE_CLASS_COUNT];
+};
+
+static void dump_kind(FILE *log_file, json_stream_writer &json, int kind) {
+    size_t so_count = m_so_count.load(std::memory_order_acquire);
+
+    // 先拷出一份, 避免排序和输出时计数仍在变化
+    std::vector<so_histogram_snapshot_t> snapshots;
+    for (size_t i = 0; i < so_count; ++i) {
+        size_class_histogram_t *histogram = m_histograms[i].load(std::memory_order_acquire);
+        if (!histogram) {
+            continue;
+        }
+        so_histogram_snapshot_t snapshot{};
+        snapshot.name = m_so_names[i];
+        for (size_t c = 0; c < m_class_count; ++c) {
+            snapshot.count[c] = histogram->bins[kind][c].count.load(std::memory_order_relaxed);
+            snapshot.size[c]  = histogram->bins[kind][c].size.load(std::memory_order_relaxed);
+            snapshot.total_size += snapshot.size[c];
+        }
+        if (snapshot.total_size) {
+            snapshots.push_back(snapshot);
+        }
+    }
+
+    std::sort(snapshots.begin(), snapshots.end(),
+              [](const so_histogram_snapshot_t &l, const so_histogram_snapshot_t &r) {
+                  return l.total_size > r.total_size;
+              });
+
+    for (auto &snapshot : snapshots) {
+        flogger(log_file, "size class of so (%s) : size = %zu\n", snapshot.name,
+                snapshot.total_size);
+
+        json.begin_object()
+                .key("so").value(snapshot.name)
+                .key("size").value_as_string(snapshot.total_size)
+                .key("classes").begin_array();
+
+        size_t total_waste = 0;
+        for (size_t c = 0; c < m_class_count; ++c) {
+            if (!snapshot.count[c]) {
+                continue;
+            }
+            // 最后一档不是真实的 size class, class 记为 0, 不计浪费
+            bool   large      = c == m_class_count - 1;
+            size_t class_size = large ? 0 : size_class_size(c);
+            size_t capacity   = class_size * snapshot.count[c];
+            size_t waste      = large || capacity < snapshot.size[c]
+                                ? 0 : capacity - snapshot.size[c];
+            total_waste += waste;
+
+            flogger(log_file, "   class = %10zu b, count = %8zu, size = %10zu b, waste = %zu b\n",
+                    class_size, snapshot.count[c], snapshot.size[c], waste);
+
+            json.begin_object()
+                    .key("class").value_as_string(class_size)
+                    .key("count").value_as_string(snapshot.count[c])
+                    .key("size").value_as_string(snapshot.size[c])
+                    .key("waste").value_as_string(waste)
+                    .end_object();
+        }
+        flogger(log_file, "   total waste = %zu b\n", total_waste);
+
+        json.end_array()
+                .key("waste").value_as_string(total_waste)
+                .end_object();
+    }
+}
+
+void size_class_dump(FILE *log_file, json_stream_writer &json, bool mmap) {
+    flogger(log_file, "\n######################## size class (heap) ########################\n");
+    json.key("SizeClassNativeHeap").begin_array();
+    dump_kind(log_file, json, KIND_HEAP);
+    json.end_array();
+
+    if (mmap) {
+        flogger(log_file, "\n######################## size class (mmap) ########################\n");
+        json.key("SizeClassMmap").begin_array();
+        dump_kind(log_file, json, KIND_MMAP);
+        json.end_array();
+    }
+}
+
+#undef TAG
@@ -0,0 +1,68 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 按 so 区分 heap / mmap 的 size class 直方图, 在分配释放时用原子计数增量维护, dump 时不需要遍历指针.
+// size class 按进程实际使用的分配器取: jemalloc 为 8, 16, 32, 48, 64, 之后每个 2 的幂区间等分 4 档;
+// scudo 为 bionic 的 AndroidSizeClassConfig 的各档, 超出最大档的由 secondary 分配.
+// caller -> so 只查 size_class_refresh_modules 建好的快照, hook 中不加锁也不调 dl_iterate_phdr
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKSIZECLASS_H
+#define LIBMATRIX_HOOK_MEMORYHOOKSIZECLASS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include "JsonStreamWriter.h"
+
+#define SIZE_CLASS_MAX_SO 256
+#define SO_INDEX_UNKNOWN 0
+
+/**
+ * 识别分配器并建立第一份 so 快照, 需在注册 hook 之前调用, 重复调用无效
+ */
+void size_class_init();
+
+/**
+ * 按当前已加载的 so 重建快照, 在 dlopen / dlclose 之后调用. 会调 dl_iterate_phdr, 不能在 malloc 等 hook 中调用
+ */
+void size_class_refresh_modules();
+
+/**
+ * 分配器实际给出的块大小, 超出最大档时返回 size 本身
+ */
+size_t size_class_of(size_t size);
+
+/**
+ * caller 所在 so 的序号, 小于 SIZE_CLASS_MAX_SO. 只查最近一次重建的快照, 不加锁;
+ * 不在快照中 (如刚 dlopen 的 so 的构造函数) 或 so 过多时为 SO_INDEX_UNKNOWN.
+ * 其他按 so 统计的模块共用这一编号, 结果需记在 meta 中, 释放时沿用
+ */
+uint32_t size_class_so_index(const void *caller);
+
+const char *size_class_so_name(uint32_t so_index);
+
+void size_class_on_acquire(uint32_t so_index, size_t size, bool is_mmap);
+
+void size_class_on_release(uint32_t so_index, size_t size, bool is_mmap);
+
+/**
+ * 输出各 so 的存活直方图及档位浪费 (块大小 - 申请大小)
+ */
+void size_class_dump(FILE *log_file, json_stream_writer &json, bool mmap);
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKSIZECLASS_H
@@ -0,0 +1,277 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// hook 线程对每个回溯过的分配都会 intern: hash -> id 的索引只插入不删除, 已有的堆栈无锁查到即返回;
+// 只有新堆栈的写入和 dump 时的 restore 加锁. 索引扩容后旧表不释放, 仍在查找的线程可继续读
+//
+
+#include <atomic>
+#include <mutex>
+#include <cstring>
+#include <sys/mman.h>
+#include "Log.h"
+#include "MemoryHookStackArena.h"
+
+#define TAG "Matrix.MemoryHook.StackArena"
+
+#define ARENA_CHUNK_SIZE (1 << 20)
+#define ARENA_INIT_RECORDS (1 << 12)
+#define ARENA_INIT_INDEX (1 << 13) // power of 2
+#define VARINT_MAX_BYTES 10
+
+struct index_entry_t {
+    uint64_t              hash;
+    std::atomic<uint32_t> id; // 先写 hash 再以 release 写 id, 读到非 0 的 id 时 hash 已可见
+};
+
+struct index_t {
+    size_t        capacity;
+    index_entry_t *entries;
+};
+
+static std::mutex    m_arena_mutex;
+static uint8_t       *m_chunk_cursor      = nullptr;
+static uint8_t       *m_chunk_end         = nullptr;
+static const uint8_t **m_records          = nullptr; // id - 1 -> 编码后的记录
+static size_t        m_records_size       = 0;
+static size_t        m_records_capacity   = 0;
+static std::atomic<index_t *> m_index(nullptr); // hash -> id
+static size_t        m_index_size         = 0;
+static size_t        m_arena_mapped_size  = 0;
+
+static void *arena_map(size_t size) {
+    void *mem = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "arena_map: mmap %zu failed", size);
+        return nullptr;
+    }
+    m_arena_mapped_size += size;
+    return mem;
+}
+
+static void arena_unmap(void *mem, size_t size) {
+    if (mem) {
+        munmap(mem, size);
+        m_arena_mapped_size -= size;
+    }
+}
+
+static inline uint8_t *write_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t) v;
+    return p;
+}
+
+static inline const uint8_t *read_varint(const uint8_t *p, uint64_t *v) {
+    uint64_t result = 0;
+    int      shift  = 0;
+    for (;;) {
+        uint8_t b = *p++;
+        result |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            break;
+        }
+        shift += 7;
+    }
+    *v = result;
+    return p;
+}
+
+static inline uint64_t zigzag_encode(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline size_t index_slot(uint64_t hash, size_t capacity) {
+    return (size_t) ((hash * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+}
+
+/**
+ * 不加锁, 未找到时返回 STACK_ID_INVALID
+ */
+static uint32_t index_lookup(const index_t *index, uint64_t hash) {
+    for (size_t idx = index_slot(hash, index->capacity);; idx = (idx + 1) & (index->capacity - 1)) {
+        const index_entry_t &entry = index->entries[idx];
+        uint32_t            id     = entry.id.load(std::memory_order_acquire);
+        if (!id || entry.hash == hash) {
+            return id;
+        }
+    }
+}
+
+/**
+ * 需持有 m_arena_mutex, hash 不在表中
+ */
+static void index_insert(index_t *index, uint64_t hash, uint32_t id) {
+    for (size_t idx = index_slot(hash, index->capacity);; idx = (idx + 1) & (index->capacity - 1)) {
+        index_entry_t &entry = index->entries[idx];
+        if (!entry.id.load(std::memory_order_relaxed)) {
+            entry.hash = hash;
+            entry.id.store(id, std::memory_order_release);
+            return;
+        }
+    }
+}
+
+/**
+ * 需持有 m_arena_mutex
+ */
+static index_t *ensure_index_capacity() {
+    index_t *old_index = m_index.load(std::memory_order_relaxed);
+    if (old_index && (m_index_size + 1) * 2 <= old_index->capacity) {
+        return old_index;
+    }
+
+    size_t capacity = old_index ? old_index->capacity * 2 : ARENA_INIT_INDEX;
+    void   *mem     = arena_map(sizeof(index_t) + capacity * sizeof(index_entry_t));
+    if (!mem) {
+        return nullptr;
+    }
+    auto index = static_cast<index_t *>(mem);
+    index->capacity = capacity;
+    index->entries  = reinterpret_cast<index_entry_t *>(index + 1);
+    for (size_t i = 0; old_index && i < old_index->capacity; ++i) {
+        const index_entry_t &entry = old_index->entries[i];
+        uint32_t            id     = entry.id.load(std::memory_order_relaxed);
+        if (id) {
+            index_insert(index, entry.hash, id);
+        }
+    }
+    // 旧表不 unmap, 其他线程可能正在无锁查找
+    m_index.store(index, std::memory_order_release);
+    return index;
+}
+
+static bool ensure_records_capacity() {
+    if (m_records_size < m_records_capacity) {
+        return true;
+    }
+
+    size_t capacity = m_records_capacity ? m_records_capacity * 2 : ARENA_INIT_RECORDS;
+    auto   records  = static_cast<const uint8_t **>(arena_map(capacity * sizeof(uint8_t *)));
+    if (!records) {
+        return false;
+    }
+    if (m_records) {
+        memcpy(records, m_records, m_records_size * sizeof(uint8_t *));
+    }
+    arena_unmap(m_records, m_records_capacity * sizeof(uint8_t *));
+    m_records          = records;
+    m_records_capacity = capacity;
+    return true;
+}
+
+static bool ensure_chunk_space(size_t size) {
+    if ((size_t) (m_chunk_end - m_chunk_cursor) >= size) {
+        return true;
+    }
+    // 旧 chunk 剩余的尾部直接弃用
+    size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    auto   chunk      = static_cast<uint8_t *>(arena_map(chunk_size));
+    if (!chunk) {
+        return false;
+    }
+    m_chunk_cursor = chunk;
+    m_chunk_end    = chunk + chunk_size;
+    return true;
+}
+
+uint32_t stack_arena_intern(uint64_t hash, const wechat_backtrace::Frame *frames, size_t frame_size) {
+    if (!frames || !frame_size) {
+        return STACK_ID_INVALID;
+    }
+
+    uint32_t id = stack_arena_find(hash);
+    if (id) {
+        return id;
+    }
+
+    std::lock_guard<std::mutex> arena_lock(m_arena_mutex);
+
+    index_t *index = ensure_index_capacity();
+    if (!index) {
+        return STACK_ID_INVALID;
+    }
+    id = index_lookup(index, hash);
+    if (id) { // 其他线程刚写入
+        return id;
+    }
+
+    if (!ensure_records_capacity()
+        || !ensure_chunk_space((frame_size + 1) * VARINT_MAX_BYTES)) {
+        return STACK_ID_INVALID;
+    }
+
+    // [帧数][pc0][pc1 - pc0]...
+    const uint8_t *record = m_chunk_cursor;
+    uint8_t       *p      = write_varint(m_chunk_cursor, frame_size);
+    int64_t       prev_pc = 0;
+    for (size_t i = 0; i < frame_size; ++i) {
+        auto pc = (int64_t) frames[i].pc;
+        p = write_varint(p, zigzag_encode(pc - prev_pc));
+        prev_pc = pc;
+    }
+    m_chunk_cursor = p;
+
+    m_records[m_records_size++] = record;
+    id = (uint32_t) m_records_size;
+    index_insert(index, hash, id);
+    m_index_size++;
+    return id;
+}
+
+size_t stack_arena_restore(uint32_t id, wechat_backtrace::Frame *frames, size_t max_frames) {
+    std::lock_guard<std::mutex> arena_lock(m_arena_mutex);
+
+    if (id == STACK_ID_INVALID || id > m_records_size) {
+        return 0;
+    }
+
+    uint64_t      frame_size;
+    const uint8_t *p = read_varint(m_records[id - 1], &frame_size);
+    if (frame_size > max_frames) {
+        frame_size = max_frames;
+    }
+
+    uint64_t pc = 0;
+    for (size_t i = 0; i < frame_size; ++i) {
+        uint64_t delta;
+        p  = read_varint(p, &delta);
+        pc += (uint64_t) zigzag_decode(delta);
+        frames[i]    = wechat_backtrace::Frame();
+        frames[i].pc = (wechat_backtrace::uptr) pc;
+    }
+    return frame_size;
+}
+
+uint32_t stack_arena_find(uint64_t hash) {
+    index_t *index = m_index.load(std::memory_order_acquire);
+    return index ? index_lookup(index, hash) : STACK_ID_INVALID;
+}
+
+size_t stack_arena_mapped_size() {
+    std::lock_guard<std::mutex> arena_lock(m_arena_mutex);
+    return m_arena_mapped_size;
+}
+
+#undef TAG
@@ -0,0 +1,54 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 全局只追加的堆栈池: 以 hash_backtrace_frames 去重, 只保存 pc,
+// 相邻 pc 取差值后 zigzag + varint 编码, stack_meta_t 只持有 32 位 id
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKSTACKARENA_H
+#define LIBMATRIX_HOOK_MEMORYHOOKSTACKARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include "BacktraceDefine.h"
+
+#define STACK_ID_INVALID 0
+
+/**
+ * 相同 hash 的堆栈返回同一个 id, 已 intern 过的堆栈不加锁
+ * @return STACK_ID_INVALID 表示内存不足
+ */
+uint32_t stack_arena_intern(uint64_t hash, const wechat_backtrace::Frame *frames, size_t frame_size);
+
+/**
+ * 还原 id 对应的 pc, 只填充 Frame::pc
+ * @return 写入的帧数
+ */
+size_t stack_arena_restore(uint32_t id, wechat_backtrace::Frame *frames, size_t max_frames);
+
+/**
+ * 不加锁
+ * @return hash 对应的 id, 未 intern 过时返回 STACK_ID_INVALID
+ */
+uint32_t stack_arena_find(uint64_t hash);
+
+/**
+ * 堆栈池自身 mmap 的内存 (字节)
+ */
+size_t stack_arena_mapped_size();
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKSTACKARENA_H
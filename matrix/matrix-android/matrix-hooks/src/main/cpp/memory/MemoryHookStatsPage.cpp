@@ -0,0 +1,169 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 统计页一旦建立不再释放, 轮询方可以一直持有指针
+//
+
+#include <cstring>
+#include <ctime>
+#include <mutex>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "Log.h"
+#include "MemoryHookStatsPage.h"
+
+#define TAG "Matrix.MemoryHook.StatsPage"
+
+static std::mutex                         m_stats_page_mutex;
+static std::atomic<memory_stats_page_t *> m_stats_page(nullptr);
+
+static __thread uint32_t t_stats_stripe __attribute__((tls_model("initial-exec")));
+static __thread uint32_t t_stats_timing_countdown __attribute__((tls_model("initial-exec")));
+
+size_t stats_page_size() {
+    static const size_t page_size = (size_t) getpagesize();
+    return (sizeof(memory_stats_page_t) + page_size - 1) & ~(page_size - 1);
+}
+
+memory_stats_page_t *stats_page_init() {
+    std::lock_guard<std::mutex> stats_page_lock(m_stats_page_mutex);
+
+    memory_stats_page_t *page = m_stats_page.load(std::memory_order_relaxed);
+    if (page) {
+        return page;
+    }
+
+    void *mem = mmap(nullptr, stats_page_size(), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "stats_page_init: mmap failed");
+        return nullptr;
+    }
+    page = new(mem) memory_stats_page_t;
+    page->magic        = STATS_PAGE_MAGIC;
+    page->version      = STATS_PAGE_VERSION;
+    page->stripe_count = STATS_PAGE_STRIPES;
+    page->so_capacity  = SIZE_CLASS_MAX_SO;
+    m_stats_page.store(page, std::memory_order_release);
+    return page;
+}
+
+static inline uint32_t stripe_index() {
+    if (!t_stats_stripe) {
+        t_stats_stripe = (uint32_t) gettid() % STATS_PAGE_STRIPES + 1;
+    }
+    return t_stats_stripe - 1;
+}
+
+static inline memory_stats_stripe_t &current_stripe(memory_stats_page_t *page) {
+    return page->stripes[stripe_index()];
+}
+
+static inline uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+uint64_t stats_page_timer_begin() {
+    if (!m_stats_page.load(std::memory_order_relaxed)) {
+        return 0;
+    }
+    if (t_stats_timing_countdown) {
+        --t_stats_timing_countdown;
+        return 0;
+    }
+    t_stats_timing_countdown = STATS_PAGE_TIMING_INTERVAL - 1;
+    return now_ns();
+}
+
+static inline void add_hook_ns(memory_stats_stripe_t &stripe, uint64_t timer) {
+    if (timer) {
+        stripe.hook_ns.fetch_add((now_ns() - timer) * STATS_PAGE_TIMING_INTERVAL,
+                                 std::memory_order_relaxed);
+    }
+}
+
+void stats_page_on_alloc(size_t __size, bool __unwound, uint64_t __timer) {
+    memory_stats_page_t *page = m_stats_page.load(std::memory_order_acquire);
+    if (!page) {
+        return;
+    }
+    memory_stats_stripe_t &stripe = current_stripe(page);
+    stripe.alloc_count.fetch_add(1, std::memory_order_relaxed);
+    stripe.alloc_bytes.fetch_add(__size, std::memory_order_relaxed);
+    if (__unwound) {
+        stripe.unwind_count.fetch_add(1, std::memory_order_relaxed);
+    }
+    add_hook_ns(stripe, __timer);
+}
+
+void stats_page_on_free(uint64_t __timer) {
+    memory_stats_page_t *page = m_stats_page.load(std::memory_order_acquire);
+    if (!page) {
+        return;
+    }
+    memory_stats_stripe_t &stripe = current_stripe(page);
+    stripe.free_count.fetch_add(1, std::memory_order_relaxed);
+    add_hook_ns(stripe, __timer);
+}
+
+/**
+ * 第一次见到某个 so 时写入名字, 写完后才置为可读
+ */
+static inline void ensure_so_name(memory_stats_so_t &so, uint32_t so_index) {
+    if (so.state.load(std::memory_order_relaxed) == 2) {
+        return;
+    }
+    uint32_t expected = 0;
+    if (!so.state.compare_exchange_strong(expected, 1, std::memory_order_relaxed)) {
+        return;
+    }
+    const char *name = size_class_so_name(so_index);
+    strncpy(so.name, name ? name : "unknown", STATS_PAGE_SO_NAME_LEN - 1);
+    so.name[STATS_PAGE_SO_NAME_LEN - 1] = '\0';
+    so.state.store(2, std::memory_order_release);
+}
+
+static inline void update(uint32_t so_index, size_t size, bool is_mmap, bool acquire) {
+    memory_stats_page_t *page = m_stats_page.load(std::memory_order_acquire);
+    if (!page || so_index >= SIZE_CLASS_MAX_SO) {
+        return;
+    }
+    ensure_so_name(page->sos[so_index], so_index);
+
+    memory_stats_so_live_t &live       = page->so_lives[stripe_index()][so_index];
+    std::atomic<uint64_t>  &live_size  = is_mmap ? live.mmap_size : live.heap_size;
+    std::atomic<uint64_t>  &live_count = is_mmap ? live.mmap_count : live.heap_count;
+    if (acquire) {
+        live_size.fetch_add(size, std::memory_order_relaxed);
+        live_count.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        live_size.fetch_sub(size, std::memory_order_relaxed);
+        live_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+}
+
+void stats_page_on_acquire(uint32_t __so_index, size_t __size, bool __is_mmap) {
+    update(__so_index, __size, __is_mmap, true);
+}
+
+void stats_page_on_release(uint32_t __so_index, size_t __size, bool __is_mmap) {
+    update(__so_index, __size, __is_mmap, false);
+}
+
+#undef TAG
@@ -0,0 +1,116 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 实时统计页: 一块 MAP_SHARED 的匿名内存, hook 用 relaxed 原子计数直接更新,
+// 轮询方 (native 指针或 Java 的 DirectByteBuffer) 不加锁按固定布局读取, 不需要 dump.
+// 累计量 (分配次数/字节, 释放次数, 回溯次数, hook 耗时) 由轮询方两次读数相减得到速率.
+// 所有计数都按线程分散到 STATS_PAGE_STRIPES 份, 读取时求和: 存活量在各份中是增量,
+// 单份可能为负 (在另一个线程释放), 按 uint64 回绕相加即得总量. 全局存活量由各 so 求和得到
+//
+// 布局修改时需同步 MemoryHookStats.java 并增加 STATS_PAGE_VERSION
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKSTATSPAGE_H
+#define LIBMATRIX_HOOK_MEMORYHOOKSTATSPAGE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "MemoryHookSizeClass.h"
+
+#define STATS_PAGE_MAGIC 0x5453484D // "MHST"
+#define STATS_PAGE_VERSION 2
+#define STATS_PAGE_STRIPES 8
+#define STATS_PAGE_SO_NAME_LEN 56
+#define STATS_PAGE_TIMING_INTERVAL 64 // 每个线程每 64 次 hook 计一次耗时
+
+struct memory_stats_stripe_t {
+    std::atomic<uint64_t> alloc_count;
+    std::atomic<uint64_t> alloc_bytes;
+    std::atomic<uint64_t> free_count;
+    std::atomic<uint64_t> unwind_count;
+    /**
+     * 按 STATS_PAGE_TIMING_INTERVAL 采样后放大的估计值
+     */
+    std::atomic<uint64_t> hook_ns;
+    uint64_t              reserved[3];
+};
+
+struct memory_stats_so_t {
+    /**
+     * 0: 空, 1: 正在写入名字, 2: 名字可读
+     */
+    std::atomic<uint32_t> state;
+    uint32_t              reserved;
+    char                  name[STATS_PAGE_SO_NAME_LEN];
+};
+
+/**
+ * 某一份中某个 so 的存活量增量
+ */
+struct memory_stats_so_live_t {
+    std::atomic<uint64_t> heap_size;
+    std::atomic<uint64_t> heap_count;
+    std::atomic<uint64_t> mmap_size;
+    std::atomic<uint64_t> mmap_count;
+};
+
+struct memory_stats_page_t {
+    uint32_t               magic;
+    uint32_t               version;
+    uint32_t               stripe_count;
+    uint32_t               so_capacity;
+    uint64_t               reserved[6];
+    memory_stats_stripe_t  stripes[STATS_PAGE_STRIPES];
+    memory_stats_so_t      sos[SIZE_CLASS_MAX_SO]; // 下标即 size_class_so_index
+    /**
+     * 按份连续存放, 同一份的线程只写自己那一段
+     */
+    memory_stats_so_live_t so_lives[STATS_PAGE_STRIPES][SIZE_CLASS_MAX_SO];
+};
+
+static_assert(sizeof(std::atomic<uint64_t>) == 8, "stats page requires lock-free 64-bit atomics");
+static_assert(sizeof(memory_stats_stripe_t) == 64, "stripe must fill one cache line");
+static_assert(sizeof(memory_stats_so_t) == 64, "layout is shared with MemoryHookStats.java");
+static_assert(sizeof(memory_stats_so_live_t) == 32, "layout is shared with MemoryHookStats.java");
+static_assert(offsetof(memory_stats_page_t, stripes) == 64, "layout is shared with MemoryHookStats.java");
+static_assert(offsetof(memory_stats_page_t, so_lives) % 64 == 0, "each stripe must start on a cache line");
+
+/**
+ * 重复调用返回同一块内存, 失败时返回 nullptr
+ */
+memory_stats_page_t *stats_page_init();
+
+size_t stats_page_size();
+
+/**
+ * @return 本次 hook 需要计时时返回开始时间, 否则 (或未开启) 返回 0
+ */
+uint64_t stats_page_timer_begin();
+
+void stats_page_on_alloc(size_t __size, bool __unwound, uint64_t __timer);
+
+void stats_page_on_free(uint64_t __timer);
+
+/**
+ * 存活量, 与 size class 统计在同一处更新
+ */
+void stats_page_on_acquire(uint32_t __so_index, size_t __size, bool __is_mmap);
+
+void stats_page_on_release(uint32_t __so_index, size_t __size, bool __is_mmap);
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKSTATSPAGE_H
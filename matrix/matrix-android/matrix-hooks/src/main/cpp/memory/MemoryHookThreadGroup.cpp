@@ -0,0 +1,259 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 线程组只增不减, 组数同时作为 TLS 缓存的版本号: 添加新组后各线程在下一次分配时重新匹配.
+// 线程可能在运行中改名, 每 THREAD_GROUP_RECHECK 次分配重新读一次线程名, 名字不变时不再跑正则
+//
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <cstring>
+#include <regex.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include "Log.h"
+#include "MemoryHookSizeClass.h"
+#include "MemoryHookThreadGroup.h"
+
+#define TAG "Matrix.MemoryHook.ThreadGroup"
+
+#define THREAD_NAME_LEN 16
+#define THREAD_GROUP_RECHECK 1024
+
+enum {
+    KIND_HEAP = 0,
+    KIND_MMAP,
+    KIND_COUNT,
+};
+
+struct thread_group_bin_t {
+    std::atomic<size_t> count;
+    std::atomic<size_t> size;
+};
+
+struct thread_group_stats_t {
+    thread_group_bin_t bins[KIND_COUNT][SIZE_CLASS_MAX_SO];
+};
+
+static std::mutex                          m_group_mutex;
+static const char                          *m_group_names[THREAD_GROUP_MAX];
+static regex_t                             m_group_regex[THREAD_GROUP_MAX];
+static std::atomic<thread_group_stats_t *> m_group_stats[THREAD_GROUP_MAX];
+static std::atomic<size_t>                 m_group_count(0);
+
+static __thread uint8_t  t_group __attribute__((tls_model("initial-exec")));
+static __thread uint32_t t_group_version __attribute__((tls_model("initial-exec")));
+static __thread uint32_t t_group_countdown __attribute__((tls_model("initial-exec")));
+static __thread char     t_thread_name[THREAD_NAME_LEN] __attribute__((tls_model("initial-exec")));
+
+static thread_group_stats_t *create_stats() {
+    void *mem = mmap(nullptr, sizeof(thread_group_stats_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        LOGE(TAG, "create_stats: mmap failed");
+        return nullptr;
+    }
+    return new(mem) thread_group_stats_t;
+}
+
+bool thread_group_add(const char *__regex) {
+    if (!__regex) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> group_lock(m_group_mutex);
+
+    size_t count = m_group_count.load(std::memory_order_relaxed);
+    if (!count) {
+        m_group_names[THREAD_GROUP_OTHER] = "other";
+        m_group_stats[THREAD_GROUP_OTHER].store(create_stats(), std::memory_order_release);
+        count = 1;
+    }
+    if (count == THREAD_GROUP_MAX) {
+        LOGE(TAG, "too many thread groups, ignore %s", __regex);
+        return false;
+    }
+
+    if (0 != regcomp(&m_group_regex[count], __regex, REG_EXTENDED | REG_NOSUB)) {
+        LOGE(TAG, "regex compiled error: %s", __regex);
+        m_group_count.store(count, std::memory_order_release);
+        return false;
+    }
+    m_group_names[count] = strdup(__regex);
+    m_group_stats[count].store(create_stats(), std::memory_order_release);
+    m_group_count.store(count + 1, std::memory_order_release);
+    return true;
+}
+
+static uint8_t match_group(const char *thread_name, size_t count) {
+    for (size_t i = 1; i < count; ++i) {
+        if (0 == regexec(&m_group_regex[i], thread_name, 0, nullptr, 0)) {
+            return (uint8_t) i;
+        }
+    }
+    return THREAD_GROUP_OTHER;
+}
+
+uint8_t thread_group_current() {
+    auto count = (uint32_t) m_group_count.load(std::memory_order_acquire);
+    if (count <= 1) {
+        return THREAD_GROUP_OTHER;
+    }
+
+    if (t_group_version == count && t_group_countdown) {
+        --t_group_countdown;
+        return t_group;
+    }
+    t_group_countdown = THREAD_GROUP_RECHECK;
+
+    char name[THREAD_NAME_LEN] = {0};
+    if (0 != prctl(PR_GET_NAME, name)) {
+        return t_group_version == count ? t_group : THREAD_GROUP_OTHER;
+    }
+    if (t_group_version == count && 0 == strncmp(name, t_thread_name, THREAD_NAME_LEN)) {
+        return t_group;
+    }
+
+    memcpy(t_thread_name, name, THREAD_NAME_LEN);
+    t_group         = match_group(name, count);
+    t_group_version = count;
+    return t_group;
+}
+
+static inline void update(uint8_t group, uint32_t so_index, size_t size, bool is_mmap,
+                          bool acquire) {
+    if (group >= THREAD_GROUP_MAX || so_index >= SIZE_CLASS_MAX_SO) {
+        return;
+    }
+    thread_group_stats_t *stats = m_group_stats[group].load(std::memory_order_acquire);
+    if (!stats) {
+        return;
+    }
+    thread_group_bin_t &bin = stats->bins[is_mmap ? KIND_MMAP : KIND_HEAP][so_index];
+    if (acquire) {
+        bin.count.fetch_add(1, std::memory_order_relaxed);
+        bin.size.fetch_add(size, std::memory_order_relaxed);
+    } else {
+        bin.count.fetch_sub(1, std::memory_order_relaxed);
+        bin.size.fetch_sub(size, std::memory_order_relaxed);
+    }
+}
+
+void thread_group_on_acquire(uint8_t __group, uint32_t __so_index, size_t __size, bool __is_mmap) {
+    update(__group, __so_index, __size, __is_mmap, true);
+}
+
+void thread_group_on_release(uint8_t __group, uint32_t __so_index, size_t __size, bool __is_mmap) {
+    update(__group, __so_index, __size, __is_mmap, false);
+}
+
+struct so_usage_t {
+    uint32_t so_index;
+    size_t   count;
+    size_t   size;
+};
+
+struct group_snapshot_t {
+    const char              *name;
+    size_t                  total_count;
+    size_t                  total_size;
+    std::vector<so_usage_t> sos;
+};
+
+static void dump_kind(FILE *log_file, json_stream_writer &json, int kind) {
+    size_t group_count = m_group_count.load(std::memory_order_acquire);
+
+    // 先拷出一份, 避免排序和输出时计数仍在变化
+    std::vector<group_snapshot_t> snapshots;
+    for (size_t i = 0; i < group_count; ++i) {
+        thread_group_stats_t *stats = m_group_stats[i].load(std::memory_order_acquire);
+        if (!stats) {
+            continue;
+        }
+        group_snapshot_t snapshot{m_group_names[i], 0, 0, {}};
+        for (uint32_t so = 0; so < SIZE_CLASS_MAX_SO; ++so) {
+            size_t count = stats->bins[kind][so].count.load(std::memory_order_relaxed);
+            size_t size  = stats->bins[kind][so].size.load(std::memory_order_relaxed);
+            if (!size) {
+                continue;
+            }
+            snapshot.total_count += count;
+            snapshot.total_size += size;
+            snapshot.sos.push_back({so, count, size});
+        }
+        if (!snapshot.total_size) {
+            continue;
+        }
+        std::sort(snapshot.sos.begin(), snapshot.sos.end(),
+                  [](const so_usage_t &l, const so_usage_t &r) {
+                      return l.size > r.size;
+                  });
+        snapshots.push_back(std::move(snapshot));
+    }
+
+    std::sort(snapshots.begin(), snapshots.end(),
+              [](const group_snapshot_t &l, const group_snapshot_t &r) {
+                  return l.total_size > r.total_size;
+              });
+
+    for (auto &snapshot : snapshots) {
+        flogger(log_file, "thread group (%s) : count = %zu, size = %zu\n", snapshot.name,
+                snapshot.total_count, snapshot.total_size);
+
+        json.begin_object()
+                .key("group").value(snapshot.name)
+                .key("count").value_as_string(snapshot.total_count)
+                .key("size").value_as_string(snapshot.total_size)
+                .key("sos").begin_array();
+
+        for (auto &so : snapshot.sos) {
+            const char *so_name = size_class_so_name(so.so_index);
+            flogger(log_file, "   so = %s, count = %zu, size = %zu\n", so_name, so.count, so.size);
+
+            json.begin_object()
+                    .key("so").value(so_name)
+                    .key("count").value_as_string(so.count)
+                    .key("size").value_as_string(so.size)
+                    .end_object();
+        }
+
+        json.end_array()
+                .end_object();
+    }
+}
+
+void thread_group_dump(FILE *__log_file, json_stream_writer &__json, bool __mmap) {
+    if (m_group_count.load(std::memory_order_acquire) <= 1) {
+        return;
+    }
+
+    flogger(__log_file, "\n######################## thread group (heap) ########################\n");
+    __json.key("ThreadGroupNativeHeap").begin_array();
+    dump_kind(__log_file, __json, KIND_HEAP);
+    __json.end_array();
+
+    if (__mmap) {
+        flogger(__log_file, "\n######################## thread group (mmap) ########################\n");
+        __json.key("ThreadGroupMmap").begin_array();
+        dump_kind(__log_file, __json, KIND_MMAP);
+        __json.end_array();
+    }
+}
+
+#undef TAG
@@ -0,0 +1,54 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+//
+// 按线程组统计 native 内存: 线程名按注册的正则归入线程组 (与 PthreadHook 的线程名匹配方式一致),
+// 每个分配记下所属线程组的 id, 各组的存活量按 so 用原子计数增量维护, dump 时不需要遍历指针.
+// 线程组 id 缓存在 TLS 中, 只在线程名变化时重新匹配
+//
+
+#ifndef LIBMATRIX_HOOK_MEMORYHOOKTHREADGROUP_H
+#define LIBMATRIX_HOOK_MEMORYHOOKTHREADGROUP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include "JsonStreamWriter.h"
+
+#define THREAD_GROUP_MAX 32 // 含 other
+#define THREAD_GROUP_OTHER 0
+
+/**
+ * 按添加顺序匹配, 先匹配上的优先; 都不匹配的线程归入 other
+ * @return 正则非法或线程组已满时返回 false
+ */
+bool thread_group_add(const char *__regex);
+
+/**
+ * 当前线程所属的线程组, 未添加任何线程组时恒为 THREAD_GROUP_OTHER
+ */
+uint8_t thread_group_current();
+
+void thread_group_on_acquire(uint8_t __group, uint32_t __so_index, size_t __size, bool __is_mmap);
+
+void thread_group_on_release(uint8_t __group, uint32_t __so_index, size_t __size, bool __is_mmap);
+
+/**
+ * 输出各线程组的存活量, 及组内按 so 的分布
+ */
+void thread_group_dump(FILE *__log_file, json_stream_writer &__json, bool __mmap);
+
+#endif //LIBMATRIX_HOOK_MEMORYHOOKTHREADGROUP_H
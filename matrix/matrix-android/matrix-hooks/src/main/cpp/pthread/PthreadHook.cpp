@@ -30,6 +30,9 @@
 #include <regex.h>
 #include <Utils.h>
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <Backtrace.h>
 #include "PthreadExt.h"
 #include "PthreadHook.h"
@@ -38,8 +41,8 @@
 #include "JNICommon.h"
 #include "cJSON.h"
 #include "ReentrantPrevention.h"
+#include "Symbolizer.h"
 
-#define ORIGINAL_LIB "libc.so"
 #define TAG "Matrix.PthreadHook"
 
 #define THREAD_NAME_LEN 16
@@ -53,44 +56,76 @@ static volatile bool m_quicken_unwind = false;
 static volatile size_t m_pthread_backtrace_max_frames =
         m_quicken_unwind ? PTHREAD_BACKTRACE_MAX_FRAMES_LONG : PTHREAD_BACKTRACE_MAX_FRAMES;
 
-struct pthread_meta_t {
-    pid_t tid;
-    char *thread_name;
-//    char  *parent_name;
+struct pthread_stack_key_t {
+    uint64_t native_hash;
+    uint64_t java_hash;
     wechat_backtrace::BacktraceMode unwind_mode;
 
+    friend bool operator<(const pthread_stack_key_t &left, const pthread_stack_key_t &right) {
+        if (left.native_hash != right.native_hash) {
+            return left.native_hash < right.native_hash;
+        }
+        if (left.java_hash != right.java_hash) {
+            return left.java_hash < right.java_hash;
+        }
+        return left.unwind_mode < right.unwind_mode;
+    }
+};
+
+/**
+ * 创建堆栈相同的线程共享一份. 没有存活线程时释放堆栈内容, 只保留 hash 和计数,
+ * 同一堆栈再次创建线程时重新填入. live 的增减及堆栈内容的释放和填入都需持有所在 shard 的锁
+ */
+struct pthread_stack_t {
     uint64_t hash;
 
+    wechat_backtrace::BacktraceMode unwind_mode;
+
     wechat_backtrace::Backtrace native_backtrace;
 
-    std::atomic<char *> java_stacktrace;
+    char *java_stacktrace;
+
+    /**
+     * 由此堆栈创建且未退出的线程数
+     */
+    std::atomic<size_t> live;
+
+    /**
+     * 由此堆栈创建过的线程数
+     */
+    std::atomic<size_t> total;
+};
+
+struct pthread_meta_t {
+    pid_t tid;
+    char *thread_name;
+//    char  *parent_name;
+
+    /**
+     * 线程名匹配 add_hook_thread_name 的正则, 只有这些线程参与 pthread_dump_json
+     */
+    bool filtered;
+
+    /**
+     * 没有取到任何堆栈时为 nullptr
+     */
+    pthread_stack_t *stack;
 
     pthread_meta_t() : tid(0),
                        thread_name(nullptr),
 //                       parent_name(nullptr),
-                       unwind_mode(wechat_backtrace::FramePointer),
-                       hash(0),
-                       native_backtrace(BACKTRACE_INITIALIZER(m_pthread_backtrace_max_frames)),
-                       java_stacktrace(nullptr) {
-    }
-
-    ~pthread_meta_t() = default;
-
-    pthread_meta_t(const pthread_meta_t &src) {
-        tid = src.tid;
-        thread_name = src.thread_name;
-//        parent_name       = src.parent_name;
-        unwind_mode = src.unwind_mode;
-        hash = src.hash;
-        native_backtrace = src.native_backtrace;
-        java_stacktrace.store(src.java_stacktrace.load(std::memory_order_acquire),
-                              std::memory_order_release);
+                       filtered(false),
+                       stack(nullptr) {
     }
 };
 
 typedef struct {
     pthread_routine_t origin_func;
     void *origin_args;
+    /**
+     * 父线程记录完 meta 后置 1 并唤醒, 子线程在此之前不执行 routine
+     */
+    std::atomic<int> created;
 } routine_wrapper_t;
 
 struct regex_wrapper {
@@ -104,21 +139,62 @@ struct regex_wrapper {
     }
 };
 
-static std::mutex m_pthread_meta_mutex;
 static std::timed_mutex m_java_stacktrace_mutex;
 typedef std::lock_guard<std::mutex> pthread_meta_lock;
 
-static std::map<pthread_t, pthread_meta_t> m_pthread_metas;
-static std::set<pthread_t> m_filtered_pthreads;
+#define PTHREAD_META_SHARDS 64 // power of 2
 
-static std::set<regex_wrapper> m_hook_thread_name_regex;
+/**
+ * 按 pthread_t 分片, 创建, 改名和退出只锁所在的分片. 回溯在锁外完成
+ */
+struct pthread_meta_shard_t {
+    std::mutex                          mutex;
+    std::map<pthread_t, pthread_meta_t> metas;
+};
 
-static pthread_key_t m_destructor_key;
+static pthread_meta_shard_t m_pthread_meta_shards[PTHREAD_META_SHARDS];
+
+static inline pthread_meta_shard_t &pthread_meta_shard(pthread_t __pthread) {
+    // pthread_t 为线程结构体的地址, 低位对齐无区分度
+    uint64_t h = (uint64_t) __pthread * 0x9E3779B97F4A7C15ULL;
+    return m_pthread_meta_shards[(h >> 32) & (PTHREAD_META_SHARDS - 1)];
+}
+
+/**
+ * dump 期间按顺序持有所有分片的锁
+ */
+class pthread_meta_all_lock {
+
+public:
+
+    pthread_meta_all_lock() {
+        for (auto &shard : m_pthread_meta_shards) {
+            shard.mutex.lock();
+        }
+    }
+
+    ~pthread_meta_all_lock() {
+        for (size_t i = PTHREAD_META_SHARDS; i > 0; --i) {
+            m_pthread_meta_shards[i - 1].mutex.unlock();
+        }
+    }
+};
+
+#define PTHREAD_STACK_SHARDS 16 // power of 2
 
-static std::mutex m_subroutine_mutex;
-static std::condition_variable m_subroutine_cv;
+struct pthread_stack_shard_t {
+    std::mutex                                         mutex;
+    std::map<pthread_stack_key_t, pthread_stack_t *> stacks;
+};
 
-static std::set<pthread_t> m_pthread_routine_flags;
+static pthread_stack_shard_t m_pthread_stack_shards[PTHREAD_STACK_SHARDS];
+
+static std::atomic<size_t> m_thread_leak_threshold(0);
+static std::atomic<thread_leak_callback_t> m_thread_leak_callback(nullptr);
+
+static std::set<regex_wrapper> m_hook_thread_name_regex;
+
+static pthread_key_t m_destructor_key;
 
 static void on_pthread_destroy(void *__specific);
 
@@ -128,8 +204,6 @@ void pthread_hook_init() {
     if (!m_destructor_key) {
         pthread_key_create(&m_destructor_key, on_pthread_destroy);
     }
-
-    rp_init();
 }
 
 void add_hook_thread_name(const char *__regex_str) {
@@ -161,16 +235,93 @@ static bool test_match_thread_name(pthread_meta_t &__meta) {
     return false;
 }
 
-static inline bool
-on_pthread_create_locked(const pthread_t __pthread, char *__java_stacktrace, bool quicken_unwind, pid_t __tid) {
-    pthread_meta_lock meta_lock(m_pthread_meta_mutex);
+static inline pthread_stack_shard_t &pthread_stack_shard(uint64_t __hash) {
+    uint64_t h = __hash * 0x9E3779B97F4A7C15ULL;
+    return m_pthread_stack_shards[(h >> 32) & (PTHREAD_STACK_SHARDS - 1)];
+}
+
+/**
+ * 取出相同堆栈的共享记录并把 live 加 1, 没有则用 __backtrace 和 __java_stacktrace 新建.
+ * 接管 __java_stacktrace, 不需要时释放
+ * @param __live 返回加 1 后的 live
+ */
+static pthread_stack_t *intern_pthread_stack(const pthread_stack_key_t &__key,
+                                             const wechat_backtrace::Backtrace &__backtrace,
+                                             char *__java_stacktrace,
+                                             size_t *__live) {
+    uint64_t              hash   = hash_combine(__key.native_hash, __key.java_hash);
+    pthread_stack_shard_t &shard = pthread_stack_shard(hash);
+
+    std::lock_guard<std::mutex> stack_lock(shard.mutex);
+
+    pthread_stack_t *stack;
+    auto            it = shard.stacks.find(__key);
+    if (it != shard.stacks.end()) {
+        stack = it->second;
+        if (!stack->live.load(std::memory_order_relaxed)) { // 内容已释放, 重新填入
+            stack->native_backtrace = __backtrace;
+            stack->java_stacktrace  = __java_stacktrace;
+        } else if (__java_stacktrace) {
+            free(__java_stacktrace);
+        }
+    } else {
+        stack = new pthread_stack_t{
+                hash,
+                __key.unwind_mode,
+                __backtrace,
+                __java_stacktrace,
+                {0},
+                {0},
+        };
+        shard.stacks.emplace(__key, stack);
+
+        LOGD(TAG, "intern_pthread_stack: new stack hash = %llu",
+             (wechat_backtrace::ullint_t) stack->hash);
+    }
+
+    stack->total.fetch_add(1, std::memory_order_relaxed);
+    *__live = stack->live.fetch_add(1, std::memory_order_relaxed) + 1;
+    return stack;
+}
+
+/**
+ * 最后一个线程退出时释放 java 堆栈 (1 KB) 和 native 帧
+ */
+static void release_pthread_stack(pthread_stack_t *__stack) {
+    pthread_stack_shard_t       &shard = pthread_stack_shard(__stack->hash);
+    std::lock_guard<std::mutex> stack_lock(shard.mutex);
 
-    if (m_pthread_metas.count(__pthread)) {
-        LOGD(TAG, "on_pthread_create: thread already recorded");
-        return false;
+    if (__stack->live.fetch_sub(1, std::memory_order_relaxed) != 1) {
+        return;
     }
+    free(__stack->java_stacktrace);
+    __stack->java_stacktrace  = nullptr;
+    __stack->native_backtrace = {};
+}
 
-    pthread_meta_t &meta = m_pthread_metas[__pthread];
+static void check_thread_leak(pthread_stack_t *__stack, size_t __live) {
+    // 只在超过阈值的那一次报警, 回落后再次超过时重新报警
+    size_t threshold = m_thread_leak_threshold.load(std::memory_order_relaxed);
+    if (!threshold || __live != threshold + 1) {
+        return;
+    }
+
+    LOGE(TAG, "thread leak: stack hash = %llu, live = %zu, total = %zu, threshold = %zu",
+         (wechat_backtrace::ullint_t) __stack->hash, __live,
+         __stack->total.load(std::memory_order_relaxed), threshold);
+
+    thread_leak_callback_t callback = m_thread_leak_callback.load(std::memory_order_acquire);
+    if (callback) {
+        callback(__stack->hash, __live, __stack->total.load(std::memory_order_relaxed));
+    }
+}
+
+/**
+ * 接管 __java_stacktrace
+ */
+static inline void
+on_pthread_create_impl(const pthread_t __pthread, char *__java_stacktrace, bool quicken_unwind, pid_t __tid) {
+    pthread_meta_t meta;
 
     meta.tid = __tid;
 
@@ -185,47 +336,60 @@ on_pthread_create_locked(const pthread_t __pthread, char *__java_stacktrace, boo
 
     LOGD(TAG, "on_pthread_create: pthread = %ld, thread name: %s", __pthread, meta.thread_name);
 
-    if (test_match_thread_name(meta)) {
-        m_filtered_pthreads.insert(__pthread);
-    }
+    meta.filtered = test_match_thread_name(meta);
 
-    uint64_t native_hash = 0;
-    uint64_t java_hash = 0;
+    wechat_backtrace::Backtrace native_backtrace = BACKTRACE_INITIALIZER(
+            m_pthread_backtrace_max_frames);
+    pthread_stack_key_t key{0, 0, wechat_backtrace::FramePointer};
 
     if (quicken_unwind) {
-        meta.unwind_mode = wechat_backtrace::Quicken;
-        wechat_backtrace::quicken_based_unwind(meta.native_backtrace.frames.get(),
-                                               meta.native_backtrace.max_frames,
-                                               meta.native_backtrace.frame_size);
+        key.unwind_mode = wechat_backtrace::Quicken;
+        wechat_backtrace::quicken_based_unwind(native_backtrace.frames.get(),
+                                               native_backtrace.max_frames,
+                                               native_backtrace.frame_size);
     } else {
-        meta.unwind_mode = wechat_backtrace::get_backtrace_mode();
-        wechat_backtrace::unwind_adapter(meta.native_backtrace.frames.get(),
-                                         meta.native_backtrace.max_frames,
-                                         meta.native_backtrace.frame_size);
+        key.unwind_mode = wechat_backtrace::get_backtrace_mode();
+        wechat_backtrace::unwind_adapter(native_backtrace.frames.get(),
+                                         native_backtrace.max_frames,
+                                         native_backtrace.frame_size);
     }
-    native_hash = hash_backtrace_frames(&(meta.native_backtrace));
-
+    key.native_hash = hash_backtrace_frames(&native_backtrace);
 
     if (__java_stacktrace) {
-        meta.java_stacktrace.store(__java_stacktrace);
-        java_hash = hash_str(__java_stacktrace);
-        LOGD(TAG, "on_pthread_create: java hash = %llu", (wechat_backtrace::ullint_t) java_hash);
+        key.java_hash = hash_str(__java_stacktrace);
+        LOGD(TAG, "on_pthread_create: java hash = %llu", (wechat_backtrace::ullint_t) key.java_hash);
     }
 
-    if (native_hash || java_hash) {
-        meta.hash = hash_combine(native_hash, java_hash);
+    size_t live = 0;
+    if (key.native_hash || key.java_hash) {
+        meta.stack = intern_pthread_stack(key, native_backtrace, __java_stacktrace, &live);
+    } else if (__java_stacktrace) {
+        free(__java_stacktrace);
     }
 
-    return true;
-}
-
-static void notify_routine(const pthread_t __pthread) {
-    std::lock_guard<std::mutex> routine_lock(m_subroutine_mutex);
+    {
+        pthread_meta_shard_t &shard = pthread_meta_shard(__pthread);
+        pthread_meta_lock meta_lock(shard.mutex);
+
+        if (!shard.metas.emplace(__pthread, meta).second) {
+            LOGD(TAG, "on_pthread_create: thread already recorded");
+            free(meta.thread_name);
+            if (meta.stack) {
+                meta.stack->total.fetch_sub(1, std::memory_order_relaxed);
+                release_pthread_stack(meta.stack);
+            }
+            return;
+        }
+    }
 
-    m_pthread_routine_flags.emplace(__pthread);
-    LOGD(TAG, "notify waiting count : %zu", m_pthread_routine_flags.size());
+    if (meta.stack) {
+        check_thread_leak(meta.stack, live);
+    }
+}
 
-    m_subroutine_cv.notify_all();
+static inline void notify_routine(routine_wrapper_t *__wrapper) {
+    __wrapper->created.store(1, std::memory_order_release);
+    syscall(__NR_futex, &__wrapper->created, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
 }
 
 // notice: 在父线程回调此函数
@@ -242,7 +406,6 @@ static void on_pthread_create(const pthread_t __pthread) {
 
     if (!rp_acquire()) {
         LOGD(TAG, "reentrant!!!");
-        notify_routine(__pthread);
         return;
     }
 
@@ -260,25 +423,20 @@ static void on_pthread_create(const pthread_t __pthread) {
         }
 
         LOGD(TAG, "parent_tid: %d -> tid: %d", pthread_gettid_np(pthread_self()), tid);
-        bool recorded = on_pthread_create_locked(__pthread, java_stacktrace, false, tid);
-
-        if (!recorded && java_stacktrace) {
-            free(java_stacktrace);
-        }
+        on_pthread_create_impl(__pthread, java_stacktrace, false, tid);
     } else {
         LOGD(TAG, "parent_tid: %d -> tid: %d", pthread_gettid_np(pthread_self()), tid);
-        on_pthread_create_locked(__pthread, nullptr, true, tid);
+        on_pthread_create_impl(__pthread, nullptr, true, tid);
     }
 //
     rp_release();
-    notify_routine(__pthread);
 
     LOGD(TAG, "------ on_pthread_create end");
 }
 
 /**
  * ~~on_pthread_setname 有可能在 on_pthread_create 之前先执行~~
- * 在增加了 cond 之后, 必然后于 on_pthread_create 执行
+ * 子线程等待父线程记录完 meta 后才执行 routine, 因此必然后于 on_pthread_create 执行
  *
  * @param __pthread
  * @param __name
@@ -299,9 +457,11 @@ static void on_pthread_setname(pthread_t __pthread, const char *__name) {
     LOGD(TAG, "++++++++ pre on_pthread_setname tid: %d, %s", pthread_gettid_np(__pthread), __name);
 
     {
-        pthread_meta_lock meta_lock(m_pthread_meta_mutex);
+        pthread_meta_shard_t &shard = pthread_meta_shard(__pthread);
+        pthread_meta_lock meta_lock(shard.mutex);
 
-        if (!m_pthread_metas.count(__pthread)) { // always false
+        auto it = shard.metas.find(__pthread);
+        if (it == shard.metas.end()) { // always false
             // 到这里说明没有回调 on_pthread_create, setname 对 on_pthread_create 是可见的
             auto lost_thread_name = static_cast<char *>(malloc(sizeof(char) * THREAD_NAME_LEN));
             pthread_getname_ext(__pthread, lost_thread_name, THREAD_NAME_LEN);
@@ -315,121 +475,117 @@ static void on_pthread_setname(pthread_t __pthread, const char *__name) {
 
         // 到这里说明 on_pthread_create 已经回调了, 需要修正并检查新的线程名是否 match 正则
 
-        pthread_meta_t &meta = m_pthread_metas.at(__pthread);
+        pthread_meta_t &meta = it->second;
 
         LOGD(TAG, "on_pthread_setname: %s -> %s, tid:%d", meta.thread_name, __name, meta.tid);
 
         assert(meta.thread_name != nullptr);
         strncpy(meta.thread_name, __name, THREAD_NAME_LEN);
 
-        bool parent_match = m_filtered_pthreads.count(__pthread) != 0;
-
-        // 如果新线程名不 match, 但父线程名 match, 说明需要从 filter 集合中移除
-        if (!test_match_thread_name(meta) && parent_match) {
-            m_filtered_pthreads.erase(__pthread);
-            LOGD(TAG, "--------------------------");
-            return;
-        }
-
-        // 如果新线程 match, 但父线程名不 match, 说明需要添加仅 filter 集合
-        if (test_match_thread_name(meta) && !parent_match) {
-            m_filtered_pthreads.insert(__pthread);
-            LOGD(TAG, "--------------------------");
-            return;
-        }
+        // 新线程名 match 则加入, 否则移出, 与父线程名是否 match 无关
+        meta.filtered = test_match_thread_name(meta);
     }
 
-    // 否则, 啥也不干 (都 match, 都不 match)
     LOGD(TAG, "--------------------------");
 }
 
-static inline void before_routine_start() {
+static inline void before_routine_start(routine_wrapper_t *__wrapper) {
     LOGI(TAG, "before_routine_start");
-    std::unique_lock<std::mutex> routine_lock(m_subroutine_mutex);
-
-    pthread_t self_thread = pthread_self();
 
-    m_subroutine_cv.wait(routine_lock, [&self_thread] {
-        return m_pthread_routine_flags.count(self_thread);
-    });
-
-    LOGI(TAG, "before_routine_start: create ready, just continue, waiting count : %zu",
-         m_pthread_routine_flags.size());
+    while (!__wrapper->created.load(std::memory_order_acquire)) {
+        syscall(__NR_futex, &__wrapper->created, FUTEX_WAIT_PRIVATE, 0, nullptr, nullptr, 0);
+    }
 
-    m_pthread_routine_flags.erase(self_thread);
+    LOGI(TAG, "before_routine_start: create ready, just continue");
 }
 
 
-static inline void pthread_dump_impl(FILE *__log_file) {
-    if (!__log_file) {
-        LOGE(TAG, "open file failed");
+static inline void pthread_dump_meta(FILE *__log_file, pthread_meta_t &__meta) {
+    LOGD(TAG, "========> RETAINED PTHREAD { name : %s, tid: %d }", __meta.thread_name, __meta.tid);
+    flogger(__log_file, "========> RETAINED PTHREAD { name : %s, tid: %d }\n",
+            __meta.thread_name, __meta.tid);
+    std::stringstream stack_builder;
+
+    pthread_stack_t *stack = __meta.stack;
+    if (!stack || stack->native_backtrace.frame_size == 0) {
         return;
     }
 
-    for (auto &i: m_pthread_metas) {
-        auto &meta = i.second;
-        LOGD(TAG, "========> RETAINED PTHREAD { name : %s, tid: %d }", meta.thread_name, meta.tid);
-        flogger(__log_file, "========> RETAINED PTHREAD { name : %s, tid: %d }\n",
-                meta.thread_name, meta.tid);
-        std::stringstream stack_builder;
+    if (stack->unwind_mode == wechat_backtrace::FramePointer) {
+        LOGD(TAG, "native stacktrace:");
+        flogger(__log_file, "native stacktrace:\n");
+
+        auto frame_detail_lambda = [&__log_file](wechat_backtrace::FrameDetail detail) -> void {
+            LOGD(TAG, "  #pc %"
+                    PRIxPTR
+                    " %s (%s)",
+                 detail.rel_pc,
+                 detail.function_name,
+                 detail.map_name);
+            flogger(__log_file, "  #pc %" PRIxPTR " %s (%s)\n", detail.rel_pc,
+                    detail.function_name, detail.map_name);
+        };
+
+        symbolizer_restore(stack->native_backtrace.frames.get(),
+                           stack->native_backtrace.frame_size,
+                           frame_detail_lambda);
+
+        LOGD(TAG, "java stacktrace:\n%s", stack->java_stacktrace);
+        flogger(__log_file, "java stacktrace:\n%s\n",
+                stack->java_stacktrace);
+    } else if (stack->unwind_mode == wechat_backtrace::Quicken) {
+
+        LOGD(TAG, "native stacktrace:");
+        flogger(__log_file, "native stacktrace:\n");
+
+        size_t elements_size = 0;
+        const size_t max_elements = PTHREAD_BACKTRACE_FRAME_ELEMENTS_MAX_SIZE;
+        wechat_backtrace::FrameElement stacktrace_elements[max_elements];
+
+        get_stacktrace_elements(stack->native_backtrace.frames.get(),
+                                stack->native_backtrace.frame_size,
+                                true, stacktrace_elements,
+                                max_elements, elements_size);
+
+        for (size_t i = 0; i < elements_size; i++) {
+            std::string data;
+            wechat_backtrace::quicken_frame_format(stacktrace_elements[i], i, data);
+            LOGD(TAG, "%s", data.c_str());
+            flogger(__log_file, data.c_str());
 
-        if (meta.native_backtrace.frame_size == 0) {
-            continue;
         }
 
-        if (meta.unwind_mode == wechat_backtrace::FramePointer) {
-            LOGD(TAG, "native stacktrace:");
-            flogger(__log_file, "native stacktrace:\n");
-
-            auto frame_detail_lambda = [&__log_file](wechat_backtrace::FrameDetail detail) -> void {
-                int status = 0;
-                char *demangled_name = abi::__cxa_demangle(detail.function_name, nullptr, 0,
-                                                           &status);
-
-                LOGD(TAG, "  #pc %"
-                        PRIxPTR
-                        " %s (%s)",
-                     detail.rel_pc,
-                     demangled_name ? demangled_name : "(null)",
-                     detail.map_name);
-                flogger(__log_file, "  #pc %" PRIxPTR " %s (%s)\n", detail.rel_pc,
-                        demangled_name ? demangled_name : "(null)", detail.map_name);
-
-                free(demangled_name);
-            };
-
-            wechat_backtrace::restore_frame_detail(meta.native_backtrace.frames.get(),
-                                                   meta.native_backtrace.frame_size,
-                                                   frame_detail_lambda);
-
-            LOGD(TAG, "java stacktrace:\n%s", meta.java_stacktrace.load(std::memory_order_acquire));
-            flogger(__log_file, "java stacktrace:\n%s\n",
-                    meta.java_stacktrace.load(std::memory_order_acquire));
-        } else if (meta.unwind_mode == wechat_backtrace::Quicken) {
-
-            LOGD(TAG, "native stacktrace:");
-            flogger(__log_file, "native stacktrace:\n");
-
-            size_t elements_size = 0;
-            const size_t max_elements = PTHREAD_BACKTRACE_FRAME_ELEMENTS_MAX_SIZE;
-            wechat_backtrace::FrameElement stacktrace_elements[max_elements];
-
-            get_stacktrace_elements(meta.native_backtrace.frames.get(),
-                                    meta.native_backtrace.frame_size,
-                                    true, stacktrace_elements,
-                                    max_elements, elements_size);
+        LOGD(TAG, "java stacktrace:\n%s", stack->java_stacktrace);
+        flogger(__log_file, "java stacktrace:\n%s\n",
+                stack->java_stacktrace);
+    }
+}
 
-            for (size_t i = 0; i < elements_size; i++) {
-                std::string data;
-                wechat_backtrace::quicken_frame_format(stacktrace_elements[i], i, data);
-                LOGD(TAG, "%s", data.c_str());
-                flogger(__log_file, data.c_str());
+static inline void pthread_dump_impl(FILE *__log_file) {
+    if (!__log_file) {
+        LOGE(TAG, "open file failed");
+        return;
+    }
 
+    {
+        std::vector<wechat_backtrace::uptr> pcs;
+        for (auto &shard : m_pthread_stack_shards) {
+            std::lock_guard<std::mutex> stack_lock(shard.mutex);
+            for (auto &i: shard.stacks) {
+                auto stack = i.second;
+                if (stack->live.load(std::memory_order_relaxed)
+                    && stack->unwind_mode == wechat_backtrace::FramePointer) {
+                    symbolizer_collect(stack->native_backtrace.frames.get(),
+                                       stack->native_backtrace.frame_size, pcs);
+                }
             }
+        }
+        symbolizer_resolve(pcs);
+    }
 
-            LOGD(TAG, "java stacktrace:\n%s", meta.java_stacktrace.load(std::memory_order_acquire));
-            flogger(__log_file, "java stacktrace:\n%s\n",
-                    meta.java_stacktrace.load(std::memory_order_acquire));
+    for (auto &shard : m_pthread_meta_shards) {
+        for (auto &i: shard.metas) {
+            pthread_dump_meta(__log_file, i.second);
         }
     }
 }
@@ -437,7 +593,7 @@ static inline void pthread_dump_impl(FILE *__log_file) {
 void pthread_dump(const char *__path) {
     LOGD(TAG,
          ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> pthread dump begin <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<");
-    pthread_meta_lock meta_lock(m_pthread_meta_mutex);
+    pthread_meta_all_lock meta_lock;
 
     FILE *log_file = fopen(__path, "w+");
     LOGD(TAG, "pthread dump path = %s", __path);
@@ -453,16 +609,28 @@ void pthread_dump(const char *__path) {
 
 static inline void pthread_dump_json_impl(FILE *__log_file) {
 
-    LOGD(TAG, "pthread dump waiting count: %zu", m_pthread_routine_flags.size());
+    // 堆栈已在创建时去重, 这里只按堆栈归集线程, 每个堆栈只还原一次
+    std::map<pthread_stack_t *, std::vector<const pthread_meta_t *>> pthread_metas_by_stack;
 
-    std::map<uint64_t, std::vector<pthread_meta_t>> pthread_metas_by_hash;
+    for (auto &shard : m_pthread_meta_shards) {
+        for (auto &i : shard.metas) {
+            auto &meta = i.second;
+            if (meta.filtered && meta.stack) {
+                pthread_metas_by_stack[meta.stack].emplace_back(&meta);
+            }
+        }
+    }
 
-    for (auto &i : m_filtered_pthreads) {
-        auto &meta = m_pthread_metas[i];
-        if (meta.hash) {
-            auto &hash_bucket = pthread_metas_by_hash[meta.hash];
-            hash_bucket.emplace_back(meta);
+    {
+        std::vector<wechat_backtrace::uptr> pcs;
+        for (auto &i : pthread_metas_by_stack) {
+            auto stack = i.first;
+            if (stack->unwind_mode == wechat_backtrace::FramePointer) {
+                symbolizer_collect(stack->native_backtrace.frames.get(),
+                                   stack->native_backtrace.frame_size, pcs);
+            }
         }
+        symbolizer_resolve(pcs);
     }
 
     char *json_str = NULL;
@@ -480,8 +648,8 @@ static inline void pthread_dump_json_impl(FILE *__log_file) {
         goto err;
     }
 
-    for (auto &i : pthread_metas_by_hash) {
-        auto &hash = i.first;
+    for (auto &i : pthread_metas_by_stack) {
+        auto stack = i.first;
         auto &metas = i.second;
 
         cJSON *hash_obj = cJSON_CreateObject();
@@ -490,46 +658,34 @@ static inline void pthread_dump_json_impl(FILE *__log_file) {
             goto err;
         }
 
-        cJSON_AddStringToObject(hash_obj, "hash", std::to_string(hash).c_str());
+        cJSON_AddStringToObject(hash_obj, "hash", std::to_string(stack->hash).c_str());
         assert(!metas.empty());
 
-        auto meta = metas.front();
-        auto front_backtrace = &metas.front().native_backtrace;
-        if (meta.unwind_mode == wechat_backtrace::FramePointer) {
+        auto front_backtrace = &stack->native_backtrace;
+        if (stack->unwind_mode == wechat_backtrace::FramePointer) {
             std::stringstream stack_builder;
 
             auto frame_detail_lambda = [&stack_builder](
                     wechat_backtrace::FrameDetail detail) -> void {
-                char *demangled_name = nullptr;
-
-                int status = 0;
-                demangled_name = abi::__cxa_demangle(detail.function_name, nullptr, nullptr,
-                                                     &status);
-
                 stack_builder << "#pc " << std::hex << detail.rel_pc << " "
-                              << (demangled_name ? demangled_name : "(null)")
+                              << detail.function_name
                               << " ("
                               << detail.map_name
                               << ");";
 
-                LOGE(TAG, "#pc %p %s %s", (void *) detail.rel_pc, demangled_name,
+                LOGE(TAG, "#pc %p %s %s", (void *) detail.rel_pc, detail.function_name,
                      detail.map_name);
-
-                if (demangled_name) {
-                    free(demangled_name);
-                }
             };
 
-            wechat_backtrace::restore_frame_detail(
-                    front_backtrace->frames.get(), front_backtrace->frame_size, frame_detail_lambda);
+            symbolizer_restore(front_backtrace->frames.get(), front_backtrace->frame_size,
+                               frame_detail_lambda);
 
             LOGE(TAG, "-------------------");
             cJSON_AddStringToObject(hash_obj, "native", stack_builder.str().c_str());
 
-            const char *java_stacktrace = metas.front().java_stacktrace.load(
-                    std::memory_order_acquire);
+            const char *java_stacktrace = stack->java_stacktrace;
             cJSON_AddStringToObject(hash_obj, "java", java_stacktrace ? java_stacktrace : "");
-        } else if (meta.unwind_mode == wechat_backtrace::Quicken) {
+        } else if (stack->unwind_mode == wechat_backtrace::Quicken) {
             std::stringstream native_stack_builder;
             std::stringstream java_stack_builder;
 
@@ -567,6 +723,10 @@ static inline void pthread_dump_json_impl(FILE *__log_file) {
         }
 
         cJSON_AddStringToObject(hash_obj, "count", std::to_string(metas.size()).c_str());
+        cJSON_AddStringToObject(hash_obj, "live",
+                                std::to_string(stack->live.load(std::memory_order_relaxed)).c_str());
+        cJSON_AddStringToObject(hash_obj, "total",
+                                std::to_string(stack->total.load(std::memory_order_relaxed)).c_str());
 
         cJSON *same_hash_metas_arr = cJSON_AddArrayToObject(hash_obj, "threads");
 
@@ -581,8 +741,8 @@ static inline void pthread_dump_json_impl(FILE *__log_file) {
                 goto err;
             }
 
-            cJSON_AddStringToObject(meta_obj, "tid", std::to_string(meta.tid).c_str());
-            cJSON_AddStringToObject(meta_obj, "name", meta.thread_name);
+            cJSON_AddStringToObject(meta_obj, "tid", std::to_string(meta->tid).c_str());
+            cJSON_AddStringToObject(meta_obj, "name", meta->thread_name);
 
             cJSON_AddItemToArray(same_hash_metas_arr, meta_obj);
         }
@@ -607,6 +767,11 @@ static inline void pthread_dump_json_impl(FILE *__log_file) {
     return;
 }
 
+void set_thread_leak_threshold(size_t __threshold, thread_leak_callback_t __callback) {
+    m_thread_leak_callback.store(__callback, std::memory_order_release);
+    m_thread_leak_threshold.store(__threshold, std::memory_order_relaxed);
+}
+
 void enable_quicken_unwind(const bool enable) {
     m_quicken_unwind = enable;
     m_pthread_backtrace_max_frames =
@@ -617,7 +782,7 @@ void pthread_dump_json(const char *path) {
 
     LOGD(TAG,
          ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>> pthread dump json begin <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<");
-    pthread_meta_lock meta_lock(m_pthread_meta_mutex);
+    pthread_meta_all_lock meta_lock;
 
     FILE *log_file = fopen(path, "w+");
     LOGD(TAG, "pthread dump path = %s", path);
@@ -635,7 +800,6 @@ void pthread_hook_on_dlopen(const char *file_name, bool *maps_refreshed) {
     LOGD(TAG, "pthread_hook_on_dlopen");
     if (!*maps_refreshed) {
         *maps_refreshed = true;
-        pthread_meta_lock meta_lock(m_pthread_meta_mutex);
         wechat_backtrace::notify_maps_changed();
     }
     LOGD(TAG, "pthread_hook_on_dlopen end");
@@ -643,27 +807,34 @@ void pthread_hook_on_dlopen(const char *file_name, bool *maps_refreshed) {
 
 static void on_pthread_destroy(void *specific) {
     LOGD(TAG, "on_pthread_destroy++++");
-    pthread_meta_lock meta_lock(m_pthread_meta_mutex);
 
     pthread_t destroying_thread = pthread_self();
 
-    if (!m_pthread_metas.count(destroying_thread)) {
-        LOGD(TAG, "on_pthread_destroy: thread not found");
-        return;
-    }
+    char *thread_name;
+    pthread_stack_t *stack;
+    {
+        pthread_meta_shard_t &shard = pthread_meta_shard(destroying_thread);
+        pthread_meta_lock meta_lock(shard.mutex);
 
-    pthread_meta_t &meta = m_pthread_metas.at(destroying_thread);
-    LOGD(TAG, "removing thread {%ld, %s, %d}", destroying_thread, meta.thread_name, meta.tid);
+        auto it = shard.metas.find(destroying_thread);
+        if (it == shard.metas.end()) {
+            LOGD(TAG, "on_pthread_destroy: thread not found");
+            return;
+        }
 
-    free(meta.thread_name);
+        pthread_meta_t &meta = it->second;
+        LOGD(TAG, "removing thread {%ld, %s, %d}", destroying_thread, meta.thread_name, meta.tid);
 
-    char *java_stacktrace = meta.java_stacktrace.load(std::memory_order_acquire);
-    if (java_stacktrace) {
-        free(java_stacktrace);
+        thread_name = meta.thread_name;
+        stack = meta.stack;
+
+        shard.metas.erase(it);
     }
 
-    m_pthread_metas.erase(destroying_thread);
-    m_filtered_pthreads.erase(destroying_thread);
+    free(thread_name);
+    if (stack) {
+        release_pthread_stack(stack);
+    }
 
     LOGD(TAG, "specific %c", *(char *) specific);
 
@@ -679,9 +850,10 @@ static void *pthread_routine_wrapper(void *arg) {
 
     pthread_setspecific(m_destructor_key, specific);
 
-    before_routine_start();
-
     auto *args_wrapper = (routine_wrapper_t *) arg;
+
+    before_routine_start(args_wrapper);
+
     void *ret = args_wrapper->origin_func(args_wrapper->origin_args);
     free(args_wrapper);
 
@@ -693,12 +865,16 @@ DEFINE_HOOK_FUN(int, pthread_create, pthread_t *pthread_ptr, pthread_attr_t cons
     auto *args_wrapper = (routine_wrapper_t *) malloc(sizeof(routine_wrapper_t));
     args_wrapper->origin_func = start_routine;
     args_wrapper->origin_args = arg;
+    args_wrapper->created.store(0, std::memory_order_relaxed);
 
     CALL_ORIGIN_FUNC_RET(int, ret, pthread_create, pthread_ptr, attr, pthread_routine_wrapper,
                          args_wrapper);
 
     if (0 == ret) {
         on_pthread_create(*pthread_ptr);
+        notify_routine(args_wrapper);
+    } else {
+        free(args_wrapper);
     }
 
     return ret;
@@ -713,4 +889,3 @@ DEFINE_HOOK_FUN(int, pthread_setname_np, pthread_t
     return ret;
 }
 
-#undef ORIGINAL_LIB
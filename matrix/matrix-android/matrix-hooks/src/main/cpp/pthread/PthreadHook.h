@@ -21,6 +21,7 @@
 #ifndef LIBMATRIX_HOOK_PTHREADHOOK_H
 #define LIBMATRIX_HOOK_PTHREADHOOK_H
 
+#include <cstdint>
 #include <pthread.h>
 #include "HookCommon.h"
 
@@ -41,6 +42,19 @@ void pthread_hook_on_dlopen(const char *file_name, bool *maps_refreshed);
 
 void enable_quicken_unwind(const bool enable);
 
+/**
+ * @param __hash 创建堆栈的 hash, 与 pthread_dump_json 中的 "hash" 一致
+ * @param __live 此堆栈创建且未退出的线程数
+ * @param __total 此堆栈创建过的线程数
+ */
+typedef void (*thread_leak_callback_t)(uint64_t __hash, size_t __live, size_t __total);
+
+/**
+ * 同一堆栈创建的存活线程数超过 __threshold 时在创建线程中打印日志并回调 __callback, 回落后再次超过时重新报警.
+ * __threshold 为 0 时关闭, __callback 可以为 NULL
+ */
+void set_thread_leak_threshold(size_t __threshold, thread_leak_callback_t __callback);
+
 inline int wrap_pthread_getname_np(pthread_t pthread, char *buf, size_t n);
 
 DECLARE_HOOK_ORIG(int, pthread_create, pthread_t* pthread_ptr, pthread_attr_t const* attr, void* (*start_routine)(void*), void* arg);
@@ -27,13 +27,15 @@ extern "C" {
 #endif
 
 static HookFunction const HOOK_FUNCTIONS[] = {
-        {"pthread_create",     (void *) HANDLER_FUNC_NAME(pthread_create),     NULL},
-        {"pthread_setname_np", (void *) HANDLER_FUNC_NAME(pthread_setname_np), NULL}
+        HOOK_FUNCTION(pthread_create),
+        HOOK_FUNCTION(pthread_setname_np),
 };
 
 static void hook_impl(const char *regex) {
     for (auto f: HOOK_FUNCTIONS) {
-        xhook_register(regex, f.name, f.handler_ptr, f.origin_ptr);
+        if (hook_function_ready(f)) {
+            xhook_register(regex, f.name, f.handler_ptr, f.origin_ptr);
+        }
     }
 }
 
@@ -46,6 +48,9 @@ static void ignore_impl(const char *regex) {
 JNIEXPORT void JNICALL
 Java_com_tencent_matrix_hook_pthread_PthreadHook_addHookSoNative(JNIEnv *env, jobject thiz,
                                                                         jobjectArray hook_so_list) {
+    resolve_hook_functions("libc.so", HOOK_FUNCTIONS,
+                           sizeof(HOOK_FUNCTIONS) / sizeof(HOOK_FUNCTIONS[0]));
+
     jsize size = env->GetArrayLength(hook_so_list);
 
     for (int i = 0; i < size; ++i) {
@@ -104,6 +109,12 @@ Java_com_tencent_matrix_hook_pthread_PthreadHook_enableQuickenNative(JNIEnv *env
     enable_quicken_unwind(enable);
 }
 
+JNIEXPORT void JNICALL
+Java_com_tencent_matrix_hook_pthread_PthreadHook_setThreadLeakThresholdNative(JNIEnv *env, jobject thiz,
+                                                                     jint threshold) {
+    set_thread_leak_threshold(threshold > 0 ? (size_t) threshold : 0, NULL);
+}
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
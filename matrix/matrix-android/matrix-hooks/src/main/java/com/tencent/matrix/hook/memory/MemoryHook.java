@@ -23,7 +23,10 @@ import com.tencent.matrix.util.MatrixLog;
 import com.tencent.matrix.hook.AbsHook;
 import com.tencent.matrix.hook.HookManager;
 
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.util.HashSet;
+import java.util.LinkedHashSet;
 import java.util.Set;
 
 /**
@@ -37,13 +40,24 @@ public class MemoryHook extends AbsHook {
 
     private Set<String> mHookSoSet   = new HashSet<>();
     private Set<String> mIgnoreSoSet = new HashSet<>();
+    private Set<String> mThreadGroupSet = new LinkedHashSet<>();
 
     private int     mMinTraceSize;
     private int     mMaxTraceSize;
     private int     mStacktraceLogThreshold = 10 * 1024 * 1024;
     private double  mSampling = 1;
+    private int     mSamplingIntervalBytes;
     private boolean mEnableStacktrace;
     private boolean mEnableMmap;
+    private boolean mEnableEventBuffer;
+    private boolean mEnableCallerSampling;
+    private boolean mEnableLifetimeProfile;
+    private boolean mEnableReallocReattribute;
+    private int     mGuardedSlotCount;
+    private int     mGuardedSampleRate;
+    private boolean mEnableStatsPage;
+
+    private volatile ByteBuffer mStatsPage;
 
     private MemoryHook() {
     }
@@ -79,6 +93,29 @@ public class MemoryHook extends AbsHook {
         return this;
     }
 
+    /**
+     * 按线程名将分配归入线程组, dump 时输出各组的存活量及组内按 so 的分布.
+     * 按添加顺序匹配, 都不匹配的线程归入 other, 最多 31 组
+     *
+     * @param regex 线程名正则
+     * @return
+     */
+    public MemoryHook addThreadGroup(String regex) {
+        if (TextUtils.isEmpty(regex)) {
+            MatrixLog.e(TAG, "thread group regex is empty!!!");
+        } else {
+            mThreadGroupSet.add(regex);
+        }
+        return this;
+    }
+
+    public MemoryHook addThreadGroup(String... regexArr) {
+        for (String regex : regexArr) {
+            addThreadGroup(regex);
+        }
+        return this;
+    }
+
     public MemoryHook enableStacktrace(boolean enable) {
         mEnableStacktrace = enable;
         return this;
@@ -120,11 +157,100 @@ public class MemoryHook extends AbsHook {
         return this;
     }
 
+    /**
+     * 按 caller 自适应采样: 低频 caller 每次都回溯, 高频 caller 的采样率随分配次数衰减, 开启后 sampling 仅用于取不到 caller 的分配
+     *
+     * @param enable
+     * @return
+     */
+    public MemoryHook enableCallerSampling(boolean enable) {
+        mEnableCallerSampling = enable;
+        return this;
+    }
+
+    /**
+     * 按字节采样, 平均每分配 interval 字节回溯一次, 大块分配更容易被采中. dump 时堆栈的 size 按权重还原为估计值
+     * > 0 时 sampling, minTraceSize, maxTraceSize 及 caller 采样均不生效, 0 表示关闭
+     *
+     * @param interval
+     * @return
+     */
+    public MemoryHook samplingIntervalBytes(int interval) {
+        if (interval < 0) {
+            throw new IllegalArgumentException("sampling interval should not be negative: " + interval);
+        }
+        mSamplingIntervalBytes = interval;
+        return this;
+    }
+
     public MemoryHook enableMmapHook(boolean enable) {
         mEnableMmap = enable;
         return this;
     }
 
+    /**
+     * 分配/释放事件先写入线程私有缓冲, 由后台线程汇总, 降低 hook 线程的开销
+     *
+     * @param enable
+     * @return
+     */
+    public MemoryHook enableEventBuffer(boolean enable) {
+        mEnableEventBuffer = enable;
+        return this;
+    }
+
+    /**
+     * 统计分配的存活时长, dump 时按堆栈输出每秒短命 (< 1ms) 分配次数最多的堆栈. 需同时开启 stacktrace
+     *
+     * @param enable
+     * @return
+     */
+    public MemoryHook enableLifetimeProfile(boolean enable) {
+        mEnableLifetimeProfile = enable;
+        return this;
+    }
+
+    /**
+     * realloc 默认保留原分配的堆栈, 只更新 size 和地址; 开启后每次 realloc 都按新分配重新回溯归属
+     *
+     * @param enable
+     * @return
+     */
+    public MemoryHook enableReallocReattribute(boolean enable) {
+        mEnableReallocReattribute = enable;
+        return this;
+    }
+
+    /**
+     * 保护页采样: 平均每 sampleRate 次 malloc 抽一次放入单独的页, 两侧及释放后均不可访问,
+     * 越界或释放后使用时 crash 并在 logcat 中输出分配/释放堆栈. 开启后所有 so 的 free/realloc 都会被 hook
+     *
+     * @param slotCount  同时存活的采样分配上限, 每个占两页虚拟地址, 0 表示关闭
+     * @param sampleRate 采样间隔 (次数)
+     * @return
+     */
+    public MemoryHook guardedAlloc(int slotCount, int sampleRate) {
+        if (slotCount < 0 || (slotCount > 0 && sampleRate <= 0)) {
+            throw new IllegalArgumentException("invalid guarded alloc config: slots = " + slotCount
+                    + ", sample rate = " + sampleRate);
+        }
+        mGuardedSlotCount = slotCount;
+        mGuardedSampleRate = sampleRate;
+        return this;
+    }
+
+    /**
+     * 开启实时统计页, 之后可以随时 readStats 读取存活量及分配/释放/回溯计数, 不需要 dump.
+     * 存活量只统计开启之后的分配, 需在 hook 之前设置
+     *
+     * @param enable
+     * @return
+     */
+    public MemoryHook enableStatsPage(boolean enable) {
+        mEnableStatsPage = enable;
+        return this;
+    }
+
     public MemoryHook stacktraceLogThreshold(int threshold) {
         mStacktraceLogThreshold = threshold;
         return this;
@@ -152,9 +278,26 @@ public class MemoryHook extends AbsHook {
 
         setSampleSizeRangeNative(mMinTraceSize, mMaxTraceSize);
         setSamplingNative(mSampling);
+        setSamplingIntervalBytesNative(mSamplingIntervalBytes);
+        enableCallerSamplingNative(mEnableCallerSampling);
 
         setStacktraceLogThresholdNative(mStacktraceLogThreshold);
         enableStacktraceNative(mEnableStacktrace);
+        enableEventBufferNative(mEnableEventBuffer);
+        enableLifetimeProfileNative(mEnableLifetimeProfile);
+        enableReallocReattributeNative(mEnableReallocReattribute);
+        addThreadGroupNative(mThreadGroupSet.toArray(new String[0]));
+        if (mEnableStatsPage) {
+            ByteBuffer page = enableStatsPageNative();
+            if (page == null) {
+                MatrixLog.e(TAG, "enable stats page failed");
+            } else {
+                mStatsPage = page.order(ByteOrder.nativeOrder());
+            }
+        }
+        if (mGuardedSlotCount > 0 && !enableGuardedAllocNative(mGuardedSlotCount, mGuardedSampleRate)) {
+            MatrixLog.e(TAG, "enable guarded alloc failed");
+        }
     }
 
     @Override
@@ -164,15 +307,74 @@ public class MemoryHook extends AbsHook {
     }
 
     public void dump(String logPath, String jsonPath) {
+        dump(logPath, jsonPath, 0);
+    }
+
+    /**
+     * 只统计 takeSnapshot 返回的 snapshot 之后的分配
+     *
+     * @param logPath
+     * @param jsonPath
+     * @param sinceSnapshot 0 表示全部
+     */
+    public void dump(String logPath, String jsonPath, int sinceSnapshot) {
+        if (HookManager.INSTANCE.hasHooked()) {
+            dumpNative(logPath, jsonPath, sinceSnapshot);
+        }
+    }
+
+    /**
+     * 开启新的一代, 之后 dumpDiff 只输出存活量相对本次快照有变化的堆栈
+     *
+     * @return snapshot, 可传给 dump 查询此后的分配; 未 hook 时返回 0
+     */
+    public int takeSnapshot() {
         if (HookManager.INSTANCE.hasHooked()) {
-            dumpNative(logPath, jsonPath);
+            return takeSnapshotNative();
         }
+        return 0;
     }
 
-    private native void dumpNative(String logPath, String jsonPath);
+    public void dumpDiff(String logPath, String jsonPath) {
+        if (HookManager.INSTANCE.hasHooked()) {
+            dumpDiffNative(logPath, jsonPath);
+        }
+    }
+
+    /**
+     * 暂停所有线程做一次可达性扫描, 输出不可达的堆块. 耗时与存活内存量成正比, 不要在主线程调用
+     */
+    public void dumpUnreachable(String logPath, String jsonPath) {
+        if (HookManager.INSTANCE.hasHooked()) {
+            dumpUnreachableNative(logPath, jsonPath);
+        }
+    }
+
+    /**
+     * 不加锁读取统计页, 开销与 dump 无关, 可以高频轮询
+     *
+     * @return 未开启统计页时返回 null
+     */
+    public MemoryHookStats readStats() {
+        ByteBuffer page = mStatsPage;
+        if (page == null) {
+            return null;
+        }
+        return MemoryHookStats.read(page);
+    }
+
+    private native void dumpNative(String logPath, String jsonPath, int sinceSnapshot);
+
+    private native int takeSnapshotNative();
+
+    private native void dumpDiffNative(String logPath, String jsonPath);
+
+    private native void dumpUnreachableNative(String logPath, String jsonPath);
 
     private native void setSamplingNative(double sampling);
 
+    private native void setSamplingIntervalBytesNative(int interval);
+
     private native void setSampleSizeRangeNative(int minSize, int maxSize);
 
     private native void enableStacktraceNative(boolean enable);
@@ -184,5 +386,19 @@ public class MemoryHook extends AbsHook {
     private native void addIgnoreSoNative(String[] ignoreSoList);
 
     private native void setStacktraceLogThresholdNative(int threshold);
+
+    private native void enableEventBufferNative(boolean enable);
+
+    private native void enableCallerSamplingNative(boolean enable);
+
+    private native void enableLifetimeProfileNative(boolean enable);
+
+    private native void enableReallocReattributeNative(boolean enable);
+
+    private native boolean enableGuardedAllocNative(int slotCount, int sampleRate);
+
+    private native void addThreadGroupNative(String[] threadGroups);
+
+    private native ByteBuffer enableStatsPageNative();
 }
 
@@ -0,0 +1,140 @@
+/*
+ * Tencent is pleased to support the open source community by making wechat-matrix available.
+ * Copyright (C) 2021 THL A29 Limited, a Tencent company. All rights reserved.
+ * Licensed under the BSD 3-Clause License (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      https://opensource.org/licenses/BSD-3-Clause
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+package com.tencent.matrix.hook.memory;
+
+import java.nio.ByteBuffer;
+import java.util.ArrayList;
+import java.util.List;
+
+/**
+ * 统计页的一次读数, 布局与 MemoryHookStatsPage.h 一致.
+ * 读取不加锁, 各字段不是同一时刻的快照; 累计量两次读数相减再除以间隔即为速率
+ */
+public class MemoryHookStats {
+
+    private static final int MAGIC   = 0x5453484D;
+    private static final int VERSION = 2;
+
+    private static final int OFFSET_MAGIC        = 0;
+    private static final int OFFSET_VERSION      = 4;
+    private static final int OFFSET_STRIPE_COUNT = 8;
+    private static final int OFFSET_SO_CAPACITY  = 12;
+    private static final int OFFSET_STRIPES      = 64;
+
+    private static final int STRIPE_SIZE         = 64;
+    private static final int STRIPE_ALLOC_COUNT  = 0;
+    private static final int STRIPE_ALLOC_BYTES  = 8;
+    private static final int STRIPE_FREE_COUNT   = 16;
+    private static final int STRIPE_UNWIND_COUNT = 24;
+    private static final int STRIPE_HOOK_NS      = 32;
+
+    private static final int SO_SIZE       = 64;
+    private static final int SO_STATE      = 0;
+    private static final int SO_NAME       = 8;
+    private static final int SO_NAME_LEN   = 56;
+    private static final int SO_STATE_READY = 2;
+
+    private static final int LIVE_SIZE       = 32;
+    private static final int LIVE_HEAP_SIZE  = 0;
+    private static final int LIVE_HEAP_COUNT = 8;
+    private static final int LIVE_MMAP_SIZE  = 16;
+    private static final int LIVE_MMAP_COUNT = 24;
+
+    public static class SoStats {
+        public String name;
+        public long   heapSize;
+        public long   heapCount;
+        public long   mmapSize;
+        public long   mmapCount;
+    }
+
+    public long heapSize;
+    public long heapCount;
+    public long mmapSize;
+    public long mmapCount;
+
+    public long allocCount;
+    public long allocBytes;
+    public long freeCount;
+    public long unwindCount;
+    /**
+     * 采样估计的 hook 累计耗时
+     */
+    public long hookNanos;
+
+    public List<SoStats> sos = new ArrayList<>();
+
+    /**
+     * @param page MemoryHook 开启统计页后返回的 buffer, 需为 native 字节序
+     * @return 布局版本不一致时返回 null
+     */
+    static MemoryHookStats read(ByteBuffer page) {
+        if (page.getInt(OFFSET_MAGIC) != MAGIC || page.getInt(OFFSET_VERSION) != VERSION) {
+            return null;
+        }
+
+        MemoryHookStats stats = new MemoryHookStats();
+
+        int stripeCount = page.getInt(OFFSET_STRIPE_COUNT);
+        for (int i = 0; i < stripeCount; i++) {
+            int stripe = OFFSET_STRIPES + i * STRIPE_SIZE;
+            stats.allocCount += page.getLong(stripe + STRIPE_ALLOC_COUNT);
+            stats.allocBytes += page.getLong(stripe + STRIPE_ALLOC_BYTES);
+            stats.freeCount += page.getLong(stripe + STRIPE_FREE_COUNT);
+            stats.unwindCount += page.getLong(stripe + STRIPE_UNWIND_COUNT);
+            stats.hookNanos += page.getLong(stripe + STRIPE_HOOK_NS);
+        }
+
+        int soCapacity = page.getInt(OFFSET_SO_CAPACITY);
+        int soBase = OFFSET_STRIPES + stripeCount * STRIPE_SIZE;
+        int liveBase = soBase + soCapacity * SO_SIZE;
+        byte[] name = new byte[SO_NAME_LEN];
+        for (int i = 0; i < soCapacity; i++) {
+            // 存活量按份记增量, 单份可能为负, 求和后才是该 so 的存活量
+            SoStats soStats = new SoStats();
+            for (int j = 0; j < stripeCount; j++) {
+                int live = liveBase + (j * soCapacity + i) * LIVE_SIZE;
+                soStats.heapSize += page.getLong(live + LIVE_HEAP_SIZE);
+                soStats.heapCount += page.getLong(live + LIVE_HEAP_COUNT);
+                soStats.mmapSize += page.getLong(live + LIVE_MMAP_SIZE);
+                soStats.mmapCount += page.getLong(live + LIVE_MMAP_COUNT);
+            }
+            stats.heapSize += soStats.heapSize;
+            stats.heapCount += soStats.heapCount;
+            stats.mmapSize += soStats.mmapSize;
+            stats.mmapCount += soStats.mmapCount;
+
+            int so = soBase + i * SO_SIZE;
+            if (page.getInt(so + SO_STATE) != SO_STATE_READY) {
+                continue;
+            }
+            if (soStats.heapCount == 0 && soStats.mmapCount == 0) {
+                continue;
+            }
+            int len = 0;
+            for (; len < SO_NAME_LEN; len++) {
+                name[len] = page.get(so + SO_NAME + len);
+                if (name[len] == 0) {
+                    break;
+                }
+            }
+            soStats.name = new String(name, 0, len);
+            stats.sos.add(soStats);
+        }
+        return stats;
+    }
+}
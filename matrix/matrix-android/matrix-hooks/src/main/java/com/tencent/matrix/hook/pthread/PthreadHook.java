@@ -40,6 +40,8 @@ public class PthreadHook extends AbsHook {
 
     private boolean mEnableQuicken = false;
 
+    private int mThreadLeakThreshold = 0;
+
     private boolean mConfigured = false;
 
     private PthreadHook() {
@@ -116,10 +118,22 @@ public class PthreadHook extends AbsHook {
         }
     }
 
+    /**
+     * logs an error when the live threads created from the same stack exceed {@code threshold},
+     * 0 to disable
+     */
+    public void setThreadLeakThreshold(int threshold) {
+        mThreadLeakThreshold = threshold;
+        if (mConfigured) {
+            setThreadLeakThresholdNative(mThreadLeakThreshold);
+        }
+    }
+
     @Override
     public void onConfigure() {
         addHookThreadNameNative(mHookThreadName.toArray(new String[0]));
         enableQuickenNative(mEnableQuicken);
+        setThreadLeakThresholdNative(mThreadLeakThreshold);
         mConfigured = true;
     }
 
@@ -139,4 +153,6 @@ public class PthreadHook extends AbsHook {
 
     private native void enableQuickenNative(boolean enable);
 
+    private native void setThreadLeakThresholdNative(int threshold);
+
 }
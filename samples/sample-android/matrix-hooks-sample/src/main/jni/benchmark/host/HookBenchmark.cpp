@@ -0,0 +1,500 @@
+//
+// 宿主机上的 hook 开销基准, 场景移植自上级目录的 MemorySingleThread / MemoryCrossThread /
+// MemoryConcurrentAlloc. 每个场景分别以 glibc 原函数 (raw) 和 hook 处理函数 (hook) 运行,
+// 两者之差即 hook 本身的开销; 并发场景从 1 个线程加倍到 --threads, 观察扩展性.
+//
+// 结果以 JSON 写到 --json (默认 stdout), 同时在 stderr 打印可读的表格.
+// 给定 --baseline 时与之前保存的结果比较, hook 场景的 ns/op 增幅超过 --max-regression 则以 1 退出
+//
+
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "cJSON.h"
+#include "JsonStreamWriter.h"
+#include "MemoryHook.h"
+#include "MemoryHookFunctions.h"
+#include "MemoryHookSizeClass.h"
+#include "HostShim.h"
+
+#define ALLOC_TIMES 10000        // 与 MemoryBenchmarkTest.h 一致
+#define THREAD_ALLOC_TIMES 2048  // 与 MemoryConcurrentAlloc.cpp 一致
+#define SINGLE_ALLOC_SIZE 512
+#define CONCURRENT_ALLOC_SIZE 64
+#define DUMP_ALLOC_SIZE 128
+#define DUMP_PATH_DEPTH 8        // 2^8 条不同的调用链
+
+typedef void *(*alloc_fn_t)(size_t);
+
+typedef void (*free_fn_t)(void *);
+
+struct allocator_t {
+    const char *name;
+    alloc_fn_t alloc;
+    free_fn_t  release;
+};
+
+struct options_t {
+    size_t      max_threads;
+    size_t      repeat;
+    size_t      rounds;
+    size_t      live;
+    bool        stacktrace;
+    double      sampling;
+    size_t      sampling_interval;
+    bool        caller_sampling;
+    bool        event_buffer;
+    const char  *json_path;
+    const char  *baseline_path;
+    double      max_regression;
+};
+
+struct result_t {
+    std::string name;
+    size_t      threads;
+    size_t      ops;
+    double      ns_per_op;
+    double      mops;
+};
+
+static inline uint64_t now_ns() {
+    timespec ts{};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void add_result(std::vector<result_t> &results, const allocator_t &allocator,
+                       const char *scenario, size_t threads, size_t ops, uint64_t ns) {
+    result_t result;
+    result.name      = std::string(allocator.name) + "." + scenario;
+    result.threads   = threads;
+    result.ops       = ops;
+    result.ns_per_op = (double) ns * threads / ops;
+    result.mops      = ns ? (double) ops * 1000.0 / ns : 0;
+    results.push_back(result);
+
+    fprintf(stderr, "%-34s %4zu %10zu %12.2f ns/op %10.2f Mops/s\n", result.name.c_str(),
+            result.threads, result.ops, result.ns_per_op, result.mops);
+}
+
+/**
+ * 同 MemorySingleThread: 连续分配后连续释放, 分开计时
+ */
+static void bench_single_thread(const allocator_t &allocator, const options_t &options,
+                                std::vector<result_t> &results) {
+    std::vector<void *> ptrs(ALLOC_TIMES);
+    uint64_t            best_alloc   = UINT64_MAX;
+    uint64_t            best_release = UINT64_MAX;
+
+    for (size_t r = 0; r <= options.repeat; ++r) { // 第一轮预热
+        uint64_t begin = now_ns();
+        for (auto &ptr : ptrs) {
+            ptr = allocator.alloc(SINGLE_ALLOC_SIZE);
+        }
+        uint64_t middle = now_ns();
+        for (auto ptr : ptrs) {
+            allocator.release(ptr);
+        }
+        uint64_t end = now_ns();
+        if (r) {
+            best_alloc   = std::min(best_alloc, middle - begin);
+            best_release = std::min(best_release, end - middle);
+        }
+    }
+    add_result(results, allocator, "single_thread.malloc", 1, ALLOC_TIMES, best_alloc);
+    add_result(results, allocator, "single_thread.free", 1, ALLOC_TIMES, best_release);
+}
+
+/**
+ * 同 MemoryCrossThread: 主线程分配, 另一个线程释放
+ */
+static void bench_cross_thread(const allocator_t &allocator, const options_t &options,
+                               std::vector<result_t> &results) {
+    std::vector<void *> ptrs(ALLOC_TIMES);
+    uint64_t            best = UINT64_MAX;
+
+    for (size_t r = 0; r <= options.repeat; ++r) {
+        for (auto &ptr : ptrs) {
+            ptr = allocator.alloc(SINGLE_ALLOC_SIZE);
+        }
+        uint64_t elapsed = 0;
+        std::thread([&] {
+            uint64_t begin = now_ns();
+            for (auto ptr : ptrs) {
+                allocator.release(ptr);
+            }
+            elapsed = now_ns() - begin;
+        }).join();
+        if (r) {
+            best = std::min(best, elapsed);
+        }
+    }
+    add_result(results, allocator, "cross_thread.free", 1, ALLOC_TIMES, best);
+}
+
+/**
+ * 同 MemoryConcurrentAlloc: 各线程同时反复分配一批小块再全部释放. ns/op 按单个线程计,
+ * 理想扩展时随线程数不变, Mops/s 为所有线程合计
+ */
+static void bench_concurrent(const allocator_t &allocator, const options_t &options,
+                             std::vector<result_t> &results) {
+    std::vector<size_t> thread_counts;
+    for (size_t n = 1; n < options.max_threads; n *= 2) {
+        thread_counts.push_back(n);
+    }
+    thread_counts.push_back(options.max_threads);
+
+    for (size_t thread_count : thread_counts) {
+        uint64_t best = UINT64_MAX;
+        for (size_t r = 0; r <= options.repeat; ++r) {
+            std::atomic<size_t> ready(0);
+            std::atomic<bool>   go(false);
+
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < thread_count; ++i) {
+                threads.emplace_back([&] {
+                    void *ptrs[THREAD_ALLOC_TIMES];
+                    ready.fetch_add(1, std::memory_order_release);
+                    while (!go.load(std::memory_order_acquire)) {
+                    }
+                    for (size_t round = 0; round < options.rounds; ++round) {
+                        for (auto &ptr : ptrs) {
+                            ptr = allocator.alloc(CONCURRENT_ALLOC_SIZE);
+                        }
+                        for (auto ptr : ptrs) {
+                            allocator.release(ptr);
+                        }
+                    }
+                });
+            }
+            while (ready.load(std::memory_order_acquire) < thread_count) {
+                std::this_thread::yield();
+            }
+
+            uint64_t begin = now_ns();
+            go.store(true, std::memory_order_release);
+            for (auto &thread : threads) {
+                thread.join();
+            }
+            if (r) {
+                best = std::min(best, now_ns() - begin);
+            }
+        }
+        add_result(results, allocator, "concurrent.malloc_free", thread_count,
+                   thread_count * options.rounds * THREAD_ALLOC_TIMES * 2, best);
+    }
+}
+
+static void *alloc_on_path(alloc_fn_t alloc, uint32_t path, int depth);
+
+static __attribute__((noinline)) void *path_left(alloc_fn_t alloc, uint32_t path, int depth) {
+    void *ptr = alloc_on_path(alloc, path >> 1, depth - 1);
+    __asm__ __volatile__("" ::: "memory"); // 阻止尾调用, 保留本帧
+    return ptr;
+}
+
+static __attribute__((noinline)) void *path_right(alloc_fn_t alloc, uint32_t path, int depth) {
+    void *ptr = alloc_on_path(alloc, path >> 1, depth - 1);
+    __asm__ __volatile__("" ::: "memory");
+    return ptr;
+}
+
+/**
+ * 按 path 的各位选择不同的调用链, 得到不同的分配堆栈
+ */
+static __attribute__((noinline)) void *alloc_on_path(alloc_fn_t alloc, uint32_t path, int depth) {
+    if (!depth) {
+        return alloc(DUMP_ALLOC_SIZE);
+    }
+    return (path & 1) ? path_right(alloc, path, depth) : path_left(alloc, path, depth);
+}
+
+/**
+ * dump 的耗时与存活指针数和堆栈数相关, ns/op 按每个存活指针计
+ */
+static void bench_dump(const allocator_t &allocator, const options_t &options,
+                       std::vector<result_t> &results) {
+    std::vector<void *> ptrs(options.live);
+    for (size_t i = 0; i < ptrs.size(); ++i) {
+        ptrs[i] = alloc_on_path(allocator.alloc, (uint32_t) i, DUMP_PATH_DEPTH);
+    }
+
+    uint64_t best = UINT64_MAX;
+    for (size_t r = 0; r <= options.repeat; ++r) {
+        uint64_t begin = now_ns();
+        dump(false, "/dev/null", "/dev/null");
+        if (r) {
+            best = std::min(best, now_ns() - begin);
+        }
+    }
+    add_result(results, allocator, "dump", 1, ptrs.size(), best);
+
+    for (auto ptr : ptrs) {
+        allocator.release(ptr);
+    }
+}
+
+typedef std::vector<std::pair<const char *, std::string>> config_t;
+
+static config_t make_config(const options_t &options) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%f", options.sampling);
+    return {
+            {"stacktrace",        std::to_string(options.stacktrace)},
+            {"sampling",          buf},
+            {"sampling_interval", std::to_string(options.sampling_interval)},
+            {"caller_sampling",   std::to_string(options.caller_sampling)},
+            {"event_buffer",      std::to_string(options.event_buffer)},
+            {"repeat",            std::to_string(options.repeat)},
+            {"rounds",            std::to_string(options.rounds)},
+            {"live",              std::to_string(options.live)},
+    };
+}
+
+static void write_results(int fd, const options_t &options, const std::vector<result_t> &results) {
+    char buf[32];
+
+    json_stream_writer json(fd);
+    json.begin_object()
+            .key("benchmark").value("matrix-hooks")
+            .key("config").begin_object();
+    for (auto &item : make_config(options)) {
+        json.key(item.first).value(item.second.c_str());
+    }
+    json.end_object()
+            .key("results").begin_array();
+
+    for (auto &result : results) {
+        json.begin_object()
+                .key("name").value(result.name.c_str())
+                .key("threads").value_as_string(result.threads)
+                .key("ops").value_as_string(result.ops);
+        snprintf(buf, sizeof(buf), "%.2f", result.ns_per_op);
+        json.key("ns_per_op").value(buf);
+        snprintf(buf, sizeof(buf), "%.2f", result.mops);
+        json.key("mops").value(buf);
+        json.end_object();
+    }
+
+    json.end_array().end_object();
+    json.flush();
+    write(fd, "\n", 1);
+}
+
+static const char *json_string(cJSON *object, const char *key) {
+    cJSON *item = cJSON_GetObjectItem(object, key);
+    return item && item->type == cJSON_String ? item->valuestring : nullptr;
+}
+
+/**
+ * raw 场景只反映机器状态, 不参与比较
+ * @return 超过阈值的场景数, 基线无法读取时返回 -1
+ */
+static int check_baseline(const options_t &options, const std::vector<result_t> &results) {
+    FILE *file = fopen(options.baseline_path, "r");
+    if (!file) {
+        fprintf(stderr, "cannot open baseline %s\n", options.baseline_path);
+        return -1;
+    }
+    std::string content;
+    char        buf[4096];
+    size_t      n;
+    while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+        content.append(buf, n);
+    }
+    fclose(file);
+
+    cJSON *root = cJSON_Parse(content.c_str());
+    cJSON *baseline = root ? cJSON_GetObjectItem(root, "results") : nullptr;
+    if (!baseline) {
+        fprintf(stderr, "invalid baseline %s\n", options.baseline_path);
+        cJSON_Delete(root);
+        return -1;
+    }
+
+    // 配置不同时结果没有可比性, 只提示不拦截
+    cJSON *config = cJSON_GetObjectItem(root, "config");
+    for (auto &item : make_config(options)) {
+        const char *value = config ? json_string(config, item.first) : nullptr;
+        if (value && item.second != value) {
+            fprintf(stderr, "warning: baseline %s = %s, current %s\n", item.first, value,
+                    item.second.c_str());
+        }
+    }
+
+    int regressions = 0;
+    for (auto &result : results) {
+        if (result.name.compare(0, 5, "hook.") != 0) {
+            continue;
+        }
+        for (int i = 0; i < cJSON_GetArraySize(baseline); ++i) {
+            cJSON      *item    = cJSON_GetArrayItem(baseline, i);
+            const char *name    = json_string(item, "name");
+            const char *threads = json_string(item, "threads");
+            const char *ns      = json_string(item, "ns_per_op");
+            if (!name || !threads || !ns || result.name != name
+                || result.threads != strtoul(threads, nullptr, 10)) {
+                continue;
+            }
+            double base   = strtod(ns, nullptr);
+            double change = base > 0 ? (result.ns_per_op - base) * 100 / base : 0;
+            bool   failed = change > options.max_regression;
+            fprintf(stderr, "%s %-34s %4zu %12.2f -> %12.2f ns/op %+7.1f%%\n",
+                    failed ? "REGRESSION" : "ok        ", result.name.c_str(), result.threads,
+                    base, result.ns_per_op, change);
+            regressions += failed;
+            break;
+        }
+    }
+    cJSON_Delete(root);
+    return regressions;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -t, --threads N             max threads of the concurrent scenario (default: cpus)\n"
+            "  -r, --repeat N              timed runs per scenario, the fastest is kept (default 5)\n"
+            "  -n, --rounds N              rounds per thread in the concurrent scenario (default 20)\n"
+            "  -l, --live N                live allocations when timing dump (default 100000)\n"
+            "  -s, --stacktrace            enable stacktrace\n"
+            "      --sampling RATE         unwind sampling rate (default 1)\n"
+            "      --sampling-interval B   byte based sampling interval, overrides --sampling\n"
+            "      --caller-sampling       enable caller sampling\n"
+            "      --event-buffer          record through the event buffer\n"
+            "  -o, --json PATH             write results to PATH instead of stdout\n"
+            "  -b, --baseline PATH         compare with a previous result\n"
+            "  -m, --max-regression PCT    allowed ns/op increase over the baseline (default 10)\n",
+            program);
+}
+
+int main(int argc, char **argv) {
+    options_t options = {};
+    options.max_threads    = std::max(1u, std::thread::hardware_concurrency());
+    options.repeat         = 5;
+    options.rounds         = 20;
+    options.live           = 100000;
+    options.sampling       = 1;
+    options.max_regression = 10;
+
+    enum {
+        OPT_SAMPLING = 256,
+        OPT_SAMPLING_INTERVAL,
+        OPT_CALLER_SAMPLING,
+        OPT_EVENT_BUFFER,
+    };
+    static const option long_options[] = {
+            {"threads",           required_argument, nullptr, 't'},
+            {"repeat",            required_argument, nullptr, 'r'},
+            {"rounds",            required_argument, nullptr, 'n'},
+            {"live",              required_argument, nullptr, 'l'},
+            {"stacktrace",        no_argument,       nullptr, 's'},
+            {"sampling",          required_argument, nullptr, OPT_SAMPLING},
+            {"sampling-interval", required_argument, nullptr, OPT_SAMPLING_INTERVAL},
+            {"caller-sampling",   no_argument,       nullptr, OPT_CALLER_SAMPLING},
+            {"event-buffer",      no_argument,       nullptr, OPT_EVENT_BUFFER},
+            {"json",              required_argument, nullptr, 'o'},
+            {"baseline",          required_argument, nullptr, 'b'},
+            {"max-regression",    required_argument, nullptr, 'm'},
+            {"help",              no_argument,       nullptr, 'h'},
+            {nullptr, 0,                             nullptr, 0},
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:r:n:l:so:b:m:h", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 't':
+                options.max_threads = std::max(1ul, strtoul(optarg, nullptr, 10));
+                break;
+            case 'r':
+                options.repeat = std::max(1ul, strtoul(optarg, nullptr, 10));
+                break;
+            case 'n':
+                options.rounds = std::max(1ul, strtoul(optarg, nullptr, 10));
+                break;
+            case 'l':
+                options.live = std::max(1ul, strtoul(optarg, nullptr, 10));
+                break;
+            case 's':
+                options.stacktrace = true;
+                break;
+            case OPT_SAMPLING:
+                options.sampling = strtod(optarg, nullptr);
+                break;
+            case OPT_SAMPLING_INTERVAL:
+                options.sampling_interval = strtoul(optarg, nullptr, 10);
+                break;
+            case OPT_CALLER_SAMPLING:
+                options.caller_sampling = true;
+                break;
+            case OPT_EVENT_BUFFER:
+                options.event_buffer = true;
+                break;
+            case 'o':
+                options.json_path = optarg;
+                break;
+            case 'b':
+                options.baseline_path = optarg;
+                break;
+            case 'm':
+                options.max_regression = strtod(optarg, nullptr);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    host_shim_init();
+    size_class_init();
+    memory_hook_init();
+    enable_stacktrace(options.stacktrace);
+    set_sampling(options.sampling);
+    set_sampling_interval_bytes(options.sampling_interval);
+    enable_caller_sampling(options.caller_sampling);
+    enable_event_buffer(options.event_buffer);
+
+    const allocator_t allocators[] = {
+            {"raw",  malloc,   free},
+            {"hook", h_malloc, h_free},
+    };
+
+    std::vector<result_t> results;
+    for (auto &allocator : allocators) {
+        bench_single_thread(allocator, options, results);
+        bench_cross_thread(allocator, options, results);
+        bench_concurrent(allocator, options, results);
+    }
+    bench_dump(allocators[1], options, results);
+
+    int fd = options.json_path ? open(options.json_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                               : STDOUT_FILENO;
+    if (fd < 0) {
+        fprintf(stderr, "cannot open %s\n", options.json_path);
+        return 2;
+    }
+    write_results(fd, options, results);
+    if (fd != STDOUT_FILENO) {
+        close(fd);
+    }
+
+    if (options.baseline_path) {
+        int regressions = check_baseline(options, results);
+        if (regressions < 0) {
+            return 2;
+        }
+        return regressions ? 1 : 0;
+    }
+    return 0;
+}
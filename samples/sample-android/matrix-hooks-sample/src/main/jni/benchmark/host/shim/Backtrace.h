@@ -0,0 +1,22 @@
+//
+// 宿主机上以帧指针回溯代替 quicken, 开销量级接近设备上的 fp 模式
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_BACKTRACE_H
+#define MATRIX_HOOKS_BENCHMARK_BACKTRACE_H
+
+#include "BacktraceDefine.h"
+
+namespace wechat_backtrace {
+
+    void unwind_adapter(Frame *frames, const size_t max_frames, size_t &frame_size);
+
+    void get_stacktrace_elements(Frame *frames, const size_t frame_size,
+                                 bool shrunk_java_stacktrace,
+            /* out */ FrameElement *stacktrace_elements, const size_t max_elements,
+            /* out */ size_t &elements_size);
+
+    void notify_maps_changed();
+}
+
+#endif //MATRIX_HOOKS_BENCHMARK_BACKTRACE_H
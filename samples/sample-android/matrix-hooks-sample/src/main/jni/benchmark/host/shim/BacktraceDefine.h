@@ -0,0 +1,64 @@
+//
+// wechat_backtrace 中 hook 用到的类型, 与 matrix-backtrace 的 BacktraceDefine.h 保持一致
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_BACKTRACEDEFINE_H
+#define MATRIX_HOOKS_BENCHMARK_BACKTRACEDEFINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#define MAX_FRAME_SHORT 16
+#define MAX_FRAME_NORMAL 32
+#define MAX_FRAME_LONG 64
+#define MAX_FRAME_LONG_LONG 80
+
+#define BACKTRACE_INITIALIZER(MAX_FRAMES) \
+    {MAX_FRAMES, 0, std::shared_ptr<wechat_backtrace::Frame>( \
+    new wechat_backtrace::Frame[MAX_FRAMES], std::default_delete<wechat_backtrace::Frame[]>())}
+
+namespace wechat_backtrace {
+
+    typedef uintptr_t uptr;
+    typedef unsigned long long int ullint_t;
+    typedef long long int llint_t;
+
+    struct Frame {
+        uptr pc        = 0;
+        uptr rel_pc    = 0;
+        bool is_dex_pc = false;
+        bool maybe_java = false;
+    };
+
+    struct FrameDetail {
+        const uptr rel_pc;
+        const char *map_name;
+        const char *function_name;
+    };
+
+    struct Backtrace {
+        size_t                 max_frames = 0;
+        size_t                 frame_size = 0;
+        std::shared_ptr<Frame> frames;
+    };
+
+    enum BacktraceMode {
+        FramePointer = 0,
+        Quicken      = 1,
+        DwarfBased   = 2,
+    };
+
+    struct FrameElement {
+        uint64_t    rel_pc          = 0;
+        bool        maybe_java      = false;
+        std::string map_name;
+        uint64_t    map_offset      = 0;
+        std::string function_name;
+        uint64_t    function_offset = 0;
+        std::string build_id;
+    };
+}
+
+#endif //MATRIX_HOOKS_BENCHMARK_BACKTRACEDEFINE_H
@@ -0,0 +1,22 @@
+//
+// 在宿主机 (glibc) 上编译 hook 源码时预先包含, 补齐 bionic / libc++ 中隐式提供的定义
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_HOSTCOMPAT_H
+#define MATRIX_HOOKS_BENCHMARK_HOSTCOMPAT_H
+
+#ifdef __cplusplus
+#include <cassert>
+#include <cstdarg>
+#include <functional>
+#endif
+
+#ifndef __INTRODUCED_IN
+#define __INTRODUCED_IN(api_level)
+#endif
+
+#ifndef _NOEXCEPT
+#define _NOEXCEPT noexcept
+#endif
+
+#endif //MATRIX_HOOKS_BENCHMARK_HOSTCOMPAT_H
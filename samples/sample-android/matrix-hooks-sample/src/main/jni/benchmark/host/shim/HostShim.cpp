@@ -0,0 +1,112 @@
+//
+// 日志只把 ERROR 及以上输出到 stderr, 其余丢弃, 避免 I/O 计入 hook 耗时.
+// 回溯沿帧指针链在当前线程栈范围内向上走, 需以 -fno-omit-frame-pointer 编译
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <malloc.h>
+#include <pthread.h>
+#include "Backtrace.h"
+#include "Utils.h"
+#include "MemoryHookFunctions.h"
+#include "HostShim.h"
+
+extern "C" int __android_log_print(int prio, const char *tag, const char *fmt, ...) {
+    if (prio < ANDROID_LOG_ERROR) {
+        return 0;
+    }
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "E/%s: ", tag);
+    int ret = vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+    va_end(args);
+    return ret;
+}
+
+extern "C" void __android_log_assert(const char *cond, const char *tag, const char *fmt, ...) {
+    fprintf(stderr, "F/%s: assert %s ", tag, cond ? cond : "");
+    if (fmt) {
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+    }
+    fputc('\n', stderr);
+    abort();
+}
+
+void host_shim_init() {
+    orig_malloc         = malloc;
+    orig_calloc         = calloc;
+    orig_realloc        = realloc;
+    orig_free           = free;
+    orig_memalign       = memalign;
+    orig_posix_memalign = posix_memalign;
+}
+
+static __thread uintptr_t t_stack_low __attribute__((tls_model("initial-exec")));
+static __thread uintptr_t t_stack_high __attribute__((tls_model("initial-exec")));
+
+static inline void current_stack_range() {
+    pthread_attr_t attr;
+    void   *addr = nullptr;
+    size_t size  = 0;
+    if (0 == pthread_getattr_np(pthread_self(), &attr)) {
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+    }
+    t_stack_low  = (uintptr_t) addr;
+    t_stack_high = (uintptr_t) addr + size;
+}
+
+namespace wechat_backtrace {
+
+    void unwind_adapter(Frame *frames, const size_t max_frames, size_t &frame_size) {
+        frame_size = 0;
+        if (!t_stack_high) {
+            current_stack_range();
+        }
+
+        auto fp = (uptr *) __builtin_frame_address(0);
+        while (frame_size < max_frames) {
+            auto addr = (uptr) fp;
+            if (addr < t_stack_low || addr + 2 * sizeof(uptr) > t_stack_high
+                || (addr & (sizeof(uptr) - 1))) {
+                break;
+            }
+            uptr pc = fp[1];
+            if (!pc) {
+                break;
+            }
+            frames[frame_size++].pc = pc;
+
+            auto next = (uptr *) fp[0];
+            if (next <= fp) {
+                break;
+            }
+            fp = next;
+        }
+    }
+
+    void get_stacktrace_elements(Frame *, const size_t, bool, FrameElement *, const size_t,
+                                 size_t &elements_size) {
+        elements_size = 0; // 由 Symbolizer 回退到 dladdr
+    }
+
+    void notify_maps_changed() {
+    }
+}
+
+uint64_t hash_backtrace_frames(wechat_backtrace::Backtrace *backtrace) {
+    wechat_backtrace::uptr sum = 1;
+    if (backtrace == nullptr) {
+        return (uint64_t) sum;
+    }
+    for (size_t i = 0; i != backtrace->frame_size; i++) {
+        sum += (backtrace->frames.get())[i].pc;
+    }
+    return (uint64_t) sum;
+}
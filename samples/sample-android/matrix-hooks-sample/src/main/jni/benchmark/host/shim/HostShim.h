@@ -0,0 +1,14 @@
+//
+// 宿主机上运行 hook 所需的替身实现
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_HOSTSHIM_H
+#define MATRIX_HOOKS_BENCHMARK_HOSTSHIM_H
+
+/**
+ * 把 orig_malloc 等原函数指针指向 glibc, 之后可以直接调用 h_malloc 等处理函数.
+ * 设备上由 xhook 在替换 PLT 时填入
+ */
+void host_shim_init();
+
+#endif //MATRIX_HOOKS_BENCHMARK_HOSTSHIM_H
@@ -0,0 +1,16 @@
+//
+// 与 matrix-backtrace common/Utils.h 中 hook 用到的部分一致
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_UTILS_H
+#define MATRIX_HOOKS_BENCHMARK_UTILS_H
+
+#include <cstdint>
+#include "Backtrace.h"
+
+#define likely(x)   __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+uint64_t hash_backtrace_frames(wechat_backtrace::Backtrace *backtrace);
+
+#endif //MATRIX_HOOKS_BENCHMARK_UTILS_H
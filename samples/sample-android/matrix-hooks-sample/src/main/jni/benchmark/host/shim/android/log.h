@@ -0,0 +1,22 @@
+//
+// 宿主机替身: 日志默认丢弃, 见 HostShim.cpp
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_ANDROID_LOG_H
+#define MATRIX_HOOKS_BENCHMARK_ANDROID_LOG_H
+
+#include <cstdio>
+
+enum {
+    ANDROID_LOG_DEBUG = 3,
+    ANDROID_LOG_INFO,
+    ANDROID_LOG_WARN,
+    ANDROID_LOG_ERROR,
+    ANDROID_LOG_FATAL,
+};
+
+extern "C" int __android_log_print(int prio, const char *tag, const char *fmt, ...);
+
+extern "C" void __android_log_assert(const char *cond, const char *tag, const char *fmt, ...);
+
+#endif //MATRIX_HOOKS_BENCHMARK_ANDROID_LOG_H
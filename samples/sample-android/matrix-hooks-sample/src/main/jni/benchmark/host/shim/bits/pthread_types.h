@@ -0,0 +1,10 @@
+//
+// bionic 的 pthread 类型定义, glibc 中由 <pthread.h> 提供
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_BITS_PTHREAD_TYPES_H
+#define MATRIX_HOOKS_BENCHMARK_BITS_PTHREAD_TYPES_H
+
+#include <pthread.h>
+
+#endif //MATRIX_HOOKS_BENCHMARK_BITS_PTHREAD_TYPES_H
@@ -0,0 +1,18 @@
+//
+// 宿主机替身: 只提供 JNICommon.h 中声明用到的类型, 基准测试不加载 JVM
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_JNI_H
+#define MATRIX_HOOKS_BENCHMARK_JNI_H
+
+struct _JavaVM;
+typedef _JavaVM JavaVM;
+
+class _jobject {};
+typedef _jobject *jobject;
+typedef jobject  jclass;
+
+struct _jmethodID;
+typedef _jmethodID *jmethodID;
+
+#endif //MATRIX_HOOKS_BENCHMARK_JNI_H
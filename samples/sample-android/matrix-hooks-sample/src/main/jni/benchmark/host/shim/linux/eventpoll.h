@@ -0,0 +1,10 @@
+//
+// glibc 的 <sys/epoll.h> 已定义 epoll_event, 内核头文件会与之冲突
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_LINUX_EVENTPOLL_H
+#define MATRIX_HOOKS_BENCHMARK_LINUX_EVENTPOLL_H
+
+#include <sys/epoll.h>
+
+#endif //MATRIX_HOOKS_BENCHMARK_LINUX_EVENTPOLL_H
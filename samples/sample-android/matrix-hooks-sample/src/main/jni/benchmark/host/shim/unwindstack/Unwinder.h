@@ -0,0 +1,8 @@
+//
+// 宿主机替身: hook 只通过 Backtrace.h 回溯, 不直接使用 unwindstack
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_UNWINDSTACK_UNWINDER_H
+#define MATRIX_HOOKS_BENCHMARK_UNWINDSTACK_UNWINDER_H
+
+#endif //MATRIX_HOOKS_BENCHMARK_UNWINDSTACK_UNWINDER_H
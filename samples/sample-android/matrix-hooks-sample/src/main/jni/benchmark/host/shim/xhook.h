@@ -0,0 +1,8 @@
+//
+// 宿主机替身: 基准测试直接调用 h_malloc 等处理函数, 不做 PLT hook
+//
+
+#ifndef MATRIX_HOOKS_BENCHMARK_XHOOK_H
+#define MATRIX_HOOKS_BENCHMARK_XHOOK_H
+
+#endif //MATRIX_HOOKS_BENCHMARK_XHOOK_H